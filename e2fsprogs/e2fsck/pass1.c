@@ -1834,19 +1834,157 @@ static int ext3u_process_block(ext2_filsys fs,
  * the block bitmap. 
  */
 
+/* Blocks of a FIFO queue read with a single request. */
+#define EXT3u_FSCK_READAHEAD	32
+
+/* Sequential reader of a FIFO queue, whose blocks are contiguous on disk. */
+struct ext3u_fifo_cursor {
+	ext2_filsys	fs;
+	blk_t		first;		/* first block of the queue */
+	blk_t		last;		/* block following the queue */
+	blk_t		start;		/* first block in 'buf' */
+	int		count;		/* blocks in 'buf' */
+	char		*buf;		/* EXT3u_FSCK_READAHEAD blocks */
+};
+
+/* The buffer holding 'block', reading it together with the blocks following. */
+static char *ext3u_cursor_block(struct ext3u_fifo_cursor *cur, blk_t block)
+{
+	int count;
+
+	if (block < cur->first || block >= cur->last)
+		return NULL;
+
+	if (cur->count && block >= cur->start && block < cur->start + cur->count)
+		return cur->buf + (block - cur->start) * cur->fs->blocksize;
+
+	count = MIN(EXT3u_FSCK_READAHEAD, cur->last - block);
+	cur->count = 0;
+	if (io_channel_read_blk(cur->fs->io, block, count, cur->buf))
+		return NULL;
+
+	cur->start = block;
+	cur->count = count;
+	return cur->buf;
+}
+
+/*
+ * The entry at 'offset' of 'block'. An entry lying in a single block is
+ * seen where it is in the buffer, an entry split across blocks is copied
+ * to 'de'.
+ */
+static struct ext3u_del_entry *ext3u_cursor_entry(struct ext3u_fifo_cursor *cur, blk_t block,
+						   int offset, struct ext3u_del_entry *de)
+{
+	struct ext3u_del_entry_header *dh;
+	int blocksize = cur->fs->blocksize;
+	int remaining, to_copy;
+	char *b, *dest;
+
+	b = ext3u_cursor_block(cur, block);
+	if (!b || offset + EXT3u_DEL_HEADER_SIZE > blocksize)
+		return NULL;
+
+	/* The header is not splitted across two blocks */
+	dh = (struct ext3u_del_entry_header *) (b + offset);
+	if (dh->d_size < EXT3u_DEL_HEADER_SIZE || dh->d_size > sizeof(struct ext3u_del_entry))
+		return NULL;
+
+	if (offset + dh->d_size <= blocksize)
+		return (struct ext3u_del_entry *) dh;
+
+	memset(de, 0, sizeof(struct ext3u_del_entry));
+	dest = (char *) de;
+	remaining = dh->d_size;
+
+	/* Copy the rest of the entry from the next blocks. */
+	while (remaining > 0) {
+		to_copy = MIN(blocksize - offset, remaining);
+		memcpy(dest, b + offset, to_copy);
+		dest += to_copy;
+		remaining -= to_copy;
+
+		if (remaining) {
+			offset = EXT3u_BLOCK_HEADER_SIZE;
+			if (++block == cur->last)
+				block = cur->first;
+			b = ext3u_cursor_block(cur, block);
+			if (!b)
+				return NULL;
+		}
+	}
+	return de;
+}
+
+/* Mark as in use the data blocks of the files saved in one FIFO queue. */
+static void ext3u_check_queue(e2fsck_t ctx, struct ext3u_fifo_info *fifo, char *buf, char *block_buf, int compact)
+{
+	ext2_filsys fs = ctx->fs;
+	struct ext3u_fifo_cursor cur;
+	struct ext3u_del_entry copy, *de;
+	struct ext3u_compact_inode ci;
+	struct ext2_inode inode;
+	blk_t block;
+	int offset;
+
+	/* No files in the FIFO queue. */
+	if (EXT3u_FIFO_EMPTY(fifo)) {
+		return;
+	}
+
+	cur.fs = fs;
+	cur.first = fifo->f_first.r_real_block - (fifo->f_first.r_block - fifo->f_start_block);
+	cur.last = cur.first + fifo->f_blocks;
+	cur.count = 0;
+	cur.buf = buf;
+	
+	/* Start from the first entry. */
+	block = fifo->f_first.r_real_block;
+	offset = fifo->f_first.r_offset;
+
+	/* Walk through all deleted file saved in the FIFO list  */
+	/* and mark as in use the data blocks.					*/
+	do {
+		de = ext3u_cursor_entry(&cur, block, offset, &copy);
+		if (!de)
+			return;
+	
+		/* Mark as in use the data blocks.*/
+		if (compact) {
+			/* Only the leading block pointers are stored. */
+			memcpy(&ci, &de->d_inode, EXT3u_COMPACT_INODE_SIZE);
+			if (ci.c_nblocks > EXT2_N_BLOCKS)
+				return;
+
+			memset(&inode, 0, sizeof(struct ext2_inode));
+			inode.i_mode = ci.c_mode;
+			inode.i_size = ci.c_size;
+			inode.i_size_high = ci.c_size_high;
+			inode.i_blocks = ci.c_blocks;
+			inode.i_flags = ci.c_flags;
+			inode.i_file_acl = ci.c_file_acl;
+			memcpy(inode.i_block, (char *) &de->d_inode + EXT3u_COMPACT_INODE_SIZE, 
+				   ci.c_nblocks * sizeof(__u32));
+			ext3u_block_iterate2(fs, &inode, 0, block_buf, ext3u_process_block, ctx);
+		} else
+			ext3u_block_iterate2(fs, &de->d_inode, 0, block_buf, ext3u_process_block, ctx);
+
+		/* Read the next entry. */
+		block = de->d_next.r_real_block;
+		offset = de->d_next.r_offset;
+
+	} while (block != 0 || offset != 0);
+
+}
+
 static void ext3u_check_blocks(e2fsck_t ctx, struct problem_context *pctx, char *block_buf)
 {
 	ext2_filsys fs = ctx->fs;
 	struct ext2_inode *u_inode = pctx->inode;
 	char * buf;
-	struct ext2_inode * inode;
 	struct ext3u_super_block usb; 
-	struct ext3u_del_entry de;
-	long long int block, first_fisical_block, last_fisical_block;
-	int offset, retval, to_copy, remaining, copied;
-	void * src, * dest;
-
-	int i, ret, limit, flags = 0, count = 0;
+	int retval;
+	unsigned int q;
 
 	/* Iterate over the blocks of the inode EXT3u_UNDEL_DIR_INO */
 	/* and mark as in use the blocks used for the FIFO queue and */
@@ -1854,8 +1992,8 @@ static void ext3u_check_blocks(e2fsck_t ctx, struct problem_context *pctx, char
 	ext3u_block_iterate2(fs, u_inode, 0, block_buf, ext3u_process_block, ctx);
 
 
-	/* Alloc the buffer used to read each data block. */
-	buf = (char *) malloc(fs->blocksize);
+	/* Alloc the buffer used to read the FIFO blocks, many at a time. */
+	buf = (char *) malloc(fs->blocksize * EXT3u_FSCK_READAHEAD);
 	if (!buf) {
 		fprintf(stderr, "fsck: malloc() error\n");
 		exit(1);
@@ -1868,93 +2006,31 @@ static void ext3u_check_blocks(e2fsck_t ctx, struct problem_context *pctx, char
 	}
 	
 	memcpy(&usb, buf, sizeof(struct ext3u_super_block)); 
-		
-	first_fisical_block = usb.s_fifo.f_first.r_real_block;
-	last_fisical_block = first_fisical_block + usb.s_fifo.f_blocks;
 
-	/* No files in the FIFO queue. */
-	if (EXT3u_FIFO_EMPTY(&usb)) {
+	/* The blocks of the saved files could not be found: do not */
+	/* let the next passes release them. */
+	if (usb.s_flags & ~EXT3u_FEATURE_SUPP) {
+		fprintf(stderr, "fsck: the undelete area has unsupported features (%x)\n",
+				usb.s_flags & ~EXT3u_FEATURE_SUPP);
+		ctx->flags |= E2F_FLAG_ABORT;
 		goto out;
 	}
-	
-	/* Start from the first entry. */
-	block = usb.s_fifo.f_first.r_real_block;
-	offset = usb.s_fifo.f_first.r_offset;
 
-	
-	retval = io_channel_read_blk(fs->io, block, -(fs->blocksize), buf);
-	if (retval) {
+	/* Without EXT3u_FEATURE_SEQ the entries may have the old header. */
+	if (!(usb.s_flags & EXT3u_FEATURE_SEQ) && EXT3u_ENTRY_COUNT(&usb) && !EXT3u_SEQ_COMPATIBLE) {
+		fprintf(stderr, "fsck: the undelete FIFO has the old entry header, "
+				"not readable on this architecture\n");
+		ctx->flags |= E2F_FLAG_ABORT;
 		goto out;
 	}
-	
-
-	/* Walk through all deleted file saved in the FIFO list  */
-	/* and mark as in use the data blocks.					*/
-	do {
-		count++;
-
-		memset(&de, 0, sizeof(struct ext3u_del_entry));
-
-		src = (void *) (buf + offset);
-		dest = (void *) &de;
-
-		/* The header is not splitted across two blocks */
-		memcpy(dest, src, EXT3u_DEL_HEADER_SIZE);
-
-		remaining =	de.d_size - EXT3u_DEL_HEADER_SIZE; 
-		copied = EXT3u_DEL_HEADER_SIZE;
-		offset += EXT3u_DEL_HEADER_SIZE;
-		dest += copied;
-	
-		/* Copy the rest of the entry */
-		while(remaining > 0) {
 
-			to_copy = MIN((fs->blocksize - offset), remaining);
-
-			src = (void *) (buf + offset);
-			memcpy(dest, src, to_copy);
-			dest+= to_copy;
-
-			offset = (offset + to_copy) % (fs->blocksize);
-			copied += to_copy;
-			remaining -= to_copy;
-		
-			/* If we reach the end of the block and */
-			/* start reading from the next block.  */
-			if ((offset == 0) && (remaining != 0)) {
-				
-				offset = EXT3u_BLOCK_HEADER_SIZE;
-				block += 1;
-				if (block == last_fisical_block)
-					block = first_fisical_block;
-				
-				memset(buf, 0, fs->blocksize);
-
-				retval = io_channel_read_blk(fs->io, block, -(fs->blocksize), buf);
-				if (retval) {
-					goto out;
-				}
-			}
-		}
-	
-		/* Mark as in use the data blocks.*/
-		ext3u_block_iterate2(fs, &de.d_inode, 0, block_buf, ext3u_process_block, ctx);
-
-		/* Read the next entry. */
-		offset = de.d_next.r_offset;
-		
-		if ( de.d_next.r_block != block ) {
-			block = de.d_next.r_real_block;
-
-			memset(buf, 0, fs->blocksize);
-
-			retval = io_channel_read_blk(fs->io, block, -(fs->blocksize), buf);
-			if (retval) {
-				goto out;
-			}
-		}
-
-	} while (block != 0 || offset != 0);
+	/* The FIFO area may be split into sub-queues. */
+	if (EXT3u_HAS_FEATURE_QUEUES(usb.s_flags) && usb.s_queue_count > 1) {
+		for (q = 0; q < usb.s_queue_count && q < EXT3u_MAX_QUEUES; q++)
+			ext3u_check_queue(ctx, &usb.s_queue[q], buf, block_buf, 
+							  EXT3u_HAS_FEATURE_COMPACT(usb.s_flags));
+	} else
+		ext3u_check_queue(ctx, &usb.s_fifo, buf, block_buf, EXT3u_HAS_FEATURE_COMPACT(usb.s_flags));
 
 out:
 	free(buf);
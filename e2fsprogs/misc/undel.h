@@ -0,0 +1,193 @@
+/**
+ * @file undel.h
+ * @autor Antonio Davoli, Vasile Claudiu Perta
+ *
+ * On-disk layout of the ext3u undelete area, shared by mke2fs and
+ * e2fsck. It must follow the kernel definitions in ext3u/undel.h.
+ */
+
+#ifndef __UNDEL_H
+#define __UNDEL_H
+
+#include <limits.h>
+#include "ext2fs/ext2_fs.h"
+#include "ext2fs/ext2fs.h"
+
+#define EXT3u_FEATURE_COMPAT_UNDELETE	0x4000
+
+#define EXT3u_FEATURE_INDEX			1
+
+#define EXT3u_FEATURE_COMPACT		2
+
+/* The FIFO area is split into the sub-queues s_queue[]. */
+#define EXT3u_FEATURE_QUEUES		4
+
+/* The entry headers carry d_queue and d_seq. */
+#define EXT3u_FEATURE_SEQ			8
+
+/* Features of the undelete area known by e2fsck. */
+#define EXT3u_FEATURE_SUPP			(EXT3u_FEATURE_INDEX | EXT3u_FEATURE_COMPACT | \
+									 EXT3u_FEATURE_QUEUES | EXT3u_FEATURE_SEQ)
+
+#define EXT3u_HAS_FEATURE_INDEX(flag) ( (flag) & EXT3u_FEATURE_INDEX )
+
+#define EXT3u_HAS_FEATURE_COMPACT(flag) ( (flag) & EXT3u_FEATURE_COMPACT )
+
+#define EXT3u_HAS_FEATURE_QUEUES(flag) ( (flag) & EXT3u_FEATURE_QUEUES )
+
+#define EXT3u_BLOCK_HEADER_SIZE		4
+
+/* Max number of sub-queues the FIFO area can be split into. */
+#define EXT3u_MAX_QUEUES			8
+
+/* Owners of the entries charged against the budgets: users, top level directories. */
+#define EXT3u_OWNER_KINDS			2
+
+#ifndef MIN
+#define MIN(a,b) ( (a) <= (b) ? (a) : (b) )
+#endif
+
+#define EXT3u_FIFO_NULL(r) (((r)->r_offset == 0) ? 1 : 0)
+
+#define EXT3u_FIFO_EMPTY(fifo) (EXT3u_FIFO_NULL((&((fifo)->f_first))))
+
+
+/* Pointer to an entry in the FIFO list. */
+struct ext3u_record {
+	__u32 r_block; 		/* logical block number */
+	__u64 r_real_block; /* fisical block number */
+	__u16 r_offset; 	/* offset in the block */
+	__u16 r_size;		/* size in bytes of the entry */
+};
+
+/* FIFO list  information */
+struct ext3u_fifo_info {
+	__u32 				f_blocks;				/* blocks reserved for the fifo queue */
+	__u32				f_start_block; 			/* first logical block of the fifo queue */
+	__u32				f_last_block; 			/* last logical block used  */
+	__u32				f_last_offset;			/* offset in the last writeable block */
+	__u32				f_last_block_remaining;	/* space left on the last used block */
+	__u32				f_free;					/* free space on the FIFO (in bytes) */
+	struct ext3u_record f_first;
+	struct ext3u_record f_last;
+};
+
+/* Information about the deleted files */
+struct ext3u_del_info {
+	__u64 d_max_size;		/* max allowed size for ext3u filesystem */
+	__u64 d_max_filesize;	/* max allowed size for a file to be saved */
+	__u64 d_current_size;	/* current size */
+	__u32 d_file_count; 	/* current number of saved files */
+	__u32 d_dir_count; 		/* current number of saved directories */
+};
+
+/* Entries in the FIFO, files and directories. */
+#define EXT3u_ENTRY_COUNT(usb) ((usb)->s_del.d_file_count + (usb)->s_del.d_dir_count)
+
+/* Information about files/directories to skip. */
+struct ext3u_skip_info {
+	__u32 s_dir_count; 			/* number af the directories  */
+	__u32 s_filext_size;		/* bytes reserved for the extensions */
+	__u32 s_filext_count; 		/* number of the extensions to filter */
+	__u32 s_current_size;		/* current size */
+	__u32 s_size; 				/* number of reserved blocks */
+};
+
+/* Hash index of the FIFO list: path hash -> record. */
+struct ext3u_index_info {
+	__u32 i_start_block;	/* first logical block of the index */
+	__u32 i_blocks;			/* blocks reserved for the index */
+	__u32 i_slots;			/* number of slots */
+	__u32 i_used;			/* used slots, including the deleted ones */
+};
+
+/* Information about ext3u filesystem, in the first block of the undelete inode. */
+struct ext3u_super_block {
+	__u32	s_flags;
+	__u32	s_block_size;		/* block size in bytes */
+	__u32	s_inode_size;		/* inode size */
+	__u32	s_fifo_free;		/* free space in the fifo list, including holes */
+	__u64	s_block_count;		/* total number of used blocks */
+	__u64	s_low_watermark; 	/* saved data where the eviction thread stops, 0 for 3/4 of d_max_size */
+	__u64	s_high_watermark;	/* saved data where it starts, 0 for 7/8 of d_max_size */
+
+	struct ext3u_del_info	s_del;
+	struct ext3u_fifo_info 	s_fifo;
+	struct ext3u_skip_info	s_skip;
+	struct ext3u_index_info	s_index;
+	__u32	s_queue_count;		/* number of sub-queues, used with EXT3u_FEATURE_QUEUES only */
+	__u32	s_seq;				/* sequence number of the next saved entry */
+	struct ext3u_fifo_info	s_queue[EXT3u_MAX_QUEUES];
+	__u64	s_budget[EXT3u_OWNER_KINDS];	/* bytes of data each user, each top level directory, can keep; 0 for no limit */
+};
+
+/* An entry of the FIFO list, as read from the disk. */
+struct ext3u_del_entry {
+	__u16					d_size;				/* size in bytes of this entry */
+	__u16					d_queue;			/* sub-queue holding this entry */
+	__u32					d_seq;				/* deletion order, across all the sub-queues */
+	struct ext3u_record 	d_next;				/* pointer to next entry in the fifo list*/
+	struct ext3u_record		d_previous;			/* pointer to the previous entry in the fifo list */
+	__u16					d_type;				/* type of this entry: file, directory, link */
+	__u16					d_base;				/* offset of the base entry in the block, 0 for a full path */
+	__u32					d_hash;				/* hash of the path */
+	__u16					d_path_length;		/* path length */
+	__u16					d_mode;
+	__u32		 			d_uid;				/* owner */
+	struct ext2_inode 		d_inode;			/* inode of the deleted file */
+	char 					d_path[PATH_MAX+1];	/* buffer for the path */
+};
+
+/* The header of an entry, never split across two blocks. It has no */
+/* implicit padding; the headers written without EXT3u_FEATURE_SEQ   */
+/* have the same layout only if EXT3u_SEQ_COMPATIBLE.                */
+struct ext3u_del_entry_header {
+	__u16					d_size;				/* size in bytes of this entry */
+	__u16					d_queue;			/* sub-queue holding this entry */
+	__u32					d_seq;				/* deletion order */
+	struct ext3u_record 	d_next;				/* pointer to next entry in the fifo list*/
+	struct ext3u_record		d_previous;			/* pointer to the previous entry in the fifo list */
+	__u16					d_type;				/* type of this entry */
+	__u16					d_base;				/* compact entries: where the path prefix is */
+	__u32					d_hash;				/* hash of the path */
+	__u16					d_path_length;
+	__u16					d_mode;
+	__u32					d_uid;
+};
+
+#define EXT3u_DEL_HEADER_SIZE (sizeof(struct ext3u_del_entry_header))
+
+#define EXT3u_SEQ_COMPATIBLE (__alignof__(struct ext3u_record) == 8)
+
+/* Compact entries (EXT3u_FEATURE_COMPACT) keep the header, followed by */
+/* this inode, the first 'c_nblocks' block pointers and the path.       */
+struct ext3u_compact_inode {
+	__u16	c_mode;
+	__u16	c_uid_low;
+	__u16	c_gid_low;
+	__u16	c_uid_high;
+	__u16	c_gid_high;
+	__u16	c_nblocks;		/* block pointers stored, the other ones are zero */
+	__u16	c_prefix;		/* bytes of the path taken from the base entry */
+	__u16	c_pad;
+	__u32	c_size;
+	__u32	c_size_high;
+	__u32	c_atime;
+	__u32	c_ctime;
+	__u32	c_mtime;
+	__u32	c_dtime;
+	__u32	c_blocks;
+	__u32	c_flags;
+	__u32	c_file_acl;
+	__u32	c_generation;
+};
+
+#define EXT3u_COMPACT_INODE_SIZE (sizeof(struct ext3u_compact_inode))
+
+/* Like ext2fs_block_iterate2(), on an inode kept in memory only. */
+errcode_t ext3u_block_iterate2(ext2_filsys fs, struct ext2_inode *inode, int flags, char *block_buf,
+			       int (*func)(ext2_filsys fs, blk_t *blocknr, e2_blkcnt_t blockcnt,
+					   blk_t ref_blk, int ref_offset, void *priv_data),
+			       void *priv_data);
+
+#endif
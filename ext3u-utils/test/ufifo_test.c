@@ -0,0 +1,224 @@
+/* -------------------------------------------------------------*
+ * Copyright 2009												*
+ * Authors: Antonio Davoli - Vasile Claudiu Perta  				*
+ * 																*
+ *																*
+ * ufifo_test: FIFO position arithmetic							*
+ * Compare ext3u_fifo_distance() and ext3u_entry_end() with the	*
+ * loops they replaced, on random queues and positions.			*
+ * -------------------------------------------------------------*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <linux/types.h>
+
+#include "../../ext3u/undel_fifo.h"
+
+#ifndef MIN
+#define MIN(a,b) ( (a) <= (b) ? (a) : (b) )
+#endif
+
+/* Largest entry: header, inode and a path of PATH_MAX bytes. */
+#define UFIFO_MAX_ENTRY		(4096 + 256)
+
+static const __u32 block_sizes[] = { 1024, 2048, 4096 };
+
+/**
+ * The byte loop of ext3u_update_superblock() before ext3u_fifo_distance().
+ */
+
+static __u32 old_distance(struct ext3u_fifo_info * fifo, __u32 block_size,
+						  __u32 start_block, __u32 start_offset,
+						  __u32 end_block, __u32 end_offset)
+{
+	__u32 free = 0;
+
+	while ((start_block != end_block) || (start_offset != end_offset)) {
+
+		if (start_block != end_block) {
+			free += (block_size - start_offset);
+			start_offset = block_size;
+		} else {
+			start_offset++;
+			free++;
+		}
+
+		if (start_offset == block_size) {
+			start_offset = EXT3u_BLOCK_HEADER_SIZE;
+			start_block = ext3u_next_block(fifo, start_block);
+		}
+	}
+	return free;
+}
+
+/**
+ * The block loop of ext3u_update_superblock() before ext3u_entry_end().
+ */
+
+static void old_entry_end(struct ext3u_fifo_info * fifo, __u32 block_size,
+						  struct ext3u_record * record, __u32 * end_block, __u32 * end_offset)
+{
+	int block, offset, size, remaining;
+
+	block = record->r_block;
+	offset = record->r_offset;
+	size = record->r_size;
+
+	if ((offset + size) >= block_size) {
+		*end_offset = ((offset + size - EXT3u_BLOCK_HEADER_SIZE) %
+					   (block_size - EXT3u_BLOCK_HEADER_SIZE)) + EXT3u_BLOCK_HEADER_SIZE;
+	} else {
+		*end_offset = offset + size;
+	}
+
+	if (size + offset > block_size) {
+		remaining = offset + size - EXT3u_BLOCK_HEADER_SIZE;
+
+		while(remaining > 0){
+			remaining -= MIN(remaining,(block_size - offset));
+			block = ext3u_next_block(fifo, block);
+			offset = EXT3u_BLOCK_HEADER_SIZE;
+		}
+	}
+	*end_block = block;
+}
+
+/**
+ * The copy loop of ext3u_save(), which decides where an entry really
+ * ends. An entry filling its last block ends at the header of the next.
+ */
+
+static void copy_entry_end(struct ext3u_fifo_info * fifo, __u32 block_size,
+						   struct ext3u_record * record, __u32 * end_block, __u32 * end_offset)
+{
+	__u32 block = record->r_block, offset = record->r_offset;
+	__u32 remaining = record->r_size, to_copy;
+
+	while (remaining > 0) {
+		to_copy = MIN(block_size - offset, remaining);
+		remaining -= to_copy;
+		*end_offset = offset + to_copy;
+
+		if (remaining) {
+			block = ext3u_next_block(fifo, block);
+			offset = EXT3u_BLOCK_HEADER_SIZE;
+		}
+	}
+	*end_block = block;
+
+	if (*end_offset == block_size) {
+		*end_block = ext3u_next_block(fifo, block);
+		*end_offset = EXT3u_BLOCK_HEADER_SIZE;
+	}
+}
+
+static __u32 random_between(__u32 low, __u32 high)
+{
+	return low + (__u32) (random() % (high - low + 1));
+}
+
+static void random_fifo(struct ext3u_fifo_info * fifo, __u32 * block_size)
+{
+	*block_size = block_sizes[random() % (sizeof(block_sizes) / sizeof(block_sizes[0]))];
+	fifo->f_start_block = random_between(1, 16);
+	fifo->f_blocks = random_between(1, 64);
+}
+
+static void random_position(struct ext3u_fifo_info * fifo, __u32 block_size, __u32 * block, __u32 * offset)
+{
+	*block = fifo->f_start_block + random_between(0, fifo->f_blocks - 1);
+	*offset = random_between(EXT3u_BLOCK_HEADER_SIZE, block_size - 1);
+}
+
+static int check_distance(void)
+{
+	struct ext3u_fifo_info fifo;
+	__u32 block_size, start_block, start_offset, end_block, end_offset, got, want;
+
+	random_fifo(&fifo, &block_size);
+	random_position(&fifo, block_size, &start_block, &start_offset);
+	if (random() % 4) {
+		random_position(&fifo, block_size, &end_block, &end_offset);
+	} else {
+		/* Positions in the same block, where the loop goes byte by byte. */
+		end_block = start_block;
+		end_offset = random_between(EXT3u_BLOCK_HEADER_SIZE, block_size - 1);
+	}
+
+	got = ext3u_fifo_distance(&fifo, block_size, start_block, start_offset, end_block, end_offset);
+	want = old_distance(&fifo, block_size, start_block, start_offset, end_block, end_offset);
+	if (got == want)
+		return 0;
+
+	fprintf(stderr, "distance: blocks %u start %u block size %u, %u/%u -> %u/%u: %u, the loop gives %u\n",
+			fifo.f_blocks, fifo.f_start_block, block_size,
+			start_block, start_offset, end_block, end_offset, got, want);
+	return 1;
+}
+
+/**
+ * The old block loop counted the offset of the entry twice: it gives
+ * the right offset, but moves too many blocks ahead for an entry going
+ * past its first block. Those entries are counted in 'crossing', and
+ * only their offset is compared.
+ */
+
+static int check_entry_end(unsigned long * crossing)
+{
+	struct ext3u_fifo_info fifo;
+	struct ext3u_record record;
+	__u32 block_size, block, offset, max_size;
+	__u32 got_block, got_offset, want_block, want_offset, old_block, old_offset;
+
+	random_fifo(&fifo, &block_size);
+	random_position(&fifo, block_size, &block, &offset);
+
+	max_size = MIN(UFIFO_MAX_ENTRY, fifo.f_blocks * (block_size - EXT3u_BLOCK_HEADER_SIZE) - 1);
+	record.r_block = block;
+	record.r_offset = offset;
+	record.r_size = random_between(1, max_size);
+
+	ext3u_entry_end(&fifo, block_size, &record, &got_block, &got_offset);
+	copy_entry_end(&fifo, block_size, &record, &want_block, &want_offset);
+	if (got_block != want_block || got_offset != want_offset) {
+		fprintf(stderr, "entry end: blocks %u start %u block size %u, %u/%u size %u: %u/%u, the copy gives %u/%u\n",
+				fifo.f_blocks, fifo.f_start_block, block_size, block, offset, record.r_size,
+				got_block, got_offset, want_block, want_offset);
+		return 1;
+	}
+
+	old_entry_end(&fifo, block_size, &record, &old_block, &old_offset);
+	if (offset + record.r_size < block_size) {
+		if (got_block == old_block && got_offset == old_offset)
+			return 0;
+	} else {
+		(*crossing)++;
+		if (got_offset == old_offset)
+			return 0;
+	}
+
+	fprintf(stderr, "entry end: blocks %u start %u block size %u, %u/%u size %u: %u/%u, the loop gives %u/%u\n",
+			fifo.f_blocks, fifo.f_start_block, block_size, block, offset, record.r_size,
+			got_block, got_offset, old_block, old_offset);
+	return 1;
+}
+
+int main(int argc, char ** argv)
+{
+	unsigned long rounds = 200000, seed = 1, i, failed = 0, crossing = 0;
+
+	if (argc > 1)
+		rounds = strtoul(argv[1], NULL, 0);
+	if (argc > 2)
+		seed = strtoul(argv[2], NULL, 0);
+	srandom(seed);
+
+	for (i = 0; i < rounds && failed < 10; i++) {
+		failed += check_distance();
+		failed += check_entry_end(&crossing);
+	}
+
+	printf("ufifo_test: %lu rounds, seed %lu, %lu entries across blocks, %lu failed\n",
+		   i, seed, crossing, failed);
+	return failed ? 1 : 0;
+}
@@ -28,8 +28,10 @@
 #define BITMASK_PERMISSIONS_SIZE 12			/* Permission Bitmask Size	*/
 #define IOCTL_BUFFER_SIZE 1024				/* Buffer size for ioctl	*/
 
-#define LIST_FIFO_ORDER 0 
-#define LIST_BUCKET_ORDER 1
+#define LIST_FIFO_ORDER 0 					/* uls orders, the biggest or	*/
+#define LIST_SIZE_ORDER 1					/* most recent files first		*/
+#define LIST_MTIME_ORDER 2
+#define LIST_DTIME_ORDER 3
 
 #define ULS_NORMAL_ENTRY 1					/* Enable uls long entry	*/
 #define ULS_SHORT_ENTRY 0					/* Enable uls short entry	*/
@@ -43,10 +45,8 @@
 #define USTATS_ERR -1
 #define USTATS_OK 0
 
-/* To Do: Future work
 #define UCONFIG_ERROR -1
 #define UCONFIG_OK 0
-*/
 
 #define BUF_SIZE 1024
 #define MAX_PATH 4096
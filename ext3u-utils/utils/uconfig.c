@@ -1,16 +1,6 @@
-#include<stdio.h>
-#include<stdlib.h>
-#include<string.h>
-#include<unistd.h>
-#include<sys/stat.h>
-#include<sys/types.h>
-#include<sys/ioctl.h>
-#include<linux/fs.h>
-#include<linux/ext3_fs.h>
-#include"/home/double/workspace/sistemi3/ext3undel/undel.h"
-#include<fcntl.h>
-#include<errno.h>
-#include<getopt.h>
+#include<limits.h>
+#include<linux/types.h>
+#include "ucommon.h"
 #include<ctype.h>
 
 #define UCONFIG_LIST 001
@@ -29,22 +19,11 @@
 #define UCONFIG_REM_BOTH ( UCONFIG_REMOVE | UCONFIG_SIZE | UCONFIG_EXT )
 
 
-#define EXT3u_NAME "ext3undel" 
-#define MOUNTS_PROC_ENTRY "/proc/mounts"
-#define IOCTL_BUFFER_SIZE 1024
-
 #define MAX_ENTRY_SIZE 192
 
 const char* program_name;
 int verbose = 0;
 
-//#define PATH_MAX 4095
-
-//typedef unsigned long long __u64
-
-#define ULS_ERROR -1
-#define ULS_OK 0
-
 int check_entry(const char *cp)
 {
 
@@ -104,40 +83,94 @@ int get_size(const char *cp, __u64 * size)
 
 
 
-void  ext3u_uconfig_command(char * mnt_point, char *dir_entry, char *ext_entry, __u64 maxsize, int mask) 
+/**
+ * Print the skip rules, as returned by the kernel.
+ * @param buf The rules.
+ * @param length Their size.
+ */
+
+void print_uconfig_rules(char *buf, int length)
+{
+  struct ext3u_skip_header sh;
+  int pos;
+
+  for (pos = 0; pos + (int) sizeof(sh) <= length; pos += sizeof(sh) + sh.s_dir_length + sh.s_ext_length) {
+    memcpy(&sh, buf + pos, sizeof(sh));
+    printf("%.*s\t%.*s", sh.s_dir_length, buf + pos + sizeof(sh), 
+           sh.s_ext_length, buf + pos + sizeof(sh) + sh.s_dir_length);
+    if (sh.s_file_max_size)
+      printf("\t> %u", sh.s_file_max_size);
+    printf("\n");
+  }
+}
+
+/**
+ * List, insert or remove the rules of the files which are not saved.
+ * @param mnt_point Mount point where is mounted an ext3u file system.
+ * @param dir_entry Directory of the rule.
+ * @param ext_entry Comma separated extensions of the rule.
+ * @param maxsize Files bigger than this are not saved.
+ * @param mask UCONFIG_* flags.
+ * @return Result of operation.
+ */
+
+int ext3u_uconfig_command(char * mnt_point, char *dir_entry, char *ext_entry, __u64 maxsize, int mask) 
 {
   struct ext3u_uconfig_info uconfig_info;
+  char buffer[EXT3u_SKIP_MAX_SIZE];
+  int fd, ioctl_ret;
+
+  if ( ( fd = open(mnt_point, O_RDONLY) ) < 0 ) {
+    fprintf(stderr, "[uconfig]: Error on opening mount point\n");
+    return UCONFIG_ERROR;
+  }
 
-  printf("mask %d\n", mask);
-  switch(mask)
-    {
-    case UCONFIG_LIST:
-      printf("List\n");
-      break;
-    case UCONFIG_INS_EXT:
-      printf("insert ext\n");
-      break;
-    case UCONFIG_INS_SIZE:
-      printf("insert size\n");
-      break;
-    case UCONFIG_INS_BOTH:
-      printf("insert size++\n");
-      break;
-    case UCONFIG_REM_EXT:
-      printf("insert ext\n");
-      break;
-    case UCONFIG_REM_SIZE:
-      printf("insert size\n");
-      break;
-    case UCONFIG_REM_BOTH:
-      printf("insert size++\n");
-      break;
-
-    default:
-      printf("default\n");
+  memset(&uconfig_info, 0, sizeof(uconfig_info));
+  uconfig_info.u_buffer = buffer;
+
+  if (mask == UCONFIG_LIST) {
+    uconfig_info.u_list = 1;
+    uconfig_info.u_buffer_length = sizeof(buffer);
+  }
+  else {
+    /* The directory is followed by the extensions */
+    uconfig_info.u_dir_length = strlen(dir_entry);
+    uconfig_info.u_ext_length = (mask & UCONFIG_EXT) ? strlen(ext_entry) : 0;
+    if (uconfig_info.u_dir_length + uconfig_info.u_ext_length > sizeof(buffer)) {
+      fprintf(stderr, "uconfig: rule too long\n");
+      close(fd);
+      return UCONFIG_ERROR;
     }
+    memcpy(buffer, dir_entry, uconfig_info.u_dir_length);
+    memcpy(buffer + uconfig_info.u_dir_length, ext_entry, uconfig_info.u_ext_length);
+    uconfig_info.u_buffer_length = uconfig_info.u_dir_length + uconfig_info.u_ext_length;
+
+    uconfig_info.u_insert = (mask & UCONFIG_INSERT) ? 1 : 0;
+    uconfig_info.u_mask = mask & (UCONFIG_EXT | UCONFIG_SIZE);
+    uconfig_info.u_size = maxsize;
+  }
+
+  ioctl_ret = ioctl(fd, EXT3_UNDEL_IOC_CONFIG, &uconfig_info);
+  close(fd);
+
+  if ( ioctl_ret == -1 ) {
+    if (errno == EOPNOTSUPP)
+      fprintf(stderr,"uconfig: Undelete suport not found on '%s'!\n", mnt_point);
+    else
+      fprintf(stderr,"uconfig: ioctl error: %s\n", strerror(errno));
+    return UCONFIG_ERROR;
+  }
+
+  if ( uconfig_info.u_errcode != 0 ) {
+    fprintf(stderr, "uconfig: %s\n", strerror(-uconfig_info.u_errcode));
+    return UCONFIG_ERROR;
+  }
+
+  if (mask == UCONFIG_LIST)
+    print_uconfig_rules(buffer, uconfig_info.u_buffer_length < (int) sizeof(buffer) ? 
+                        uconfig_info.u_buffer_length : (int) sizeof(buffer));
   
-  return;
+  return UCONFIG_OK;
 }
 
 /* --------------------- 
@@ -173,11 +206,10 @@ int main(int argc, char * argv[]) {
   char ext_entry[MAX_ENTRY_SIZE] = {0};
   int mount_point_inserted = 0;
   int dir_inserted = 0, entry_inserted = 0, size_inserted = 0;
-  int remove = 0, list = 0;
+  int list = 0;
   int mask = 0;
   int next_option, mnt_number;
   __u64 max_size = 0;
-  struct ext3u_uconfig_info uconfig_info;
 
   const char* const short_options = "hvm:d:s:e:lir";
 
@@ -194,8 +226,6 @@ int main(int argc, char * argv[]) {
     { NULL,       0, NULL, 0   }
   };
 
-  const char* output_filename = NULL;
-  
   program_name = argv[0];
 
   do {
@@ -217,13 +247,17 @@ int main(int argc, char * argv[]) {
           fprintf(stderr,"Error on size inserted\n");
           exit(EXIT_FAILURE);
         }
+        /* The rules keep the size in 32 bits. */
+        if ( max_size > UINT_MAX ) {
+          fprintf(stderr,"uconfig: size %s too big, the limit must be below 4G\n", optarg);
+          exit(EXIT_FAILURE);
+        }
         mask = mask | UCONFIG_SIZE;
         break;
       case 'e':
         entry_inserted = 1;
         
         strncpy(ext_entry, optarg, strlen(optarg));
-        printf("ext3->%s\n", ext_entry);
         
         if ( check_entry(ext_entry) != 0 ) {
           fprintf(stderr,"Error on size inserted\n");
@@ -236,11 +270,9 @@ int main(int argc, char * argv[]) {
         break;
       case 'r':
         mask = mask | UCONFIG_REMOVE;
-        remove = 1;
         break;
       case 'l': /* Only list */
-        mask = UCONFIG_LIST;
-        list = 0;
+        list = 1;
         break;
       case 'h':
         print_usage (stdout, 0);
@@ -258,6 +290,10 @@ int main(int argc, char * argv[]) {
   }
   while (next_option != -1);
 
+  /* Listing ignores the other options, whatever their order. */
+  if ( list )
+    mask = UCONFIG_LIST;
+
   /* Check Mount point */
 
   if ( mount_point_inserted ) {
@@ -290,7 +326,8 @@ int main(int argc, char * argv[]) {
         exit(EXIT_FAILURE);
       }
   
-  ext3u_uconfig_command(mount_point, dir_entry, ext_entry, max_size, mask); 
+  if ( ext3u_uconfig_command(mount_point, dir_entry, ext_entry, max_size, mask) != UCONFIG_OK )
+    exit(EXIT_FAILURE);
   
   return 0;
 }
@@ -18,6 +18,11 @@
 int long_listing = ULS_SHORT_ENTRY;
 int verbose = 0;
 
+extern unsigned int since_time;
+extern unsigned int until_time;
+extern int list_order;
+extern struct ext3u_uls_filter uls_filter;
+
 /* ---------------------------------*
  * Print Command Usage Information	*
  * ---------------------------------*/
@@ -29,22 +34,114 @@ static void print_usage(FILE* stream, int exit_code)
 	fprintf(stream, "\t -a Search on all availables (ext3u) mount points.\n");
 	fprintf(stream, "\t -l Enable Long listing option.\n");
 	fprintf(stream, "\t -n Specific how many of oldest files view.\n");
+	fprintf(stream, "\t -s Only files deleted since TIME (seconds since the Epoch, or ago if negative).\n");
+	fprintf(stream, "\t -u Only files deleted until TIME (seconds since the Epoch, or ago if negative).\n");
+	fprintf(stream, "\t -p Only files whose path, as printed after the mount point, starts with PREFIX.\n");
+	fprintf(stream, "\t -U Only files owned by USER (name or ID).\n");
+	fprintf(stream, "\t -z Only files of at least SIZE bytes (K, M, G suffixes).\n");
+	fprintf(stream, "\t -Z Only files of at most SIZE bytes (K, M, G suffixes).\n");
+	fprintf(stream, "\t -m Only files modified since TIME.\n");
+	fprintf(stream, "\t -M Only files modified until TIME.\n");
+	fprintf(stream, "\t -o Biggest or most recent files first: size, mtime or dtime (with -n, the first N).\n");
 	fprintf(stream, "\t -h Print this help.\n");
 	exit(exit_code);
 }
 
+/* ---------------------------------------------*
+ * Deletion time given on the command line: a 	*
+ * negative one counts back from now.			*
+ * ---------------------------------------------*/
+
+static unsigned int parse_time(const char * arg)
+{
+	long t = atol(arg);
+
+	if (t < 0)
+		t += time(NULL);
+	return (t > 0) ? (unsigned int) t : 1;
+}
+
+/* ---------------------------------------------*
+ * Size given on the command line, with an 		*
+ * optional K, M or G suffix.					*
+ * ---------------------------------------------*/
+
+static unsigned long long parse_size(const char * arg)
+{
+	char * end;
+	unsigned long long size = strtoull(arg, &end, 10);
+
+	switch (*end) {
+		case 'G': case 'g':
+			size <<= 10;
+		case 'M': case 'm':
+			size <<= 10;
+		case 'K': case 'k':
+			size <<= 10;
+	}
+	return size;
+}
+
+/* ---------------------------------------------*
+ * Owner given on the command line, by name 	*
+ * or by ID.									*
+ * ---------------------------------------------*/
+
+static unsigned int parse_user(const char * arg)
+{
+	struct passwd * pwd_entry;
+	char * end;
+	unsigned long uid = strtoul(arg, &end, 10);
+
+	if (*arg && *end == '\0')
+		return uid;
+
+	if ( ( pwd_entry = getpwnam(arg) ) == NULL ) {
+		fprintf(stderr, "uls: Unknown user '%s'.\n", arg);
+		exit(1);
+	}
+	return pwd_entry->pw_uid;
+}
+
+/* ---------------------------------------------*
+ * Order of the listing given on the command	*
+ * line.										*
+ * ---------------------------------------------*/
+
+static int parse_order(const char * arg)
+{
+	if (strcmp(arg, "size") == 0)
+		return LIST_SIZE_ORDER;
+	if (strcmp(arg, "mtime") == 0)
+		return LIST_MTIME_ORDER;
+	if (strcmp(arg, "dtime") == 0)
+		return LIST_DTIME_ORDER;
+
+	fprintf(stderr, "uls: Unknown order '%s'.\n", arg);
+	exit(1);
+}
+
 int main(int argc, char * argv[]) {
 	
 	char ** mnt_points;
 	int mnt_number, i , all_partitions = 0, num_files = 0;
 	
 	int next_option;
-	const char* const short_options = "lhan:";
+	const char* const short_options = "lhan:s:u:p:U:z:Z:m:M:o:";
 	
 	const struct option long_options[] = {
 		{ "all",		0, NULL, 'a' },
 		{ "long",		0, NULL, 'l' },
 		{ "number",		1, NULL, 'n' },
+		{ "since",		1, NULL, 's' },
+		{ "until",		1, NULL, 'u' },
+		{ "prefix",		1, NULL, 'p' },
+		{ "user",		1, NULL, 'U' },
+		{ "min-size",	1, NULL, 'z' },
+		{ "max-size",	1, NULL, 'Z' },
+		{ "newer",		1, NULL, 'm' },
+		{ "older",		1, NULL, 'M' },
+		{ "order",		1, NULL, 'o' },
 		{ "help",		0, NULL, 'h' },
 		{ NULL,			0, NULL, 0   }
 	};
@@ -68,6 +165,39 @@ int main(int argc, char * argv[]) {
 			case 'n':
 				num_files = atoi(optarg);
 				break;
+			case 's':
+				since_time = parse_time(optarg);
+				break;
+			case 'u':
+				until_time = parse_time(optarg);
+				break;
+			case 'p':
+				uls_filter.u_prefix = optarg;
+				uls_filter.u_prefix_length = strlen(optarg);
+				break;
+			case 'U':
+				uls_filter.u_uid = parse_user(optarg);
+				uls_filter.u_mask |= EXT3u_ULS_UID;
+				break;
+			case 'z':
+				uls_filter.u_min_size = parse_size(optarg);
+				uls_filter.u_mask |= EXT3u_ULS_SIZE;
+				break;
+			case 'Z':
+				uls_filter.u_max_size = parse_size(optarg);
+				uls_filter.u_mask |= EXT3u_ULS_SIZE;
+				break;
+			case 'm':
+				uls_filter.u_min_mtime = parse_time(optarg);
+				uls_filter.u_mask |= EXT3u_ULS_MTIME;
+				break;
+			case 'M':
+				uls_filter.u_max_mtime = parse_time(optarg);
+				uls_filter.u_mask |= EXT3u_ULS_MTIME;
+				break;
+			case 'o':
+				list_order = parse_order(optarg);
+				break;
 			case 'v':
 				verbose = 1;
 				break;
@@ -21,6 +21,13 @@ extern int verbose;
 
 int list_order = LIST_FIFO_ORDER;
 
+/* Deletion time range, zero for no bound. */
+unsigned int since_time = 0;
+unsigned int until_time = 0;
+
+/* Owner, path prefix, size and modified time filters. */
+struct ext3u_uls_filter uls_filter;
+
 /**
  * @brief These two functions (ftypelet, strmode) 
  * are used for analyse permissions' bitmask.
@@ -198,6 +205,70 @@ static int uls_info_dispatcher(char * mnt_point, char *buffer, int files_number,
 	return ULS_OK;
 }
 
+/**
+ * @brief List the entries through a uls descriptor: the kernel keeps
+ * the position, each read gives many records.
+ * @param mnt_point Mount point name.
+ * @param fd Descriptor of the mount point.
+ * @param num_files Maximum number of files to view, zero for all.
+ * @return ULS_OK, or ULS_ERROR if the descriptor cannot be opened.
+ */
+
+static int ext3u_uls_stream(char * mnt_point, int fd, int num_files)
+{
+	struct ext3u_uls_open_info open_info;
+	struct ext3u_uls_record * record;
+	struct ext3u_uls_entry uls_entry;
+	char * buffer;
+	int ufd, files = 0;
+	ssize_t len, offset;
+
+	memset(&open_info, 0, sizeof(open_info));
+	open_info.u_since = since_time;
+	open_info.u_until = until_time;
+	open_info.u_flags = O_CLOEXEC;
+	open_info.u_filter = uls_filter;
+
+	if ( ( ufd = ioctl(fd, EXT3_UNDEL_IOC_ULS_OPEN, &open_info) ) < 0 )
+		return ULS_ERROR;
+
+	if ( ( buffer = malloc(EXT3u_ULS_STREAM_SIZE) ) == NULL ) {
+		fprintf(stderr, "uls: Error on malloc().\n");
+		close(ufd);
+		return ULS_OK;
+	}
+
+	while ( ( len = read(ufd, buffer, EXT3u_ULS_STREAM_SIZE) ) > 0 ) {
+		for (offset = 0; offset < len; offset += record->r_reclen) {
+			record = (struct ext3u_uls_record *) (buffer + offset);
+
+			if ( long_listing == ULS_NORMAL_ENTRY ) {
+				memset(&uls_entry, 0, sizeof(uls_entry));
+				uls_entry.u_path_length = record->r_path_length;
+				uls_entry.u_mtime.tv_sec = record->r_mtime;
+				uls_entry.u_size = record->r_size;
+				uls_entry.u_mode = record->r_mode;
+				uls_entry.u_uid = record->r_uid;
+				uls_entry.u_gid = record->r_gid;
+				uls_entry.u_nlink = record->r_nlink;
+				print_uls_entry(&uls_entry);
+			}
+			printf("%s%s\n", mnt_point, record->r_path);
+
+			if ( num_files > 0 && ++files >= num_files )
+				goto out;
+		}
+	}
+
+	if ( len < 0 )
+		fprintf(stderr, "uls: read() error: %s\n", strerror(errno));
+
+out:
+	free(buffer);
+	close(ufd);
+	return ULS_OK;
+}
+
 /**
  * @brief Call 'uls' command on a specific mount point.
  * @param mnt_point Mount point name,
@@ -219,6 +290,13 @@ void ext3u_uls_command(char *mnt_point, int num_files)
 		return;
 	}
 	
+	/* Kernels without uls descriptors are asked entry by entry, */
+	/* and so are the ordered listings.                            */
+	if ( list_order == LIST_FIFO_ORDER && ext3u_uls_stream(mnt_point, fd, num_files) == ULS_OK ) {
+		close(fd);
+		return;
+	}
+	
 	/* Create buffer for communication */
 	if ( ( uls_info.u_buffer = malloc(IOCTL_BUFFER_SIZE) ) == NULL ) {
 		fprintf(stderr, "[ext3u_uls_command]: Erron on malloc sys_call\n");
@@ -233,6 +311,9 @@ void ext3u_uls_command(char *mnt_point, int num_files)
 	uls_info.u_next_record.r_block = 0;
 	uls_info.u_next_record.r_offset = 0;
 	uls_info.u_max_files = num_files;
+	uls_info.u_since = since_time;
+	uls_info.u_until = until_time;
+	uls_info.u_filter = uls_filter;
 	uls_info.u_read_files = 0;
 	uls_info.u_files = 0;
 	
@@ -292,7 +373,9 @@ void ext3u_uls_command(char *mnt_point, int num_files)
 		
 		}
 	
-	} while ( uls_info.u_next_record.r_block != 0 );
+	/* An ordered listing is given at once, asked again only with a bigger buffer. */
+	} while ( uls_info.u_next_record.r_block != 0 || 
+			  ( list_order != LIST_FIFO_ORDER && ioctl_ret == 0 && uls_info.u_errcode == -ENOMEM ) );
 
 	/* Free buffer */
 	free(uls_info.u_buffer);
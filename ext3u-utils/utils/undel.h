@@ -21,6 +21,10 @@
 
 #define EXT3_UNDEL_IOC_CONFIG _IOW('f', 14, struct ext3u_uconfig_info)
 
+#define EXT3_UNDEL_IOC_URM_BATCH _IOWR('f', 15, struct ext3u_urm_batch_info)
+
+#define EXT3_UNDEL_IOC_ULS_OPEN _IOW('f', 16, struct ext3u_uls_open_info)
+
 #define UNDEL_ERR -1
 #define UNDEL_OK 0
 
@@ -48,8 +52,31 @@ struct ext3u_urm_info {
 	int u_path_length;		/* length of file path*/
 	int u_dpath_length;		/* directory's path length */
 	int u_errcode;			/* returned error code */			
+	int u_blocks;			/* blocks read to find the entry */
 };
 
+/* urm of many files at once */
+struct ext3u_urm_batch_info {
+	char * u_buffer;		/* the paths, each one ended by a '\0' */
+	int u_buffer_length;	/* buffer length */
+	int u_count;			/* number of paths */
+	int * u_status;			/* returned error code of each path */
+	int u_flags;			/* EXT3u_URM_GLOB */
+	int u_restored;			/* entries restored */
+	int u_errcode;			/* returned error code */
+	int u_blocks;			/* blocks read to find the entries */
+};
+
+/* The paths are patterns: '*' and '?' do not match a '/' */
+#define EXT3u_URM_GLOB 1
+
+/* Most paths in a batch, and most bytes they take */
+#define EXT3u_URM_BATCH_MAX 65536
+#define EXT3u_URM_BATCH_SIZE (EXT3u_URM_BATCH_MAX * 64)
+
+/* Size classes of ustats: below 4K, then four times bigger each */
+#define EXT3u_STATS_SIZES 12
+
 /* ustats command structure */
 struct ext3u_ustats_info {
 	int 			u_errcode;				/* Operation Result Code */
@@ -61,6 +88,19 @@ struct ext3u_ustats_info {
 	unsigned int u_fifo_free;				/* free space in the fifo list, including holes */
 	unsigned int u_file_count;				/* current number of saved files */
 	unsigned int u_dir_count;				/* current number of all saved directory */
+	unsigned int u_fifo_tail;				/* free space at the tails of the queues, in one piece */
+	unsigned int u_elapsed;					/* seconds since mount */
+	unsigned long long u_saved_files;		/* files saved since mount */
+	unsigned long long u_saved_dirs;		/* directories saved since mount */
+	unsigned long long u_evicted;			/* entries evicted since mount */
+	unsigned long long u_restored;			/* entries restored since mount */
+	unsigned long long u_skipped;			/* files not saved since mount */
+	unsigned long long u_evict_runs;		/* runs of entries evicted together */
+	unsigned long long u_evict_usecs;		/* time spent evicting */
+	unsigned long long u_evict_max_usecs;	/* longest run */
+	unsigned long long u_sizes[EXT3u_STATS_SIZES];	/* files saved by size */
+	unsigned long long u_searches;			/* urm lookups by path */
+	unsigned long long u_search_blocks;		/* blocks they read */
 };
 
 /* Short Entry for uls command */
@@ -79,6 +119,22 @@ struct ext3u_uls_entry {
 	unsigned int u_nlink;			/* Link Number */
 };
 
+/* uls filters, checked by the kernel before the paths are copied */
+struct ext3u_uls_filter {
+	char * u_prefix;					/* paths starting with it */
+	int u_prefix_length;				/* prefix length, zero for all the paths */
+	int u_mask;							/* EXT3u_ULS_UID, EXT3u_ULS_SIZE, EXT3u_ULS_MTIME */
+	unsigned int u_uid;					/* owner */
+	unsigned int u_min_mtime;			/* modified time range */
+	unsigned int u_max_mtime;
+	unsigned long long u_min_size;		/* size range */
+	unsigned long long u_max_size;
+};
+
+#define EXT3u_ULS_UID	1
+#define EXT3u_ULS_SIZE	2
+#define EXT3u_ULS_MTIME	4
+
 /* uls command */
 struct ext3u_uls_info {
 	char * u_buffer;					/* Communication Buffer */ 
@@ -90,11 +146,51 @@ struct ext3u_uls_info {
 	int u_ll;							/* Long listing Option */
 	int u_order;						/* Visualization Order */
 	struct ext3u_record u_next_record;	/* First entry to search */
+	unsigned int u_since;				/* Deleted from this time on, zero for no bound */
+	unsigned int u_until;				/* Deleted up to this time, zero for no bound */
+	struct ext3u_uls_filter u_filter;
 };
 
 #define EXT3u_ULS_ENTRY_SIZE (sizeof(int))
 #define EXT3u_ULL_ENTRY_SIZE (sizeof(struct ext3u_uls_entry) - sizeof(int))
 
+/* uls through a file: the ioctl returns a descriptor to read the entries from */
+struct ext3u_uls_open_info {
+	unsigned int u_since;				/* deleted from this time on, zero for no bound */
+	unsigned int u_until;				/* deleted up to this time, zero for no bound */
+	int u_flags;						/* O_CLOEXEC */
+	struct ext3u_uls_filter u_filter;
+};
+
+/* Record read from a uls descriptor, the path is padded to 8 bytes */
+struct ext3u_uls_record {
+	unsigned short r_reclen;			/* record length */
+	unsigned short r_path_length;		/* path length */
+	unsigned short r_type;				/* file or directory */
+	unsigned short r_mode;				/* permission */
+	unsigned int r_uid;					/* user ID */
+	unsigned int r_gid;					/* group ID */
+	unsigned int r_nlink;				/* link number */
+	unsigned int r_mtime;				/* modified time */
+	unsigned int r_dtime;				/* deletion time, zero if not known */
+	unsigned int r_seq;					/* deletion order */
+	unsigned long long r_size;			/* size */
+	char r_path[0];
+};
+
+/* Most bytes given by a read of a uls descriptor */
+#define EXT3u_ULS_STREAM_SIZE (64 * 1024)
+
+/* Skip rule as listed by uconfig: the header is followed by the */
+/* directory and by the comma separated extensions.             */
+struct ext3u_skip_header {
+	unsigned int s_dir_length;		/* directory path length */
+	unsigned int s_ext_length; 		/* extensions length */
+	unsigned int s_file_max_size;	/* skip files bigger than this, 0 for no limit */
+};
+
+#define EXT3u_SKIP_MAX_SIZE 8192
+
 struct ext3u_uconfig_info {
 	char * u_buffer;
 	int u_buffer_length;
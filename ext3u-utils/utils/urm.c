@@ -18,6 +18,30 @@
 int verbose = 0;
 char * root = "/";
 
+/**
+ * @brief Message for an error code returned by the kernel.
+ */
+
+static const char * ext3u_urm_error(int errcode)
+{
+	switch (errcode) {
+		case -ENOENT:
+			return "Entry not found.";
+		case -ENOMEM:
+			return "Memory error.";
+		case -EPERM:
+			return "Permission denied.";
+		case -EEXIST:
+			return "File already exists! Try '-d' option.";
+		case -ENODATA:
+			return "Directory does not exist!";
+		case -E2BIG:
+			return "Too many entries, restore them in smaller groups.";
+		default:
+			return strerror(-errcode);
+	}
+}
+
 /**
  * Implementation of urm command in user space.
  * @param mnt_point Partitio Mount point (mounted with ext3u filesystem).
@@ -86,24 +110,7 @@ int ext3u_urm_command(char *mnt_point, char* file_path, char * dir_path)
 	else {
 		/* Manage ext3u error situation */
 		if ( urm_info.u_errcode != 0 ) {
-			fprintf(stderr, "Error during recovery: ");
-
-			if ( urm_info.u_errcode == -ENOENT )	
-				fprintf(stderr, "Entry not found.\n");
-
-			else if ( urm_info.u_errcode == -ENOMEM )
-				fprintf(stderr, "Memory error.\n"); 
-			
-			else if ( urm_info.u_errcode == -EPERM )
-				fprintf(stderr, "Permission denied.\n"); 
-
-			else if ( urm_info.u_errcode == -EEXIST )
-				fprintf(stderr, "File already exists! Try '-d' option.\n"); 
-
-			else if ( urm_info.u_errcode == -ENODATA )
-				fprintf(stderr, "Directory does not exist!\n"); 
-			else
-				fprintf(stderr,"urm: ioctl error: %s\n", strerror(errno));
+			fprintf(stderr, "Error during recovery: %s\n", ext3u_urm_error(urm_info.u_errcode));
 
 			free(urm_info.u_path);
 			
@@ -117,6 +124,9 @@ int ext3u_urm_command(char *mnt_point, char* file_path, char * dir_path)
 	}
 	
 	/* Normal exit: Operation successfully executed */
+	if (verbose)
+		printf("(%d blocks read) ", urm_info.u_blocks);
+
 	free(urm_info.u_path);
 	if (urm_info.u_dpath) {
 		free(urm_info.u_dpath);
@@ -127,6 +137,93 @@ int ext3u_urm_command(char *mnt_point, char* file_path, char * dir_path)
 	return URM_OK;
 }
 
+/**
+ * Restore many files with one ioctl per group of paths: the kernel
+ * looks for all of them in a single walk of the deleted entries.
+ * @param mnt_point Partition Mount point (mounted with ext3u filesystem).
+ * @param paths Paths of the files to restore, or patterns.
+ * @param count Number of paths.
+ * @param flags EXT3u_URM_GLOB if the paths are patterns.
+ * @return Result of operation.
+ */
+
+int ext3u_urm_batch_command(char *mnt_point, char ** paths, int count, int flags)
+{
+	struct ext3u_urm_batch_info batch_info;
+	int fd, first, i, len, ret = URM_OK;
+
+	if ( ( fd = open(mnt_point, O_RDONLY) ) < 0 ) {
+		fprintf(stderr, "urm: Error on opening mount point\n");
+		return URM_ERR;
+	}
+
+	memset(&batch_info, 0, sizeof(batch_info));
+	batch_info.u_buffer = malloc(EXT3u_URM_BATCH_SIZE);
+	batch_info.u_status = malloc(EXT3u_URM_BATCH_MAX * sizeof(int));
+	if ( !batch_info.u_buffer || !batch_info.u_status ) {
+		fprintf(stderr, "urm: Memory Error\n");
+		ret = URM_ERR;
+		goto out;
+	}
+
+	for (first = 0; first < count; first += batch_info.u_count) {
+
+		/* Fill the buffer with as many paths as it holds */
+		batch_info.u_buffer_length = 0;
+		batch_info.u_count = 0;
+		for (i = first; i < count && batch_info.u_count < EXT3u_URM_BATCH_MAX; i++) {
+			len = strlen(paths[i]) + 1;
+			if ( batch_info.u_buffer_length + len > EXT3u_URM_BATCH_SIZE )
+				break;
+			memcpy(batch_info.u_buffer + batch_info.u_buffer_length, paths[i], len);
+			batch_info.u_buffer_length += len;
+			batch_info.u_count++;
+		}
+
+		if ( batch_info.u_count == 0 ) {
+			fprintf(stderr, "urm: Path too long (%s).\n", paths[first]);
+			ret = URM_ERR;
+			break;
+		}
+
+		batch_info.u_flags = flags;
+
+		if ( ioctl(fd, EXT3_UNDEL_IOC_URM_BATCH, &batch_info) == -1 ) {
+			if (errno == EOPNOTSUPP)
+				fprintf(stderr,"urm: Undelete support not found on '%s'!\n", mnt_point);
+			else
+				fprintf(stderr,"urm: ioctl error: %s\n", strerror(errno));
+			ret = URM_ERR;
+			break;
+		}
+
+		if ( batch_info.u_errcode != 0 ) {
+			fprintf(stderr, "Error during recovery: %s\n", ext3u_urm_error(batch_info.u_errcode));
+			ret = URM_ERR;
+			break;
+		}
+
+		/* Result of each path */
+		for (i = 0; i < batch_info.u_count; i++) {
+			if ( batch_info.u_status[i] != 0 ) {
+				fprintf(stderr, "%s: %s\n", paths[first + i], ext3u_urm_error(batch_info.u_status[i]));
+				ret = URM_ERR;
+			}
+			else if (verbose)
+				printf("Restored '%s'.\n", paths[first + i]);
+		}
+
+		if (verbose)
+			printf("(%d entries restored, %d blocks read)\n", batch_info.u_restored, batch_info.u_blocks);
+	}
+
+out:
+	free(batch_info.u_buffer);
+	free(batch_info.u_status);
+	close(fd);
+	return ret;
+}
+
 /**
  * @brief Clean path from mount point.
  * @param mnt_point Mount point name.
@@ -185,6 +282,7 @@ static void print_usage(FILE* stream, int exit_code)
 	fprintf(stream, "Usage: urm [OPTIONS] File(s)\n");
 	fprintf(stream, "\t Recovery of deleted files,\n");
 	fprintf(stream, "\t -d Select a directory where restore selected file(s),\n");
+	fprintf(stream, "\t -g The files are patterns: '*' and '?' do not match a '/',\n");
 	fprintf(stream, "\t -v Verbose Mode,\n"); 
 	fprintf(stream, "\t -h Print this help.\n");
 	exit(exit_code);
@@ -199,15 +297,18 @@ int main(int argc, char * argv[])
 	char * dpath;
 	char * file_name;
 	
-	int mount_point_inserted = 0, dir_path_inserted = 0, mnt_number, i, urm_ret;
+	char ** file_names;
+	
+	int mount_point_inserted = 0, dir_path_inserted = 0, mnt_number, i, urm_ret, glob = 0, count = 0;
 	
 	int next_option;
-	const char* const short_options = "vhm:d:";
+	const char* const short_options = "vhgm:d:";
 	
 	const struct option long_options[] = {
 		{ "help",     0, NULL, 'h' },
 		{ "mount_point", 1, NULL, 'm'},
 		{ "dir",  1, NULL, 'd' },
+		{ "glob",  0, NULL, 'g' },
 		{ "verbose",  0, NULL, 'v' },
 		{ NULL,       0, NULL, 0   }
 	};
@@ -221,6 +322,9 @@ int main(int argc, char * argv[])
 				dir_path_inserted = 1;
 				realpath(optarg, dir_path);
 				break;
+			case 'g':
+				glob = 1;
+				break;
 			case 'h':
 				print_usage (stdout, 0);
 				break;
@@ -274,6 +378,31 @@ int main(int argc, char * argv[])
 	if ( dir_path_inserted ) 
 		ext3u_clean_path(mount_point, dir_path, &dpath);
 	
+	/* Several files, or patterns, are restored together */
+	if ( !dir_path_inserted && ( glob || ( argc - optind ) > 1 ) ) {
+		
+		if ( ( file_names = malloc((argc - optind) * sizeof(char *)) ) == NULL ) {
+			fprintf(stderr, "urm: Memory Error\n");
+			exit(-1);
+		}
+		
+		for (i = optind; i < argc; ++i) {
+			if ( ext3u_clean_path(mount_point, argv[i], &file_names[count]) == URM_ERR ) {
+				fprintf(stderr, "Wrong file name or mount point inserted (%s).\n", argv[i]);
+				continue;
+			}
+			count++;
+		}
+		
+		if (count)
+			ext3u_urm_batch_command(mount_point, file_names, count, glob ? EXT3u_URM_GLOB : 0);
+		
+		for (i = 0; i < count; i++)
+			free(file_names[i]);
+		free(file_names);
+		optind = argc;
+	}
+	
 	/* Recovery files */
 	for (i = optind; i < argc; ++i) {
 				
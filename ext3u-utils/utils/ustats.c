@@ -18,8 +18,78 @@
 
 int long_listing = ULS_SHORT_ENTRY;
 
+/* Seconds between the two samples of the rates, zero for the averages since mount. */
+static int interval = 0;
 
 
+/**
+ * Rate per second of a counter, between two samples taken 'seconds' apart.
+ */
+
+static double ustats_rate(unsigned long long now, unsigned long long before, unsigned int seconds)
+{
+	return seconds ? (double) (now - before) / seconds : 0.0;
+}
+
+/**
+ * Print the activity of an ext3u mount point: the rates of the saves, 
+ * evictions, restores and skips, the eviction latency, the sizes of the
+ * saved files and the fragmentation of the FIFO.
+ * @param now Last sample.
+ * @param before First sample, all zero for the averages since mount.
+ * @param seconds Time between the samples.
+ */
+
+static void print_ustats_activity(struct ext3u_ustats_info * now, struct ext3u_ustats_info * before, unsigned int seconds)
+{
+	static const char * classes[EXT3u_STATS_SIZES] = { 
+		"< 4K", "< 16K", "< 64K", "< 256K", "< 1M", "< 4M", 
+		"< 16M", "< 64M", "< 256M", "< 1G", "< 4G", ">= 4G" 
+	};
+	unsigned long long runs, usecs, searches, blocks, saved = 0;
+	unsigned int holes;
+	int i;
+
+	printf("Activity per second over %us:\n", seconds);
+	printf("  Saves(files)  Saves(dirs)  Evictions  Restores  Skips\n");
+	printf("%14.2f%13.2f%11.2f%10.2f%7.2f\n",
+			ustats_rate(now->u_saved_files, before->u_saved_files, seconds),
+			ustats_rate(now->u_saved_dirs, before->u_saved_dirs, seconds),
+			ustats_rate(now->u_evicted, before->u_evicted, seconds),
+			ustats_rate(now->u_restored, before->u_restored, seconds),
+			ustats_rate(now->u_skipped, before->u_skipped, seconds));
+
+	runs = now->u_evict_runs - before->u_evict_runs;
+	usecs = now->u_evict_usecs - before->u_evict_usecs;
+	printf("Eviction runs: %llu, average %llu us, longest since mount %llu us\n", 
+			runs, runs ? usecs / runs : 0, now->u_evict_max_usecs);
+
+	searches = now->u_searches - before->u_searches;
+	blocks = now->u_search_blocks - before->u_search_blocks;
+	printf("Lookups: %llu, average %.2f blocks read\n", 
+			searches, searches ? (float) blocks / searches : 0.0);
+
+	/* The holes left by urm are free only when the head goes past them. */
+	holes = (now->u_fifo_free > now->u_fifo_tail) ? now->u_fifo_free - now->u_fifo_tail : 0;
+	printf("FIFO free(bytes): %u, at the tails %u, in holes %u (%.2f%%)\n", 
+			now->u_fifo_free, now->u_fifo_tail, holes, 
+			now->u_fifo_free ? (float) holes * 100 / now->u_fifo_free : 0.0);
+
+	for (i = 0; i < EXT3u_STATS_SIZES; i++)
+		saved += now->u_sizes[i] - before->u_sizes[i];
+
+	if (saved == 0)
+		return;
+
+	printf("Files saved by size:\n");
+	for (i = 0; i < EXT3u_STATS_SIZES; i++) {
+		if (now->u_sizes[i] == before->u_sizes[i])
+			continue;
+		printf("%8s %12llu %6.2f%%\n", classes[i], now->u_sizes[i] - before->u_sizes[i], 
+				(float) (now->u_sizes[i] - before->u_sizes[i]) * 100 / saved);
+	}
+}
+
 /**
  * Print information and statistic about ext3u mount point.
  * @param mnt_point Working mount point.
@@ -45,6 +115,34 @@ void print_ustats_info(char *mnt_point, struct ext3u_ustats_info * ustats_info)
 			ustats_info->u_file_count);
 }
 
+/**
+ * Take a sample of the status of an ext3u mount point.
+ * @param mnt_point Mount point name, for the errors.
+ * @param fd Descriptor of the mount point.
+ * @param ustats_info Filled by the kernel.
+ * @return Result of operation. 
+ */
+
+static int ext3u_ustats_sample(char *mnt_point, int fd, struct ext3u_ustats_info * ustats_info)
+{
+	/* ioctl */
+	/* Kernel funcion will fill the ext3u_ustats_info structure */
+	if ( ioctl(fd, EXT3_UNDEL_IOC_USTATS, ustats_info) == -1 ) {
+		if (errno == EOPNOTSUPP)
+			fprintf(stderr,"ustats: Undelete suport not found on '%s'!", mnt_point);
+		else
+			fprintf(stderr,"ioctl error: %s\n", strerror(errno));
+		return USTATS_ERR;
+	}
+
+	/* internal error: TO DO */
+	if ( ustats_info->u_errcode != 0 ) {
+		fprintf(stderr, "Error %d\n", ustats_info->u_errcode);
+		return USTATS_ERR;
+	}
+	return USTATS_OK;
+}
+
 /**
  * Retrieve information about status of ext3u structure.
  * @param mnt_point Mount point where is mounted an ext3u file system.
@@ -54,8 +152,9 @@ void print_ustats_info(char *mnt_point, struct ext3u_ustats_info * ustats_info)
 int ext3u_ustats_command(char *mnt_point)
 {
 	int fd;									/* Mount Point file descriptor */
-	int ioctl_ret;							/* Return code of ioctl */
 	struct ext3u_ustats_info ustats_info;	/* Structure for ioctl communication */
+	struct ext3u_ustats_info before;		/* First sample of the rates */
+	unsigned int seconds;
 	
 	/* Open mount point inserted */	
 	if ( ( fd = open(mnt_point, O_RDONLY) ) < 0 ) {
@@ -63,31 +162,28 @@ int ext3u_ustats_command(char *mnt_point)
 		return USTATS_ERR;
 	}
 
-	/* ioctl */
-	/* Kernel funcion will fill the ext3u_ustats_info structure */
-	ioctl_ret = ioctl(fd, EXT3_UNDEL_IOC_USTATS, &ustats_info);
-	
-	/* ioctl error cases */
-	if ( ioctl_ret == -1 ) {
-		if (errno == EOPNOTSUPP)
-			fprintf(stderr,"ustats: Undelete suport not found on '%s'!", mnt_point);
-		else
-			fprintf(stderr,"ioctl error: %s\n", strerror(errno));
-
+	/* The counters are read twice 'interval' seconds apart, */
+	/* or once for the averages since mount.                 */
+	memset(&before, 0, sizeof(before));
+	if ( ext3u_ustats_sample(mnt_point, fd, &ustats_info) != USTATS_OK ) {
 		close(fd);
 		return USTATS_ERR;
 	}
-	else {
-		/* internal error: TO DO */
-		if ( ustats_info.u_errcode != 0 ) {
-			fprintf(stderr, "Error %d\n", ustats_info.u_errcode);
+	seconds = ustats_info.u_elapsed;
+
+	if ( interval > 0 ) {
+		before = ustats_info;
+		sleep(interval);
+		if ( ext3u_ustats_sample(mnt_point, fd, &ustats_info) != USTATS_OK ) {
 			close(fd);
 			return USTATS_ERR;
 		}
+		seconds = interval;
 	}
 	
 	/* Print information gained */
 	print_ustats_info(mnt_point, &ustats_info);
+	print_ustats_activity(&ustats_info, &before, seconds);
 	
 	/* Normal exit: Operation successfully executed */
 	close(fd);
@@ -106,6 +202,7 @@ static void print_usage(FILE* stream, int exit_code)
 	fprintf(stream, "\t Retrive information about ext3u mount points.\n");
 	fprintf(stream, "\t -a Search on all availables (ext3u) mount points.\n");
 	fprintf(stream, "\t -n Specific how many of oldest files view.\n");
+	fprintf(stream, "\t -i Rates over SECONDS, instead of the averages since mount.\n");
 	fprintf(stream, "\t -h Print this help.\n");
 	exit(exit_code);
 }
@@ -116,11 +213,12 @@ int main(int argc, char * argv[]) {
 	int mnt_number, i , all_partitions = 0, num_files = 0;
 	
 	int next_option;
-	const char* const short_options = "han:";
+	const char* const short_options = "han:i:";
 	
 	const struct option long_options[] = {
 		{ "all",		0, NULL, 'a' },	
 		{ "number",		1, NULL, 'n' },
+		{ "interval",	1, NULL, 'i' },
 		{ "help",		0, NULL, 'h' },
 		{ NULL,			0, NULL, 0   }
 	};
@@ -141,6 +239,9 @@ int main(int argc, char * argv[]) {
 			case 'n':
 				num_files = atoi(optarg);
 				break;
+			case 'i':
+				interval = atoi(optarg);
+				break;
 			case '?':
 				print_usage (stderr, 1);
 			case -1:
@@ -2052,7 +2052,8 @@ static void ext3_clear_blocks(handle_t *handle, struct inode *inode,
 			BUFFER_TRACE(bh, "call ext3_journal_dirty_metadata");
 			ext3_journal_dirty_metadata(handle, bh);
 		}
-		ext3_mark_inode_dirty(handle, inode);
+		if (inode->i_ino)
+			ext3_mark_inode_dirty(handle, inode);
 		ext3_journal_test_restart(handle, inode);
 		if (bh) {
 			BUFFER_TRACE(bh, "retaking write access");
@@ -2263,7 +2264,8 @@ static void ext3_free_branches(handle_t *handle, struct inode *inode,
 			if (is_handle_aborted(handle))
 				return;
 			if (try_to_extend_transaction(handle, inode)) {
-				ext3_mark_inode_dirty(handle, inode);
+				if (inode->i_ino)
+					ext3_mark_inode_dirty(handle, inode);
 				ext3_journal_test_restart(handle, inode);
 			}
 
@@ -2501,6 +2503,39 @@ out_stop:
 	ext3_journal_stop(handle);
 }
 
+/*
+ * ext3u_free_inode_blocks - free all the blocks of a file saved in the
+ * undelete FIFO, when its entry is evicted.
+ *
+ * @inode is an in-memory inode holding the saved i_data, with i_ino set
+ * to 0: it has no on-disk inode, so the truncate helpers above never mark
+ * it dirty.  The handle is extended or restarted while the blocks are
+ * freed, so everything else must already be dirtied against it.
+ */
+void ext3u_free_inode_blocks(handle_t *handle, struct inode *inode)
+{
+	__le32 *i_data = EXT3_I(inode)->i_data;
+	__le32 nr;
+
+	ext3_free_data(handle, inode, NULL, i_data, i_data + EXT3_NDIR_BLOCKS);
+
+	nr = i_data[EXT3_IND_BLOCK];
+	if (nr) {
+		ext3_free_branches(handle, inode, NULL, &nr, &nr+1, 1);
+		i_data[EXT3_IND_BLOCK] = 0;
+	}
+	nr = i_data[EXT3_DIND_BLOCK];
+	if (nr) {
+		ext3_free_branches(handle, inode, NULL, &nr, &nr+1, 2);
+		i_data[EXT3_DIND_BLOCK] = 0;
+	}
+	nr = i_data[EXT3_TIND_BLOCK];
+	if (nr) {
+		ext3_free_branches(handle, inode, NULL, &nr, &nr+1, 3);
+		i_data[EXT3_TIND_BLOCK] = 0;
+	}
+}
+
 static ext3_fsblk_t ext3_get_inode_block(struct super_block *sb,
 		unsigned long ino, struct ext3_iloc *iloc)
 {
@@ -3080,19 +3115,46 @@ int ext3_setattr(struct dentry *dentry, struct iattr *attr)
 	if (S_ISREG(inode->i_mode) &&
 	    attr->ia_valid & ATTR_SIZE && attr->ia_size < inode->i_size) {
 		handle_t *handle;
+		struct ext3u_queue *u_queue = NULL;
 
-		handle = ext3_journal_start(inode, 3);
+		/*
+		 * A file truncated to zero is saved in the undelete FIFO,
+		 * which takes its blocks over in the same transaction. An
+		 * open file already unlinked has no path left to save.
+		 */
+		if (!attr->ia_size && inode->i_blocks && inode->i_nlink)
+			u_queue = ext3u_lock_save(dentry, EXT3u_ENTRY_FILE);
+
+		handle = ext3_journal_start(inode, 3 +
+				(u_queue ? EXT3u_SAVE_TRANS_BLOCKS(inode->i_sb) : 0));
 		if (IS_ERR(handle)) {
+			ext3u_unlock_fifo(u_queue);
 			error = PTR_ERR(handle);
 			goto err_out;
 		}
 
-		error = ext3_orphan_add(handle, inode);
-		EXT3_I(inode)->i_disksize = attr->ia_size;
-		rc = ext3_mark_inode_dirty(handle, inode);
-		if (!error)
-			error = rc;
-		ext3_journal_stop(handle);
+		if (u_queue)
+			ext3u_save(handle, u_queue, dentry, EXT3u_ENTRY_FILE);
+
+		if (u_queue && !inode->i_size) {
+			/*
+			 * Nothing is left to truncate, so no orphan is needed;
+			 * inode_setattr() sees no size change either, and the
+			 * page cache is dropped here.
+			 */
+			error = ext3_mark_inode_dirty(handle, inode);
+			ext3_journal_stop(handle);
+			ext3u_unlock_fifo(u_queue);
+			truncate_inode_pages(inode->i_mapping, 0);
+		} else {
+			error = ext3_orphan_add(handle, inode);
+			EXT3_I(inode)->i_disksize = attr->ia_size;
+			rc = ext3_mark_inode_dirty(handle, inode);
+			if (!error)
+				error = rc;
+			ext3_journal_stop(handle);
+			ext3u_unlock_fifo(u_queue);
+		}
 	}
 
 	rc = inode_setattr(inode, attr);
@@ -20,6 +20,8 @@
 #include <linux/time.h>
 #include <linux/compat.h>
 #include <linux/smp_lock.h>
+#include <linux/vmalloc.h>
+#include <linux/sort.h>
 #include <asm/uaccess.h>
 #include "acl.h"
 #include "undel.h"
@@ -38,12 +40,63 @@ static int ext3u_do_urm(struct super_block * i_sb, struct ext3u_urm_info * urm_i
 	/* If 'urm_info->u_dpath' is non-null, we first check if */
 	/* the user has the WRITE priviledges on that directory. */
 
-	urm_info->u_errcode = ext3u_urm(i_sb, urm_info->u_path, urm_info->u_dpath);
+	urm_info->u_errcode = ext3u_urm(i_sb, urm_info->u_path, urm_info->u_dpath, &(urm_info->u_blocks));
 	return urm_info->u_errcode;
 }
 
 /**
- * @brief Implements the 'ustats' command in kernel space.
+ * @brief Implements the batch 'urm' command in kernel space.
+ *
+ * @param i_sb Pointer to super block of partition.
+ * @param batch_info Pointer to ext3u_urm_batch_info structure.
+ *
+ * @return On success it returns zero, otherwise a value different from zero indicating the error.
+ */
+
+static int ext3u_do_urm_batch(struct super_block * i_sb, struct ext3u_urm_batch_info * batch_info)
+{
+	char * buf = NULL;
+	int * status = NULL;
+	int err;
+
+	batch_info->u_restored = 0;
+	batch_info->u_blocks = 0;
+
+	err = -EROFS;
+	if (i_sb->s_flags & MS_RDONLY)
+		goto out;
+
+	err = -EINVAL;
+	if (batch_info->u_count <= 0 || batch_info->u_count > EXT3u_URM_BATCH_MAX ||
+		batch_info->u_buffer_length <= 0 || batch_info->u_buffer_length > EXT3u_URM_BATCH_SIZE)
+		goto out;
+
+	err = -ENOMEM;
+	buf = vmalloc(batch_info->u_buffer_length);
+	status = vmalloc(batch_info->u_count * sizeof(int));
+	if (!buf || !status)
+		goto out;
+
+	err = -EFAULT;
+	if (copy_from_user(buf, batch_info->u_buffer, batch_info->u_buffer_length))
+		goto out;
+
+	err = ext3u_urm_batch(i_sb, buf, batch_info->u_buffer_length, batch_info->u_count, batch_info->u_flag, 
+						  status, &(batch_info->u_restored), &(batch_info->u_blocks));
+
+	if (!err && copy_to_user(batch_info->u_status, status, batch_info->u_count * sizeof(int)))
+		err = -EFAULT;
+
+out:
+	vfree(buf);
+	vfree(status);
+	batch_info->u_errcode = err;
+	return err;
+}
+
+/**
+ * @brief Implements the 'ustats' command in kernel space. Nothing is
+ * read from the disk and no lock is taken: an unlink never waits for it.
  *
  * @param i_sb Pointer to super block of partition.
  * @param ustats_info Pointer to ext3u_uls_info structure.
@@ -53,57 +106,162 @@ static int ext3u_do_urm(struct super_block * i_sb, struct ext3u_urm_info * urm_i
 
 static int ext3u_do_ustats(struct super_block * i_sb, struct ext3u_ustats_info * ustats_info) 
 {
-	struct ext3u_super_block * usb;
-	struct buffer_head * bh;
-	struct inode * u_inode;
-	
-	/* Get the undelete_inode */
-	u_inode = ext3_iget(i_sb, EXT3u_UNDEL_DIR_INO);
-	if (!u_inode) {
-		ustats_info->u_errcode = -EIO;
-		goto exit;
-	}
-	
-	ext3u_lock(u_inode);
-	
-	/* Read the undelete superblock. */
-	bh = ext3_bread(NULL, u_inode, 0, 0, &(ustats_info->u_errcode));
-	if (!bh) {
+	/* The undelete inode and superblock are pinned at mount time. */
+	if (!EXT3u_SB(i_sb)->s_undel_inode) {
 		ustats_info->u_errcode = -EIO;
-	 	ext3u_unlock(u_inode);
-		goto exit;
+		return ustats_info->u_errcode;
 	}
 	
-	usb = (struct ext3u_super_block *) bh->b_data;	
-
 	/* Fill ext3u_ustats_info structure */
-	
-	ustats_info->u_inode_size = usb->s_inode_size;
-	ustats_info->u_block_size = usb->s_block_size;
-	ustats_info->u_fifo_free = usb->s_fifo_free;
-	ustats_info->u_fifo_blocks = usb->s_fifo.f_blocks;
-	ustats_info->u_max_size = usb->s_del.d_max_size;
-	ustats_info->u_current_size = usb->s_del.d_current_size;
-	ustats_info->u_file_count = usb->s_del.d_file_count;
-	ustats_info->u_dir_count = usb->s_del.d_dir_count;	
+	ext3u_stats_read(i_sb, ustats_info);
 	
 	/* Errcode */
 	ustats_info->u_errcode = 0;
 	
-exit:
-	
-	ext3u_unlock(u_inode);
-	
-	iput(u_inode);
 	return ustats_info->u_errcode;
 }
 
 
+/* An entry kept by an ordered listing, the path is read at the end. */
+struct ext3u_uls_top {
+	__u64 t_key;
+	__u32 t_seq;
+	__u16 t_path_length;
+	struct ext3u_record t_record;
+};
+
+/**
+ * @brief Order of the entries kept: bigger key first, then the most
+ * recently deleted.
+ */
+static int ext3u_top_before(struct ext3u_uls_top * a, struct ext3u_uls_top * b)
+{
+	if (a->t_key != b->t_key)
+		return a->t_key > b->t_key;
+	return ext3u_seq_before(b->t_seq, a->t_seq);
+}
+
+static int ext3u_top_cmp(const void * a, const void * b)
+{
+	if (ext3u_top_before((struct ext3u_uls_top *) a, (struct ext3u_uls_top *) b))
+		return -1;
+	return ext3u_top_before((struct ext3u_uls_top *) b, (struct ext3u_uls_top *) a);
+}
+
+/**
+ * @brief Offer an entry to the 'k' best ones kept in 'heap', 'count' of
+ * them taken. The root of the heap is the one coming last: once the 
+ * heap is full, it is replaced only by a better entry.
+ */
+static void ext3u_top_add(struct ext3u_uls_top * heap, int * count, int k, struct ext3u_uls_top * t)
+{
+	int i, child;
+
+	if (*count < k) {
+		for (i = (*count)++; i > 0 && ext3u_top_before(&heap[(i - 1) / 2], t); i = (i - 1) / 2)
+			heap[i] = heap[(i - 1) / 2];
+		heap[i] = *t;
+		return;
+	}
+
+	if (!ext3u_top_before(t, &heap[0]))
+		return;
+
+	for (i = 0; (child = 2 * i + 1) < k; i = child) {
+		if (child + 1 < k && ext3u_top_before(&heap[child], &heap[child + 1]))
+			child++;
+		if (!ext3u_top_before(t, &heap[child]))
+			break;
+		heap[i] = heap[child];
+	}
+	heap[i] = *t;
+}
+
+/**
+ * @brief Key of the current entry in the order 'order'.
+ */
+static __u64 ext3u_uls_key(struct ext3u_cursor * cur, int order)
+{
+	switch (order) {
+		case EXT3u_ULS_ORDER_SIZE:
+			return ext3u_cursor_size(cur);
+		case EXT3u_ULS_ORDER_MTIME:
+			return ext3u_cursor_mtime(cur);
+		default:
+			return ext3u_cursor_time(cur);
+	}
+}
+
 /**
- * @brief Implements the 'uls' command in kernel space.
+ * @brief Append an entry to the buffer of 'uls_info', in the short or
+ * in the long format. The room has been checked by the caller.
+ */
+static void ext3u_uls_put(struct ext3u_uls_info * uls_info, struct ext3u_del_entry * e, int * uls_buffer_fill)
+{
+	struct ext3u_uls_entry uls_entry;
+
+	if ( uls_info->u_ll == 1 ) {
+		uls_entry.u_path_length = e->d_path_length;
+		uls_entry.u_mtime.tv_sec = e->d_inode.i_mtime;
+		uls_entry.u_size = e->d_inode.i_size;
+		uls_entry.u_mode = e->d_inode.i_mode;
+		uls_entry.u_uid = e->d_inode.i_uid;
+		uls_entry.u_gid = e->d_inode.i_gid;
+		uls_entry.u_nlink = e->d_inode.i_links_count;
+		memcpy((char*)(uls_info->u_buffer + *uls_buffer_fill), &uls_entry, sizeof(struct ext3u_uls_entry));
+		*uls_buffer_fill += sizeof(struct ext3u_uls_entry);
+	}
+	else {
+		memcpy((char*)(uls_info->u_buffer + *uls_buffer_fill), (char*)(&e->d_path_length), 2);
+		*uls_buffer_fill += 2;
+	}
+
+	memcpy((char*)(uls_info->u_buffer + *uls_buffer_fill), e->d_path, e->d_path_length + 1);
+	*uls_buffer_fill += (e->d_path_length + 1);
+}
+
+/**
+ * @brief Fill the buffer of an ordered listing with the entries kept,
+ * best first. They are given in a single call: if they do not fit, the
+ * length needed is returned with -ENOMEM and the listing is asked again.
+ */
+static int ext3u_uls_top_fill(struct ext3u_uls_info * uls_info, struct ext3u_cursor * cur, 
+							  struct ext3u_uls_top * top, int count, struct ext3u_del_entry * de)
+{
+	struct ext3u_del_entry * e;
+	int i, needed = 0, uls_buffer_fill = 0;
+
+	for (i = 0; i < count; i++)
+		needed += EXT3u_ULS_ENTRY_SIZE + (top[i].t_path_length + 1) + (uls_info->u_ll * EXT3u_ULL_ENTRY_SIZE);
+
+	if (needed > uls_info->u_buffer_length) {
+		uls_info->u_buffer_length = needed;
+		return -ENOMEM;
+	}
+
+	sort(top, count, sizeof(struct ext3u_uls_top), ext3u_top_cmp, NULL);
+
+	for (i = 0; i < count; i++) {
+		ext3u_cursor_seek(cur, &(top[i].t_record));
+		e = ext3u_cursor_entry(cur, de);
+		if (IS_ERR(e))
+			return PTR_ERR(e);
+		ext3u_uls_put(uls_info, e, &uls_buffer_fill);
+	}
+
+	uls_info->u_files = count;
+	return 0;
+}
+
+/**
+ * @brief Implements the 'uls' command in kernel space. The entries not
+ * passing 'u_filter' are skipped before their path is copied; with an
+ * order other than the FIFO one, the whole FIFO is walked keeping the
+ * best 'u_max_files' entries in a bounded heap, given in a single call.
  *
  * @param i_sb Pointer to super block of partition.
- * @param uls_info Pointer to ext3u_uls_info structure.
+ * @param uls_info Pointer to ext3u_uls_info structure, the prefix of its
+ * filter in kernel memory.
  *
  * @return On success it returns zero, otherwise a value different from zero indicating the error.
  */
@@ -113,151 +271,190 @@ static int ext3u_do_uls(struct super_block * i_sb, struct ext3u_uls_info * uls_i
 	struct inode * u_inode;
 	struct buffer_head * bh;	
 	struct ext3u_super_block * usb = NULL;
-	struct ext3u_uls_entry uls_entry;	
-	struct ext3u_del_entry * de;
-	unsigned int long block_size = i_sb->s_blocksize; 
+	struct ext3u_del_entry * de, * e;
+	struct ext3u_del_entry_header * dh;
+	struct ext3u_cursor cur;
+	struct ext3u_record record, next;
+	struct ext3u_uls_top * top = NULL, t;
+	unsigned int q, uid;
+	__u32 time;
+
+	int err = 0, uls_buffer_remaining, uls_buffer_fill, needed, by_owner = 0, wanted;
+	int k = 0, top_count = 0;
 	
-	__u32 block;
-	__u16 offset;	
+	if (uls_info->u_order < EXT3u_ULS_ORDER_FIFO || uls_info->u_order > EXT3u_ULS_ORDER_DTIME) {
+		uls_info->u_errcode = -EINVAL;
+		return -EINVAL;
+	}
 
-	int err = 0, remaining, uls_buffer_remaining, uls_buffer_fill, to_copy, needed;
-	char *src, *dest;
-	
-	if ( ( u_inode = ext3_iget(i_sb, EXT3u_UNDEL_DIR_INO) ) == NULL ) {
+	if ( ( u_inode = EXT3u_SB(i_sb)->s_undel_inode ) == NULL ) {
 		uls_info->u_errcode = -EIO;
 		return -EIO;
 	}
 	
-	ext3u_lock(u_inode);
-
-	de =  &ext3u_de_ioctl;
-
-	block = uls_info->u_next_record.r_block;
-	offset = uls_info->u_next_record.r_offset;
-	
-	/* First time, read super block for location of FIFO first entry */
-	
+	/* The ext3u superblock is pinned, the reference is dropped at the end. */
 	bh = ext3u_read_super(u_inode);
-	if (IS_ERR(bh )) {
-		err = -EIO;
-		goto out;
+	if (IS_ERR(bh)) {
+		uls_info->u_errcode = -EIO;
+		return -EIO;
 	}
-	
 	usb = (struct ext3u_super_block * )bh->b_data;
+
+	/* An ordered listing keeps the best entries of the whole FIFO. */
+	if (uls_info->u_order != EXT3u_ULS_ORDER_FIFO) {
+		k = EXT3u_ULS_TOP_MAX;
+		if (uls_info->u_max_files > 0 && uls_info->u_max_files < k)
+			k = uls_info->u_max_files;
+		top = vmalloc(k * sizeof(struct ext3u_uls_top));
+	}
+
+	de = ext3u_alloc_entry(GFP_KERNEL);
+	if (!de || (k && !top)) {
+		if (de)
+			ext3u_free_entry(de);
+		vfree(top);
+		brelse(bh);
+		uls_info->u_errcode = -ENOMEM;
+		return -ENOMEM;
+	}
+
+	/* The listing walks the queues one after the other. */
+	ext3u_lock_all(i_sb);
+
+	memcpy(&record, &(uls_info->u_next_record), EXT3u_RECORD_SIZE);
+	if (top)
+		memset(&record, 0, EXT3u_RECORD_SIZE);
+
+	/* A user other than root only sees their own entries, which */
+	/* are reached through the owners without walking the FIFO.   */
+	uid = current->fsuid;
+	if (uid) {
+		err = ext3u_owner_first(i_sb, uid, &record);
+		if (err == -ENOENT) {
+			err = 0;
+			uls_info->u_files = 0;
+			memset(&(uls_info->u_next_record), 0, EXT3u_RECORD_SIZE);
+			goto out_unlock;
+		}
+		by_owner = !err;
+		err = 0;
+	}
 	
-	if ( (block == 0) && (offset == 0)) {
+	/* First time, start from the first entry of the FIFO. */
+	if (!by_owner && EXT3u_FIFO_NULL(&record)) {
 	
-		if (usb->s_del.d_file_count == 0) {
+		if (EXT3u_ENTRY_COUNT(usb) == 0) {
 			uls_info->u_files = 0;
-			brelse(bh);
-			goto out;
+			goto out_unlock;
 		}
 
-		block = usb->s_fifo.f_first.r_block;
-		offset = usb->s_fifo.f_first.r_offset;
+		/* Start from the first queue holding some entry, */
+		/* past the ones deleted before 'u_since'.         */
+		for (q = 0; q < EXT3u_SB(i_sb)->s_queue_count; q++) {
+			if (!ext3u_time_seek(u_inode, usb, q, uls_info->u_since, &record))
+				break;
+		}
+		if (q == EXT3u_SB(i_sb)->s_queue_count) {
+			uls_info->u_files = 0;
+			goto out_unlock;
+		}
 	}
 	
-	brelse(bh);
-	
 	uls_info->u_files = 0;
 	uls_buffer_fill = 0; 
 	uls_buffer_remaining = uls_info->u_buffer_length;
 
-	bh = ext3_bread(NULL, u_inode, block, 0, &err);
-	if (!bh) {
-		err = -EIO;
-		goto out;
-	}
+	/* The blocks coming next are read while the entries are copied. */
+	ext3u_cursor_init(&cur, u_inode, usb, &record, 0);
 
 	do {
-		memset(de, 0 , sizeof(struct ext3u_del_entry));
-		dest = (char*)de;
-
 		/* The header cannot be split across blocks. */
-		memcpy(dest, (char *) (bh->b_data + offset), EXT3u_DEL_HEADER_SIZE);
-		dest+=EXT3u_DEL_HEADER_SIZE;	
-
-		/* Space in the buffer needed to fill this entry */
-		/* path length (int) + full path + eventualy long listing attributes*/
-		needed = EXT3u_ULS_ENTRY_SIZE + (de->d_path_length + 1) + (uls_info->u_ll * EXT3u_ULL_ENTRY_SIZE);
-			
-		/* buffer has not a sufficient length, return an error and the new length needed */
-		if ( needed > uls_info->u_buffer_length) {	
-			err = -ENOMEM;
-			uls_info->u_buffer_length = needed;
-			uls_info->u_files = 0;
-			uls_info->u_next_record.r_block = block; 
-			/* Real offset is withous offset */
-			uls_info->u_next_record.r_offset = offset;
+		dh = ext3u_cursor_header(&cur);
+		if (IS_ERR(dh)) {
+			err = PTR_ERR(dh);
 			goto out;
 		}
-				
-		/* Not enough space, return to the user. */	
-		if (needed > uls_buffer_remaining) {	
-			uls_info->u_errcode = 0;
-			uls_info->u_next_record.r_block = block; 
-			/* Real offset is withous offset */
-			uls_info->u_next_record.r_offset = offset;
-			goto out;
+
+		/* The entries of a user are linked together. */
+		if (by_owner) {
+			memcpy(&next, &(cur.c_record), EXT3u_RECORD_SIZE);
+			if (ext3u_owner_next(i_sb, uid, &next))
+				memset(&next, 0, EXT3u_RECORD_SIZE);
+		} else {
+			memcpy(&next, &(dh->d_next), EXT3u_RECORD_SIZE);
 		}
-		
-		remaining =	de->d_size - EXT3u_DEL_HEADER_SIZE; 
-		offset += EXT3u_DEL_HEADER_SIZE;
-		
-		/* Check the permissions first. */
-		if ( (ext3u_permission(de->d_uid, de->d_mode,  MAY_WRITE) == 0 )) {	
-			/* bytes, eventualy reading more consecutive blocks */	
 
-			while (remaining > 0) {	
-		
-				to_copy = MIN(block_size - offset, remaining);
-				src = (char *) (bh->b_data + offset);
-				memcpy(dest, src, to_copy);
-				
-				dest += to_copy;
-				offset = (offset + to_copy) % block_size;
-				remaining -= to_copy;
-				
-				/* We reached the end of the block so we */
-				/* must start reading from the next block. */
-				if ((offset == 0) && (remaining != 0)) {
+		/* Only the entries deleted in the range asked for are listed. */
+		time = (uls_info->u_since || uls_info->u_until) ? ext3u_cursor_time(&cur) : 0;
+		wanted = !(uls_info->u_since && time < uls_info->u_since) && 
+				 !(uls_info->u_until && time > uls_info->u_until);
+
+		/* At the end of a queue, or after its entries deleted in the range, */
+		/* go on with the next one holding some entry.                       */
+		if (!by_owner && (EXT3u_FIFO_NULL(&next) || (uls_info->u_until && time > uls_info->u_until))) {
+			memset(&next, 0, EXT3u_RECORD_SIZE);
+			for (q = ext3u_record_queue(usb, &(cur.c_record)) + 1; q < EXT3u_SB(i_sb)->s_queue_count; q++) {
+				if (!ext3u_time_seek(u_inode, usb, q, uls_info->u_since, &next))
+					break;
+			}
+		}
+
+		/* Check the permissions first: the entries of the other */
+		/* users take no room and cannot stop the listing.       */
+		if (wanted)
+			wanted = (ext3u_permission(dh->d_uid, dh->d_mode,  MAY_WRITE) == 0);
+
+		/* The filter is checked on the header, the path comes last. */
+		if (wanted) {
+			wanted = ext3u_uls_match(&cur, dh, &(uls_info->u_filter), de);
+			if (wanted < 0) {
+				err = wanted;
+				goto out;
+			}
+		}
 
-					offset = EXT3u_BLOCK_HEADER_SIZE;
-					block = (block % usb->s_fifo.f_blocks) + 1;
+		if (wanted && top) {
+			t.t_key = ext3u_uls_key(&cur, uls_info->u_order);
+			t.t_seq = dh->d_seq;
+			t.t_path_length = dh->d_path_length;
+			memcpy(&(t.t_record), &(cur.c_record), EXT3u_RECORD_SIZE);
+			ext3u_top_add(top, &top_count, k, &t);
+		}
+		else if (wanted) {	
+
+			/* Space in the buffer needed to fill this entry */
+			/* path length (int) + full path + eventualy long listing attributes*/
+			needed = EXT3u_ULS_ENTRY_SIZE + (dh->d_path_length + 1) + (uls_info->u_ll * EXT3u_ULL_ENTRY_SIZE);
+				
+			/* buffer has not a sufficient length, return an error and the new length needed */
+			if ( needed > uls_info->u_buffer_length) {	
+				err = -ENOMEM;
+				uls_info->u_buffer_length = needed;
+				uls_info->u_files = 0;
+				memcpy(&(uls_info->u_next_record), &(cur.c_record), EXT3u_RECORD_SIZE);
+				goto out;
+			}
 					
-					brelse(bh);
+			/* Not enough space, return to the user. */	
+			if (needed > uls_buffer_remaining) {	
+				uls_info->u_errcode = 0;
+				memcpy(&(uls_info->u_next_record), &(cur.c_record), EXT3u_RECORD_SIZE);
+				goto out;
+			}
 
-					bh = ext3_bread(NULL, u_inode, block, 0, &err);
-					if (!bh) {
-						err =  -EIO;
-						goto out;
-					}
-				}
+			/* Compact entries get their inode and path back, */
+			/* the others are seen in the block itself.        */
+			e = ext3u_cursor_entry(&cur, de);
+			if (IS_ERR(e)) {
+				err = PTR_ERR(e);
+				goto out;
 			}
 
 			uls_buffer_remaining -= needed;
 			uls_info->u_files++;
 
 			/* Fill the buffer with the entry's information. */	
-			if ( uls_info->u_ll == 1 ) {
-				uls_entry.u_path_length = de->d_path_length;
-				uls_entry.u_mtime.tv_sec = de->d_inode.i_mtime;
-				uls_entry.u_size = de->d_inode.i_size;
-				uls_entry.u_mode = de->d_inode.i_mode;
-				uls_entry.u_uid = de->d_inode.i_uid;
-				uls_entry.u_gid = de->d_inode.i_gid;
-				uls_entry.u_nlink = de->d_inode.i_links_count;
-				memcpy((char*)(uls_info->u_buffer+uls_buffer_fill), &uls_entry, sizeof(struct ext3u_uls_entry));
-				uls_buffer_fill += sizeof(struct ext3u_uls_entry);
-			}
-			else {
-				memcpy((char*)(uls_info->u_buffer+uls_buffer_fill), (char*)(&de->d_path_length), 2);
-				uls_buffer_fill += 2;
-			}
-	
-			memcpy((char*)(uls_info->u_buffer+uls_buffer_fill), de->d_path, de->d_path_length + 1);
-
-			uls_buffer_fill += (de->d_path_length + 1);
+			ext3u_uls_put(uls_info, e, &uls_buffer_fill);
 
 			/* -n option is enabled. */
 			if ( uls_info->u_max_files > 0 ) {
@@ -265,51 +462,136 @@ static int ext3u_do_uls(struct super_block * i_sb, struct ext3u_uls_info * uls_i
 				if ( uls_info->u_read_files >= uls_info->u_max_files ) {
 					uls_info->u_next_record.r_block = EXT3u_FIFO_END; 
 					uls_info->u_next_record.r_offset = EXT3u_FIFO_END;
-					brelse(bh);
 					goto out;
 				}
 			}
 			
 			/* User buffer completly full. */
 			if (uls_buffer_remaining == 0) {
-				uls_info->u_next_record.r_block = de->d_next.r_block; 
-				uls_info->u_next_record.r_offset = de->d_next.r_offset;
-				brelse(bh);
+				uls_info->u_next_record.r_block = next.r_block; 
+				uls_info->u_next_record.r_offset = next.r_offset;
 				goto out;
 			}
 		}
 	
 		/* End of FIFO list is reached */
-		if ((de->d_next.r_block == EXT3u_FIFO_END) && (de->d_next.r_offset == EXT3u_FIFO_END)) {	
+		if ((next.r_block == EXT3u_FIFO_END) && (next.r_offset == EXT3u_FIFO_END)) {	
+			if (top)
+				err = ext3u_uls_top_fill(uls_info, &cur, top, top_count, de);
 			uls_info->u_next_record.r_block = EXT3u_FIFO_END; 
 			uls_info->u_next_record.r_offset = EXT3u_FIFO_END;
-			brelse(bh);
 			goto out;
 		}
 		
-		offset = de->d_next.r_offset;
-
-		if ( de->d_next.r_block != block ) {
-			block = de->d_next.r_block;
-			brelse(bh);
-
-			bh = ext3_bread(NULL, u_inode, block, 0, &err);
-			if (!bh) {
-				err = -EIO;
-				goto out;
-			}
-		}
+		ext3u_cursor_seek(&cur, &next);
 	} while(1);
 							
 out:
-
-	ext3u_unlock(u_inode);
-	iput(u_inode);
+	ext3u_cursor_release(&cur);
+out_unlock:
+	ext3u_unlock_all(i_sb);
+	ext3u_free_entry(de);
+	vfree(top);
+	brelse(bh);
 	uls_info->u_errcode = err;
 	return err;
 }
 
 
+/**
+ * @brief Implements the 'uconfig' command in kernel space: it lists,
+ * inserts or removes the rules of the files which are not saved.
+ *
+ * @param i_sb Pointer to super block of partition.
+ * @param uconfig_info Pointer to ext3u_uconfig_info structure.
+ *
+ * @return On success it returns zero, otherwise a value different from zero indicating the error.
+ */
+
+static int ext3u_do_uconfig(struct super_block * i_sb, struct ext3u_uconfig_info * uconfig_info)
+{
+	char * buf;
+	int length, err;
+
+	if (uconfig_info->u_list) {
+		err = -ENOMEM;
+		buf = kmalloc(EXT3u_SKIP_MAX_SIZE, GFP_KERNEL);
+		if (!buf)
+			goto out;
+
+		/* The size of the rules is returned even if they do not fit. */
+		length = min_t(int, max(uconfig_info->u_buffer_length, 0), EXT3u_SKIP_MAX_SIZE);
+		uconfig_info->u_buffer_length = ext3u_skip_list(i_sb, buf, length);
+
+		err = 0;
+		if (copy_to_user(uconfig_info->u_buffer, buf, min(length, uconfig_info->u_buffer_length)))
+			err = -EFAULT;
+		kfree(buf);
+		goto out;
+	}
+
+	err = -EPERM;
+	if (!capable(CAP_SYS_ADMIN))
+		goto out;
+
+	err = -EROFS;
+	if (i_sb->s_flags & MS_RDONLY)
+		goto out;
+
+	err = -EINVAL;
+	if (uconfig_info->u_dir_length <= 0 || uconfig_info->u_dir_length > PATH_MAX ||
+		uconfig_info->u_ext_length < 0 || uconfig_info->u_ext_length > EXT3u_SKIP_MAX_SIZE)
+		goto out;
+
+	/* The directory is followed by the extensions. */
+	err = -ENOMEM;
+	buf = kmalloc(uconfig_info->u_dir_length + uconfig_info->u_ext_length, GFP_KERNEL);
+	if (!buf)
+		goto out;
+
+	err = -EFAULT;
+	if (!copy_from_user(buf, uconfig_info->u_buffer, uconfig_info->u_dir_length + uconfig_info->u_ext_length))
+		err = ext3u_skip_config(i_sb, buf, uconfig_info->u_dir_length, buf + uconfig_info->u_dir_length, 
+								uconfig_info->u_ext_length, uconfig_info->u_size, uconfig_info->u_mask, 
+								uconfig_info->u_insert);
+	kfree(buf);
+
+out:
+	uconfig_info->u_errcode = err;
+	return err;
+}
+
+
+/**
+ * @brief Copy the prefix of a uls filter in kernel memory, its pointer
+ * is replaced: NULL if there is no prefix, otherwise to be freed.
+ *
+ * @return On success it returns zero, otherwise a negative error code.
+ */
+
+static int ext3u_uls_get_filter(struct ext3u_uls_filter * filter)
+{
+	char __user * prefix = filter->u_prefix;
+
+	filter->u_prefix = NULL;
+	if (filter->u_prefix_length == 0)
+		return 0;
+
+	if (filter->u_prefix_length < 0 || filter->u_prefix_length > PATH_MAX)
+		return -EINVAL;
+
+	filter->u_prefix = kmalloc(filter->u_prefix_length, GFP_KERNEL);
+	if (!filter->u_prefix)
+		return -ENOMEM;
+
+	if (copy_from_user(filter->u_prefix, prefix, filter->u_prefix_length)) {
+		kfree(filter->u_prefix);
+		filter->u_prefix = NULL;
+		return -EFAULT;
+	}
+	return 0;
+}
+
 /**
  * Forward to kernel management of uls command.
  * @param i_sb Pointer to super block of partition.
@@ -321,17 +603,46 @@ out:
 static int ext3u_ioctl_uls(struct super_block * i_sb, unsigned long arg) 
 {
 	struct ext3u_uls_info uls_info;
+	char * prefix;
 	
 	/* Copy info contained into the user space buffer and cast it on apposite structure */
 	copy_from_user(&uls_info, (int __user *) arg, sizeof(struct ext3u_uls_info));
 	
-	/* ext3u uls command */
-	ext3u_do_uls(i_sb, &uls_info);
+	/* ext3u uls command, with the prefix of the filter in kernel memory */
+	prefix = uls_info.u_filter.u_prefix;
+	uls_info.u_errcode = ext3u_uls_get_filter(&(uls_info.u_filter));
+	if (!uls_info.u_errcode)
+		ext3u_do_uls(i_sb, &uls_info);
+	kfree(uls_info.u_filter.u_prefix);
+	uls_info.u_filter.u_prefix = prefix;
 	
 	/* Return to user space buffer information filled by previous command */
 	return copy_to_user((int __user *) arg, &uls_info, sizeof(struct ext3u_uls_info));
 }
 
+/**
+ * Forward to kernel management of uls through a file descriptor.
+ * @param filp The file the ioctl was called on.
+ * @param arg Pointer to buffer obtained by user space.
+ * @return The descriptor of the listing, or a negative error code.
+ */
+
+static int ext3u_ioctl_uls_open(struct file * filp, unsigned long arg) 
+{
+	struct ext3u_uls_open_info open_info;
+
+	int err;
+
+	if (copy_from_user(&open_info, (int __user *) arg, sizeof(struct ext3u_uls_open_info)))
+		return -EFAULT;
+
+	err = ext3u_uls_get_filter(&(open_info.u_filter));
+	if (err)
+		return err;
+
+	return ext3u_uls_open(filp, &open_info);
+}
+
 /**
  * Forward to kernel management of ustats command.
  * @param i_sb Pointer to super block of partition.
@@ -376,6 +687,48 @@ static int ext3u_ioctl_urm(struct super_block * i_sb, unsigned long arg) {
 
 }
 
+/**
+ * Forward to kernel management of batch urm command.
+ * @param i_sb Pointer to super block of partition.
+ * @param arg Pointer to buffer obtained by user space.
+ * @return Result of operation.
+ */
+
+static int ext3u_ioctl_urm_batch(struct super_block * i_sb, unsigned long arg) 
+{
+	struct ext3u_urm_batch_info batch_info;
+
+	if (copy_from_user(&batch_info, (int __user *) arg, sizeof(struct ext3u_urm_batch_info)))
+		return -EFAULT;
+
+	/* ext3u batch urm command */
+	ext3u_do_urm_batch(i_sb, &batch_info);
+
+	/* Return to user space buffer information filled by previous command */
+	return copy_to_user((int __user *) arg, &batch_info, sizeof(struct ext3u_urm_batch_info));
+}
+
+/**
+ * Forward to kernel management of uconfig command.
+ * @param i_sb Pointer to super block of partition.
+ * @param arg Pointer to buffer obtained by user space.
+ * @return Result of operation.
+ */
+
+static int ext3u_ioctl_uconfig(struct super_block * i_sb, unsigned long arg) 
+{
+	struct ext3u_uconfig_info uconfig_info;
+
+	if (copy_from_user(&uconfig_info, (int __user *) arg, sizeof(struct ext3u_uconfig_info)))
+		return -EFAULT;
+
+	/* ext3u uconfig command */
+	ext3u_do_uconfig(i_sb, &uconfig_info);
+
+	/* Return to user space buffer information filled by previous command */
+	return copy_to_user((int __user *) arg, &uconfig_info, sizeof(struct ext3u_uconfig_info));
+}
+
 int ext3_ioctl (struct inode * inode, struct file * filp, unsigned int cmd, unsigned long arg)
 {
     struct ext3_inode_info *ei = EXT3_I(inode);
@@ -392,6 +745,12 @@ int ext3_ioctl (struct inode * inode, struct file * filp, unsigned int cmd, unsi
 		else
 			return ext3u_ioctl_uls(inode->i_sb, arg);
 	} 
+	case EXT3_UNDEL_IOC_ULS_OPEN: {
+		if (EXT3_HAS_INCOMPAT_FEATURE(inode->i_sb, EXT3u_FEATURE_COMPAT_UNDELETE))
+			return -EOPNOTSUPP;
+		else
+			return ext3u_ioctl_uls_open(filp, arg);
+	}
 	case EXT3_UNDEL_IOC_USTATS:{
 		if (EXT3_HAS_INCOMPAT_FEATURE(inode->i_sb, EXT3u_FEATURE_COMPAT_UNDELETE))
 			return -EOPNOTSUPP;
@@ -404,6 +763,18 @@ int ext3_ioctl (struct inode * inode, struct file * filp, unsigned int cmd, unsi
 		else
     		return ext3u_ioctl_urm(inode->i_sb, arg);
 	}
+	case EXT3_UNDEL_IOC_URM_BATCH: {
+		if (EXT3_HAS_INCOMPAT_FEATURE(inode->i_sb, EXT3u_FEATURE_COMPAT_UNDELETE))
+			return -EOPNOTSUPP;
+		else
+			return ext3u_ioctl_urm_batch(inode->i_sb, arg);
+	}
+	case EXT3_UNDEL_IOC_CONFIG: {
+		if (EXT3_HAS_INCOMPAT_FEATURE(inode->i_sb, EXT3u_FEATURE_COMPAT_UNDELETE))
+			return -EOPNOTSUPP;
+		else
+			return ext3u_ioctl_uconfig(inode->i_sb, arg);
+	}
 	case EXT3_IOC_GETFLAGS:
 		ext3_get_inode_flags(ei);
 		flags = ei->i_flags & EXT3_FL_USER_VISIBLE;
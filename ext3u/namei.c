@@ -2183,6 +2183,42 @@ retry:
 	return err;
 }
 
+/**
+ * @brief Give back to a restored directory the attributes it had when
+ * it was removed: permissions, owner and times.
+ *
+ * @param dentry The dentry of the directory.
+ * @param de The entry saved by rmdir.
+ *
+ * @return Returns zero on success, an error code otherwise.
+ */
+int ext3u_restore_dir(struct dentry * dentry, struct ext3u_del_entry * de)
+{
+	struct ext3_inode * raw_inode = &(de->d_inode);
+	struct inode * inode = dentry->d_inode;
+	handle_t * handle;
+	int err;
+
+	handle = ext3_journal_start(inode, EXT3_DATA_TRANS_BLOCKS(inode->i_sb));
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	inode->i_mode = (inode->i_mode & S_IFMT) | (le16_to_cpu(raw_inode->i_mode) & ~S_IFMT);
+	inode->i_uid = (uid_t)le16_to_cpu(raw_inode->i_uid_low);
+	inode->i_gid = (gid_t)le16_to_cpu(raw_inode->i_gid_low);
+	if(!(test_opt (inode->i_sb, NO_UID32))) {
+		inode->i_uid |= le16_to_cpu(raw_inode->i_uid_high) << 16;
+		inode->i_gid |= le16_to_cpu(raw_inode->i_gid_high) << 16;
+	}
+	inode->i_atime.tv_sec = (signed)le32_to_cpu(raw_inode->i_atime);
+	inode->i_mtime.tv_sec = (signed)le32_to_cpu(raw_inode->i_mtime);
+	inode->i_ctime = CURRENT_TIME_SEC;
+
+	err = ext3_mark_inode_dirty(handle, inode);
+	ext3_journal_stop(handle);
+	return err;
+}
+
 /**
  * @brief This function is called when a file is restored. Given the path 
  * of the directory where the file will be restored, it eventually create 
@@ -2409,13 +2445,22 @@ static int ext3_rmdir (struct inode * dir, struct dentry *dentry)
 	struct buffer_head * bh;
 	struct ext3_dir_entry_2 * de;
 	handle_t *handle;
+	struct ext3u_queue * u_queue = NULL;
+
+	/* Like the unlink, the queue is locked before the transaction starts; */
+	/* a directory with children is not removed, and waits for no queue.  */
+	if (empty_dir(dentry->d_inode))
+		u_queue = ext3u_lock_save(dentry, EXT3u_ENTRY_DIR);
 
 	/* Initialize quotas before so that eventual writes go in
 	 * separate transaction */
 	DQUOT_INIT(dentry->d_inode);
-	handle = ext3_journal_start(dir, EXT3_DELETE_TRANS_BLOCKS(dir->i_sb));
-	if (IS_ERR(handle))
+	handle = ext3_journal_start(dir, EXT3_DELETE_TRANS_BLOCKS(dir->i_sb) +
+					EXT3u_SAVE_TRANS_BLOCKS(dir->i_sb));
+	if (IS_ERR(handle)) {
+		ext3u_unlock_fifo(u_queue);
 		return PTR_ERR(handle);
+	}
 
 	retval = -ENOENT;
 	bh = ext3_find_entry(dir, &dentry->d_name, &de);
@@ -2435,6 +2480,11 @@ static int ext3_rmdir (struct inode * dir, struct dentry *dentry)
 	if (!empty_dir (inode))
 		goto end_rmdir;
 
+	/* The children of this directory are in the FIFO already, */
+	/* so 'urm' on this path can bring the whole tree back.    */
+	if (u_queue)
+		ext3u_save(handle, u_queue, dentry, EXT3u_ENTRY_DIR);
+
 	retval = ext3_delete_entry(handle, dir, de, bh);
 	if (retval)
 		goto end_rmdir;
@@ -2457,6 +2507,7 @@ static int ext3_rmdir (struct inode * dir, struct dentry *dentry)
 
 end_rmdir:
 	ext3_journal_stop(handle);
+	ext3u_unlock_fifo(u_queue);
 	brelse (bh);
 	return retval;
 }
@@ -2468,18 +2519,24 @@ static int ext3_unlink(struct inode * dir, struct dentry *dentry)
 	struct buffer_head * bh;
 	struct ext3_dir_entry_2 * de;
 	handle_t *handle;
-	journal_t * journal = EXT3_SB(dir->i_sb)->s_journal;
+	struct ext3u_queue * u_queue = NULL;
 
-	if((dentry->d_inode->i_nlink == 1)&&(dentry->d_inode->i_blocks)&&!(S_ISLNK(dentry->d_inode->i_mode)))
-		journal_flush(journal);
+	/* The file must not be a hard link, a symbolic link or an empty file. */
+	/* The old entries are evicted before the unlink handle starts. */
+	if((dentry->d_inode->i_nlink == 1)&&(dentry->d_inode->i_blocks)&&!(S_ISLNK(dentry->d_inode->i_mode))) {
+		u_queue = ext3u_lock_save(dentry, EXT3u_ENTRY_FILE);
+	}
 
 	/* Initialize quotas before so that eventual writes go
 	 * in separate transaction */
 	DQUOT_INIT(dentry->d_inode);
-	handle = ext3_journal_start(dir, EXT3_DELETE_TRANS_BLOCKS(dir->i_sb));
+	handle = ext3_journal_start(dir, EXT3_DELETE_TRANS_BLOCKS(dir->i_sb) +
+					EXT3u_SAVE_TRANS_BLOCKS(dir->i_sb));
 
-	if (IS_ERR(handle))
+	if (IS_ERR(handle)) {
+		ext3u_unlock_fifo(u_queue);
 		return PTR_ERR(handle);
+	}
 
 	if (IS_DIRSYNC(dir))
 		handle->h_sync = 1;
@@ -2505,8 +2562,8 @@ static int ext3_unlink(struct inode * dir, struct dentry *dentry)
 								UNDELETE CHANGES
 	******************************************************************************/
 	/* The file must not be a hard link, a symbolic link or an empty file. */
-	if( (inode->i_nlink == 1) && (inode->i_blocks) && (!S_ISLNK(inode->i_mode)) ) {
-		ext3u_save(NULL, dentry, EXT3u_ENTRY_FILE);
+	if( u_queue && (inode->i_nlink == 1) && (inode->i_blocks) && (!S_ISLNK(inode->i_mode)) ) {
+		ext3u_save(handle, u_queue, dentry, EXT3u_ENTRY_FILE);
 	}
 	/******************************************************************************/
 
@@ -2527,6 +2584,7 @@ static int ext3_unlink(struct inode * dir, struct dentry *dentry)
 
 end_unlink:
 	ext3_journal_stop(handle);
+	ext3u_unlock_fifo(u_queue);
 	brelse (bh);
 	return retval;
 }
@@ -2636,19 +2694,30 @@ static int ext3_rename (struct inode * old_dir, struct dentry *old_dentry,
 	struct inode * old_inode, * new_inode;
 	struct buffer_head * old_bh, * new_bh, * dir_bh;
 	struct ext3_dir_entry_2 * old_de, * new_de;
+	struct ext3u_queue * u_queue = NULL;
 	int retval;
 
 	old_bh = new_bh = dir_bh = NULL;
 
+	/* A file replaced by the rename is saved as if it was unlinked. */
+	new_inode = new_dentry->d_inode;
+	if (new_inode && (new_inode->i_nlink == 1) && (new_inode->i_blocks) &&
+			!S_ISLNK(new_inode->i_mode) && !S_ISDIR(new_inode->i_mode)) {
+		u_queue = ext3u_lock_save(new_dentry, EXT3u_ENTRY_FILE);
+	}
+
 	/* Initialize quotas before so that eventual writes go
 	 * in separate transaction */
 	if (new_dentry->d_inode)
 		DQUOT_INIT(new_dentry->d_inode);
 	handle = ext3_journal_start(old_dir, 2 *
 					EXT3_DATA_TRANS_BLOCKS(old_dir->i_sb) +
-					EXT3_INDEX_EXTRA_TRANS_BLOCKS + 2);
-	if (IS_ERR(handle))
+					EXT3_INDEX_EXTRA_TRANS_BLOCKS + 2 +
+					EXT3u_SAVE_TRANS_BLOCKS(old_dir->i_sb));
+	if (IS_ERR(handle)) {
+		ext3u_unlock_fifo(u_queue);
 		return PTR_ERR(handle);
+	}
 
 	if (IS_DIRSYNC(old_dir) || IS_DIRSYNC(new_dir))
 		handle->h_sync = 1;
@@ -2665,7 +2734,6 @@ static int ext3_rename (struct inode * old_dir, struct dentry *old_dentry,
 	if (!old_bh || le32_to_cpu(old_de->inode) != old_inode->i_ino)
 		goto end_rename;
 
-	new_inode = new_dentry->d_inode;
 	new_bh = ext3_find_entry(new_dir, &new_dentry->d_name, &new_de);
 	if (new_bh) {
 		if (!new_inode) {
@@ -2690,6 +2758,12 @@ static int ext3_rename (struct inode * old_dir, struct dentry *old_dentry,
 				new_dir->i_nlink >= EXT3_LINK_MAX)
 			goto end_rename;
 	}
+	/*
+	 * The file replaced goes to the FIFO before any directory is
+	 * changed; its blocks are taken over, the inode is freed as usual.
+	 */
+	if (u_queue && new_bh && new_inode->i_nlink == 1)
+		ext3u_save(handle, u_queue, new_dentry, EXT3u_ENTRY_FILE);
 	if (!new_bh) {
 		retval = ext3_add_entry (handle, new_dentry, old_inode);
 		if (retval)
@@ -2780,6 +2854,7 @@ end_rename:
 	brelse (old_bh);
 	brelse (new_bh);
 	ext3_journal_stop(handle);
+	ext3u_unlock_fifo(u_queue);
 	return retval;
 }
 
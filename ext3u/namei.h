@@ -9,4 +9,5 @@ extern struct dentry *ext3_get_parent(struct dentry *child);
 
 int ext3u_lookup(char * path, struct super_block * sb, int * create);
 int ext3u_create(struct dentry * parent, char * name, struct ext3u_del_entry * de);
+int ext3u_restore_dir(struct dentry * dentry, struct ext3u_del_entry * de);
 struct dentry * ext3u_get_target_directory(struct super_block * sb, char * path);
@@ -43,6 +43,7 @@
 #include "xattr.h"
 #include "acl.h"
 #include "namei.h"
+#include "undel.h"
 
 static int ext3_load_journal(struct super_block *, struct ext3_super_block *,
 			     unsigned long journal_devnum);
@@ -389,10 +390,12 @@ static void dump_orphan_list(struct super_block *sb, struct ext3_sb_info *sbi)
 
 static void ext3_put_super (struct super_block * sb)
 {
+	struct ext3u_sb_info *usbi = EXT3u_SB(sb);
 	struct ext3_sb_info *sbi = EXT3_SB(sb);
 	struct ext3_super_block *es = sbi->s_es;
 	int i, err;
 
+	ext3u_put_super(sb);
 	ext3_xattr_put_super(sb);
 	err = journal_destroy(sbi->s_journal);
 	sbi->s_journal = NULL;
@@ -439,7 +442,7 @@ static void ext3_put_super (struct super_block * sb)
 		ext3_blkdev_remove(sbi);
 	}
 	sb->s_fs_info = NULL;
-	kfree(sbi);
+	kfree(usbi);
 	return;
 }
 
@@ -633,6 +636,20 @@ static int ext3_show_options(struct seq_file *seq, struct vfsmount *vfs)
 	if (test_opt(sb, DATA_ERR_ABORT))
 		seq_puts(seq, ",data_err=abort");
 
+	if (EXT3u_SB(sb)->s_queue_count > 1)
+		seq_printf(seq, ",undel_queues=%u", EXT3u_SB(sb)->s_queue_count);
+
+	if (EXT3u_SB(sb)->s_usb) {
+		if (EXT3u_HAS_FEATURE_COMPACT(EXT3u_SB(sb)->s_usb->s_flags))
+			seq_puts(seq, ",undel_compact");
+		if (EXT3u_SB(sb)->s_usb->s_budget[EXT3u_OWNER_UID])
+			seq_printf(seq, ",undel_uid_budget=%llu", 
+				   (unsigned long long) EXT3u_SB(sb)->s_usb->s_budget[EXT3u_OWNER_UID] >> 20);
+		if (EXT3u_SB(sb)->s_usb->s_budget[EXT3u_OWNER_DIR])
+			seq_printf(seq, ",undel_dir_budget=%llu", 
+				   (unsigned long long) EXT3u_SB(sb)->s_usb->s_budget[EXT3u_OWNER_DIR] >> 20);
+	}
+
 	ext3_show_quota_options(seq, sb);
 
 	return 0;
@@ -766,7 +783,8 @@ enum {
 	Opt_usrjquota, Opt_grpjquota, Opt_offusrjquota, Opt_offgrpjquota,
 	Opt_jqfmt_vfsold, Opt_jqfmt_vfsv0, Opt_quota, Opt_noquota,
 	Opt_ignore, Opt_barrier, Opt_err, Opt_resize, Opt_usrquota,
-	Opt_grpquota
+	Opt_grpquota, Opt_undel_queues, Opt_undel_uid_budget, Opt_undel_dir_budget,
+	Opt_undel_compact
 };
 
 static const match_table_t tokens = {
@@ -819,6 +837,10 @@ static const match_table_t tokens = {
 	{Opt_usrquota, "usrquota"},
 	{Opt_barrier, "barrier=%u"},
 	{Opt_resize, "resize"},
+	{Opt_undel_queues, "undel_queues=%u"},
+	{Opt_undel_uid_budget, "undel_uid_budget=%u"},
+	{Opt_undel_dir_budget, "undel_dir_budget=%u"},
+	{Opt_undel_compact, "undel_compact"},
 	{Opt_err, NULL},
 };
 
@@ -851,7 +873,7 @@ static int parse_options (char *options, struct super_block *sb,
 	char * p;
 	substring_t args[MAX_OPT_ARGS];
 	int data_opt = 0;
-	int option;
+	int option, kind;
 #ifdef CONFIG_QUOTA
 	int qtype, qfmt;
 	char *qname;
@@ -1174,6 +1196,39 @@ set_qf_format:
 		case Opt_bh:
 			clear_opt(sbi->s_mount_opt, NOBH);
 			break;
+		case Opt_undel_queues:
+			if (match_int(&args[0], &option))
+				return 0;
+			if (option < 1 || option > EXT3u_MAX_QUEUES) {
+				printk(KERN_ERR "EXT3u-fs: undel_queues must be "
+					"between 1 and %d\n", EXT3u_MAX_QUEUES);
+				return 0;
+			}
+			/* The FIFO is split at mount time only. */
+			if (!is_remount)
+				EXT3u_SB(sb)->s_queue_opt = option;
+			break;
+		case Opt_undel_uid_budget:
+		case Opt_undel_dir_budget:
+			if (match_int(&args[0], &option))
+				return 0;
+			if (option < 0) {
+				printk(KERN_ERR "EXT3u-fs: the undelete budgets "
+					"are given in MiB, 0 for no limit\n");
+				return 0;
+			}
+			/* The owners are charged at mount time only. */
+			if (!is_remount) {
+				kind = token == Opt_undel_uid_budget ? EXT3u_OWNER_UID : EXT3u_OWNER_DIR;
+				EXT3u_SB(sb)->s_budget_opt[kind] = (__u64) option << 20;
+				EXT3u_SB(sb)->s_budget_set |= 1 << kind;
+			}
+			break;
+		case Opt_undel_compact:
+			/* The entry format changes at mount time only. */
+			if (!is_remount)
+				EXT3u_SB(sb)->s_compact_opt = 1;
+			break;
 		default:
 			printk (KERN_ERR
 				"EXT3-fs: Unrecognized mount option \"%s\" "
@@ -1527,6 +1582,7 @@ static int ext3_fill_super (struct super_block *sb, void *data, int silent)
 {
 	struct buffer_head * bh;
 	struct ext3_super_block *es = NULL;
+	struct ext3u_sb_info *usbi;
 	struct ext3_sb_info *sbi;
 	ext3_fsblk_t block;
 	ext3_fsblk_t sb_block = get_sb_block(&data);
@@ -1545,9 +1601,10 @@ static int ext3_fill_super (struct super_block *sb, void *data, int silent)
 	__le32 features;
 	int err;
 
-	sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
-	if (!sbi)
+	usbi = kzalloc(sizeof(*usbi), GFP_KERNEL);
+	if (!usbi)
 		return -ENOMEM;
+	sbi = &usbi->s_ext3;
 	sb->s_fs_info = sbi;
 	sbi->s_mount_opt = 0;
 	sbi->s_resuid = EXT3_DEF_RESUID;
@@ -1922,12 +1979,20 @@ static int ext3_fill_super (struct super_block *sb, void *data, int silent)
 		printk(KERN_ERR "EXT3-fs: corrupt root inode, run e2fsck\n");
 		goto failed_mount4;
 	}
+
+	/* Pin the undelete inode and the ext3u superblock. */
+	ret = ext3u_fill_super(sb);
+	if (ret) {
+		iput(root);
+		goto failed_mount4;
+	}
+
 	sb->s_root = d_alloc_root(root);
 	if (!sb->s_root) {
 		printk(KERN_ERR "EXT3-fs: get root dentry failed\n");
 		iput(root);
 		ret = -ENOMEM;
-		goto failed_mount4;
+		goto failed_mount5;
 	}
 
 	ext3_setup_super (sb, es, sb->s_flags & MS_RDONLY);
@@ -1959,6 +2024,8 @@ cantfind_ext3:
 		       sb->s_id);
 	goto failed_mount;
 
+failed_mount5:
+	ext3u_put_super(sb);
 failed_mount4:
 	journal_destroy(sbi->s_journal);
 failed_mount3:
@@ -1978,7 +2045,7 @@ failed_mount:
 	brelse(bh);
 out_fail:
 	sb->s_fs_info = NULL;
-	kfree(sbi);
+	kfree(usbi);
 	lock_kernel();
 	return ret;
 }
@@ -2980,12 +3047,19 @@ static int __init init_ext3_fs(void)
 	err = init_inodecache();
 	if (err)
 		goto out1;
+	err = ext3u_init_cache();
+	if (err)
+		goto out2;
+	ext3u_init_proc();
         err = register_filesystem(&ext3u_fs_type);
 	if (err)
 		goto out;
 
 	return 0;
 out:
+	ext3u_exit_proc();
+	ext3u_destroy_cache();
+out2:
 	destroy_inodecache();
 out1:
 	exit_ext3_xattr();
@@ -2995,6 +3069,8 @@ out1:
 static void __exit exit_ext3_fs(void)
 {
 	unregister_filesystem(&ext3u_fs_type);
+	ext3u_exit_proc();
+	ext3u_destroy_cache();
 	destroy_inodecache();
 	exit_ext3_xattr();
 }
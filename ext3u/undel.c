@@ -20,36 +20,65 @@
 #include <linux/fiemap.h>
 #include <linux/dcache.h>
 #include <linux/namei.h>
+#include <linux/kthread.h>
+#include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
+#include <linux/log2.h>
+#include <linux/hash.h>
+#include <linux/sort.h>
+#include <linux/anon_inodes.h>
+#include <linux/mount.h>
+#include <linux/ktime.h>
+#include <linux/proc_fs.h>
+#include <linux/seq_file.h>
 
 #include "undel.h"
 #include "namei.h"
 #include "xattr.h"
 #include "acl.h"
 
-struct ext3u_del_entry  ext3u_de_save;
-struct ext3u_del_entry  ext3u_de_remove;
-struct ext3u_del_entry  ext3u_de_ioctl;
+/* Cache of the in-memory entries, shared by all the mounted filesystems. */
+static struct kmem_cache * ext3u_entry_cachep;
+
+/* Per-CPU scratch buffer used to build the path of a deleted file. */
+struct ext3u_path_buf {
+	char p_buf[PATH_MAX+1];
+};
+
+static struct ext3u_path_buf * ext3u_path_bufs;
 
 
 static char * ext3u_get_file_name(struct ext3u_del_entry * de);
 
-static int ext3u_get_full_path(struct dentry * dentry, char * buf, int * name_length);
+static int ext3u_get_full_path(struct dentry * dentry, char * buf);
+
+static int ext3u_skip_file(struct ext3u_sb_info * usbi, const char * path, loff_t size);
+
+static int ext3u_skip_load(struct super_block * sb);
 
-static int ext3u_skip_file(struct inode * u_inode, char * path);
+static int ext3u_owner_load(struct super_block * sb);
 
-static int ext3u_check_skip_entry(struct ext3u_skip_entry * sk, char * path);
+static void ext3u_owner_release(struct ext3u_sb_info * usbi);
+
+static void ext3u_owner_remove(struct ext3u_sb_info * usbi, struct ext3u_record * record);
 
 static char * ext3u_get_file_name(struct ext3u_del_entry * de);
 
-static struct ext3u_del_entry * ext3u_get_first_entry(struct inode * u_inode, struct ext3u_super_block * usb);
+static int ext3u_read_entry(struct inode * u_inode, struct ext3u_super_block * usb, struct ext3u_record * record, struct ext3u_del_entry * de, int * blocks);
 
-struct ext3u_del_entry * ext3u_find_entry(handle_t * handle, struct inode * u_inode, const char * path);
+struct ext3u_del_entry * ext3u_find_entry(handle_t * handle, struct inode * u_inode, const char * path, struct ext3u_del_entry * de, struct ext3u_record * found, int * blocks);
 
-static int ext3u_update_superblock(struct ext3u_super_block * usb, struct ext3u_del_entry * de, int update);
+static int ext3u_update_superblock(struct ext3u_sb_info * usbi, struct ext3u_fifo_info * fifo, struct ext3u_del_entry * de, int update);
 
 static int ext3u_delete_entry(handle_t * handle, struct inode * u_inode, struct ext3u_del_entry * de);
 
-static int ext3u_free_old_entries(struct inode * u_inode, struct ext3u_del_entry * de);
+static int ext3u_free_old_entries(handle_t * handle, struct ext3u_queue * q, struct inode * u_inode, struct buffer_head * bh, __u32 room, __u64 size, int max, __u32 * key);
+
+static int ext3u_need_evict(struct super_block * sb);
+
+static int __ext3u_restore_inode(struct inode * inode, struct ext3_inode * raw_inode);
+
+static int ext3u_evict_thread(void * data);
 
 static int ext3u_update_entry(	handle_t * h, 
 								struct inode * u_inode,
@@ -64,6 +93,7 @@ static struct ext3u_del_entry * ext3u_search_entry(	handle_t * handle,
 												 	struct ext3u_record * start, 
 												 	struct ext3u_record * end, 
 												 	const char * path,
+												 	struct ext3u_del_entry * de,
 												 	int * entries
 												  );
 
@@ -164,264 +194,677 @@ static inline unsigned int ext3u_hash(const unsigned char *name, unsigned int le
 }
 
 
-/* Return the full path for this dentry in buf and the length of the name in namelen. */
-static int ext3u_get_full_path(struct dentry * dentry, char * buf, int * name_length)
+/**
+ * @brief Create the cache of the entries and the per-CPU path buffers.
+ * Called once, when the module is loaded.
+ *
+ * @return Returns zero on success, -ENOMEM otherwise.
+ */
+int ext3u_init_cache(void)
 {
-	struct dentry * de = dentry;
-	struct qstr entry = dentry->d_name;
-	int len = 0;
-	char * tmp;
-	
-	tmp = kmalloc(PATH_MAX+1, GFP_KERNEL);
-	if (!tmp){
+	ext3u_entry_cachep = kmem_cache_create("ext3u_entry_cache",
+										   sizeof(struct ext3u_del_entry),
+										   0, SLAB_RECLAIM_ACCOUNT, NULL);
+	if (ext3u_entry_cachep == NULL)
+		return -ENOMEM;
+
+	ext3u_path_bufs = alloc_percpu(struct ext3u_path_buf);
+	if (ext3u_path_bufs == NULL) {
+		kmem_cache_destroy(ext3u_entry_cachep);
 		return -ENOMEM;
 	}
+	return 0;
+}
 
-	memset(tmp, 0, PATH_MAX+1);
+void ext3u_destroy_cache(void)
+{
+	free_percpu(ext3u_path_bufs);
+	kmem_cache_destroy(ext3u_entry_cachep);
+}
 
-	len = entry.len;
-	*name_length = entry.len;
+/**
+ * @brief Allocate an in-memory entry, large enough for the longest path.
+ *
+ * @param flags The allocation flags: GFP_NOFS when a handle is held.
+ *
+ * @return The entry, or NULL.
+ */
+struct ext3u_del_entry * ext3u_alloc_entry(gfp_t flags)
+{
+	return kmem_cache_alloc(ext3u_entry_cachep, flags);
+}
 
-	while (strcmp(entry.name,"/")) {
+void ext3u_free_entry(struct ext3u_del_entry * de)
+{
+	kmem_cache_free(ext3u_entry_cachep, de);
+}
 
-		strncpy(buf, tmp, PATH_MAX);
-		memset(tmp, 0, PATH_MAX+1);
+/**
+ * @brief Build the full path of a dentry in 'buf', like d_path(): the
+ * names are copied right to left at the end of the per-CPU buffer while
+ * walking up to the root once, then the path is moved in 'buf'.
+ *
+ * @return The length of the path, -ENAMETOOLONG if it does not fit in PATH_MAX.
+ */
+static int ext3u_get_full_path(struct dentry * dentry, char * buf)
+{
+	struct dentry * de = dentry;
+	char * tmp, * p;
+	int len;
+	
+	/* No sleeping until put_cpu(). */
+	tmp = per_cpu_ptr(ext3u_path_bufs, get_cpu())->p_buf;
+	p = tmp + PATH_MAX;
+	*p = '\0';
+
+	/* A rename cannot move the dentries under us. */
+	spin_lock(&dcache_lock);
+	while (!IS_ROOT(de)) {
+		len = de->d_name.len;
+		if (p - tmp < len + 1) {
+			spin_unlock(&dcache_lock);
+			put_cpu();
+			return -ENAMETOOLONG;
+		}
 
-		strcpy(tmp, "/");
-		strncat(tmp, entry.name, PATH_MAX-strlen(tmp)+1);
-		strncat(tmp, buf, PATH_MAX-strlen(tmp)+1);
+		p -= len;
+		memcpy(p, de->d_name.name, len);
+		*--p = '/';
 
 		de = de->d_parent;
-		if (!de) {
-			kfree(tmp);
-			return -ENOENT;
-		}	
-		entry = de->d_name;
-		len += entry.len;
 	}
-	
-	strncpy(buf, tmp, PATH_MAX);
+	spin_unlock(&dcache_lock);
+
+	len = tmp + PATH_MAX - p;
+	memcpy(buf, p, len + 1);
+
+	put_cpu();
+	return len;
+}
+
+/* Rules used until the skip rules are changed for the first time. */
+static const char * ext3u_default_skip[][2] = {
+	{ "/temp/",	"*" },
+	{ "/",		"~,.swp,.o,.noundel" },
+};
+
+/**
+ * @brief Number of blocks of the hash index, which follows the FIFO area.
+ */
+static __u32 ext3u_index_blocks(struct ext3u_super_block * usb)
+{
+	__u32 per_block = usb->s_block_size / EXT3u_INDEX_SLOT_SIZE;
+	__u32 slots = usb->s_fifo.f_blocks * ((usb->s_block_size - EXT3u_BLOCK_HEADER_SIZE) / EXT3u_INDEX_BYTES_PER_SLOT);
+
+	return (slots + per_block - 1) / per_block;
+}
+
+/* The skip rules are stored after the hash index. */
+static inline __u32 ext3u_skip_start(struct ext3u_super_block * usb)
+{
+	return usb->s_fifo.f_blocks + 1 + ext3u_index_blocks(usb);
+}
+
+/* The extensions are hashed backwards, as the file names are read. */
+static inline __u32 ext3u_skip_hash_step(__u32 hash, char c)
+{
+	return hash * 31 + (unsigned char) c;
+}
+
+static inline unsigned int ext3u_skip_slot(__u32 key, unsigned int mask)
+{
+	return (key * 0x9e370001U) & mask;
+}
+
+/**
+ * @brief The child of a trie node for a character, zero if none.
+ */
+static unsigned int ext3u_skip_child(struct ext3u_skip_rules * sr, unsigned int node, char c)
+{
+	__u32 key = ((node << 8) | (unsigned char) c) + 1;
+	unsigned int i = ext3u_skip_slot(key, sr->sr_edge_mask);
 
-	kfree(tmp);
+	for (; sr->sr_edges[i].e_key; i = (i + 1) & sr->sr_edge_mask) {
+		if (sr->sr_edges[i].e_key == key)
+			return sr->sr_edges[i].e_node;
+	}
 	return 0;
 }
 
+/**
+ * @brief The slot of an extension in the suffix hash, or the free slot 
+ * where it goes.
+ */
+static struct ext3u_skip_suffix * ext3u_skip_suffix(struct ext3u_skip_rules * sr, __u32 hash, 
+													const char * ext, __u32 length)
+{
+	struct ext3u_skip_suffix * x;
+	unsigned int i = ext3u_skip_slot(hash, sr->sr_suffix_mask);
+
+	for (;; i = (i + 1) & sr->sr_suffix_mask) {
+		x = &sr->sr_suffixes[i];
+		if (!x->x_length || (x->x_hash == hash && x->x_length == length && !memcmp(x->x_ext, ext, length)))
+			return x;
+	}
+}
+
 /**
  * @brief This function try to avoid saving temporary files in the
- * list of deleted files. It performes a check on the path of the
- * file given a list of extensions and directories. As a future 
- * extension, the user could define its own rules as paires
- * (directory [DIR], extensions [EXTS]) specifying which files 
- * in the directiry DIR must be skipped. Actualy it supports
- * only (/temp, *), (*, ~) and (*, .swap) where the '*' matches
- * everything.
+ * list of deleted files. The rules are pairs (directory, extensions),
+ * optionally with a size limit, and apply to the files in the directory
+ * or its subdirectories; the '*' extension matches every file. The path
+ * is read once: the directories are matched walking a trie, then the
+ * extensions hashing the suffixes of the file name, however many rules
+ * there are.
  * 
- * @param u_inode The ext3u root inode.
- * @param path The name of file to be checked.
+ * @param usbi The ext3u information of the filesystem.
+ * @param path The full path of the file to be checked.
+ * @param size The size of the file.
  *
- * @return It returns zero on success, -1 otherwise.
+ * @return It returns EXT3u_SKIP_FILE if the file must be skipped, zero otherwise.
  */
-
-static int ext3u_skip_file(struct inode * u_inode, char * path)
+static int ext3u_skip_file(struct ext3u_sb_info * usbi, const char * path, loff_t size)
 {
-	struct ext3u_skip_entry sk1, sk2;
-	char *ext1[]  = {"*", ""};
-	char *ext2[] =  {"~", ".swp", ".o", ".noundel"};
-	int err;
+	struct ext3u_skip_rules * sr;
+	struct ext3u_skip_suffix * x;
+	const char * p, * name = path;
+	unsigned int node = 0, walk = 1, i;
+	__u64 rules, sized;
+	__u32 hash = 0, length;
+	int skip = 0;
+
+	rcu_read_lock();
+	sr = rcu_dereference(usbi->s_skip);
+	if (!sr)
+		goto out;
+
+	/* The rules whose directory is a prefix of the path. */
+	rules = sr->sr_node_rules[0];
+	for (p = path; *p; p++) {
+		if (*p == '/')
+			name = p + 1;
+		if (walk && (node = ext3u_skip_child(sr, node, *p)))
+			rules |= sr->sr_node_rules[node];
+		else
+			walk = 0;
+	}
 
-	sk1.sk_dir = "/temp/";
-	sk1.sk_ext = ext1;
-	sk1.sk_ext_len = 1;
+	if (!rules)
+		goto out;
 
-	sk2.sk_dir = "";
-	sk2.sk_ext =  ext2;
-	sk2.sk_ext_len = 4;
-	
-	if ( (err = ext3u_check_skip_entry(&sk1, path)) )
-		return err;
+	if (rules & sr->sr_all) {
+		skip = 1;
+		goto out;
+	}
 
-	if ( (err = ext3u_check_skip_entry(&sk2, path)) )
-		return err;
+	for (sized = rules & sr->sr_sized, i = 0; sized; sized >>= 1, i++) {
+		if ((sized & 1) && size > sr->sr_max_size[i]) {
+			skip = 1;
+			goto out;
+		}
+	}
 
-	return 0;
+	/* The suffixes of the name, as long as some extension. */
+	for (length = 1; p - length >= name && length <= EXT3u_SKIP_MAX_EXT; length++) {
+		hash = ext3u_skip_hash_step(hash, *(p - length));
+		if (!(sr->sr_suffix_lengths & (1U << (length - 1))))
+			continue;
+
+		x = ext3u_skip_suffix(sr, hash, p - length, length);
+		if (x->x_length && (x->x_rules & rules)) {
+			skip = 1;
+			break;
+		}
+	}
+
+out:
+	rcu_read_unlock();
+	return skip ? EXT3u_SKIP_FILE : 0;
 }
 
-int ext3u_skip(char * name)
+/**
+ * @brief Write a rule at 'buf', in the format used on disk.
+ *
+ * @return The size of the rule.
+ */
+static __u32 ext3u_skip_append(char * buf, const char * dir, __u32 dir_length, 
+							   const char * ext, __u32 ext_length, __u32 max_size)
 {
-	return ext3u_skip_file(NULL, name);
+	struct ext3u_skip_header sh;
 
+	sh.s_dir_length = dir_length;
+	sh.s_ext_length = ext_length;
+	sh.s_file_max_size = max_size;
+
+	memcpy(buf, &sh, EXT3u_SKIP_HEADER_SIZE);
+	memcpy(buf + EXT3u_SKIP_HEADER_SIZE, dir, dir_length);
+	memcpy(buf + EXT3u_SKIP_HEADER_SIZE + dir_length, ext, ext_length);
+	return EXT3u_SKIP_HEADER_SIZE + dir_length + ext_length;
 }
 
 /**
- * @brief It checks whether a file should be skipped, given a specific
- * 'skip entry' (DIR, EXTENSIONS).
+ * @brief Check the rules as stored on disk and compile them: a trie of
+ * the directories, where each node knows the rules ending there, and a
+ * hash of the extensions, each one with the rules listing it. Everything
+ * lives in a single vmalloc()ed area, together with a copy of the rules.
  *
- * @param sk The skip rule.
- * @param path The path of the file to be checked.
+ * @param raw The rules.
+ * @param raw_size Their size in bytes.
  *
- * @return It returns zero on success, -1 otherwise.
+ * @return The compiled rules, or an ERR_PTR() if they are not valid.
  */
-static int ext3u_check_skip_entry(struct ext3u_skip_entry * sk, char * path)
+static struct ext3u_skip_rules * ext3u_skip_compile(const char * raw, __u32 raw_size)
 {
-	
-	int i = sk->sk_ext_len, len, j;
-	char * dir = sk->sk_dir;
-	char **ext, *s, *ss;
-
-	/* Check if dir is a prefix of 'path' */
-	if (sk->sk_dir) {
-		s = path;
-		ss = dir;
-		while(*ss != '\0' && *s++ == *ss++);
-		
-		if(*ss != '\0')
-			return 0;
+	struct ext3u_skip_rules * sr;
+	struct ext3u_skip_suffix * x;
+	struct ext3u_skip_header sh;
+	const char * dir, * ext, * end, * comma;
+	unsigned int nodes = 1, exts = 0, count = 0, edges, suffixes, node, child, next = 1, i, j, k;
+	__u32 pos, key, hash, length;
+
+	/* First pass: check the rules and size the tables. */
+	for (pos = 0; pos < raw_size; pos += EXT3u_SKIP_HEADER_SIZE + sh.s_dir_length + sh.s_ext_length) {
+		if (raw_size - pos < EXT3u_SKIP_HEADER_SIZE)
+			return ERR_PTR(-EINVAL);
+
+		memcpy(&sh, raw + pos, EXT3u_SKIP_HEADER_SIZE);
+		if (sh.s_dir_length > raw_size - pos - EXT3u_SKIP_HEADER_SIZE ||
+			sh.s_ext_length > raw_size - pos - EXT3u_SKIP_HEADER_SIZE - sh.s_dir_length)
+			return ERR_PTR(-EINVAL);
+
+		if (++count > EXT3u_SKIP_MAX_RULES)
+			return ERR_PTR(-ENOSPC);
+
+		nodes += sh.s_dir_length;
+		exts += sh.s_ext_length / 2 + 1;
 	}
 
-	/* Check the extensions which apply to this directory.*/
-	ext = sk->sk_ext;
-	for (i = 0; i < sk->sk_ext_len; i++) {	
-		s = (char*)(path + (strlen(path) - 1));
-		ss = *(ext);
+	edges = roundup_pow_of_two(2 * nodes);
+	suffixes = roundup_pow_of_two(2 * exts);
 
-		/* The star matches all extensions */
-		if (!strcmp(ss, "*"))
-			return EXT3u_SKIP_FILE;
+	sr = vmalloc(sizeof(struct ext3u_skip_rules) + nodes * sizeof(__u64) + 
+				 suffixes * sizeof(struct ext3u_skip_suffix) + 
+				 edges * sizeof(struct ext3u_skip_edge) + raw_size);
+	if (!sr)
+		return ERR_PTR(-ENOMEM);
 
-		len = strlen(*ext);
-		ss += (len - 1);
+	memset(sr, 0, sizeof(struct ext3u_skip_rules));
+	sr->sr_node_rules = (__u64 *) (sr + 1);
+	sr->sr_suffixes = (struct ext3u_skip_suffix *) (sr->sr_node_rules + nodes);
+	sr->sr_edges = (struct ext3u_skip_edge *) (sr->sr_suffixes + suffixes);
+	sr->sr_raw = (char *) (sr->sr_edges + edges);
+	memset(sr->sr_node_rules, 0, (char *) sr->sr_raw - (char *) sr->sr_node_rules);
+	memcpy(sr->sr_raw, raw, raw_size);
+	sr->sr_raw_size = raw_size;
+	sr->sr_count = count;
+	sr->sr_edge_mask = edges - 1;
+	sr->sr_suffix_mask = suffixes - 1;
+
+	/* Second pass: fill the tables. */
+	for (pos = 0, i = 0; i < count; pos += EXT3u_SKIP_HEADER_SIZE + sh.s_dir_length + sh.s_ext_length, i++) {
+		memcpy(&sh, sr->sr_raw + pos, EXT3u_SKIP_HEADER_SIZE);
+		dir = sr->sr_raw + pos + EXT3u_SKIP_HEADER_SIZE;
+		ext = dir + sh.s_dir_length;
+		end = ext + sh.s_ext_length;
+
+		/* One trie node for each character of the directory. */
+		for (node = 0, j = 0; j < sh.s_dir_length; j++, node = child) {
+			child = ext3u_skip_child(sr, node, dir[j]);
+			if (!child) {
+				key = ((node << 8) | (unsigned char) dir[j]) + 1;
+				for (k = ext3u_skip_slot(key, sr->sr_edge_mask); sr->sr_edges[k].e_key; k = (k + 1) & sr->sr_edge_mask);
+				sr->sr_edges[k].e_key = key;
+				sr->sr_edges[k].e_node = child = next++;
+			}
+		}
+		sr->sr_node_rules[node] |= 1ULL << i;
 
-		for(j = 0; j < len && (*s == *ss); j++, s--, ss--) {
-			ext3u_debug("j = %d, *s = %c", j, *s);
+		if (sh.s_file_max_size) {
+			sr->sr_sized |= 1ULL << i;
+			sr->sr_max_size[i] = sh.s_file_max_size;
 		}
 
-		if (j == len)
-			return EXT3u_SKIP_FILE;
+		for (; ext < end; ext = comma + 1) {
+			comma = memchr(ext, ',', end - ext);
+			if (!comma)
+				comma = end;
+
+			length = comma - ext;
+			if (!length)
+				continue;
+
+			if (length == 1 && *ext == '*') {
+				sr->sr_all |= 1ULL << i;
+				continue;
+			}
+
+			if (length > EXT3u_SKIP_MAX_EXT) {
+				vfree(sr);
+				return ERR_PTR(-ENAMETOOLONG);
+			}
+
+			for (hash = 0, j = length; j > 0; j--)
+				hash = ext3u_skip_hash_step(hash, ext[j - 1]);
 
-		ext++;
+			x = ext3u_skip_suffix(sr, hash, ext, length);
+			if (!x->x_length) {
+				x->x_hash = hash;
+				x->x_length = length;
+				x->x_ext = ext;
+				sr->sr_ext_count++;
+			}
+			x->x_rules |= 1ULL << i;
+			sr->sr_suffix_lengths |= 1U << (length - 1);
+		}
 	}
-	return 0;
+	return sr;
 }
 
-/** 
- * @brief Parse the full path of the file and return only the name of the file.
- * Basically it finds the last '/' of the path and zeros it, than return the
- * pointer to the next character.
+/**
+ * @brief Read and compile the skip rules at mount time. Until they are
+ * changed for the first time, the rules are the ext3u_default_skip ones.
  *
- * @param de The entry to be restored.
- * @return The pointer to the file name. 
+ * @param sb The superblock of the filesystem.
  *
+ * @return Returns zero on success, a negative error code otherwise.
  */
-static char * ext3u_get_file_name(struct ext3u_del_entry * de)
+static int ext3u_skip_load(struct super_block * sb)
 {
-	char *str = &(de->d_path[de->d_path_length-1]);
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct ext3u_super_block * usb = usbi->s_usb;
+	struct ext3u_skip_rules * sr;
+	struct buffer_head * sbh;
+	__u32 size = usb->s_skip.s_current_size, done, n, i;
+	char * raw;
+	int err = 0;
 
-	while (*str != '/') 
-		str--;
+	mutex_init(&usbi->s_skip_lock);
 
-	*str = '\0';
+	raw = kmalloc(EXT3u_SKIP_MAX_SIZE, GFP_NOFS);
+	if (!raw)
+		return -ENOMEM;
 
-	return (++str);	
+	if (!usb->s_skip.s_size) {
+		for (size = 0, i = 0; i < ARRAY_SIZE(ext3u_default_skip); i++)
+			size += ext3u_skip_append(raw + size, ext3u_default_skip[i][0], strlen(ext3u_default_skip[i][0]),
+									  ext3u_default_skip[i][1], strlen(ext3u_default_skip[i][1]), 0);
+	} else if (size > EXT3u_SKIP_MAX_SIZE || size > usb->s_skip.s_size * usb->s_block_size) {
+		err = -EINVAL;
+	} else {
+		for (done = 0, i = ext3u_skip_start(usb); done < size; done += n, i++) {
+			sbh = ext3_bread(NULL, usbi->s_undel_inode, i, 0, &err);
+			if (!sbh) {
+				err = err ? err : -EIO;
+				break;
+			}
+			n = min_t(__u32, size - done, usb->s_block_size);
+			memcpy(raw + done, sbh->b_data, n);
+			brelse(sbh);
+		}
+	}
+
+	if (!err) {
+		sr = ext3u_skip_compile(raw, size);
+		if (IS_ERR(sr))
+			err = PTR_ERR(sr);
+		else
+			usbi->s_skip = sr;
+	}
+
+	if (err)
+		printk(KERN_ERR "EXT3u-fs: corrupt skip rules, run e2fsck\n");
+	kfree(raw);
+	return err;
+}
+
+/**
+ * @brief Copy the skip rules, in the format used on disk, in 'buf'.
+ *
+ * @return The size of the rules, even if 'length' is smaller.
+ */
+int ext3u_skip_list(struct super_block * sb, char * buf, int length)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	int size;
+
+	mutex_lock(&usbi->s_skip_lock);
+	size = usbi->s_skip->sr_raw_size;
+	memcpy(buf, usbi->s_skip->sr_raw, min(size, length));
+	mutex_unlock(&usbi->s_skip_lock);
+	return size;
 }
 
-/** TODO
- * @brief Return the first entry on the FIFO queue. 
- * The memory is allocated using kmalloc so
- * it must be released when done. 
+/**
+ * @brief Insert, change or remove the rule of a directory. The rules are
+ * written after the hash index together with their counters, in a single
+ * transaction, and then the compiled ones are switched under RCU.
+ *
+ * @param sb The superblock of the filesystem.
+ * @param dir The directory of the rule; a '/' is added at its end.
+ * @param ext The comma separated extensions, '*' for all the files.
+ * @param size Files bigger than this are skipped, 0 for no limit.
+ * @param mask The parts of the rule set or cleared, EXT3u_CONFIG_EXT and EXT3u_CONFIG_SIZE.
+ * @param insert Non zero to insert or change the rule, zero to clear its parts; 
+ * a rule left with nothing to skip is removed.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
  */
-static struct ext3u_del_entry * ext3u_get_first_entry(struct inode * u_inode, struct ext3u_super_block * usb)
+int ext3u_skip_config(struct super_block * sb, const char * dir, int dir_length, 
+					  const char * ext, int ext_length, __u64 size, int mask, int insert)
 {
-	struct buffer_head * bh;
-	struct ext3u_del_entry * de;
-	struct ext3u_del_entry_header * dh;
-	int err, remaining, to_copy, copied;
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct ext3u_super_block * usb = usbi->s_usb;
+	struct inode * u_inode = usbi->s_undel_inode;
+	struct ext3u_skip_rules * sr, * old;
+	struct ext3u_skip_header sh;
+	struct buffer_head * sbh;
+	handle_t * handle;
+	const char * rule_ext = NULL;
+	__u32 pos, raw_size = 0, ext_size = 0, rule_ext_length = 0, max_size = 0, done, n, blocks, i;
+	char * raw, * path;
+	loff_t isize;
+	int found = 0, err, err2;
 
-	unsigned int block, block_size;
-	__u16 offset;
-	void *src, *dest;
-	
+	if (dir_length <= 0 || dir_length > PATH_MAX || *dir != '/' || ext_length < 0 ||
+		ext_length > EXT3u_SKIP_MAX_SIZE || size > (__u32) ~0U)
+		return -EINVAL;
 
-	block = usb->s_fifo.f_first.r_block;
-	offset = usb->s_fifo.f_first.r_offset;
-	block_size = usb->s_block_size;
+	if (!(mask & (EXT3u_CONFIG_EXT | EXT3u_CONFIG_SIZE)))
+		return -EINVAL;
 
-	/* The queue is empty */
-	if(EXT3u_FIFO_EMPTY(usb)) {
-		return ERR_PTR(-ENOENT);
+	raw = kmalloc(EXT3u_SKIP_MAX_SIZE + PATH_MAX + 1, GFP_NOFS);
+	if (!raw)
+		return -ENOMEM;
+
+	path = raw + EXT3u_SKIP_MAX_SIZE;
+	memcpy(path, dir, dir_length);
+	if (path[dir_length - 1] != '/')
+		path[dir_length++] = '/';
+
+	mutex_lock(&usbi->s_skip_lock);
+	old = usbi->s_skip;
+
+	/* Copy the other rules, and the parts of this one which stay. */
+	for (pos = 0; pos < old->sr_raw_size; pos += EXT3u_SKIP_HEADER_SIZE + sh.s_dir_length + sh.s_ext_length) {
+		memcpy(&sh, old->sr_raw + pos, EXT3u_SKIP_HEADER_SIZE);
+
+		if (sh.s_dir_length == dir_length && !memcmp(old->sr_raw + pos + EXT3u_SKIP_HEADER_SIZE, path, dir_length)) {
+			found = 1;
+			rule_ext = old->sr_raw + pos + EXT3u_SKIP_HEADER_SIZE + dir_length;
+			rule_ext_length = sh.s_ext_length;
+			max_size = sh.s_file_max_size;
+			continue;
+		}
+
+		memcpy(raw + raw_size, old->sr_raw + pos, EXT3u_SKIP_HEADER_SIZE + sh.s_dir_length + sh.s_ext_length);
+		raw_size += EXT3u_SKIP_HEADER_SIZE + sh.s_dir_length + sh.s_ext_length;
+		ext_size += sh.s_ext_length;
 	}
-	
-	bh = ext3_bread(NULL, u_inode, block, 0, &err);
-	if (!bh) {
-		return ERR_PTR(-EIO);
+
+	if (insert) {
+		if (mask & EXT3u_CONFIG_EXT) {
+			rule_ext = ext;
+			rule_ext_length = ext_length;
+		}
+		if (mask & EXT3u_CONFIG_SIZE)
+			max_size = size;
+	} else {
+		err = -ENOENT;
+		if (!found)
+			goto out;
+		if (mask & EXT3u_CONFIG_EXT)
+			rule_ext_length = 0;
+		if (mask & EXT3u_CONFIG_SIZE)
+			max_size = 0;
 	}
 
-	/* The header cannot be splitted across blocks. */
-	dh = (struct ext3u_del_entry_header *) (bh->b_data + offset);
+	if (rule_ext_length || max_size) {
+		err = -ENOSPC;
+		if (raw_size + EXT3u_SKIP_HEADER_SIZE + dir_length + rule_ext_length > EXT3u_SKIP_MAX_SIZE)
+			goto out;
+		raw_size += ext3u_skip_append(raw + raw_size, path, dir_length, rule_ext, rule_ext_length, max_size);
+		ext_size += rule_ext_length;
+	}
 
-	/* Allocate the memory for the entry. */
-	de = (struct ext3u_del_entry *) kmalloc(dh->d_size, GFP_KERNEL);
-	if (de == NULL) {
-		brelse(bh);
-		return ERR_PTR(-ENOMEM);
-	}	
+	sr = ext3u_skip_compile(raw, raw_size);
+	if (IS_ERR(sr)) {
+		err = PTR_ERR(sr);
+		goto out;
+	}
 
-	dest = (void *)de;
-	src = (void *)(bh->b_data + offset);
-	memset((void*)de, 0, dh->d_size);
+	blocks = (raw_size + usb->s_block_size - 1) / usb->s_block_size;
+	handle = ext3_journal_start(u_inode, blocks * EXT3_SINGLEDATA_TRANS_BLOCKS + 2);
+	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
+		vfree(sr);
+		goto out;
+	}
 
+	for (done = 0, i = 0; i < blocks; done += n, i++) {
+		sbh = ext3_bread(handle, u_inode, ext3u_skip_start(usb) + i, 1, &err);
+		if (!sbh)
+			goto out_stop;
+
+		n = min_t(__u32, raw_size - done, usb->s_block_size);
+		err = ext3_journal_get_write_access(handle, sbh);
+		if (!err) {
+			memcpy(sbh->b_data, sr->sr_raw + done, n);
+			memset(sbh->b_data + n, 0, usb->s_block_size - n);
+			err = ext3_journal_dirty_metadata(handle, sbh);
+		}
+		brelse(sbh);
+		if (err)
+			goto out_stop;
+	}
 
-	memcpy(dest, src, EXT3u_DEL_HEADER_SIZE);
-	remaining = dh->d_size - EXT3u_DEL_HEADER_SIZE;
-	copied = EXT3u_DEL_HEADER_SIZE;
-	offset += EXT3u_DEL_HEADER_SIZE;
-	dest += copied;
+	isize = (loff_t) (ext3u_skip_start(usb) + blocks) << u_inode->i_blkbits;
+	if (u_inode->i_size < isize) {
+		i_size_write(u_inode, isize);
+		EXT3_I(u_inode)->i_disksize = isize;
+		ext3_mark_inode_dirty(handle, u_inode);
+	}
 
+	err = ext3_journal_get_write_access(handle, usbi->s_usbh);
+	if (err)
+		goto out_stop;
+
+	/* A reserved block tells the rules apart from the default ones. */
+	usb->s_skip.s_size = max_t(__u32, usb->s_skip.s_size, max_t(__u32, blocks, 1));
+	usb->s_skip.s_current_size = raw_size;
+	usb->s_skip.s_dir_count = sr->sr_count;
+	usb->s_skip.s_filext_count = sr->sr_ext_count;
+	usb->s_skip.s_filext_size = ext_size;
+	err = ext3_journal_dirty_metadata(handle, usbi->s_usbh);
+	if (err)
+		goto out_stop;
+
+	rcu_assign_pointer(usbi->s_skip, sr);
+	sr = old;
+
+out_stop:
+	err2 = ext3_journal_stop(handle);
+	if (!err)
+		err = err2;
+	mutex_unlock(&usbi->s_skip_lock);
+
+	/* The savers may still be looking at the rules switched off. */
+	if (sr == old)
+		synchronize_rcu();
+	vfree(sr);
+	kfree(raw);
+	return err;
 
-	/* Copy the rest of the entry. */
-	while (remaining > 0) {
-		to_copy = MIN((block_size - offset), remaining);
+out:
+	mutex_unlock(&usbi->s_skip_lock);
+	kfree(raw);
+	return err;
+}
 
-			
-		src = (void *) (bh->b_data + offset);
-		memcpy(dest, src, to_copy);
-		dest+= to_copy;
+/** 
+ * @brief Parse the full path of the file and return only the name of the file.
+ * Basically it finds the last '/' of the path and zeros it, than return the
+ * pointer to the next character.
+ *
+ * @param de The entry to be restored.
+ * @return The pointer to the file name. 
+ *
+ */
+static char * ext3u_get_file_name(struct ext3u_del_entry * de)
+{
+	char *str = &(de->d_path[de->d_path_length-1]);
 
-		offset = (offset + to_copy) % block_size;
-		copied += to_copy;
-		remaining -= to_copy;
+	while (*str != '/') 
+		str--;
 
-		/* If we reach the end of the block and */
-		/* start reading from the next block.  */
-		if ((offset == 0) && (remaining != 0)) {
-				
-			offset = EXT3u_BLOCK_HEADER_SIZE;
-			block = (block) % usb->s_fifo.f_blocks + 1;
+	*str = '\0';
 
-			bh = ext3_bread(NULL, u_inode, block, 0, &err);
-			if (!bh) {
-				return ERR_PTR(-EIO);
-			}
-		}
-	}
+	return (++str);	
+}
 
-	return de;
+/**
+ * @brief Bytes given back when the head of a queue moves to 'next'. With 
+ * compact entries a block is given back only when the head leaves it: 
+ * the entries still there may take their path from the ones removed.
+ */
+static __u32 ext3u_head_room(struct ext3u_super_block * usb, struct ext3u_fifo_info * fifo, struct ext3u_record * next)
+{
+	if (EXT3u_HAS_FEATURE_COMPACT(usb->s_flags))
+		return ext3u_fifo_distance(fifo, usb->s_block_size, 
+								   fifo->f_first.r_block, EXT3u_BLOCK_HEADER_SIZE,
+								   next->r_block, EXT3u_BLOCK_HEADER_SIZE);
+
+	return ext3u_fifo_distance(fifo, usb->s_block_size, 
+							   fifo->f_first.r_block, fifo->f_first.r_offset,
+							   next->r_block, next->r_offset);
+}
+
+/* Reinitialize the head and the tail of a queue left without entries. */
+static void ext3u_reset_fifo(struct ext3u_fifo_info * fifo, __u32 block_size)
+{
+	memset(&(fifo->f_first), 0, sizeof(struct ext3u_record));
+	memset(&(fifo->f_last), 0, sizeof(struct ext3u_record));
+
+	fifo->f_last_block = fifo->f_start_block;
+	fifo->f_last_offset = EXT3u_BLOCK_HEADER_SIZE;
+	fifo->f_free = (fifo->f_blocks *(block_size - EXT3u_BLOCK_HEADER_SIZE));
 }
 
 /**
  * @brief Update the ext3u superblock.
  * 
- * @param usb Pointer to the superblock.
+ * @param usbi The in-memory ext3u information.
+ * @param fifo The queue holding the entry, locked by the caller.
  * @param de The entry wich caused the update.
  * @param update The type of the update; it can be either EXT3u_UPDATE_DELETE or EXT3u_UPDATE_ADD.
  * 
  * @return Returns zero on success, otherwise 0.
  */
-static int ext3u_update_superblock(struct ext3u_super_block * usb, struct ext3u_del_entry * de, int update)
+static int ext3u_update_superblock(struct ext3u_sb_info * usbi, struct ext3u_fifo_info * fifo, struct ext3u_del_entry * de, int update)
 {
-	int free, block_size, remaining;
-	int start_block = 0, start_offset = 0;
-	int end_block = 0, end_offset = 0;
-	int block, offset, size;
+	struct ext3u_super_block * usb = usbi->s_usb;
+	__u32 block_size;
+	__u32 start_block = 0, start_offset = 0;
+	__u32 end_block = 0, end_offset = 0;
 
 	block_size = usb->s_block_size;
 
@@ -430,101 +873,74 @@ static int ext3u_update_superblock(struct ext3u_super_block * usb, struct ext3u_
 		/* The entry was removed. */
 		case EXT3u_UPDATE_DELETE:
 
-			usb->s_del.d_current_size -= de->d_inode.i_size;
-			usb->s_del.d_file_count--;
+			/* The listings holding a position look for it again. */
+			atomic_inc(&usbi->s_generation);
+
+			/* The counters are shared by all the queues. */
+			write_seqlock(&usbi->s_del_lock);
+			usb->s_del.d_current_size -= ext3u_entry_size(de);
+			if (de->d_type == EXT3u_ENTRY_DIR)
+				usb->s_del.d_dir_count--;
+			else
+				usb->s_del.d_file_count--;
+			write_sequnlock(&usbi->s_del_lock);
+			atomic_long_sub(de->d_size, &usbi->s_stats.s_used);
 
 			if ( !(EXT3u_FIFO_NULL(&(de->d_previous))) && !(EXT3u_FIFO_NULL(&(de->d_next))) ) {
 				return 0;
 			}
 			
 			/* The fifo list is empty, reinitialize the head and the tail*/
-			if ( (EXT3u_FIFO_EMPTY(usb)) ) {
-	
-				memset(&(usb->s_fifo.f_first), 0, sizeof(struct ext3u_record));
-				memset(&(usb->s_fifo.f_last), 0, sizeof(struct ext3u_record));
-
-				usb->s_fifo.f_last_block = usb->s_fifo.f_start_block;
-				usb->s_fifo.f_last_offset = EXT3u_BLOCK_HEADER_SIZE;
-				usb->s_fifo.f_free = (usb->s_fifo.f_blocks *(block_size - EXT3u_BLOCK_HEADER_SIZE));
-
+			if ( (EXT3u_FIFO_EMPTY(fifo)) || 
+				 (EXT3u_FIFO_NULL(&(de->d_previous)) && EXT3u_FIFO_NULL(&(de->d_next))) ) {
+				ext3u_reset_fifo(fifo, block_size);
 				return 0;
 			}
 
 			if (EXT3u_FIFO_NULL(&(de->d_previous))) {
 
-				start_block = usb->s_fifo.f_first.r_block;
-				start_offset = usb->s_fifo.f_first.r_offset;
+				start_block = fifo->f_first.r_block;
+				start_offset = fifo->f_first.r_offset;
 
 				end_block = de->d_next.r_block;
 				end_offset = de->d_next.r_offset;
 
-				usb->s_fifo.f_first.r_block = de->d_next.r_block;
-				usb->s_fifo.f_first.r_real_block = de->d_next.r_real_block;
-				usb->s_fifo.f_first.r_offset = de->d_next.r_offset;	
-				usb->s_fifo.f_first.r_size = de->d_next.r_size;
+				/* Compact entries: only the blocks left behind are free. */
+				if (EXT3u_HAS_FEATURE_COMPACT(usb->s_flags))
+					start_offset = end_offset = EXT3u_BLOCK_HEADER_SIZE;
+
+				fifo->f_first.r_block = de->d_next.r_block;
+				fifo->f_first.r_real_block = de->d_next.r_real_block;
+				fifo->f_first.r_offset = de->d_next.r_offset;	
+				fifo->f_first.r_size = de->d_next.r_size;
 
 			}
 
 			/* We removed the last entry, so the free space must be updated */
 			if (EXT3u_FIFO_NULL(&(de->d_next))) {
 
-				end_block = usb->s_fifo.f_last_block;
-				end_offset = usb->s_fifo.f_last_offset;
+				end_block = fifo->f_last_block;
+				end_offset = fifo->f_last_offset;
 
-				usb->s_fifo.f_last.r_block = de->d_previous.r_block;
-				usb->s_fifo.f_last.r_real_block = de->d_previous.r_real_block;
-				usb->s_fifo.f_last.r_offset = de->d_previous.r_offset;	
-				usb->s_fifo.f_last.r_size = de->d_previous.r_size;
+				fifo->f_last.r_block = de->d_previous.r_block;
+				fifo->f_last.r_real_block = de->d_previous.r_real_block;
+				fifo->f_last.r_offset = de->d_previous.r_offset;	
+				fifo->f_last.r_size = de->d_previous.r_size;
 				
-				block = de->d_previous.r_block;
-				offset = de->d_previous.r_offset;
-				size = de->d_previous.r_size;
-
-				if ((offset + size) >= block_size) {
-					start_offset = ((offset + size - EXT3u_BLOCK_HEADER_SIZE) %
-									(block_size - EXT3u_BLOCK_HEADER_SIZE)) + EXT3u_BLOCK_HEADER_SIZE;
-				} else {
-					start_offset = offset + size;
-				}
-
-				if (size + offset > block_size) {
-					remaining = offset + size - EXT3u_BLOCK_HEADER_SIZE;
-
-					while(remaining > 0){
-						remaining -= MIN(remaining,(block_size - offset));
-						block = (block % usb->s_fifo.f_blocks) + 1;
-						offset = EXT3u_BLOCK_HEADER_SIZE;
-					}	
-				}		
-				start_block = block;
+				ext3u_entry_end(fifo, block_size, &(de->d_previous), &start_block, &start_offset);
 	
-				if ((usb->s_block_size - start_offset) < EXT3u_WRITE_MIN) {
+				if ((usb->s_block_size - start_offset) < EXT3u_WRITE_MIN(usb)) {
 
-					start_block = (start_block % usb->s_fifo.f_blocks) + 1;
+					start_block = ext3u_next_block(fifo, start_block);
 					start_offset = EXT3u_BLOCK_HEADER_SIZE;
 				}
 
-				usb->s_fifo.f_last_offset = start_offset;
+				fifo->f_last_block = start_block;
+				fifo->f_last_offset = start_offset;
 			}	
 			
-			free = 0;
-			while ((start_block != end_block) || (start_offset != end_offset)) {
-
-				if (start_block != end_block) {
-					free += (block_size - start_offset);
-					start_offset = block_size;
-				} else {
-					start_offset++;
-					free++;
-				}
-
-				if (start_offset == block_size) {
-					start_offset = EXT3u_BLOCK_HEADER_SIZE;
-					start_block = (start_block % usb->s_fifo.f_blocks) + 1;
-				}
-			}
-	
-			usb->s_fifo.f_free += free;
+			fifo->f_free += ext3u_fifo_distance(fifo, block_size, start_block, start_offset, 
+												end_block, end_offset);
 
 			break;
 	}
@@ -566,7 +982,14 @@ static int ext3u_update_entry(handle_t * h,struct inode * u_inode,struct ext3u_r
 	/* Read the block correspondig to this entry. */
 	bh = ext3_bread(NULL, u_inode, entry->r_block, 0, &err);
 	if (!bh) {
-		return err;
+		goto out;
+	}
+
+	/* The block must be journaled before we touch it. */
+	err = ext3_journal_get_write_access(handle, bh);
+	if (err) {
+		brelse(bh);
+		goto out;
 	}
 
 	/* The header of the entry cannot be split across the blocks */
@@ -597,11 +1020,11 @@ static int ext3u_update_entry(handle_t * h,struct inode * u_inode,struct ext3u_r
 
 	}
 
-	/* Write the block to disk */
-	ext3_journal_get_write_access(handle, bh);
+	/* The block reaches the disk with the commit of this transaction. */
 	ext3_journal_dirty_metadata(handle, bh);
-	sync_dirty_buffer(bh);
+	brelse(bh);
 
+out:
 	if (!h)
 		ext3_journal_stop(handle);
 
@@ -623,14 +1046,14 @@ static int ext3u_delete_entry(handle_t * handle, struct inode * u_inode, struct
 	
 	/* Update the 'previous' FIFO pointer of the next entry. */
 	if (!EXT3u_FIFO_NULL(&(de->d_next))) {
-			if ((err = ext3u_update_entry(NULL, u_inode, &(de->d_next), &(de->d_previous), EXT3u_UPDATE_PREVIOUS))) {
+			if ((err = ext3u_update_entry(handle, u_inode, &(de->d_next), &(de->d_previous), EXT3u_UPDATE_PREVIOUS))) {
 				return err;
 		}
 	}
 	
 	/* Update the 'd_next' FIFO pointer of the previous entry. */
 	if (!EXT3u_FIFO_NULL(&(de->d_previous))) {
-		if ((err = ext3u_update_entry(NULL, u_inode, &(de->d_previous), &(de->d_next), EXT3u_UPDATE_NEXT))) {
+		if ((err = ext3u_update_entry(handle, u_inode, &(de->d_previous), &(de->d_next), EXT3u_UPDATE_NEXT))) {
 			return err;
 		}
 	}
@@ -640,122 +1063,3128 @@ static int ext3u_delete_entry(handle_t * handle, struct inode * u_inode, struct
 
 
 /**
- * @brief Read the ext3u superblock.
+ * @brief Read the ext3u superblock. The buffer is pinned at mount time,
+ * this only takes a new reference to it.
  *
  * @param u_inode The ext3u root inode.
  *
- * @return On success, it returns the buffer containig the superblock. 
+ * @return On success, it returns the buffer containig the superblock,
+ * to be released with brelse(). 
  */
 struct buffer_head * ext3u_read_super(struct inode * u_inode)
 {
-	struct buffer_head * bh;
-	int err;
+	struct buffer_head * bh = EXT3u_SB(u_inode->i_sb)->s_usbh;
 
-	bh = ext3_bread(NULL, u_inode, 0, 0, &err);
 	if (!bh) {
 		return ERR_PTR(-EIO);
 	}
 	
+	get_bh(bh);
 	return bh;
 }
 
-/** 
- * @brief Free one or more entries of the FIFO queue to make space for the new entry.
- * 1. We make space in the queue for this entry, if there is less then
- * new->d_size.
- * 2. The size of all data-blocks must be checked in order to ensure
- * that their sum remain below the value 'd_max_size' witch is the
- * the maximun size of all data blocks pointed by the entries in the
- * FIFO list. This size has been specified at filesystem creation.
+/**
+ * @brief Split the FIFO area into 'count' sub-queues of the same size,
+ * or give it back to s_fifo when 'count' is 1. The FIFO must be empty.
+ */
+static void ext3u_split_fifo(struct ext3u_super_block * usb, unsigned int count)
+{
+	struct ext3u_fifo_info * fifo;
+	__u32 blocks = usb->s_fifo.f_blocks / count;
+	unsigned int q;
+
+	memset(usb->s_queue, 0, sizeof(usb->s_queue));
+	usb->s_queue_count = count;
+	if (count > 1)
+		usb->s_flags |= EXT3u_FEATURE_QUEUES;
+	else
+		usb->s_flags &= ~EXT3u_FEATURE_QUEUES;
+
+	for (q = 0; q < count; q++) {
+		fifo = EXT3u_QUEUE_FIFO(usb, q);
+
+		/* The last queue also takes the blocks left over. */
+		if (count > 1) {
+			fifo->f_start_block = 1 + q * blocks;
+			fifo->f_blocks = (q == count - 1) ? usb->s_fifo.f_blocks - q * blocks : blocks;
+		} else
+			fifo->f_start_block = 1;
+
+		ext3u_reset_fifo(fifo, usb->s_block_size);
+	}
+}
+
+/**
+ * @brief Set up the in-memory queues. If the undel_queues= mount option
+ * asks for a different number of sub-queues the FIFO area is split
+ * again, but only while it is empty; compact entries are switched on 
+ * the same way, only when the undel_compact option asks for them: the
+ * modules and the e2fsck not knowing them cannot read the FIFO any more.
  *
- * @param u_inode The ext3u root inode.
- * @param de The new entry to be added in the list.
+ * @param sb The superblock of the filesystem.
  *
- * @return Returns zero on success, otherwise a positive number indicating the error.
+ * @return Returns zero on success, a negative error code otherwise.
  */
-static int ext3u_free_old_entries(struct inode * u_inode, struct ext3u_del_entry * de)
+static int ext3u_setup_queues(struct super_block * sb)
 {
-	struct buffer_head * bh;
-	struct inode * inode, *dir;
-	struct ext3u_del_entry * dh;
-	struct ext3u_super_block * usb;
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct ext3u_super_block * usb = usbi->s_usb;
+	unsigned int count = usbi->s_queue_opt, q;
 	handle_t * handle;
+	int err, split = 0, compact, mark, seq;
+
+	if (usb->s_queue_count > EXT3u_MAX_QUEUES) {
+		printk(KERN_ERR "EXT3u-fs: corrupt undelete superblock, run e2fsck\n");
+		return -EINVAL;
+	}
+
+	/* A FIFO split before the feature existed gets it now. */
+	mark = usb->s_queue_count > 1 && !(usb->s_flags & EXT3u_FEATURE_QUEUES);
+
+	/* Entries written with the old header are readable only where */
+	/* d_next did not move; an empty FIFO takes the new one anyway. */
+	seq = !(usb->s_flags & EXT3u_FEATURE_SEQ);
+	if (seq && EXT3u_ENTRY_COUNT(usb) && !EXT3u_SEQ_COMPATIBLE) {
+		printk(KERN_ERR "EXT3u-fs: undelete FIFO with the old entry header, "
+			   "not readable on this architecture\n");
+		return -EINVAL;
+	}
+
+	if (count && count != max_t(__u32, usb->s_queue_count, 1)) {
+
+		if ((usb->s_fifo.f_blocks / count) * (usb->s_block_size - EXT3u_BLOCK_HEADER_SIZE) <
+			2 * (EXT3u_DEL_ENTRY_SIZE + PATH_MAX + 1)) {
+			printk(KERN_WARNING "EXT3u-fs: FIFO too small for %u queues\n", count);
+		} else if (EXT3u_ENTRY_COUNT(usb)) {
+			printk(KERN_WARNING "EXT3u-fs: FIFO not empty, undel_queues=%u ignored\n", count);
+		} else
+			split = 1;
+	}
+
+	compact = usbi->s_compact_opt && !EXT3u_HAS_FEATURE_COMPACT(usb->s_flags);
+	if (compact && EXT3u_ENTRY_COUNT(usb)) {
+		printk(KERN_WARNING "EXT3u-fs: FIFO not empty, undel_compact ignored\n");
+		compact = 0;
+	}
+
+	if ((split || compact || mark || seq) && !(sb->s_flags & MS_RDONLY)) {
+		handle = ext3_journal_start(usbi->s_undel_inode, 1);
+		if (IS_ERR(handle)) {
+			return PTR_ERR(handle);
+		}
+		err = ext3_journal_get_write_access(handle, usbi->s_usbh);
+		if (!err) {
+			if (compact)
+				usb->s_flags |= EXT3u_FEATURE_COMPACT;
+			if (mark)
+				usb->s_flags |= EXT3u_FEATURE_QUEUES;
+			if (seq)
+				usb->s_flags |= EXT3u_FEATURE_SEQ;
+			/* The queues are empty: they all start again from scratch. */
+			if (split || compact)
+				ext3u_split_fifo(usb, split ? count : max_t(__u32, usb->s_queue_count, 1));
+			ext3_journal_dirty_metadata(handle, usbi->s_usbh);
+		}
+		ext3_journal_stop(handle);
+		if (err) {
+			return err;
+		}
+	}
+
+	usbi->s_queue_count = max_t(__u32, usb->s_queue_count, 1);
+	for (q = 0; q < usbi->s_queue_count; q++) {
+		mutex_init(&usbi->s_queue[q].q_mutex);
+		usbi->s_queue[q].q_fifo = EXT3u_QUEUE_FIFO(usb, q);
+		usbi->s_queue[q].q_num = q;
+	}
+	return 0;
+}
+
+/**
+ * @brief Start the counters of ustats. The bytes of the queues not free
+ * at their tails count as used: the holes left before the mount are 
+ * found again only as the heads go past them.
+ */
+static void ext3u_stats_init(struct ext3u_sb_info * usbi)
+{
+	struct ext3u_stats * st = &usbi->s_stats;
+	struct ext3u_fifo_info * fifo;
+	unsigned long used = 0;
+	unsigned int q;
+
+	memset(st, 0, sizeof(struct ext3u_stats));
+	for (q = 0; q < usbi->s_queue_count; q++) {
+		fifo = usbi->s_queue[q].q_fifo;
+		used += EXT3u_FIFO_CAPACITY(fifo, usbi->s_usb->s_block_size) - fifo->f_free;
+	}
+	atomic_long_set(&st->s_used, used);
+	st->s_mount_time = get_seconds();
+}
+
+/**
+ * @brief Size class of a saved file: below 4K, then four times bigger 
+ * each, the last one open.
+ */
+static unsigned int ext3u_stats_class(__u64 size)
+{
+	unsigned int class;
+
+	if (size < 4096)
+		return 0;
+
+	class = (ilog2(size) - 12) / 2 + 1;
+	return min_t(unsigned int, class, EXT3u_STATS_SIZES - 1);
+}
+
+/**
+ * @brief Keep in 'max' the biggest value seen, without a lock.
+ */
+static void ext3u_stats_max(atomic_long_t * max, long value)
+{
+	long old = atomic_long_read(max), prev;
+
+	while (value > old) {
+		prev = atomic_long_cmpxchg(max, old, value);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+}
+
+/**
+ * @brief Fill the counters shared by ustats and /proc/fs/ext3u/<dev>/stats.
+ * Nothing is read from the disk and no lock is taken: an unlink never 
+ * waits for it.
+ */
+void ext3u_stats_read(struct super_block * sb, struct ext3u_ustats_info * ustats_info)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct ext3u_stats * st = &usbi->s_stats;
+	struct ext3u_super_block * usb = usbi->s_usb;
+	struct ext3u_fifo_info * fifo;
+	unsigned long capacity = 0, used;
+	unsigned int q, seq;
+	int i;
+
+	ustats_info->u_inode_size = usb->s_inode_size;
+	ustats_info->u_block_size = usb->s_block_size;
+	ustats_info->u_fifo_blocks = usb->s_fifo.f_blocks;
+
+	/* The totals are read again if a save or a removal changed them meanwhile. */
+	do {
+		seq = read_seqbegin(&usbi->s_del_lock);
+		ustats_info->u_max_size = usb->s_del.d_max_size;
+		ustats_info->u_current_size = usb->s_del.d_current_size;
+		ustats_info->u_file_count = usb->s_del.d_file_count;
+		ustats_info->u_dir_count = usb->s_del.d_dir_count;	
+	} while (read_seqretry(&usbi->s_del_lock, seq));
+
+	/* Fragmentation: the room of the queues not used by any entry, */
+	/* and the part of it at the tails, where the next entries go.  */
+	ustats_info->u_fifo_tail = 0;
+	for (q = 0; q < usbi->s_queue_count; q++) {
+		fifo = usbi->s_queue[q].q_fifo;
+		capacity += EXT3u_FIFO_CAPACITY(fifo, usb->s_block_size);
+		ustats_info->u_fifo_tail += fifo->f_free;
+	}
+	used = atomic_long_read(&st->s_used);
+	ustats_info->u_fifo_free = capacity > used ? capacity - used : 0;
+
+	ustats_info->u_elapsed = get_seconds() - st->s_mount_time;
+	ustats_info->u_saved_files = atomic_long_read(&st->s_saved_files);
+	ustats_info->u_saved_dirs = atomic_long_read(&st->s_saved_dirs);
+	ustats_info->u_evicted = atomic_long_read(&st->s_evicted);
+	ustats_info->u_restored = atomic_long_read(&st->s_restored);
+	ustats_info->u_skipped = atomic_long_read(&st->s_skipped);
+	ustats_info->u_evict_runs = atomic_long_read(&st->s_evict_runs);
+	ustats_info->u_evict_usecs = atomic_long_read(&st->s_evict_usecs);
+	ustats_info->u_evict_max_usecs = atomic_long_read(&st->s_evict_max_usecs);
+	for (i = 0; i < EXT3u_STATS_SIZES; i++)
+		ustats_info->u_sizes[i] = atomic_long_read(&st->s_sizes[i]);
+	ustats_info->u_searches = atomic_long_read(&st->s_searches);
+	ustats_info->u_search_blocks = atomic_long_read(&st->s_search_blocks);
+}
+
+#ifdef CONFIG_PROC_FS
+
+/* /proc/fs/ext3u, one directory in it for each mounted filesystem. */
+static struct proc_dir_entry * ext3u_proc_root;
+
+static const char * const ext3u_tune_names[EXT3u_TUNES] = {
+	"max_size",
+	"max_file_size",
+	"low_watermark",
+	"high_watermark",
+	"evict_batch",
+};
+
+static int ext3u_proc_stats_show(struct seq_file * m, void * v)
+{
+	struct super_block * sb = m->private;
+	struct ext3u_ustats_info * info;
+	__u64 depth;
+	unsigned int rem;
+
+	info = kmalloc(sizeof(struct ext3u_ustats_info), GFP_KERNEL);
+	if (!info)
+		return -ENOMEM;
+	ext3u_stats_read(sb, info);
+
+	/* Blocks read by a lookup, in hundredths. */
+	depth = info->u_search_blocks * 100;
+	if (info->u_searches)
+		do_div(depth, info->u_searches);
+	rem = do_div(depth, 100);
+
+	seq_printf(m, "entries:          %u\n", info->u_file_count + info->u_dir_count);
+	seq_printf(m, "files:            %u\n", info->u_file_count);
+	seq_printf(m, "dirs:             %u\n", info->u_dir_count);
+	seq_printf(m, "bytes:            %llu\n", (unsigned long long) info->u_current_size);
+	seq_printf(m, "max_size:         %llu\n", (unsigned long long) info->u_max_size);
+	seq_printf(m, "fifo_free:        %u\n", info->u_fifo_free);
+	seq_printf(m, "saved_files:      %llu\n", (unsigned long long) info->u_saved_files);
+	seq_printf(m, "saved_dirs:       %llu\n", (unsigned long long) info->u_saved_dirs);
+	seq_printf(m, "restored:         %llu\n", (unsigned long long) info->u_restored);
+	seq_printf(m, "skipped:          %llu\n", (unsigned long long) info->u_skipped);
+	seq_printf(m, "evicted:          %llu\n", (unsigned long long) info->u_evicted);
+	seq_printf(m, "evict_runs:       %llu\n", (unsigned long long) info->u_evict_runs);
+	seq_printf(m, "evict_usecs:      %llu\n", (unsigned long long) info->u_evict_usecs);
+	seq_printf(m, "evict_max_usecs:  %llu\n", (unsigned long long) info->u_evict_max_usecs);
+	seq_printf(m, "searches:         %llu\n", (unsigned long long) info->u_searches);
+	seq_printf(m, "search_blocks:    %llu\n", (unsigned long long) info->u_search_blocks);
+	seq_printf(m, "search_depth:     %llu.%02u\n", (unsigned long long) depth, rem);
+
+	kfree(info);
+	return 0;
+}
+
+static int ext3u_proc_stats_open(struct inode * inode, struct file * file)
+{
+	return single_open(file, ext3u_proc_stats_show, PDE(inode)->data);
+}
+
+static const struct file_operations ext3u_proc_stats_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ext3u_proc_stats_open,
+	.read		= seq_read,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/**
+ * @brief Current value of a tunable. 
+ */
+static __u64 ext3u_tune_get(struct ext3u_sb_info * usbi, unsigned int index)
+{
+	struct ext3u_super_block * usb = usbi->s_usb;
+	unsigned int seq;
+	__u64 value;
+
+	if (index == EXT3u_TUNE_EVICT_BATCH)
+		return ACCESS_ONCE(usbi->s_evict_batch);
+
+	do {
+		seq = read_seqbegin(&usbi->s_del_lock);
+		switch (index) {
+		case EXT3u_TUNE_MAX_SIZE:
+			value = usb->s_del.d_max_size;
+			break;
+		case EXT3u_TUNE_MAX_FILE_SIZE:
+			value = usb->s_del.d_max_filesize;
+			break;
+		case EXT3u_TUNE_LOW_WATERMARK:
+			value = usb->s_low_watermark;
+			break;
+		default:
+			value = usb->s_high_watermark;
+			break;
+		}
+	} while (read_seqretry(&usbi->s_del_lock, seq));
+
+	return value;
+}
+
+/**
+ * @brief Change a tunable while the filesystem is in use. The ones kept 
+ * in the ext3u superblock are journaled and survive a remount, the 
+ * eviction batch lasts until the unmount. The readers, ext3u_save() and
+ * the eviction thread, pick up the new value the next time they look.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
+ */
+static int ext3u_tune_set(struct super_block * sb, unsigned int index, __u64 value)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct ext3u_super_block * usb = usbi->s_usb;
+	handle_t * handle;
+	__u64 low, high;
+	int err;
+
+	if (index == EXT3u_TUNE_EVICT_BATCH) {
+		if (value < 1 || value > EXT3u_EVICT_BATCH_MAX)
+			return -EINVAL;
+		usbi->s_evict_batch = value;
+		return 0;
+	}
+
+	if (index == EXT3u_TUNE_MAX_SIZE && !value)
+		return -EINVAL;
+
+	if (sb->s_flags & MS_RDONLY)
+		return -EROFS;
+
+	handle = ext3_journal_start(usbi->s_undel_inode, 1);
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	err = ext3_journal_get_write_access(handle, usbi->s_usbh);
+	if (err)
+		goto out;
+
+	write_seqlock(&usbi->s_del_lock);
+	low = index == EXT3u_TUNE_LOW_WATERMARK ? value : usb->s_low_watermark;
+	high = index == EXT3u_TUNE_HIGH_WATERMARK ? value : usb->s_high_watermark;
+
+	/* The thread must stop below the point where it starts. */
+	if (low && high && low > high) {
+		err = -EINVAL;
+	} else {
+		switch (index) {
+		case EXT3u_TUNE_MAX_SIZE:
+			usb->s_del.d_max_size = value;
+			break;
+		case EXT3u_TUNE_MAX_FILE_SIZE:
+			usb->s_del.d_max_filesize = value;
+			break;
+		case EXT3u_TUNE_LOW_WATERMARK:
+			usb->s_low_watermark = value;
+			break;
+		default:
+			usb->s_high_watermark = value;
+			break;
+		}
+	}
+	write_sequnlock(&usbi->s_del_lock);
+
+	if (!err)
+		err = ext3_journal_dirty_metadata(handle, usbi->s_usbh);
+out:
+	ext3_journal_stop(handle);
+
+	/* A lower limit can put the saved data over the high watermark. */
+	if (!err && ext3u_need_evict(sb))
+		wake_up(&usbi->s_evict_wait);
+	return err;
+}
+
+static int ext3u_proc_tune_show(struct seq_file * m, void * v)
+{
+	struct ext3u_tune * t = m->private;
+
+	seq_printf(m, "%llu\n", (unsigned long long) ext3u_tune_get(EXT3u_SB(t->t_sb), t->t_index));
+	return 0;
+}
+
+static int ext3u_proc_tune_open(struct inode * inode, struct file * file)
+{
+	return single_open(file, ext3u_proc_tune_show, PDE(inode)->data);
+}
+
+static ssize_t ext3u_proc_tune_write(struct file * file, const char __user * buf, 
+									 size_t count, loff_t * ppos)
+{
+	struct ext3u_tune * t = ((struct seq_file *) file->private_data)->private;
+	char str[32], * end;
+	__u64 value;
+	int err;
+
+	if (!capable(CAP_SYS_ADMIN))
+		return -EPERM;
+
+	if (count >= sizeof(str))
+		return -EINVAL;
+	if (copy_from_user(str, buf, count))
+		return -EFAULT;
+	str[count] = '\0';
+
+	value = simple_strtoull(str, &end, 0);
+	if (end == str || (*end && *end != '\n'))
+		return -EINVAL;
+
+	err = ext3u_tune_set(t->t_sb, t->t_index, value);
+	return err ? err : count;
+}
+
+static const struct file_operations ext3u_proc_tune_fops = {
+	.owner		= THIS_MODULE,
+	.open		= ext3u_proc_tune_open,
+	.read		= seq_read,
+	.write		= ext3u_proc_tune_write,
+	.llseek		= seq_lseek,
+	.release	= single_release,
+};
+
+/**
+ * @brief Remove /proc/fs/ext3u/<dev>/, before the superblock goes away.
+ */
+static void ext3u_proc_unregister(struct super_block * sb)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	unsigned int i;
+
+	if (!usbi->s_proc)
+		return;
+
+	remove_proc_entry("stats", usbi->s_proc);
+	for (i = 0; i < EXT3u_TUNES; i++)
+		remove_proc_entry(ext3u_tune_names[i], usbi->s_proc);
+	remove_proc_entry(sb->s_id, ext3u_proc_root);
+	usbi->s_proc = NULL;
+}
+
+/**
+ * @brief Create /proc/fs/ext3u/<dev>/ for a mounted filesystem. The 
+ * filesystem works without it, so a failure is only reported.
+ */
+static void ext3u_proc_register(struct super_block * sb)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	unsigned int i;
+
+	if (!ext3u_proc_root)
+		return;
+
+	usbi->s_proc = proc_mkdir(sb->s_id, ext3u_proc_root);
+	if (!usbi->s_proc)
+		goto fail;
+
+	if (!proc_create_data("stats", S_IRUGO, usbi->s_proc, &ext3u_proc_stats_fops, sb))
+		goto fail;
+
+	for (i = 0; i < EXT3u_TUNES; i++) {
+		usbi->s_tune[i].t_sb = sb;
+		usbi->s_tune[i].t_index = i;
+		if (!proc_create_data(ext3u_tune_names[i], S_IRUGO | S_IWUSR, usbi->s_proc,
+							  &ext3u_proc_tune_fops, &usbi->s_tune[i]))
+			goto fail;
+	}
+	return;
+
+fail:
+	printk(KERN_WARNING "EXT3u-fs: cannot create /proc/fs/ext3u/%s\n", sb->s_id);
+	ext3u_proc_unregister(sb);
+}
+
+/**
+ * @brief Create /proc/fs/ext3u when the module is loaded. The 
+ * filesystems are mounted without their directories if it fails.
+ */
+void ext3u_init_proc(void)
+{
+	ext3u_proc_root = proc_mkdir("fs/ext3u", NULL);
+	if (!ext3u_proc_root)
+		printk(KERN_WARNING "EXT3u-fs: cannot create /proc/fs/ext3u\n");
+}
+
+void ext3u_exit_proc(void)
+{
+	if (ext3u_proc_root)
+		remove_proc_entry("fs/ext3u", NULL);
+	ext3u_proc_root = NULL;
+}
+
+#else
+
+static inline void ext3u_proc_register(struct super_block * sb)
+{
+}
+
+static inline void ext3u_proc_unregister(struct super_block * sb)
+{
+}
+
+void ext3u_init_proc(void)
+{
+}
+
+void ext3u_exit_proc(void)
+{
+}
+
+#endif /* CONFIG_PROC_FS */
+
+/**
+ * @brief The entry headers are written as they are in memory: fail the
+ * build if the compiler adds any padding to them.
+ */
+static inline void ext3u_check_layout(void)
+{
+	BUILD_BUG_ON(offsetof(struct ext3u_del_entry_header, d_next) != 8);
+	BUILD_BUG_ON(offsetof(struct ext3u_del_entry_header, d_type) != 
+				 8 + 2 * sizeof(struct ext3u_record));
+	BUILD_BUG_ON(offsetof(struct ext3u_del_entry_header, d_hash) != 
+				 offsetof(struct ext3u_del_entry_header, d_type) + 4);
+	BUILD_BUG_ON(EXT3u_DEL_HEADER_SIZE != offsetof(struct ext3u_del_entry_header, d_hash) + 12);
+	BUILD_BUG_ON(offsetof(struct ext3u_del_entry, d_inode) != EXT3u_DEL_HEADER_SIZE);
+}
+
+/**
+ * @brief Read the ext3u root inode and the ext3u superblock at mount
+ * time; both stay in memory until the filesystem is unmounted.
+ *
+ * @param sb The superblock of the filesystem.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
+ */
+int ext3u_fill_super(struct super_block * sb)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct inode * u_inode;
+	struct buffer_head * bh;
+	int err;
+
+	ext3u_check_layout();
+
+	if (EXT3_HAS_INCOMPAT_FEATURE(sb, EXT3u_FEATURE_COMPAT_UNDELETE)){
+		return 0;
+	}
+
+	u_inode = ext3_iget(sb, EXT3u_UNDEL_DIR_INO);
+	if (IS_ERR(u_inode)) {
+		printk(KERN_ERR "EXT3u-fs: get undelete inode failed\n");
+		return PTR_ERR(u_inode);
+	}
+
+	bh = ext3_bread(NULL, u_inode, 0, 0, &err);
+	if (!bh) {
+		printk(KERN_ERR "EXT3u-fs: cannot read the undelete superblock\n");
+		iput(u_inode);
+		return -EIO;
+	}
+
+	if (((struct ext3u_super_block *) bh->b_data)->s_block_size != sb->s_blocksize) {
+		printk(KERN_ERR "EXT3u-fs: corrupt undelete superblock, run e2fsck\n");
+		brelse(bh);
+		iput(u_inode);
+		return -EINVAL;
+	}
+
+	if (((struct ext3u_super_block *) bh->b_data)->s_flags & ~EXT3u_FEATURE_SUPP) {
+		printk(KERN_ERR "EXT3u-fs: undelete area with unsupported features (%x)\n",
+			   ((struct ext3u_super_block *) bh->b_data)->s_flags & ~EXT3u_FEATURE_SUPP);
+		brelse(bh);
+		iput(u_inode);
+		return -EINVAL;
+	}
+
+	usbi->s_undel_inode = u_inode;
+	usbi->s_usbh = bh;
+	usbi->s_usb = (struct ext3u_super_block *) bh->b_data;
+	seqlock_init(&usbi->s_del_lock);
+	atomic_set(&usbi->s_generation, 0);
+	mutex_init(&usbi->s_index_lock);
+
+	err = ext3u_setup_queues(sb);
+	if (!err) {
+		ext3u_stats_init(usbi);
+		err = ext3u_skip_load(sb);
+	}
+	if (!err)
+		err = ext3u_owner_load(sb);
+	if (err) {
+		ext3u_put_super(sb);
+		return err;
+	}
+
+	init_waitqueue_head(&usbi->s_evict_wait);
+	usbi->s_evict_batch = EXT3u_EVICT_BATCH;
+	usbi->s_evict_task = kthread_run(ext3u_evict_thread, sb, "ext3u_evict/%s", sb->s_id);
+	if (IS_ERR(usbi->s_evict_task)) {
+		err = PTR_ERR(usbi->s_evict_task);
+		usbi->s_evict_task = NULL;
+		ext3u_put_super(sb);
+		return err;
+	}
+
+	ext3u_proc_register(sb);
+	return 0;
+}
+
+/**
+ * @brief Release the ext3u root inode and superblock at unmount time.
+ *
+ * @param sb The superblock of the filesystem.
+ */
+void ext3u_put_super(struct super_block * sb)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+
+	/* The files in /proc use the superblock too. */
+	ext3u_proc_unregister(sb);
+
+	/* The thread uses the superblock and the root inode. */
+	if (usbi->s_evict_task)
+		kthread_stop(usbi->s_evict_task);
+	usbi->s_evict_task = NULL;
+
+	vfree(usbi->s_skip);
+	usbi->s_skip = NULL;
+	ext3u_owner_release(usbi);
+
+	brelse(usbi->s_usbh);
+	usbi->s_usbh = NULL;
+	usbi->s_usb = NULL;
+
+	if (usbi->s_undel_inode)
+		iput(usbi->s_undel_inode);
+	usbi->s_undel_inode = NULL;
+}
+
+/**
+ * @brief Make sure the handle has at least 'thresh' credits left. If the
+ * running transaction cannot be extended the handle is restarted, so
+ * everything modified so far must already be dirtied against it. Only
+ * the handles started by ext3u itself are restarted: the handle of an 
+ * unlink is never passed here, see ext3u_make_room().
+ *
+ * @param handle The handle of this transaction.
+ * @param thresh The number of credits needed by the caller.
+ * @param bh The ext3u superblock buffer; write access is requested
+ * again in the new transaction.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
+ */
+static int ext3u_extend_or_restart(handle_t * handle, int thresh, struct buffer_head * bh)
+{
+	int err;
+
+	if (handle->h_buffer_credits >= thresh)
+		return 0;
+
+	err = ext3_journal_extend(handle, thresh);
+	if (err < 0)
+		return err;
+
+	if (err) {
+		err = ext3_journal_restart(handle, thresh);
+		if (err)
+			return err;
+		err = ext3_journal_get_write_access(handle, bh);
+	}
+	return err;
+}
+
+/**
+ * @brief Return the number of the sub-queue holding 'record'; the
+ * sub-queues are contiguous and sorted by their first block.
+ */
+unsigned int ext3u_record_queue(struct ext3u_super_block * usb, struct ext3u_record * record)
+{
+	unsigned int q;
+
+	for (q = 1; q < usb->s_queue_count; q++) {
+		if (record->r_block < usb->s_queue[q].f_start_block)
+			break;
+	}
+	return q - 1;
+}
+
+/**
+ * @brief Copy 'len' bytes of a queue starting at ('block', 'offset'), 
+ * which is moved after them. When 'dest' is NULL the bytes are skipped.
+ *
+ * @return Returns zero on success, -EIO otherwise.
+ */
+static int ext3u_read_raw(struct inode * u_inode, struct ext3u_fifo_info * fifo, 
+						  __u32 * block, __u32 * offset, char * dest, int len)
+{
+	struct buffer_head * bh;
+	__u32 block_size = u_inode->i_sb->s_blocksize;
+	int to_copy, err;
+
+	while (len > 0) {
+		if (*offset >= block_size) {
+			*block = ext3u_next_block(fifo, *block);
+			*offset = EXT3u_BLOCK_HEADER_SIZE;
+		}
+
+		to_copy = MIN(block_size - *offset, len);
+		if (dest) {
+			bh = ext3_bread(NULL, u_inode, *block, 0, &err);
+			if (!bh) {
+				return -EIO;
+			}
+			memcpy(dest, bh->b_data + *offset, to_copy);
+			brelse(bh);
+			dest += to_copy;
+		}
+
+		*offset += to_copy;
+		len -= to_copy;
+	}
+	return 0;
+}
+
+/**
+ * @brief Find the path of the base entry at 'base' in 'block'.
+ *
+ * @param block The block of the base entry, then the block where its path starts.
+ * @param offset Where the path starts.
+ * @param length The length of the path.
+ *
+ * @return Returns zero on success, -EIO if the base is not a full entry.
+ */
+static int ext3u_base_path(struct inode * u_inode, struct ext3u_fifo_info * fifo, 
+						   __u16 base, __u32 * block, __u32 * offset, int * length)
+{
+	struct ext3u_del_entry_header dh;
+	struct ext3u_compact_inode ci;
+	int err;
+
+	*offset = base;
+	if ((err = ext3u_read_raw(u_inode, fifo, block, offset, (char *) &dh, EXT3u_DEL_HEADER_SIZE)) ||
+		(err = ext3u_read_raw(u_inode, fifo, block, offset, (char *) &ci, EXT3u_COMPACT_INODE_SIZE))) {
+		return err;
+	}
+
+	if (dh.d_base || ci.c_prefix || ci.c_nblocks > EXT3_N_BLOCKS || dh.d_path_length > PATH_MAX) {
+		return -EIO;
+	}
+
+	*length = dh.d_path_length;
+	return ext3u_read_raw(u_inode, fifo, block, offset, NULL, ci.c_nblocks * sizeof(__le32));
+}
+
+/**
+ * @brief Turn a compact entry, read as it is on disk, into the in-memory 
+ * entry: the inode is filled again and the path is completed with the 
+ * prefix of the base entry. Nothing is done for the old format.
+ *
+ * @param u_inode The ext3u root inode.
+ * @param usb Pointer to the ext3u superblock.
+ * @param record The position of the entry.
+ * @param de The entry.
+ *
+ * @return Returns zero on success, -EIO otherwise.
+ */
+int ext3u_decode_entry(struct inode * u_inode, struct ext3u_super_block * usb, struct ext3u_record * record, struct ext3u_del_entry * de)
+{
+	struct ext3u_fifo_info * fifo = EXT3u_QUEUE_FIFO(usb, ext3u_record_queue(usb, record));
+	struct ext3_inode * raw_inode = &(de->d_inode);
+	struct ext3u_compact_inode ci;
+	__le32 blocks[EXT3_N_BLOCKS];
+	char * body = (char *) raw_inode;
+	__u32 block, offset;
+	int suffix, length, err;
+
+	if (!EXT3u_HAS_FEATURE_COMPACT(usb->s_flags))
+		return 0;
+
+	memcpy(&ci, body, EXT3u_COMPACT_INODE_SIZE);
+	suffix = de->d_path_length - ci.c_prefix;
+
+	if (ci.c_nblocks > EXT3_N_BLOCKS || de->d_path_length > PATH_MAX || suffix < 0 ||
+		de->d_size != EXT3u_COMPACT_ENTRY_SIZE(ci.c_nblocks, suffix) || 
+		(ci.c_prefix && (de->d_base < EXT3u_BLOCK_HEADER_SIZE || de->d_base >= record->r_offset))) {
+		return -EIO;
+	}
+
+	memset(blocks, 0, sizeof(blocks));
+	memcpy(blocks, body + EXT3u_COMPACT_INODE_SIZE, ci.c_nblocks * sizeof(__le32));
+
+	/* The stored part of the path goes behind the prefix. */
+	memmove(de->d_path + ci.c_prefix, body + EXT3u_COMPACT_INODE_SIZE + ci.c_nblocks * sizeof(__le32), suffix);
+	de->d_path[de->d_path_length] = '\0';
+
+	if (ci.c_prefix) {
+		block = record->r_block;
+		err = ext3u_base_path(u_inode, fifo, de->d_base, &block, &offset, &length);
+		if (err || length < ci.c_prefix) {
+			return -EIO;
+		}
+		err = ext3u_read_raw(u_inode, fifo, &block, &offset, de->d_path, ci.c_prefix);
+		if (err) {
+			return err;
+		}
+	}
+
+	memset(raw_inode, 0, sizeof(struct ext3_inode));
+	raw_inode->i_mode = ci.c_mode;
+	raw_inode->i_uid_low = ci.c_uid_low;
+	raw_inode->i_gid_low = ci.c_gid_low;
+	raw_inode->i_uid_high = ci.c_uid_high;
+	raw_inode->i_gid_high = ci.c_gid_high;
+	raw_inode->i_links_count = cpu_to_le16(1);
+	raw_inode->i_size = ci.c_size;
+	raw_inode->i_size_high = ci.c_size_high;
+	raw_inode->i_atime = ci.c_atime;
+	raw_inode->i_ctime = ci.c_ctime;
+	raw_inode->i_mtime = ci.c_mtime;
+	raw_inode->i_dtime = ci.c_dtime;
+	raw_inode->i_blocks = ci.c_blocks;
+	raw_inode->i_flags = ci.c_flags;
+	raw_inode->i_file_acl = ci.c_file_acl;
+	raw_inode->i_generation = ci.c_generation;
+	memcpy(raw_inode->i_block, blocks, sizeof(blocks));
+
+	return 0;
+}
+
+/* Block pointers of a compact entry: the trailing zero ones are dropped. */
+static int ext3u_compact_blocks(struct ext3_inode * raw_inode)
+{
+	int n = EXT3_N_BLOCKS;
+
+	while (n > 0 && !raw_inode->i_block[n - 1])
+		n--;
+	return n;
+}
+
+/**
+ * @brief Turn the in-memory entry into a compact one, in place, before
+ * it is written at the tail of 'fifo'. When the last entry of the queue
+ * starts in the block where this one goes, its base (or itself, if it
+ * is a full entry) becomes the base of this entry too.
+ *
+ * @param u_inode The ext3u root inode.
+ * @param fifo The queue, locked by the caller.
+ * @param de The entry; 'd_size' is updated.
+ */
+static void ext3u_encode_entry(struct inode * u_inode, struct ext3u_fifo_info * fifo, struct ext3u_del_entry * de)
+{
+	struct ext3_inode * raw_inode = &(de->d_inode);
+	struct ext3u_del_entry_header dh;
+	struct ext3u_compact_inode ci;
+	__le32 blocks[EXT3_N_BLOCKS];
+	char * body = (char *) raw_inode;
+	char chunk[64];
+	__u32 block, offset;
+	int length, prefix = 0, to_copy, i;
+	__u16 base = 0;
+
+	memset(&ci, 0, sizeof(ci));
+	ci.c_mode = raw_inode->i_mode;
+	ci.c_uid_low = raw_inode->i_uid_low;
+	ci.c_gid_low = raw_inode->i_gid_low;
+	ci.c_uid_high = raw_inode->i_uid_high;
+	ci.c_gid_high = raw_inode->i_gid_high;
+	ci.c_nblocks = ext3u_compact_blocks(raw_inode);
+	ci.c_size = raw_inode->i_size;
+	ci.c_size_high = raw_inode->i_size_high;
+	ci.c_atime = raw_inode->i_atime;
+	ci.c_ctime = raw_inode->i_ctime;
+	ci.c_mtime = raw_inode->i_mtime;
+	ci.c_dtime = raw_inode->i_dtime;
+	ci.c_blocks = raw_inode->i_blocks;
+	ci.c_flags = raw_inode->i_flags;
+	ci.c_file_acl = raw_inode->i_file_acl;
+	ci.c_generation = raw_inode->i_generation;
+	memcpy(blocks, raw_inode->i_block, sizeof(blocks));
+
+	/* Look for the longest common prefix with the base, a chunk at a time. */
+	if (!EXT3u_FIFO_NULL(&(fifo->f_last)) && fifo->f_last.r_block == fifo->f_last_block) {
+		block = fifo->f_last.r_block;
+		offset = fifo->f_last.r_offset;
+
+		if (!ext3u_read_raw(u_inode, fifo, &block, &offset, (char *) &dh, EXT3u_DEL_HEADER_SIZE)) {
+			base = dh.d_base ? dh.d_base : fifo->f_last.r_offset;
+			block = fifo->f_last.r_block;
+
+			if (!ext3u_base_path(u_inode, fifo, base, &block, &offset, &length)) {
+				length = MIN(length, de->d_path_length);
+
+				while (prefix < length) {
+					to_copy = MIN(length - prefix, (int) sizeof(chunk));
+					if (ext3u_read_raw(u_inode, fifo, &block, &offset, chunk, to_copy))
+						break;
+					for (i = 0; i < to_copy && chunk[i] == de->d_path[prefix]; i++)
+						prefix++;
+					if (i < to_copy)
+						break;
+				}
+			}
+		}
+	}
+
+	ci.c_prefix = prefix;
+	de->d_base = prefix ? base : 0;
+
+	/* The path moves down first, the inode and the pointers go over the old inode. */
+	memmove(body + EXT3u_COMPACT_INODE_SIZE + ci.c_nblocks * sizeof(__le32), 
+			de->d_path + prefix, de->d_path_length - prefix);
+	memcpy(body, &ci, EXT3u_COMPACT_INODE_SIZE);
+	memcpy(body + EXT3u_COMPACT_INODE_SIZE, blocks, ci.c_nblocks * sizeof(__le32));
+
+	de->d_size = EXT3u_COMPACT_ENTRY_SIZE(ci.c_nblocks, de->d_path_length - prefix);
+}
+
+/**
+ * @brief Read the entry pointed by 'record' from the FIFO list.
+ *
+ * @param u_inode The ext3u root inode.
+ * @param usb Pointer to the ext3u superblock.
+ * @param record The position of the entry.
+ * @param de The buffer where the entry is copied.
+ * @param blocks If not NULL, it is incremented for each block read after 
+ * the first one, which is the block holding the header.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
+ */
+static int ext3u_read_entry(struct inode * u_inode,
+							struct ext3u_super_block * usb,
+							struct ext3u_record * record,
+							struct ext3u_del_entry * de,
+							int * blocks)
+{
+	struct ext3u_fifo_info * fifo = EXT3u_QUEUE_FIFO(usb, ext3u_record_queue(usb, record));
+	struct buffer_head * bh;
+	unsigned int block, block_size, offset;
+	int err, remaining, to_copy;
+	char * dest;
+
+	block = record->r_block;
+	offset = record->r_offset;
+	block_size = usb->s_block_size;
+
+	bh = ext3_bread(NULL, u_inode, block, 0, &err);
+	if (!bh) {
+		return -EIO;
+	}
+
+	/* The header cannot be splitted across blocks. */
+	memcpy(de, bh->b_data + offset, EXT3u_DEL_HEADER_SIZE);
+	if (de->d_size < EXT3u_ENTRY_MIN_SIZE(usb) || de->d_size > sizeof(struct ext3u_del_entry)) {
+		brelse(bh);
+		return -EIO;
+	}
+
+	dest = (char *) de + EXT3u_DEL_HEADER_SIZE;
+	offset += EXT3u_DEL_HEADER_SIZE;
+	remaining = de->d_size - EXT3u_DEL_HEADER_SIZE;
+
+	/* The rest of the entry could be splitted across two or more blocks. */
+	while (remaining > 0) {
+		if (offset == block_size) {
+			brelse(bh);
+			block = ext3u_next_block(fifo, block);
+			offset = EXT3u_BLOCK_HEADER_SIZE;
+
+			bh = ext3_bread(NULL, u_inode, block, 0, &err);
+			if (!bh) {
+				return -EIO;
+			}
+			if (blocks)
+				(*blocks)++;
+		}
+
+		to_copy = MIN(block_size - offset, remaining);
+		memcpy(dest, bh->b_data + offset, to_copy);
+
+		dest += to_copy;
+		offset += to_copy;
+		remaining -= to_copy;
+	}
+
+	brelse(bh);
+	return ext3u_decode_entry(u_inode, usb, record, de);
+}
+
+/**
+ * @brief Start reading ahead 'count' blocks of the queue under the cursor,
+ * from 'c_ra_next' on in the direction of the walk, without waiting for them.
+ */
+static void ext3u_cursor_readahead(struct ext3u_cursor * cur, __u32 count)
+{
+	struct buffer_head * bh;
+	__u32 i;
+	int err;
+
+	for (i = 0; i < count; i++) {
+		bh = ext3_getblk(NULL, cur->c_inode, cur->c_ra_next, 0, &err);
+		if (bh) {
+			if (!buffer_uptodate(bh))
+				ll_rw_block(READA, 1, &bh);
+			brelse(bh);
+		}
+		if (cur->c_backward)
+			cur->c_ra_next = ext3u_prev_block(cur->c_fifo, cur->c_ra_next);
+		else
+			cur->c_ra_next = ext3u_next_block(cur->c_fifo, cur->c_ra_next);
+	}
+	cur->c_ra_left += count;
+}
+
+/**
+ * @brief Bring the block 'block' under the cursor. Following the list
+ * uses the readahead window up, which is topped up when half of it is
+ * left; a jump somewhere else starts a new window.
+ *
+ * @return Returns zero on success, -EIO otherwise.
+ */
+static int ext3u_cursor_block(struct ext3u_cursor * cur, __u32 block)
+{
+	struct ext3u_fifo_info * fifo = cur->c_fifo;
+	__u32 step, window;
+	int err;
+
+	if (cur->c_bh && cur->c_block == block)
+		return 0;
+
+	step = cur->c_backward ? ext3u_prev_block(fifo, cur->c_block) : ext3u_next_block(fifo, cur->c_block);
+	if (cur->c_bh && cur->c_ra_left && block == step) {
+		cur->c_ra_left--;
+	} else {
+		cur->c_ra_next = block;
+		cur->c_ra_left = 0;
+	}
+
+	window = min_t(__u32, EXT3u_DISK_CACHE_SIZE, fifo->f_blocks);
+	if (cur->c_ra_left < window / 2 + 1)
+		ext3u_cursor_readahead(cur, window - cur->c_ra_left);
+
+	brelse(cur->c_bh);
+	cur->c_bh = ext3_bread(NULL, cur->c_inode, block, 0, &err);
+	if (!cur->c_bh) {
+		return -EIO;
+	}
+	cur->c_block = block;
+	cur->c_blocks++;
+	return 0;
+}
+
+/**
+ * @brief Move the cursor to the entry at 'record', which can be in 
+ * another queue. Nothing is read until the entry is asked for.
+ *
+ * @return Returns zero, or -ENOENT if 'record' is the end of a queue.
+ */
+int ext3u_cursor_seek(struct ext3u_cursor * cur, struct ext3u_record * record)
+{
+	struct ext3u_fifo_info * fifo;
+
+	memcpy(&(cur->c_record), record, EXT3u_RECORD_SIZE);
+	if (EXT3u_FIFO_NULL(record))
+		return -ENOENT;
+
+	/* The window read ahead in another queue does not help. */
+	fifo = EXT3u_QUEUE_FIFO(cur->c_usb, ext3u_record_queue(cur->c_usb, record));
+	if (fifo != cur->c_fifo) {
+		cur->c_fifo = fifo;
+		cur->c_ra_left = 0;
+	}
+	return 0;
+}
+
+/**
+ * @brief Set up a cursor on the entry at 'record'. A cursor walking
+ * 'backward' follows the 'd_previous' pointers and reads ahead the 
+ * blocks coming before. The caller holds the locks of the queues walked
+ * and calls ext3u_cursor_release() at the end.
+ *
+ * @param cur The cursor.
+ * @param u_inode The ext3u root inode.
+ * @param usb Pointer to the ext3u superblock.
+ * @param record The first entry.
+ * @param backward Walk from the tail to the head.
+ */
+void ext3u_cursor_init(struct ext3u_cursor * cur, struct inode * u_inode, struct ext3u_super_block * usb, 
+					   struct ext3u_record * record, int backward)
+{
+	memset(cur, 0, sizeof(struct ext3u_cursor));
+	cur->c_inode = u_inode;
+	cur->c_usb = usb;
+	cur->c_backward = backward;
+	ext3u_cursor_seek(cur, record);
+}
+
+/**
+ * @brief The header of the current entry, where it is in the buffer of
+ * its block; it stays valid until the cursor moves.
+ *
+ * @return The header, or an ERR_PTR: -ENOENT at the end of the queue, 
+ * -EIO if the block cannot be read or the entry is corrupt.
+ */
+struct ext3u_del_entry_header * ext3u_cursor_header(struct ext3u_cursor * cur)
+{
+	struct ext3u_del_entry_header * dh;
+	int err;
+
+	if (EXT3u_FIFO_NULL(&(cur->c_record)))
+		return ERR_PTR(-ENOENT);
+
+	err = ext3u_cursor_block(cur, cur->c_record.r_block);
+	if (err)
+		return ERR_PTR(err);
+
+	/* The header cannot be splitted across blocks. */
+	if (cur->c_record.r_offset + EXT3u_DEL_HEADER_SIZE > cur->c_usb->s_block_size)
+		return ERR_PTR(-EIO);
+
+	dh = (struct ext3u_del_entry_header *) (cur->c_bh->b_data + cur->c_record.r_offset);
+	if (dh->d_size < EXT3u_ENTRY_MIN_SIZE(cur->c_usb) || dh->d_size > sizeof(struct ext3u_del_entry))
+		return ERR_PTR(-EIO);
+
+	return dh;
+}
+
+/**
+ * @brief The whole current entry. An entry of the old format lying in 
+ * a single block, the most common case, is not copied: the view in the
+ * buffer of the block is returned, it is valid until the cursor moves
+ * and must not be changed. Any other entry is copied to 'de' and decoded.
+ *
+ * @return The entry, or an ERR_PTR.
+ */
+struct ext3u_del_entry * ext3u_cursor_entry(struct ext3u_cursor * cur, struct ext3u_del_entry * de)
+{
+	struct ext3u_del_entry_header * dh;
+	int err;
+
+	dh = ext3u_cursor_header(cur);
+	if (IS_ERR(dh))
+		return ERR_CAST(dh);
+
+	if (!EXT3u_HAS_FEATURE_COMPACT(cur->c_usb->s_flags) && 
+		cur->c_record.r_offset + dh->d_size <= cur->c_usb->s_block_size)
+		return (struct ext3u_del_entry *) dh;
+
+	/* The blocks it spans have been read ahead. */
+	err = ext3u_read_entry(cur->c_inode, cur->c_usb, &(cur->c_record), de, &(cur->c_blocks));
+	if (err)
+		return ERR_PTR(err);
+
+	return de;
+}
+
+/**
+ * @brief Keep in 'de' an entry returned by ext3u_cursor_entry(), when it
+ * must outlive the cursor: a view is copied, only the bytes it takes.
+ */
+static struct ext3u_del_entry * ext3u_cursor_keep(struct ext3u_del_entry * e, struct ext3u_del_entry * de)
+{
+	if (e != de)
+		memcpy(de, e, e->d_size);
+	return de;
+}
+
+/**
+ * @brief Move the cursor to the entry following the current one in the
+ * direction of the walk.
+ *
+ * @return Returns zero, -ENOENT at the end of the queue, or another 
+ * negative error code.
+ */
+int ext3u_cursor_next(struct ext3u_cursor * cur)
+{
+	struct ext3u_del_entry_header * dh;
+
+	dh = ext3u_cursor_header(cur);
+	if (IS_ERR(dh))
+		return PTR_ERR(dh);
+
+	memcpy(&(cur->c_record), cur->c_backward ? &(dh->d_previous) : &(dh->d_next), EXT3u_RECORD_SIZE);
+	return EXT3u_FIFO_NULL(&(cur->c_record)) ? -ENOENT : 0;
+}
+
+/**
+ * @brief Drop the block pinned by the cursor.
+ */
+void ext3u_cursor_release(struct ext3u_cursor * cur)
+{
+	brelse(cur->c_bh);
+	cur->c_bh = NULL;
+}
+
+/**
+ * @brief A field of the inode saved in the entry at 'record', read alone:
+ * 'compact' is its offset in a compact inode, 'full' in an ext3 inode.
+ *
+ * @param bh A block already read, used if the field is there; may be NULL.
+ *
+ * @return The field, zero if it cannot be read.
+ */
+static __u32 ext3u_entry_field(struct inode * u_inode, struct ext3u_super_block * usb, 
+							   struct ext3u_record * record, struct buffer_head * bh, __u32 bh_block,
+							   size_t compact, size_t full)
+{
+	struct ext3u_fifo_info * fifo = EXT3u_QUEUE_FIFO(usb, ext3u_record_queue(usb, record));
+	__u32 block = record->r_block;
+	__u32 offset = record->r_offset + EXT3u_DEL_HEADER_SIZE;
+	__le32 field;
+
+	offset += EXT3u_HAS_FEATURE_COMPACT(usb->s_flags) ? compact : full;
+
+	if (bh && bh_block == block && offset + sizeof(field) <= usb->s_block_size)
+		memcpy(&field, bh->b_data + offset, sizeof(field));
+	else if (ext3u_read_raw(u_inode, fifo, &block, &offset, (char *) &field, sizeof(field)))
+		return 0;
+
+	return le32_to_cpu(field);
+}
+
+/**
+ * @brief Deletion time of the entry at 'record', kept in the dtime of 
+ * its inode. The entries saved before it was kept have a zero time.
+ */
+static __u32 ext3u_entry_time(struct inode * u_inode, struct ext3u_super_block * usb, 
+							  struct ext3u_record * record, struct buffer_head * bh, __u32 bh_block)
+{
+	return ext3u_entry_field(u_inode, usb, record, bh, bh_block, 
+							 offsetof(struct ext3u_compact_inode, c_dtime), 
+							 offsetof(struct ext3_inode, i_dtime));
+}
+
+/**
+ * @brief Deletion time of the current entry, zero if it is not known.
+ */
+__u32 ext3u_cursor_time(struct ext3u_cursor * cur)
+{
+	if (EXT3u_FIFO_NULL(&(cur->c_record)))
+		return 0;
+	return ext3u_entry_time(cur->c_inode, cur->c_usb, &(cur->c_record), cur->c_bh, cur->c_block);
+}
+
+/**
+ * @brief Modification time of the current entry.
+ */
+__u32 ext3u_cursor_mtime(struct ext3u_cursor * cur)
+{
+	if (EXT3u_FIFO_NULL(&(cur->c_record)))
+		return 0;
+	return ext3u_entry_field(cur->c_inode, cur->c_usb, &(cur->c_record), cur->c_bh, cur->c_block, 
+							 offsetof(struct ext3u_compact_inode, c_mtime), 
+							 offsetof(struct ext3_inode, i_mtime));
+}
+
+/**
+ * @brief Size of the current entry.
+ */
+__u64 ext3u_cursor_size(struct ext3u_cursor * cur)
+{
+	__u32 low, high;
+
+	if (EXT3u_FIFO_NULL(&(cur->c_record)))
+		return 0;
+
+	low = ext3u_entry_field(cur->c_inode, cur->c_usb, &(cur->c_record), cur->c_bh, cur->c_block, 
+							offsetof(struct ext3u_compact_inode, c_size), 
+							offsetof(struct ext3_inode, i_size));
+	high = ext3u_entry_field(cur->c_inode, cur->c_usb, &(cur->c_record), cur->c_bh, cur->c_block, 
+							 offsetof(struct ext3u_compact_inode, c_size_high), 
+							 offsetof(struct ext3_inode, i_size_high));
+	return low | ((__u64) high << 32);
+}
+
+/**
+ * @brief Check the current entry of a listing against 'filter', whose
+ * prefix is in kernel memory. The owner and the length of the path are
+ * in the header, the size and the time are read alone: the path is 
+ * looked at last, through 'de' if the entry is not whole in its block.
+ *
+ * @return Returns 1 if the entry passes, 0 if it does not, or a 
+ * negative error code.
+ */
+int ext3u_uls_match(struct ext3u_cursor * cur, struct ext3u_del_entry_header * dh, 
+					struct ext3u_uls_filter * filter, struct ext3u_del_entry * de)
+{
+	struct ext3u_del_entry * e;
+	__u64 size;
+	__u32 mtime;
+
+	if ((filter->u_mask & EXT3u_ULS_UID) && dh->d_uid != filter->u_uid)
+		return 0;
+
+	if (dh->d_path_length < filter->u_prefix_length)
+		return 0;
+
+	if (filter->u_mask & EXT3u_ULS_SIZE) {
+		size = ext3u_cursor_size(cur);
+		if (size < filter->u_min_size || (filter->u_max_size && size > filter->u_max_size))
+			return 0;
+	}
+
+	if (filter->u_mask & EXT3u_ULS_MTIME) {
+		mtime = ext3u_cursor_mtime(cur);
+		if (mtime < filter->u_min_mtime || (filter->u_max_mtime && mtime > filter->u_max_mtime))
+			return 0;
+	}
+
+	if (!filter->u_prefix_length)
+		return 1;
+
+	e = ext3u_cursor_entry(cur, de);
+	if (IS_ERR(e))
+		return PTR_ERR(e);
+
+	return !memcmp(e->d_path, filter->u_prefix, filter->u_prefix_length);
+}
+
+/**
+ * @brief The bytes of an entry removed from the middle of a queue stay
+ * where they are: the entry with header 'dh' at 'record' is still in 
+ * the queue if it is the head, or if the entry before it points to it.
+ */
+static int ext3u_entry_live(struct inode * u_inode, struct ext3u_fifo_info * fifo, 
+							struct ext3u_record * record, struct ext3u_del_entry_header * dh)
+{
+	struct ext3u_del_entry_header * prev;
+	struct buffer_head * bh;
+	int err, live;
+
+	if (record->r_block == fifo->f_first.r_block && record->r_offset == fifo->f_first.r_offset)
+		return 1;
+
+	if (EXT3u_FIFO_NULL(&(dh->d_previous)) || 
+		dh->d_previous.r_offset + EXT3u_DEL_HEADER_SIZE > u_inode->i_sb->s_blocksize)
+		return 0;
+
+	bh = ext3_bread(NULL, u_inode, dh->d_previous.r_block, 0, &err);
+	if (!bh)
+		return 0;
+
+	prev = (struct ext3u_del_entry_header *) (bh->b_data + dh->d_previous.r_offset);
+	live = (prev->d_next.r_block == record->r_block && prev->d_next.r_offset == record->r_offset);
+	brelse(bh);
+	return live;
+}
+
+/**
+ * @brief The first entry starting in 'block' of a queue, with its deletion
+ * time and order. The block header holds the offset of this entry, zero
+ * when no entry starts in the block.
+ *
+ * @return Returns zero, or -ENOENT if no entry of the queue starts there.
+ */
+static int ext3u_block_first(struct inode * u_inode, struct ext3u_super_block * usb, struct ext3u_fifo_info * fifo, 
+							 __u32 block, struct ext3u_record * record, __u32 * time, __u32 * seq)
+{
+	struct ext3u_del_entry_header * dh;
+	struct buffer_head * bh;
+	__u32 offset;
+	int err;
+
+	bh = ext3_bread(NULL, u_inode, block, 0, &err);
+	if (!bh)
+		return -ENOENT;
+
+	err = -ENOENT;
+	offset = *((__u32 *)bh->b_data);
+	if (offset < EXT3u_BLOCK_HEADER_SIZE || offset + EXT3u_DEL_HEADER_SIZE > usb->s_block_size)
+		goto out;
+
+	record->r_block = block;
+	record->r_real_block = bh->b_blocknr;
+	record->r_offset = offset;
+
+	dh = (struct ext3u_del_entry_header *) (bh->b_data + offset);
+	if (dh->d_size < EXT3u_ENTRY_MIN_SIZE(usb) || dh->d_size > sizeof(struct ext3u_del_entry) ||
+		!ext3u_entry_live(u_inode, fifo, record, dh))
+		goto out;
+
+	record->r_size = dh->d_size;
+	*seq = dh->d_seq;
+	*time = ext3u_entry_time(u_inode, usb, record, bh, block);
+	err = 0;
+out:
+	brelse(bh);
+	return err;
+}
+
+/**
+ * @brief Find an entry of queue 'q' such that all the entries before it
+ * come before 'key', a deletion time or, with 'by_seq', a deletion order.
+ * The entries of a queue are in deletion order, and the block headers 
+ * are a sparse index of them: the search is binary over the blocks, 
+ * reading only the first entry of each block it looks at. A block it 
+ * cannot tell about counts as a later one, so the start is never too far on.
+ *
+ * @return Returns zero, or -ENOENT if the queue is empty.
+ */
+static int ext3u_queue_seek(struct inode * u_inode, struct ext3u_super_block * usb, unsigned int q, 
+							__u32 key, int by_seq, struct ext3u_record * record)
+{
+	struct ext3u_fifo_info * fifo = EXT3u_QUEUE_FIFO(usb, q);
+	struct ext3u_record found;
+	__u32 lo, hi, mid, time, seq;
+
+	if (EXT3u_FIFO_EMPTY(fifo))
+		return -ENOENT;
+	memcpy(record, &(fifo->f_first), EXT3u_RECORD_SIZE);
+
+	/* Blocks are counted from the one of the head. */
+	lo = 1;
+	hi = (fifo->f_last.r_block + fifo->f_blocks - fifo->f_first.r_block) % fifo->f_blocks;
+
+	while ((key || by_seq) && lo <= hi) {
+		mid = lo + (hi - lo) / 2;
+
+		if (ext3u_block_first(u_inode, usb, fifo, fifo->f_start_block + 
+							  (fifo->f_first.r_block - fifo->f_start_block + mid) % fifo->f_blocks, 
+							  &found, &time, &seq) || 
+			(by_seq ? !ext3u_seq_before(seq, key) : time >= key)) {
+			hi = mid - 1;
+			continue;
+		}
+
+		memcpy(record, &found, EXT3u_RECORD_SIZE);
+		lo = mid + 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Find where to start listing the entries of queue 'q' deleted
+ * since 'since': every entry before 'record' was deleted earlier.
+ *
+ * @return Returns zero, or -ENOENT if the queue is empty.
+ */
+int ext3u_time_seek(struct inode * u_inode, struct ext3u_super_block * usb, unsigned int q, 
+					__u32 since, struct ext3u_record * record)
+{
+	return ext3u_queue_seek(u_inode, usb, q, since, 0, record);
+}
+
+/* A listing of the deleted entries through a file descriptor. */
+struct ext3u_uls_stream {
+	struct super_block *		s_sb;
+	struct vfsmount *			s_mnt;			/* pinned while the descriptor is open */
+	struct mutex				s_mutex;		/* serializes the reads */
+	struct ext3u_del_entry *	s_de;
+	char *						s_buf;			/* the records, before they are copied to the user */
+	struct ext3u_record			s_record;		/* next entry of the queue to look at */
+	unsigned int				s_queue;		/* queue walked */
+	__u32						s_seq;			/* last entry looked at in the queue */
+	int							s_visited;		/* some entry of the queue was looked at */
+	int							s_started;
+	int							s_done;
+	int							s_generation;	/* of the FIFO when s_record was found */
+	__u32						s_since;
+	__u32						s_until;
+	struct ext3u_uls_filter		s_filter;		/* its prefix is freed with the stream */
+};
+
+/**
+ * @brief Move a listing to the first entry of its queue not looked at 
+ * yet, or to the first entry deleted since 's_since'; an empty queue is
+ * left for the next one.
+ */
+static void ext3u_uls_seek(struct ext3u_uls_stream * s)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(s->s_sb);
+
+	for (; s->s_queue < usbi->s_queue_count; s->s_queue++, s->s_visited = 0) {
+		if (!ext3u_queue_seek(usbi->s_undel_inode, usbi->s_usb, s->s_queue, 
+							  s->s_visited ? s->s_seq + 1 : s->s_since, s->s_visited, &(s->s_record)))
+			return;
+	}
+	memset(&(s->s_record), 0, EXT3u_RECORD_SIZE);
+	s->s_done = 1;
+}
+
+/**
+ * @brief Fill the buffer of a listing with the records of the entries
+ * coming next, up to 'count' bytes. All the queues are locked.
+ *
+ * @return Returns zero, -EINVAL if 'count' is too small for the next
+ * record, or the error reading an entry.
+ */
+static int ext3u_uls_fill(struct ext3u_uls_stream * s, size_t count, size_t * len)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(s->s_sb);
+	struct ext3u_del_entry_header * dh;
+	struct ext3u_del_entry * e;
+	struct ext3u_uls_record * r;
+	struct ext3u_cursor cur;
+	__u32 time = 0;
+	size_t reclen;
+	int err = 0, match;
+
+	/* Entries left the FIFO since the last read: the position could */
+	/* be gone, it is found again from the deletion order.            */
+	if (!s->s_started || s->s_generation != atomic_read(&usbi->s_generation)) {
+		s->s_started = 1;
+		s->s_generation = atomic_read(&usbi->s_generation);
+		ext3u_uls_seek(s);
+	}
+
+	ext3u_cursor_init(&cur, usbi->s_undel_inode, usbi->s_usb, &(s->s_record), 0);
+
+	while (!s->s_done) {
+
+		/* At the end of a queue, go on with the next one. */
+		if (EXT3u_FIFO_NULL(&(s->s_record))) {
+			s->s_queue++;
+			s->s_visited = 0;
+			ext3u_uls_seek(s);
+			ext3u_cursor_seek(&cur, &(s->s_record));
+			continue;
+		}
+
+		dh = ext3u_cursor_header(&cur);
+		if (IS_ERR(dh)) {
+			err = PTR_ERR(dh);
+			break;
+		}
+
+		/* The search stops at the first entry of a block. */
+		if (s->s_visited && !ext3u_seq_before(s->s_seq, dh->d_seq))
+			goto next;
+
+		if (s->s_since || s->s_until) {
+			time = ext3u_cursor_time(&cur);
+
+			/* The next entries of the queue were deleted later. */
+			if (s->s_until && time > s->s_until) {
+				memset(&(s->s_record), 0, EXT3u_RECORD_SIZE);
+				continue;
+			}
+			if (time < s->s_since)
+				goto next;
+		}
+
+		if (ext3u_permission(dh->d_uid, dh->d_mode, MAY_WRITE))
+			goto next;
+
+		match = ext3u_uls_match(&cur, dh, &(s->s_filter), s->s_de);
+		if (match < 0) {
+			err = match;
+			break;
+		}
+		if (!match)
+			goto next;
+
+		/* The entry is left for the next read. */
+		reclen = ALIGN(sizeof(struct ext3u_uls_record) + dh->d_path_length + 1, 8);
+		if (*len + reclen > count) {
+			if (!*len)
+				err = -EINVAL;
+			break;
+		}
+
+		e = ext3u_cursor_entry(&cur, s->s_de);
+		if (IS_ERR(e)) {
+			err = PTR_ERR(e);
+			break;
+		}
+
+		r = (struct ext3u_uls_record *) (s->s_buf + *len);
+		memset(r, 0, reclen);
+		r->r_reclen = reclen;
+		r->r_path_length = e->d_path_length;
+		r->r_type = e->d_type;
+		r->r_mode = le16_to_cpu(e->d_inode.i_mode);
+		r->r_uid = e->d_uid;
+		r->r_gid = le16_to_cpu(e->d_inode.i_gid_low) | (le16_to_cpu(e->d_inode.i_gid_high) << 16);
+		r->r_nlink = le16_to_cpu(e->d_inode.i_links_count);
+		r->r_mtime = le32_to_cpu(e->d_inode.i_mtime);
+		r->r_dtime = le32_to_cpu(e->d_inode.i_dtime);
+		r->r_seq = e->d_seq;
+		r->r_size = ext3u_entry_size(e);
+		memcpy(r->r_path, e->d_path, e->d_path_length);
+		*len += reclen;
+
+next:
+		s->s_seq = dh->d_seq;
+		s->s_visited = 1;
+		memcpy(&(s->s_record), &(dh->d_next), EXT3u_RECORD_SIZE);
+		ext3u_cursor_seek(&cur, &(s->s_record));
+	}
+
+	ext3u_cursor_release(&cur);
+	return err;
+}
+
+static ssize_t ext3u_uls_read(struct file * file, char __user * buf, size_t count, loff_t * ppos)
+{
+	struct ext3u_uls_stream * s = file->private_data;
+	size_t len = 0;
+	int err;
+
+	mutex_lock(&s->s_mutex);
+
+	ext3u_lock_all(s->s_sb);
+	err = ext3u_uls_fill(s, min_t(size_t, count, EXT3u_ULS_STREAM_SIZE), &len);
+	ext3u_unlock_all(s->s_sb);
+
+	/* The records read before an error are given anyway. */
+	if (len) {
+		err = 0;
+		if (copy_to_user(buf, s->s_buf, len))
+			err = -EFAULT;
+		else
+			*ppos += len;
+	}
+
+	mutex_unlock(&s->s_mutex);
+	return err ? err : len;
+}
+
+static int ext3u_uls_release(struct inode * inode, struct file * file)
+{
+	struct ext3u_uls_stream * s = file->private_data;
+
+	mntput(s->s_mnt);
+	ext3u_free_entry(s->s_de);
+	vfree(s->s_buf);
+	kfree(s->s_filter.u_prefix);
+	kfree(s);
+	return 0;
+}
+
+static const struct file_operations ext3u_uls_fops = {
+	.read		= ext3u_uls_read,
+	.release	= ext3u_uls_release,
+	.llseek		= no_llseek,
+};
+
+/**
+ * @brief Open a listing of the deleted entries on the filesystem of 
+ * 'filp'. Each read() of the descriptor returned gives the next entries
+ * the user may restore as ext3u_uls_record, queue after queue; the end
+ * of the listing reads as the end of a file. The position is kept 
+ * between the reads, and found again by the deletion order when the
+ * FIFO changes: no entry is listed twice, none still there is skipped.
+ *
+ * @param filp A file of the filesystem, its mount is pinned.
+ * @param open_info The deletion time range, the filter and O_CLOEXEC;
+ * the prefix of the filter is in kernel memory, it is taken by the 
+ * listing even on error.
+ *
+ * @return The descriptor, or a negative error code.
+ */
+int ext3u_uls_open(struct file * filp, struct ext3u_uls_open_info * open_info)
+{
+	struct ext3u_uls_stream * s;
+	int fd;
+
+	fd = -EIO;
+	if (!EXT3u_SB(filp->f_path.dentry->d_sb)->s_undel_inode)
+		goto err_prefix;
+
+	fd = -ENOMEM;
+	s = kzalloc(sizeof(struct ext3u_uls_stream), GFP_KERNEL);
+	if (!s)
+		goto err_prefix;
+
+	s->s_de = ext3u_alloc_entry(GFP_KERNEL);
+	s->s_buf = vmalloc(EXT3u_ULS_STREAM_SIZE);
+	if (!s->s_de || !s->s_buf) {
+		fd = -ENOMEM;
+		goto err_free;
+	}
+
+	s->s_sb = filp->f_path.dentry->d_sb;
+	s->s_since = open_info->u_since;
+	s->s_until = open_info->u_until;
+	memcpy(&(s->s_filter), &(open_info->u_filter), sizeof(struct ext3u_uls_filter));
+	mutex_init(&s->s_mutex);
+	s->s_mnt = mntget(filp->f_path.mnt);
+
+	fd = anon_inode_getfd("[ext3u-uls]", &ext3u_uls_fops, s, open_info->u_flags & O_CLOEXEC);
+	if (fd >= 0)
+		return fd;
+
+	mntput(s->s_mnt);
+err_free:
+	if (s->s_de)
+		ext3u_free_entry(s->s_de);
+	vfree(s->s_buf);
+	kfree(s);
+err_prefix:
+	kfree(open_info->u_filter.u_prefix);
+	return fd;
+}
+
+/**
+ * @brief Distance in bytes of an entry from the head of its FIFO queue;
+ * the bigger the distance, the more recent the entry.
+ */
+static __u64 ext3u_fifo_position(struct ext3u_super_block * usb, struct ext3u_record * record)
+{
+	struct ext3u_fifo_info * fifo = EXT3u_QUEUE_FIFO(usb, ext3u_record_queue(usb, record));
+	__u32 blocks = fifo->f_blocks;
+	__s64 pos;
+
+	pos = (__s64) ((record->r_block + blocks - fifo->f_first.r_block) % blocks) * usb->s_block_size;
+	pos += (__s64) record->r_offset - fifo->f_first.r_offset;
+
+	/* Same block of the head, but the list wrapped around. */
+	if (pos < 0)
+		pos += (__s64) blocks * usb->s_block_size;
+
+	return pos;
+}
+
+/**
+ * @brief Return a slot of the hash index. The block holding the slot
+ * is read only if it is not the one already in 'bh'.
+ *
+ * @param u_inode The ext3u root inode.
+ * @param usb Pointer to the ext3u superblock.
+ * @param slot The number of the slot.
+ * @param bh The buffer of the last index block read, or NULL.
+ * @param block The logical block in 'bh'.
+ * @param blocks If not NULL, it counts the blocks read.
+ *
+ * @return The slot, or NULL on I/O error.
+ */
+static struct ext3u_index_slot * ext3u_index_get_slot(struct inode * u_inode,
+													 struct ext3u_super_block * usb,
+													 __u32 slot,
+													 struct buffer_head ** bh,
+													 __u32 * block,
+													 int * blocks)
+{
+	__u32 per_block = usb->s_block_size / EXT3u_INDEX_SLOT_SIZE;
+	__u32 b = usb->s_index.i_start_block + slot / per_block;
+	int err;
+
+	if (!*bh || *block != b) {
+		brelse(*bh);
+		*bh = ext3_bread(NULL, u_inode, b, 0, &err);
+		if (!*bh) {
+			return NULL;
+		}
+		*block = b;
+		if (blocks)
+			(*blocks)++;
+	}
+
+	return ((struct ext3u_index_slot *) (*bh)->b_data) + slot % per_block;
+}
+
+/**
+ * @brief Add a record to the hash index, without checking if the index
+ * is valid.
+ */
+static int __ext3u_index_insert(handle_t * handle,
+								struct inode * u_inode,
+								struct ext3u_super_block * usb,
+								__u32 hash,
+								struct ext3u_record * record)
+{
+	struct ext3u_index_info * ii = &usb->s_index;
+	struct ext3u_index_slot * xs = NULL;
+	struct buffer_head * bh = NULL;
+	__u32 slot, block = 0, i;
+	int err;
+
+	/* Linear probing: the first free or deleted slot is taken. */
+	slot = hash % ii->i_slots;
+	for (i = 0; i < ii->i_slots; i++, slot = (slot + 1) % ii->i_slots) {
+		xs = ext3u_index_get_slot(u_inode, usb, slot, &bh, &block, NULL);
+		if (!xs) {
+			return -EIO;
+		}
+		if (xs->x_state != EXT3u_INDEX_SLOT_USED)
+			break;
+	}
+
+	/* No room left, drop the index. */
+	if (i == ii->i_slots) {
+		brelse(bh);
+		usb->s_flags &= ~EXT3u_FEATURE_INDEX;
+		return 0;
+	}
+
+	err = ext3_journal_get_write_access(handle, bh);
+	if (err) {
+		brelse(bh);
+		return err;
+	}
+
+	if (xs->x_state == EXT3u_INDEX_SLOT_FREE)
+		ii->i_used++;
+
+	xs->x_hash = hash;
+	xs->x_state = EXT3u_INDEX_SLOT_USED;
+	memcpy(&(xs->x_record), record, EXT3u_RECORD_SIZE);
+
+	ext3_journal_dirty_metadata(handle, bh);
+	brelse(bh);
+	return 0;
+}
+
+/**
+ * @brief Add a new entry of the FIFO list to the hash index.
+ * The caller must have write access to the ext3u superblock. On error
+ * the index is dropped, and rebuilt by the next urm. The index is
+ * shared by all the sub-queues, so it has its own lock.
+ *
+ * @param handle The handle of this transaction.
+ * @param u_inode The ext3u root inode.
+ * @param usb Pointer to the ext3u superblock.
+ * @param hash The hash of the path of the entry.
+ * @param record The position of the entry in the FIFO list.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
+ */
+static int ext3u_index_insert(handle_t * handle,
+							  struct inode * u_inode,
+							  struct ext3u_super_block * usb,
+							  __u32 hash,
+							  struct ext3u_record * record)
+{
+	struct mutex * lock = &EXT3u_SB(u_inode->i_sb)->s_index_lock;
+	int err = 0;
+
+	mutex_lock(lock);
+	if (!EXT3u_HAS_FEATURE_INDEX(usb->s_flags))
+		goto out;
+
+	err = __ext3u_index_insert(handle, u_inode, usb, hash, record);
+
+	/* Too many used or deleted slots: the next urm rebuilds the index. */
+	if (err || EXT3u_INDEX_FULL(&(usb->s_index)))
+		usb->s_flags &= ~EXT3u_FEATURE_INDEX;
+
+out:
+	mutex_unlock(lock);
+	return err;
+}
+
+/**
+ * @brief Remove an entry of the FIFO list from the hash index. 
+ * The slot is marked as deleted, so the probe sequences crossing it 
+ * are not broken. On error the index is dropped.
+ *
+ * @param handle The handle of this transaction.
+ * @param u_inode The ext3u root inode.
+ * @param usb Pointer to the ext3u superblock.
+ * @param hash The hash of the path of the entry.
+ * @param record The position of the entry in the FIFO list.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
+ */
+static int ext3u_index_remove(handle_t * handle,
+							  struct inode * u_inode,
+							  struct ext3u_super_block * usb,
+							  __u32 hash,
+							  struct ext3u_record * record)
+{
+	struct mutex * lock = &EXT3u_SB(u_inode->i_sb)->s_index_lock;
+	struct ext3u_index_info * ii = &usb->s_index;
+	struct ext3u_index_slot * xs;
+	struct buffer_head * bh = NULL;
+	__u32 slot, block = 0, i;
+	int err = 0;
+
+	mutex_lock(lock);
+	if (!EXT3u_HAS_FEATURE_INDEX(usb->s_flags))
+		goto out;
+
+	slot = hash % ii->i_slots;
+	for (i = 0; i < ii->i_slots; i++, slot = (slot + 1) % ii->i_slots) {
+		xs = ext3u_index_get_slot(u_inode, usb, slot, &bh, &block, NULL);
+		if (!xs) {
+			err = -EIO;
+			break;
+		}
+
+		if (xs->x_state == EXT3u_INDEX_SLOT_FREE)
+			break;
+
+		if ((xs->x_state == EXT3u_INDEX_SLOT_USED) && (xs->x_hash == hash) &&
+			(xs->x_record.r_block == record->r_block) &&
+			(xs->x_record.r_offset == record->r_offset)) {
+
+			err = ext3_journal_get_write_access(handle, bh);
+			if (!err) {
+				xs->x_state = EXT3u_INDEX_SLOT_DELETED;
+				ext3_journal_dirty_metadata(handle, bh);
+			}
+			break;
+		}
+	}
+
+	brelse(bh);
+	if (err)
+		usb->s_flags &= ~EXT3u_FEATURE_INDEX;
+
+out:
+	mutex_unlock(lock);
+	return err;
+}
+
+/**
+ * @brief Look for 'path' in the hash index. If the same path was saved
+ * more than once, the most recent entry is returned.
+ *
+ * @param u_inode The ext3u root inode.
+ * @param usb Pointer to the ext3u superblock.
+ * @param path The path of the file we are looking for.
+ * @param de The buffer where the entry is copied.
+ * @param found It returns the position of the entry in the FIFO list.
+ * @param blocks It returns the number of blocks read.
+ *
+ * @return On success it returns 'de', otherwise an error.
+ */
+static struct ext3u_del_entry * ext3u_index_lookup(struct inode * u_inode,
+												   struct ext3u_super_block * usb,
+												   const char * path,
+												   struct ext3u_del_entry * de,
+												   struct ext3u_record * found,
+												   int * blocks)
+{
+	struct ext3u_index_info * ii = &usb->s_index;
+	struct ext3u_index_slot * xs;
+	struct ext3u_record record;
+	struct buffer_head * bh = NULL;
+	__u32 slot, block = 0, hash, i, seq = 0;
+	int err, loaded = 0, same_queue;
+
+	memset(found, 0, EXT3u_RECORD_SIZE);
+	hash = ext3u_hash(path, strlen(path));
+
+	slot = hash % ii->i_slots;
+	for (i = 0; i < ii->i_slots; i++, slot = (slot + 1) % ii->i_slots) {
+		xs = ext3u_index_get_slot(u_inode, usb, slot, &bh, &block, blocks);
+		if (!xs) {
+			return ERR_PTR(-EIO);
+		}
+
+		if (xs->x_state == EXT3u_INDEX_SLOT_FREE)
+			break;
+
+		if ((xs->x_state != EXT3u_INDEX_SLOT_USED) || (xs->x_hash != hash))
+			continue;
+
+		/* Older than the match we already have, in the same queue. */
+		memcpy(&record, &(xs->x_record), EXT3u_RECORD_SIZE);
+		same_queue = !EXT3u_FIFO_NULL(found) &&
+			ext3u_record_queue(usb, &record) == ext3u_record_queue(usb, found);
+		if (same_queue && ext3u_fifo_position(usb, &record) <= ext3u_fifo_position(usb, found))
+			continue;
+
+		/* Same hash: check the path. */
+		(*blocks)++;
+		err = ext3u_read_entry(u_inode, usb, &record, de, blocks);
+		if (err) {
+			brelse(bh);
+			return ERR_PTR(err);
+		}
+
+		/* Entries of different queues are ordered by deletion. */
+		loaded = !strncmp(path, de->d_path, PATH_MAX) &&
+			(EXT3u_FIFO_NULL(found) || same_queue || ext3u_seq_before(seq, de->d_seq));
+		if (loaded) {
+			memcpy(found, &record, EXT3u_RECORD_SIZE);
+			seq = de->d_seq;
+		}
+	}
+	brelse(bh);
+
+	if (EXT3u_FIFO_NULL(found)) {
+		return ERR_PTR(-ENOENT);
+	}
+
+	/* The last entry read was not the match. */
+	if (!loaded && (err = ext3u_read_entry(u_inode, usb, found, de, NULL))) {
+		return ERR_PTR(err);
+	}
+
+	/* Check if user has the permission to restore this file */
+	if (ext3u_permission(de->d_uid, de->d_mode, MAY_WRITE) == -EPERM)  {
+		return ERR_PTR(-EPERM);
+	}
+
+	return de;
+}
+
+/**
+ * @brief Build the hash index, walking every FIFO queue once. The 
+ * index lives in the blocks of the ext3u root inode following the 
+ * FIFO; they are allocated the first time the index is built.
+ *
+ * @param handle The handle of this transaction.
+ * @param u_inode The ext3u root inode.
+ * @param bh The buffer of the ext3u superblock, already journaled.
+ * All the queues must be locked by the caller.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
+ */
+static int ext3u_index_build(handle_t * handle, struct inode * u_inode, struct buffer_head * bh)
+{
+	struct ext3u_super_block * usb = (struct ext3u_super_block *) bh->b_data;
+	struct ext3u_index_info * ii = &usb->s_index;
+	struct ext3u_del_entry_header * dh;
+	struct ext3u_record record, next;
+	struct buffer_head * ibh;
+	__u32 per_block, blocks, i, q, hash;
+	loff_t size;
+	int err;
+
+	per_block = usb->s_block_size / EXT3u_INDEX_SLOT_SIZE;
+	blocks = ext3u_index_blocks(usb);
+
+	/* The index is not valid until it is complete. */
+	usb->s_flags &= ~EXT3u_FEATURE_INDEX;
+	ii->i_start_block = usb->s_fifo.f_blocks + 1;
+	ii->i_blocks = blocks;
+	ii->i_slots = blocks * per_block;
+	ii->i_used = 0;
+	ext3_journal_dirty_metadata(handle, bh);
+
+	/* Clear all the slots. */
+	for (i = 0; i < blocks; i++) {
+
+		err = ext3u_extend_or_restart(handle, EXT3_SINGLEDATA_TRANS_BLOCKS + 1, bh);
+		if (err) {
+			return err;
+		}
+
+		ibh = ext3_bread(handle, u_inode, ii->i_start_block + i, 1, &err);
+		if (!ibh) {
+			return err;
+		}
+
+		err = ext3_journal_get_write_access(handle, ibh);
+		if (err) {
+			brelse(ibh);
+			return err;
+		}
+
+		memset(ibh->b_data, 0, usb->s_block_size);
+		ext3_journal_dirty_metadata(handle, ibh);
+		brelse(ibh);
+	}
+
+	size = (loff_t) (ii->i_start_block + blocks) << u_inode->i_blkbits;
+	if (u_inode->i_size < size) {
+		i_size_write(u_inode, size);
+		EXT3_I(u_inode)->i_disksize = size;
+		ext3_mark_inode_dirty(handle, u_inode);
+	}
+
+	/* Add all the entries of every FIFO queue. */
+	for (q = 0, i = 0; q < EXT3u_SB(u_inode->i_sb)->s_queue_count; q++) {
+
+		memcpy(&record, &(EXT3u_QUEUE_FIFO(usb, q)->f_first), EXT3u_RECORD_SIZE);
+
+		for (; !EXT3u_FIFO_NULL(&record) && i < EXT3u_ENTRY_COUNT(usb); i++) {
+
+			ibh = ext3_bread(NULL, u_inode, record.r_block, 0, &err);
+			if (!ibh) {
+				return -EIO;
+			}
+
+			/* The header cannot be splitted across blocks. */
+			dh = (struct ext3u_del_entry_header *) (ibh->b_data + record.r_offset);
+			hash = dh->d_hash;
+			memcpy(&next, &(dh->d_next), EXT3u_RECORD_SIZE);
+			brelse(ibh);
+
+			err = ext3u_extend_or_restart(handle, 2, bh);
+			if (err) {
+				return err;
+			}
+
+			err = __ext3u_index_insert(handle, u_inode, usb, hash, &record);
+			if (err) {
+				return err;
+			}
+
+			memcpy(&record, &next, EXT3u_RECORD_SIZE);
+		}
+	}
+
+	if (!EXT3u_INDEX_FULL(ii))
+		usb->s_flags |= EXT3u_FEATURE_INDEX;
+
+	ext3_journal_dirty_metadata(handle, bh);
+	return 0;
+}
+
+/**
+ * @brief The owners of an entry: its user, and the top level directory
+ * of its path, '/' for the files deleted in the root directory.
+ */
+static void ext3u_owner_key(const char * path, unsigned int uid, __u32 * key)
+{
+	const char * p = strchr(path + 1, '/');
+
+	key[EXT3u_OWNER_UID] = uid;
+	key[EXT3u_OWNER_DIR] = ext3u_hash(path, p ? p - path : 1);
+}
+
+/**
+ * @brief Find an owner in its tree; if it is not there and 'new' is
+ * given, 'new' is inserted for it.
+ */
+static struct ext3u_owner * ext3u_owner_get(struct rb_root * root, __u32 key, struct ext3u_owner * new)
+{
+	struct rb_node ** p = &root->rb_node, * parent = NULL;
+	struct ext3u_owner * o;
+
+	while (*p) {
+		parent = *p;
+		o = rb_entry(parent, struct ext3u_owner, o_node);
+		if (key < o->o_key)
+			p = &parent->rb_left;
+		else if (key > o->o_key)
+			p = &parent->rb_right;
+		else
+			return o;
+	}
+
+	if (new) {
+		new->o_key = key;
+		new->o_size = 0;
+		INIT_LIST_HEAD(&new->o_entries);
+		rb_link_node(&new->o_node, parent, p);
+		rb_insert_color(&new->o_node, root);
+	}
+	return new;
+}
+
+static inline struct hlist_head * ext3u_owned_bucket(struct ext3u_sb_info * usbi, struct ext3u_record * record)
+{
+	return &usbi->s_owned[hash_long(record->r_block * 31 + record->r_offset, EXT3u_OWNER_HASH_BITS)];
+}
+
+/* The entry at 'record' as seen by its owners, NULL if it is not tracked. */
+static struct ext3u_owned * ext3u_owned_find(struct ext3u_sb_info * usbi, struct ext3u_record * record)
+{
+	struct hlist_node * pos;
+	struct ext3u_owned * w;
+
+	hlist_for_each_entry(w, pos, ext3u_owned_bucket(usbi, record), w_hash) {
+		if (w->w_record.r_block == record->r_block && w->w_record.r_offset == record->r_offset)
+			return w;
+	}
+	return NULL;
+}
+
+/**
+ * @brief Charge a new entry to its owners. Without memory the entry is
+ * not tracked: it escapes the budgets, and the owners cannot be listed
+ * any more.
+ */
+static void ext3u_owner_add(struct ext3u_sb_info * usbi, __u32 * key, struct ext3u_record * record, __u64 size)
+{
+	struct ext3u_owner * new[EXT3u_OWNER_KINDS], * o;
+	struct ext3u_owned * w;
+	int kind;
+
+	if (!usbi->s_owned)
+		return;
+
+	w = kmalloc(sizeof(struct ext3u_owned), GFP_NOFS);
+	for (kind = 0; kind < EXT3u_OWNER_KINDS; kind++)
+		new[kind] = kmalloc(sizeof(struct ext3u_owner), GFP_NOFS);
+
+	for (kind = 0; kind < EXT3u_OWNER_KINDS; kind++) {
+		if (!new[kind])
+			goto out;
+	}
+	if (!w)
+		goto out;
+
+	memcpy(&(w->w_record), record, EXT3u_RECORD_SIZE);
+	w->w_size = size;
+
+	spin_lock(&usbi->s_owner_lock);
+	hlist_add_head(&w->w_hash, ext3u_owned_bucket(usbi, record));
+	for (kind = 0; kind < EXT3u_OWNER_KINDS; kind++) {
+		o = ext3u_owner_get(&usbi->s_owners[kind], key[kind], new[kind]);
+		if (o == new[kind])
+			new[kind] = NULL;
+		o->o_size += size;
+		list_add_tail(&(w->w_list[kind]), &o->o_entries);
+		w->w_owner[kind] = o;
+	}
+	spin_unlock(&usbi->s_owner_lock);
+	w = NULL;
+
+out:
+	if (w)
+		usbi->s_owner_partial = 1;
+	kfree(w);
+	for (kind = 0; kind < EXT3u_OWNER_KINDS; kind++)
+		kfree(new[kind]);
+}
+
+/**
+ * @brief Give back to its owners the data of an entry leaving the FIFO.
+ * An owner left without entries is dropped.
+ */
+static void ext3u_owner_remove(struct ext3u_sb_info * usbi, struct ext3u_record * record)
+{
+	struct ext3u_owned * w;
+	struct ext3u_owner * o;
+	int kind;
+
+	if (!usbi->s_owned)
+		return;
+
+	spin_lock(&usbi->s_owner_lock);
+	w = ext3u_owned_find(usbi, record);
+	if (w) {
+		hlist_del(&w->w_hash);
+		for (kind = 0; kind < EXT3u_OWNER_KINDS; kind++) {
+			o = w->w_owner[kind];
+			o->o_size -= w->w_size;
+			list_del(&(w->w_list[kind]));
+			if (list_empty(&o->o_entries)) {
+				rb_erase(&o->o_node, &usbi->s_owners[kind]);
+				kfree(o);
+			}
+		}
+		kfree(w);
+	}
+	spin_unlock(&usbi->s_owner_lock);
+}
+
+/**
+ * @brief Charge all the saved entries to their owners, walking the queues.
+ * It runs at mount time when a budget is set, otherwise the first time a
+ * user lists their entries; either way no queue can change meanwhile. An
+ * entry which cannot be read leaves the owners partial.
+ *
+ * @param sb The superblock of the filesystem.
+ * @param flags How to allocate the memory.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
+ */
+static int ext3u_owner_build(struct super_block * sb, gfp_t flags)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct ext3u_super_block * usb = usbi->s_usb;
+	struct ext3u_del_entry * de, * e;
+	struct ext3u_cursor cur;
+	__u32 key[EXT3u_OWNER_KINDS], n;
+	unsigned int q, i;
+	int err = 0;
+
+	usbi->s_owned = kmalloc(sizeof(struct hlist_head) << EXT3u_OWNER_HASH_BITS, flags);
+	if (!usbi->s_owned)
+		return -ENOMEM;
+	for (i = 0; i < (1 << EXT3u_OWNER_HASH_BITS); i++)
+		INIT_HLIST_HEAD(&usbi->s_owned[i]);
+
+	de = ext3u_alloc_entry(flags);
+	if (!de) {
+		usbi->s_owner_partial = 1;
+		return -ENOMEM;
+	}
+
+	for (q = 0; q < usbi->s_queue_count && !err; q++) {
+		ext3u_cursor_init(&cur, usbi->s_undel_inode, usb, &(EXT3u_QUEUE_FIFO(usb, q)->f_first), 0);
+
+		for (n = 0; !EXT3u_FIFO_NULL(&(cur.c_record)) && n < EXT3u_ENTRY_COUNT(usb); n++) {
+			e = ext3u_cursor_entry(&cur, de);
+			if (IS_ERR(e)) {
+				err = PTR_ERR(e);
+				break;
+			}
+
+			ext3u_owner_key(e->d_path, e->d_uid, key);
+			ext3u_owner_add(usbi, key, &(cur.c_record), ext3u_entry_size(e));
+
+			err = ext3u_cursor_next(&cur);
+			if (err) {
+				err = err == -ENOENT ? 0 : err;
+				break;
+			}
+		}
+		ext3u_cursor_release(&cur);
+	}
+
+	if (err)
+		usbi->s_owner_partial = 1;
+	ext3u_free_entry(de);
+	return err;
+}
+
+/*
+ * The entry of user 'uid' at 'record', or the one following it, or the
+ * first of their entries if 'record' is the end of the FIFO. The owners 
+ * are built the first time; the caller holds the locks of all the queues.
+ */
+static int ext3u_owner_walk(struct super_block * sb, unsigned int uid, struct ext3u_record * record, int next)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct ext3u_owner * o;
+	struct ext3u_owned * w;
+	struct list_head * p;
+	int err = 0;
+
+	if (!usbi->s_owned && !usbi->s_owner_partial)
+		ext3u_owner_build(sb, GFP_NOFS);
+	if (!usbi->s_owned || usbi->s_owner_partial)
+		return -EAGAIN;
+
+	spin_lock(&usbi->s_owner_lock);
+	o = ext3u_owner_get(&usbi->s_owners[EXT3u_OWNER_UID], uid, NULL);
+	if (!o) {
+		err = -ENOENT;
+		goto out;
+	}
+
+	if (EXT3u_FIFO_NULL(record)) {
+		p = o->o_entries.next;
+	} else {
+		/* The entry went away, or it belongs to somebody else. */
+		w = ext3u_owned_find(usbi, record);
+		if (!w || w->w_owner[EXT3u_OWNER_UID] != o) {
+			err = -EAGAIN;
+			goto out;
+		}
+		p = next ? w->w_list[EXT3u_OWNER_UID].next : &(w->w_list[EXT3u_OWNER_UID]);
+	}
+
+	if (p == &o->o_entries) {
+		err = -ENOENT;
+		goto out;
+	}
+	w = list_entry(p, struct ext3u_owned, w_list[EXT3u_OWNER_UID]);
+	memcpy(record, &(w->w_record), EXT3u_RECORD_SIZE);
+
+out:
+	spin_unlock(&usbi->s_owner_lock);
+	return err;
+}
+
+/**
+ * @brief Start listing the entries of the user 'uid', oldest first, from
+ * 'record', or from their first entry if 'record' is the end of the FIFO.
+ * The caller holds the locks of all the queues.
+ *
+ * @return Returns zero, -ENOENT if the user has no entries, or -EAGAIN
+ * if 'record' is not one of them or the entries of the users are not 
+ * known: the caller has to walk the whole FIFO.
+ */
+int ext3u_owner_first(struct super_block * sb, unsigned int uid, struct ext3u_record * record)
+{
+	return ext3u_owner_walk(sb, uid, record, 0);
+}
+
+/**
+ * @brief Move 'record' to the next entry of the user 'uid'.
+ *
+ * @return Returns zero, -ENOENT after their last entry, -EAGAIN as 
+ * ext3u_owner_first().
+ */
+int ext3u_owner_next(struct super_block * sb, unsigned int uid, struct ext3u_record * record)
+{
+	return ext3u_owner_walk(sb, uid, record, 1);
+}
+
+/**
+ * @brief Set the budgets given with the undel_uid_budget= and 
+ * undel_dir_budget= mount options; then, if there is any budget, 
+ * charge the saved entries to their owners walking all the queues.
+ *
+ * @param sb The superblock of the filesystem.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
+ */
+static int ext3u_owner_load(struct super_block * sb)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct ext3u_super_block * usb = usbi->s_usb;
+	handle_t * handle;
+	int kind, changed = 0, err = 0;
+
+	spin_lock_init(&usbi->s_owner_lock);
+	for (kind = 0; kind < EXT3u_OWNER_KINDS; kind++) {
+		usbi->s_owners[kind] = RB_ROOT;
+		if ((usbi->s_budget_set & (1 << kind)) && usb->s_budget[kind] != usbi->s_budget_opt[kind])
+			changed = 1;
+	}
+
+	if (changed && !(sb->s_flags & MS_RDONLY)) {
+		handle = ext3_journal_start(usbi->s_undel_inode, 1);
+		if (IS_ERR(handle)) {
+			return PTR_ERR(handle);
+		}
+		err = ext3_journal_get_write_access(handle, usbi->s_usbh);
+		if (!err) {
+			for (kind = 0; kind < EXT3u_OWNER_KINDS; kind++) {
+				if (usbi->s_budget_set & (1 << kind))
+					usb->s_budget[kind] = usbi->s_budget_opt[kind];
+			}
+			ext3_journal_dirty_metadata(handle, usbi->s_usbh);
+		}
+		ext3_journal_stop(handle);
+		if (err) {
+			return err;
+		}
+	}
+
+	if (!usb->s_budget[EXT3u_OWNER_UID] && !usb->s_budget[EXT3u_OWNER_DIR])
+		return 0;
+
+	return ext3u_owner_build(sb, GFP_KERNEL);
+}
+
+/**
+ * @brief Free the owners and the entries charged to them, at unmount time.
+ */
+static void ext3u_owner_release(struct ext3u_sb_info * usbi)
+{
+	struct hlist_node * pos, * n;
+	struct ext3u_owned * w;
+	struct rb_node * node;
+	int kind, i;
+
+	if (!usbi->s_owned)
+		return;
+
+	for (i = 0; i < (1 << EXT3u_OWNER_HASH_BITS); i++) {
+		hlist_for_each_entry_safe(w, pos, n, &usbi->s_owned[i], w_hash)
+			kfree(w);
+	}
+
+	for (kind = 0; kind < EXT3u_OWNER_KINDS; kind++) {
+		while ((node = rb_first(&usbi->s_owners[kind]))) {
+			rb_erase(node, &usbi->s_owners[kind]);
+			kfree(rb_entry(node, struct ext3u_owner, o_node));
+		}
+	}
+
+	kfree(usbi->s_owned);
+	usbi->s_owned = NULL;
+}
+
+/**
+ * @brief Check if saving 'size' more bytes goes over the 'd_max_size' limit,
+ * once 'freed' bytes still counted are released.
+ */
+static int ext3u_over_max_size(struct ext3u_sb_info * usbi, __u64 size, __u64 freed)
+{
+	struct ext3u_super_block * usb = usbi->s_usb;
+	unsigned int seq;
+	int ret;
+
+	do {
+		seq = read_seqbegin(&usbi->s_del_lock);
+		ret = (usb->s_del.d_current_size + size) > (usb->s_del.d_max_size + freed);
+	} while (read_seqretry(&usbi->s_del_lock, seq));
+
+	return ret;
+}
+
+/**
+ * @brief The biggest file that can be saved: 'd_max_size', or 
+ * 'd_max_filesize' when it is set and smaller. Both can be changed 
+ * through /proc while the filesystem is in use.
+ */
+static __u64 ext3u_max_file_size(struct ext3u_sb_info * usbi)
+{
+	struct ext3u_super_block * usb = usbi->s_usb;
+	unsigned int seq;
+	__u64 max;
+
+	do {
+		seq = read_seqbegin(&usbi->s_del_lock);
+		max = usb->s_del.d_max_size;
+		if (usb->s_del.d_max_filesize && usb->s_del.d_max_filesize < max)
+			max = usb->s_del.d_max_filesize;
+	} while (read_seqretry(&usbi->s_del_lock, seq));
+
+	return max;
+}
+
+/**
+ * @brief Read the deletion order of the first entry of a queue.
+ *
+ * @return Returns zero on success, -EIO otherwise.
+ */
+static int ext3u_head_seq(struct inode * u_inode, struct ext3u_fifo_info * fifo, __u32 * seq)
+{
+	struct buffer_head * bh;
 	int err;
-	int mode =  S_IFREG|S_IRUSR|S_IWUSR|S_IRGRP|S_IROTH;
-	struct ext3u_record record = { 
+
+	bh = ext3_bread(NULL, u_inode, fifo->f_first.r_block, 0, &err);
+	if (!bh) {
+		return -EIO;
+	}
+
+	/* The header cannot be splitted across blocks. */
+	*seq = ((struct ext3u_del_entry_header *) (bh->b_data + fifo->f_first.r_offset))->d_seq;
+	brelse(bh);
+	return 0;
+}
+
+/**
+ * @brief Pick the queue holding the oldest entry, comparing the heads 
+ * of the queues. The other queues are only tried: a queue busy with 
+ * another save is skipped, so two saves never wait for each other.
+ *
+ * @param u_inode The ext3u root inode.
+ * @param q The queue locked by the caller.
+ *
+ * @return The chosen queue, locked; 'q' if none of the others is older.
+ */
+static struct ext3u_queue * ext3u_oldest_queue(struct inode * u_inode, struct ext3u_queue * q)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(u_inode->i_sb);
+	struct ext3u_queue * best = NULL, * p;
+	__u32 seq, best_seq = 0;
+	unsigned int i;
+
+	if (usbi->s_queue_count == 1)
+		return q;
+
+	if (!EXT3u_FIFO_EMPTY(q->q_fifo) && !ext3u_head_seq(u_inode, q->q_fifo, &best_seq))
+		best = q;
+
+	for (i = 0; i < usbi->s_queue_count; i++) {
+		p = &usbi->s_queue[i];
+		if (p == q || !mutex_trylock(&p->q_mutex))
+			continue;
+
+		if (EXT3u_FIFO_EMPTY(p->q_fifo) || ext3u_head_seq(u_inode, p->q_fifo, &seq) ||
+			(best && !ext3u_seq_before(seq, best_seq))) {
+			mutex_unlock(&p->q_mutex);
+			continue;
+		}
+
+		if (best && best != q)
+			mutex_unlock(&best->q_mutex);
+		best = p;
+		best_seq = seq;
+	}
+
+	return best ? best : q;
+}
+
+/* What is left of an entry unlinked from the FIFO: enough to free its blocks. */
+struct ext3u_evicted {
+	struct ext3_inode		e_inode;		/* the saved inode */
+	struct ext3u_record		e_record;		/* where the entry was */
+	__u32					e_hash;			/* hash of the path */
+};
+
+/**
+ * @brief Move the head of a queue past a run of 'count' entries, 'dirs'
+ * of them directories, holding 'size' bytes of data; 'next' is the new head.
+ */
+static void ext3u_advance_head(struct ext3u_sb_info * usbi, struct ext3u_fifo_info * fifo, 
+							   struct ext3u_record * next, int count, int dirs, __u64 size)
+{
+	struct ext3u_super_block * usb = usbi->s_usb;
+
+	write_seqlock(&usbi->s_del_lock);
+	usb->s_del.d_current_size -= size;
+	usb->s_del.d_file_count -= count - dirs;
+	usb->s_del.d_dir_count -= dirs;
+	write_sequnlock(&usbi->s_del_lock);
+
+	if (EXT3u_FIFO_NULL(next)) {
+		ext3u_reset_fifo(fifo, usb->s_block_size);
+		atomic_inc(&usbi->s_generation);
+		return;
+	}
+
+	fifo->f_free += ext3u_head_room(usb, fifo, next);
+	memcpy(&(fifo->f_first), next, sizeof(struct ext3u_record));
+	atomic_inc(&usbi->s_generation);
+}
+
+/**
+ * @brief Unlink a run of entries from the head of a queue. The blocks
+ * of the run are read ahead, then the entries are read one after the 
+ * other until 'room' bytes of the queue and 'size' bytes of data are 
+ * released, or 'max' entries are taken. The removed entries are not 
+ * touched: only the new head is written, and the superblock is updated
+ * once for the whole run.
+ *
+ * @param handle The handle of this transaction, with enough credits for the run.
+ * @param u_inode The ext3u root inode.
+ * @param bh The buffer of the ext3u superblock, already journaled.
+ * @param fifo The queue, locked by the caller.
+ * @param room The free bytes needed in the queue.
+ * @param size The bytes of data that must fit below 'd_max_size'.
+ * @param ev Where the removed entries are returned.
+ * @param max The size of 'ev'.
+ *
+ * @return The number of entries removed, or a negative error code.
+ */
+static int ext3u_evict_run(handle_t * handle, struct inode * u_inode, struct buffer_head * bh,
+						   struct ext3u_fifo_info * fifo, __u32 room, __u64 size,
+						   struct ext3u_evicted * ev, int max)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(u_inode->i_sb);
+	struct ext3u_super_block * usb = usbi->s_usb;
+	struct ext3u_del_entry * de, * e;
+	struct ext3u_cursor cur;
+	struct ext3u_record next;
+	struct ext3u_record null = { 
 		.r_block = 0, 
 		.r_real_block = 0, 
 		.r_offset = 0, 
 		.r_size = 0
 	};
+	__u64 freed_size = 0;
+	__u32 freed_room, freed_used = 0;
+	int count = 0, dirs = 0, i, err = 0;
+
+	de = ext3u_alloc_entry(GFP_NOFS);
+	if (de == NULL)
+		return -ENOMEM;
+
+	ext3u_cursor_init(&cur, u_inode, usb, &(fifo->f_first), 0);
+
+	memcpy(&next, &(fifo->f_first), sizeof(struct ext3u_record));
+	while (!EXT3u_FIFO_NULL(&next) && count < max) {
+
+		e = ext3u_cursor_entry(&cur, de);
+		if (IS_ERR(e)) {
+			err = PTR_ERR(e);
+			break;
+		}
+		ext3u_print_entry(e);
+
+		memcpy(&(ev[count].e_inode), &(e->d_inode), sizeof(struct ext3_inode));
+		memcpy(&(ev[count].e_record), &next, sizeof(struct ext3u_record));
+		ev[count].e_hash = e->d_hash;
+		freed_size += ext3u_entry_size(e);
+		freed_used += e->d_size;
+		if (e->d_type == EXT3u_ENTRY_DIR)
+			dirs++;
+		count++;
+
+		memcpy(&next, &(e->d_next), sizeof(struct ext3u_record));
+		if (ext3u_cursor_seek(&cur, &next))
+			break;
+
+		/* Stop as soon as the run is long enough. */
+		freed_room = ext3u_head_room(usb, fifo, &next);
+		if (fifo->f_free + freed_room >= room && !ext3u_over_max_size(usbi, size, freed_size))
+			break;
+	}
+	ext3u_cursor_release(&cur);
+	ext3u_free_entry(de);
+
+	/* An unreadable entry stops the run, the ones before it go anyway. */
+	if (!count)
+		return err;
+
+	for (i = 0; i < count; i++) {
+		ext3u_index_remove(handle, u_inode, usb, ev[i].e_hash, &(ev[i].e_record));
+		ext3u_owner_remove(usbi, &(ev[i].e_record));
+	}
+
+	/* The new first entry of the FIFO queue. */
+	if (!EXT3u_FIFO_NULL(&next))
+		ext3u_update_entry(handle, u_inode, &next, &null, EXT3u_UPDATE_PREVIOUS);
+
+	ext3u_advance_head(usbi, fifo, &next, count, dirs, freed_size);
+	ext3_journal_dirty_metadata(handle, bh);
+
+	atomic_long_add(count, &usbi->s_stats.s_evicted);
+	atomic_long_sub(freed_used, &usbi->s_stats.s_used);
+	return count;
+}
+
+/**
+ * @brief Free the data blocks of entries already unlinked from the FIFO.
+ * The blocks are still charged to the quota of the owners of the files,
+ * which are credited back here.
+ *
+ * @param bh The buffer of the ext3u superblock, already journaled.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
+ */
+static int ext3u_free_evicted(handle_t * handle, struct super_block * sb, struct buffer_head * bh, 
+							  struct ext3u_evicted * ev, int count)
+{
+	struct inode * inode;
+	int i, err;
+
+	for (i = 0; i < count; i++) {
+
+		/* The saved inode is restored in memory only, to walk */
+		/* its block tree: inode number 0 is never written.    */
+		inode = new_inode(sb);
+		if (!inode) {
+			return -ENOMEM;
+		}
+		inode->i_ino = 0;
+		__ext3u_restore_inode(inode, &(ev[i].e_inode));
+
+		/* Reading the dquots of the owner may write the quota file. */
+		err = ext3u_extend_or_restart(handle, EXT3_MAXQUOTAS_INIT_BLOCKS(sb) + 
+										EXT3_MAXQUOTAS_TRANS_BLOCKS(sb), bh);
+		if (err) {
+			iput(inode);
+			return err;
+		}
+
+		/* Free the data blocks: ext3_free_blocks() credits the */
+		/* dquots of the saved uid and gid. The inode goes away. */
+		DQUOT_INIT(inode);
+		ext3u_free_inode_blocks(handle, inode);
+		DQUOT_DROP(inode);
+		iput(inode);
+	}
+	return 0;
+}
+
+/**
+ * @brief Unlink one entry from anywhere in its queue, as urm does, and
+ * free its data blocks. A queue other than 'q' is only tried.
+ *
+ * @param handle The handle of this transaction.
+ * @param q The queue locked by the caller.
+ * @param u_inode The ext3u root inode.
+ * @param bh The buffer of the ext3u superblock, already journaled.
+ * @param record The entry.
+ * @param ev Room for the entry while its blocks are freed.
+ *
+ * @return Returns zero on success, -EBUSY if the queue of the entry is 
+ * busy, another negative error code otherwise.
+ */
+static int ext3u_evict_one(handle_t * handle, struct ext3u_queue * q, struct inode * u_inode, 
+						   struct buffer_head * bh, struct ext3u_record * record, struct ext3u_evicted * ev)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(u_inode->i_sb);
+	struct ext3u_super_block * usb = usbi->s_usb;
+	struct ext3u_queue * victim = &usbi->s_queue[ext3u_record_queue(usb, record)];
+	struct ext3u_del_entry * de;
+	int err;
+
+	if (victim != q && !mutex_trylock(&victim->q_mutex))
+		return -EBUSY;
+
+	err = -ENOMEM;
+	de = ext3u_alloc_entry(GFP_NOFS);
+	if (!de)
+		goto out;
+
+	err = ext3u_extend_or_restart(handle, EXT3_DELETE_TRANS_BLOCKS(u_inode->i_sb) + 
+										EXT3u_SAVE_TRANS_BLOCKS(u_inode->i_sb), bh);
+	if (err)
+		goto out_free;
+
+	/* An entry which cannot be read is not charged any more. */
+	err = ext3u_read_entry(u_inode, usb, record, de, NULL);
+	if (!err)
+		err = ext3u_delete_entry(handle, u_inode, de);
+	if (err) {
+		ext3u_owner_remove(usbi, record);
+		goto out_free;
+	}
+
+	ext3u_index_remove(handle, u_inode, usb, de->d_hash, record);
+	ext3u_update_superblock(usbi, victim->q_fifo, de, EXT3u_UPDATE_DELETE);
+	ext3_journal_dirty_metadata(handle, bh);
+	ext3u_owner_remove(usbi, record);
+	atomic_long_inc(&usbi->s_stats.s_evicted);
+	memcpy(&(ev->e_inode), &(de->d_inode), sizeof(struct ext3_inode));
+
+out_free:
+	ext3u_free_entry(de);
+out:
+	if (victim != q)
+		mutex_unlock(&victim->q_mutex);
+
+	/* The queue is consistent again, only the data blocks are left. */
+	if (!err)
+		err = ext3u_free_evicted(handle, u_inode->i_sb, bh, ev, 1);
+	if (!err)
+		err = ext3_journal_get_write_access(handle, bh);
+	return err;
+}
+
+/**
+ * @brief Keep the owners of a new entry within their budgets: a user, 
+ * or a top level directory, going over its budget gives up its own 
+ * oldest entries, and the others' files are left alone. The owner is
+ * found in its tree and its oldest entry is the first of its list, so
+ * picking a victim costs O(log n). A victim in a busy queue ends the 
+ * search; the global limits are enforced anyway.
+ *
+ * @param handle The handle of this transaction.
+ * @param q The queue where the new entry goes, locked by the caller.
+ * @param u_inode The ext3u root inode.
+ * @param bh The buffer of the ext3u superblock, already journaled.
+ * @param key The owners of the new entry.
+ * @param size The bytes of data of the new entry.
+ * @param ev Room for an entry while its blocks are freed.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
+ */
+static int ext3u_evict_owner(handle_t * handle, struct ext3u_queue * q, struct inode * u_inode, 
+							 struct buffer_head * bh, __u32 * key, __u64 size, struct ext3u_evicted * ev)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(u_inode->i_sb);
+	struct ext3u_owner * o;
+	struct ext3u_owned * w;
+	struct ext3u_record record;
+	__u64 budget;
+	int kind, err = 0;
+
+	for (kind = 0; kind < EXT3u_OWNER_KINDS && !err; kind++) {
+		budget = usbi->s_usb->s_budget[kind];
+		if (!budget)
+			continue;
+
+		while (!err) {
+			spin_lock(&usbi->s_owner_lock);
+			o = ext3u_owner_get(&usbi->s_owners[kind], key[kind], NULL);
+			if (!o || o->o_size + size <= budget) {
+				spin_unlock(&usbi->s_owner_lock);
+				break;
+			}
+			w = list_entry(o->o_entries.next, struct ext3u_owned, w_list[kind]);
+			memcpy(&record, &(w->w_record), EXT3u_RECORD_SIZE);
+			spin_unlock(&usbi->s_owner_lock);
+
+			err = ext3u_evict_one(handle, q, u_inode, bh, &record, ev);
+		}
+	}
+	return err == -EBUSY ? 0 : err;
+}
+
+/** 
+ * @brief Free one or more entries of the FIFO queue to make space for the new entry.
+ * 1. We make space in the queue for this entry, if there is less then
+ * 'room' bytes free.
+ * 2. The size of all data-blocks must be checked in order to ensure
+ * that their sum remain below the value 'd_max_size' witch is the
+ * the maximun size of all data blocks pointed by the entries in the
+ * FIFO list. This size has been specified at filesystem creation.
+ *
+ * Only the head of 'q' can make room in 'q'; when the size limit is 
+ * reached instead, the oldest queue gives up a run of its entries.
+ *
+ * The entries are unlinked EXT3u_EVICT_RUN at a time by ext3u_evict_run(),
+ * then their data blocks are freed. The handle is restarted only while 
+ * freeing the blocks, when the FIFO is consistent already: a crash there
+ * just leaks some blocks, which e2fsck gives back.
+ *
+ * @param handle The handle of this transaction.
+ * @param q The queue where the new entry goes, locked by the caller.
+ * @param u_inode The ext3u root inode.
+ * @param bh The buffer of the ext3u superblock, already journaled.
+ * @param room The free bytes needed in 'q'.
+ * @param size The bytes of data that must fit below 'd_max_size'.
+ * @param max The max number of entries to free, zero for no limit.
+ * @param key The owners of the new entry, NULL if it has none.
+ *
+ * @return Returns zero on success, otherwise a negative number indicating the error.
+ */
+static int ext3u_free_old_entries(handle_t * handle, struct ext3u_queue * q, struct inode * u_inode, struct buffer_head * bh, __u32 room, __u64 size, int max, __u32 * key)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(u_inode->i_sb);
+	struct super_block * sb = u_inode->i_sb;
+	struct ext3u_evicted * ev;
+	struct ext3u_queue * victim;
+	ktime_t start;
+	long usecs;
+	int err = 0, freed = 0, run;
 	
-	bh = ext3_bread(NULL, u_inode, 0, 0, &err);
-	if (!bh) {
-		return -EIO;
-	}	
-	usb = (struct ext3u_super_block *)bh->b_data;
+	if (!(key && usbi->s_owned) && (q->q_fifo->f_free >= room) && !ext3u_over_max_size(usbi, size, 0))
+		return 0;
+
+	ev = kmalloc(EXT3u_EVICT_RUN * sizeof(struct ext3u_evicted), GFP_NOFS);
+	if (ev == NULL)
+		return -ENOMEM;
+
+	/* The owners over their budget pay first. */
+	if (key) {
+		err = ext3u_evict_owner(handle, q, u_inode, bh, key, size, ev);
+		if (err)
+			goto out;
+	}
+
+	/* Free enough space in the queue for the new entry. */
+	/* Keep the sum of data blocks below the value 'd_max_size'.*/
+
+	while ( ((q->q_fifo->f_free < room) || ext3u_over_max_size(usbi, size, 0)) && (!max || freed < max) ) {
+		
+		run = EXT3u_EVICT_RUN;
+		if (max && max - freed < run)
+			run = max - freed;
+
+		/* Room for freeing one inode, the index slots of the run, the */
+		/* new head and the superblock.                                */
+		err = ext3u_extend_or_restart(handle, EXT3_DELETE_TRANS_BLOCKS(sb) + 
+											EXT3u_SAVE_TRANS_BLOCKS(sb) + run, bh);
+		if (err)
+			break;
+
+		if (q->q_fifo->f_free < room)
+			victim = q;
+		else
+			victim = ext3u_oldest_queue(u_inode, q);
+
+		/* Nothing left to free. */
+		if (EXT3u_FIFO_EMPTY(victim->q_fifo)) {
+			if (victim != q)
+				mutex_unlock(&victim->q_mutex);
+			break;
+		}
+
+		start = ktime_get();
+		run = ext3u_evict_run(handle, u_inode, bh, victim->q_fifo, 
+							  victim == q ? room : 0, size, ev, run);
+
+		/* The other queue is consistent again, only the data blocks are left. */
+		if (victim != q)
+			mutex_unlock(&victim->q_mutex);
+
+		if (run < 0) {
+			ext3u_debug("Cannot unlink the first entries");
+			err = run;
+			break;
+		}
+
+		err = ext3u_free_evicted(handle, sb, bh, ev, run);
+		freed += run;
+
+		/* The run is timed up to its blocks freed. */
+		usecs = ktime_us_delta(ktime_get(), start);
+		atomic_long_inc(&usbi->s_stats.s_evict_runs);
+		atomic_long_add(usecs, &usbi->s_stats.s_evict_usecs);
+		ext3u_stats_max(&usbi->s_stats.s_evict_max_usecs, usecs);
+		if (err)
+			break;
+
+		/* Freeing the blocks may have restarted the handle. */
+		err = ext3_journal_get_write_access(handle, bh);
+		if (err)
+			break;
+	}
+
+out:
+	kfree(ev);
+	return err;	
+}
 
-	if (EXT3u_FIFO_EMPTY(usb))
+/**
+ * @brief Bytes of data between a watermark and 'd_max_size'. When the
+ * watermarks are not set, the eviction thread starts at 7/8 of 
+ * 'd_max_size' and stops at 3/4. They are read again each time, so a
+ * change made through /proc is seen by the next run.
+ *
+ * @param high Non zero for the high watermark, zero for the low one.
+ */
+static __u64 ext3u_headroom(struct ext3u_sb_info * usbi, int high)
+{
+	struct ext3u_super_block * usb = usbi->s_usb;
+	__u64 max, watermark;
+	unsigned int seq;
+
+	do {
+		seq = read_seqbegin(&usbi->s_del_lock);
+		max = usb->s_del.d_max_size;
+		watermark = high ? usb->s_high_watermark : usb->s_low_watermark;
+	} while (read_seqretry(&usbi->s_del_lock, seq));
+
+	if (!watermark)
+		return max >> (high ? 3 : 2);
+
+	return watermark < max ? max - watermark : 0;
+}
+
+/**
+ * @brief Check if the eviction thread has some work to do: the saved 
+ * data is above the high watermark, or a queue is almost full.
+ */
+static int ext3u_need_evict(struct super_block * sb)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct ext3u_super_block * usb = usbi->s_usb;
+	struct ext3u_fifo_info * fifo;
+	unsigned int q;
+
+	if (sb->s_flags & MS_RDONLY)
 		return 0;
 
-	/* We need a directory to create the inode used */
-	/* to remove the entries from the FIFO list. */
-	dir = ext3_iget(u_inode->i_sb, EXT3_ROOT_INO);
-	if (!dir) {
-		return -EIO;
+	if (ext3u_over_max_size(usbi, ext3u_headroom(usbi, 1), 0))
+		return 1;
+
+	for (q = 0; q < usbi->s_queue_count; q++) {
+		fifo = usbi->s_queue[q].q_fifo;
+		if (fifo->f_free < EXT3u_QUEUE_HIGH_ROOM(fifo, usb->s_block_size))
+			return 1;
 	}
+	return 0;
+}
 
-	/* Free enough space in the queue for the new entry. */
-	/* Keep the sum of data blocks below the value 'd_max_size'.*/
+/**
+ * @brief Free the old entries until the saved data is below the low 
+ * watermark and every queue has enough room. A queue is locked for
+ * 's_evict_batch' entries at most, so the unlinks using it do not 
+ * wait for long.
+ *
+ * @param sb The superblock of the filesystem.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
+ */
+static int ext3u_evict(struct super_block * sb)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct ext3u_super_block * usb = usbi->s_usb;
+	struct inode * u_inode = usbi->s_undel_inode;
+	struct buffer_head * bh = usbi->s_usbh;
+	struct ext3u_queue * q;
+	__u32 room;
+	__u64 size;
+	handle_t * handle;
+	unsigned int i;
+	int err = 0;
 
-	while ( (usb->s_fifo.f_free < de->d_size) || ((usb->s_del.d_current_size + de->d_inode.i_size) > usb->s_del.d_max_size) ) {
-		
-		dh = ext3u_get_first_entry(u_inode, usb);
-		if (IS_ERR(dh)) {
-			ext3u_debug("Cannot get the first entry");
-			iput(dir);
-			return PTR_ERR(dh);
-		}	
-		ext3u_print_entry(dh);
-		ext3u_delete_entry(handle, u_inode, dh);
-		ext3u_update_superblock(usb, dh, EXT3u_UPDATE_DELETE);
+	size = ext3u_headroom(usbi, 0);
 
-		/* Update the first entry of the FIFO queue. */
-		if (!EXT3u_FIFO_EMPTY(usb)) {
-			ext3u_update_entry(NULL, u_inode, &(usb->s_fifo.f_first), &record, EXT3u_UPDATE_PREVIOUS);
-		}	
+	for (i = 0; i < usbi->s_queue_count && !err; i++) {
+		q = &usbi->s_queue[i];
+		room = EXT3u_QUEUE_LOW_ROOM(q->q_fifo, usb->s_block_size);
 
-		/* Use a new inode to restore the old one and then free the data blocks. */
-		handle = ext3_journal_start(dir, EXT3_DELETE_TRANS_BLOCKS(dir->i_sb));
+		if (q->q_fifo->f_free >= room && !ext3u_over_max_size(usbi, size, 0))
+			continue;
 
+		/* Same order as an unlink: the lock, then the handle. */
+		mutex_lock(&q->q_mutex);
+		handle = ext3_journal_start(u_inode, EXT3_DELETE_TRANS_BLOCKS(sb) + 
+											EXT3u_SAVE_TRANS_BLOCKS(sb));
 		if (IS_ERR(handle)) {
-			iput(dir);
-			kfree(dh);
+			mutex_unlock(&q->q_mutex);
 			return PTR_ERR(handle);
 		}
-		
-		inode = ext3_new_inode(handle, dir, mode);
-		if (IS_ERR(inode)) {
-			iput(dir);
-			ext3_journal_stop(handle);
-			kfree(dh);
-			return PTR_ERR(inode);
-		}
-	
-		/* Restore the previously deleted inode. */
-		ext3u_restore_inode(NULL, inode, dh);
-	
-		/* Delete the inode and free the data blocks. */
-		drop_nlink(inode);	
-		iput(inode);
-		ext3_journal_stop(handle);
 
-		kfree(dh);
+		err = ext3_journal_get_write_access(handle, bh);
+		if (!err)
+			err = ext3u_free_old_entries(handle, q, u_inode, bh, room, size, 
+											 ACCESS_ONCE(usbi->s_evict_batch), NULL);
+
+		ext3_journal_stop(handle);
+		mutex_unlock(&q->q_mutex);
 	}
+	return err;
+}
 
-	brelse(bh);
-	iput(dir);
-	return 0;	
+/**
+ * @brief The eviction thread, one for each mounted filesystem. It is
+ * woken up by ext3u_save() when the high watermark is crossed, so an
+ * unlink frees the old entries itself only when the FIFO is full.
+ */
+static int ext3u_evict_thread(void * data)
+{
+	struct super_block * sb = data;
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	int err;
+
+	while (!kthread_should_stop()) {
+
+		wait_event_interruptible(usbi->s_evict_wait, 
+								 kthread_should_stop() || ext3u_need_evict(sb));
+		if (kthread_should_stop())
+			break;
+
+		err = ext3u_evict(sb);
+		if (err) {
+			printk(KERN_WARNING "EXT3u-fs: eviction failed on %s (%d)\n", sb->s_id, err);
+			/* Do not spin on a failing filesystem. */
+			schedule_timeout_interruptible(HZ);
+		}
+		cond_resched();
+	}
+	return 0;
 }
 
 /**
@@ -789,7 +4218,12 @@ int ext3u_permission(unsigned int uid, umode_t mode, int mask)
 
 int ext3u_restore_inode(handle_t * handle, struct inode * inode, struct ext3u_del_entry * de)
 {
-	struct ext3_inode * raw_inode = &(de->d_inode);
+	return __ext3u_restore_inode(inode, &(de->d_inode));
+}
+
+/* Fill an in-memory inode from the copy saved in an entry. */
+static int __ext3u_restore_inode(struct inode * inode, struct ext3_inode * raw_inode)
+{
 	struct ext3_inode_info *ei = EXT3_I(inode);
 	int block;
 
@@ -813,7 +4247,8 @@ int ext3u_restore_inode(handle_t * handle, struct inode * inode, struct ext3u_de
 
 	ei->i_state = 0;
 	ei->i_dir_start_lookup = 0;
-	ei->i_dtime = le32_to_cpu(raw_inode->i_dtime);
+	/* The saved dtime is the deletion time of the entry. */
+	ei->i_dtime = 0;
 
 	inode->i_blocks = le32_to_cpu(raw_inode->i_blocks);
 	ei->i_flags = le32_to_cpu(raw_inode->i_flags);
@@ -862,76 +4297,311 @@ int ext3u_restore_inode(handle_t * handle, struct inode * inode, struct ext3u_de
 	return 0;
 }
 
+/**
+ * @brief Take the lock of a FIFO queue before deleting a file. Like 
+ * i_mutex in ext3, the lock must be taken before the transaction is 
+ * started: the handle can then be extended or restarted while holding it.
+ * The queue of the current CPU is tried first, then any idle queue; we
+ * wait only when all of them are busy.
+ *
+ * @param sb The superblock of the filesystem.
+ *
+ * @return The locked queue, NULL if undelete is disabled.
+ */
+struct ext3u_queue * ext3u_lock_fifo(struct super_block * sb)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct ext3u_queue * q;
+	unsigned int i, first;
+
+	if (EXT3_HAS_INCOMPAT_FEATURE(sb, EXT3u_FEATURE_COMPAT_UNDELETE)){
+		return NULL;
+	}
+
+	if (!usbi->s_undel_inode) {
+		return NULL;
+	}
+
+	first = raw_smp_processor_id() % usbi->s_queue_count;
+	for (i = 0; i < usbi->s_queue_count; i++) {
+		q = &usbi->s_queue[(first + i) % usbi->s_queue_count];
+		if (mutex_trylock(&q->q_mutex))
+			return q;
+	}
+
+	q = &usbi->s_queue[first];
+	mutex_lock(&q->q_mutex);
+	return q;
+}
+
+/**
+ * @brief Release the lock taken by ext3u_lock_fifo().
+ *
+ * @param q The locked queue, can be NULL.
+ */
+void ext3u_unlock_fifo(struct ext3u_queue * q)
+{
+	if (!q)
+		return;
+
+	mutex_unlock(&q->q_mutex);
+}
+
+/**
+ * @brief Lock all the FIFO queues, in order, for the commands walking
+ * or changing more than one of them. As ext3u_lock_fifo(), it must be
+ * called before starting a transaction.
+ *
+ * @param sb The superblock of the filesystem.
+ */
+void ext3u_lock_all(struct super_block * sb)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	unsigned int q;
+
+	for (q = 0; q < usbi->s_queue_count; q++)
+		mutex_lock_nested(&usbi->s_queue[q].q_mutex, q);
+}
+
+void ext3u_unlock_all(struct super_block * sb)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	unsigned int q;
+
+	for (q = usbi->s_queue_count; q > 0; q--)
+		mutex_unlock(&usbi->s_queue[q - 1].q_mutex);
+}
+
+/**
+ * @brief Check if a file is left out of the FIFO: bigger than allowed,
+ * matched by a skip rule, or bigger than a whole budget, which would 
+ * wipe its owner out.
+ */
+static int ext3u_save_skipped(struct ext3u_sb_info * usbi, struct inode * inode, const char * path, __u64 size)
+{
+	struct ext3u_super_block * usb = usbi->s_usb;
+	int kind;
+
+	if (i_size_read(inode) > ext3u_max_file_size(usbi))
+		return 1;
+
+	if (ext3u_skip_file(usbi, path, i_size_read(inode)))
+		return 1;
+
+	for (kind = 0; kind < EXT3u_OWNER_KINDS; kind++) {
+		if (usb->s_budget[kind] && size > usb->s_budget[kind])
+			return 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Check if some old entries must go before a new one is saved in
+ * 'q': the queue has less than 'room' bytes free, the saved data would 
+ * go over 'd_max_size', or an owner of the entry over its budget.
+ */
+static int ext3u_need_room(struct ext3u_sb_info * usbi, struct ext3u_queue * q, __u32 room, __u64 size, __u32 * key)
+{
+	struct ext3u_owner * o;
+	__u64 budget;
+	int kind, need = 0;
+
+	if (q->q_fifo->f_free < room || ext3u_over_max_size(usbi, size, 0))
+		return 1;
+
+	if (!usbi->s_owned)
+		return 0;
+
+	spin_lock(&usbi->s_owner_lock);
+	for (kind = 0; kind < EXT3u_OWNER_KINDS && !need; kind++) {
+		budget = usbi->s_usb->s_budget[kind];
+		if (!budget)
+			continue;
+		o = ext3u_owner_get(&usbi->s_owners[kind], key[kind], NULL);
+		need = o && o->o_size + size > budget;
+	}
+	spin_unlock(&usbi->s_owner_lock);
+	return need;
+}
+
+/**
+ * @brief Make room in 'q' for the entry of a file about to be deleted.
+ * The old entries are freed in transactions of their own, with the queue
+ * locked and before the caller starts its handle: ext3u_save() then fits
+ * in the credits reserved by the caller, and the unlink handle is never
+ * extended or restarted half way through.
+ *
+ * @param q The queue locked with ext3u_lock_fifo().
+ * @param dentry The dentry being deleted, replaced by a rename or truncated to zero.
+ * @param path The full path of 'dentry', 'length' bytes long.
+ * @param size The bytes of data of the file, 0 for a directory.
+ *
+ * @return Returns zero on success, a negative error code otherwise. The
+ * file is deleted anyway; ext3u_save() does not save it without room.
+ */
+static int ext3u_make_room(struct ext3u_queue * q, struct dentry * dentry, const char * path, int length, __u64 size)
+{
+	struct super_block * sb = dentry->d_sb;
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct inode * u_inode = usbi->s_undel_inode;
+	handle_t * handle;
+	__u32 room, owner[EXT3u_OWNER_KINDS];
+	int err;
+
+	if (sb->s_flags & MS_RDONLY)
+		return 0;
+
+	/* The compact encoding of the entry is never bigger. */
+	room = EXT3u_DEL_ENTRY_SIZE + length + 1;
+	ext3u_owner_key(path, dentry->d_inode->i_uid, owner);
+	if (!ext3u_need_room(usbi, q, room, size, owner))
+		return 0;
+
+	handle = ext3_journal_start(u_inode, EXT3_DELETE_TRANS_BLOCKS(sb) + 
+										EXT3u_SAVE_TRANS_BLOCKS(sb));
+	if (IS_ERR(handle))
+		return PTR_ERR(handle);
+
+	err = ext3_journal_get_write_access(handle, usbi->s_usbh);
+	if (!err)
+		err = ext3u_free_old_entries(handle, q, u_inode, usbi->s_usbh, room, size, 0, owner);
+	ext3_journal_stop(handle);
+	return err;
+}
+
+/**
+ * @brief Get ready to save a file about to be deleted: unless the file
+ * is left out of the FIFO, write back its pages, lock a queue and make
+ * room there. A skipped file costs only the lookup of its path, and 
+ * never waits for a queue.
+ *
+ * @param dentry The dentry being deleted, replaced by a rename or truncated to zero.
+ * @param type The type of the entry, EXT3u_ENTRY_FILE or EXT3u_ENTRY_DIR.
+ *
+ * @return The locked queue to pass to ext3u_save(), then to 
+ * ext3u_unlock_fifo(); NULL if the file is not saved.
+ */
+struct ext3u_queue * ext3u_lock_save(struct dentry * dentry, int type)
+{
+	struct super_block * sb = dentry->d_sb;
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct ext3u_queue * q = NULL;
+	struct ext3u_del_entry * de;
+	__u64 size;
+	int length;
+
+	if (EXT3_HAS_INCOMPAT_FEATURE(sb, EXT3u_FEATURE_COMPAT_UNDELETE) || !usbi->s_undel_inode)
+		return NULL;
+
+	de = ext3u_alloc_entry(GFP_NOFS);
+	if (!de)
+		return NULL;
+
+	length = ext3u_get_full_path(dentry, de->d_path);
+	if (length < 0)
+		goto out;
+
+	size = type == EXT3u_ENTRY_DIR ? 0 : i_size_read(dentry->d_inode);
+	if (ext3u_save_skipped(usbi, dentry->d_inode, de->d_path, size)) {
+		atomic_long_inc(&usbi->s_stats.s_skipped);
+		goto out;
+	}
+
+	/* The dirty pages would be dropped with the inode, and the */
+	/* saved blocks would keep whatever they held before.       */
+	if (type != EXT3u_ENTRY_DIR)
+		filemap_write_and_wait(dentry->d_inode->i_mapping);
+
+	q = ext3u_lock_fifo(sb);
+	if (q)
+		ext3u_make_room(q, dentry, de->d_path, length, size);
+
+out:
+	ext3u_free_entry(de);
+	return q;
+}
+
 /**	
  * @brief Save a file in the FIFO list before beeing deleted.
+ * The entry is written in the caller's transaction, together with the 
+ * unlink itself: after a crash either both are replayed or none of them.
  *
- * @param handle The handle of this transaction.
- * @param dentry The the dentry being deleted.
- * @param type The type of this entry on the FIFO queue (now only EXT3u_ENTRY_FILE is supported).
+ * @param h The handle of this transaction, or NULL to open a new one. 
+ * @param q The queue where the entry goes. A caller passing its own
+ * handle must have got it from ext3u_lock_save() before the handle 
+ * was started; it is ignored when 'h' is NULL.
+ * @param dentry The the dentry being deleted, replaced by a rename or truncated to zero.
+ * @param type The type of this entry on the FIFO queue, EXT3u_ENTRY_FILE or EXT3u_ENTRY_DIR.
  * 
  * @return Returns zero on success, otherwise an integer indicating the error.
  */
-int ext3u_save(handle_t * h, struct dentry * dentry, int type)
+int ext3u_save(handle_t * h, struct ext3u_queue * q, struct dentry * dentry, int type)
 {
+	struct ext3u_sb_info * usbi;
+	struct ext3u_fifo_info * fifo;
 	struct inode * u_inode;
+	struct super_block * sb = dentry->d_sb;
 	struct ext3_iloc iloc;
 	struct ext3u_super_block * usb;
-	struct ext3u_del_entry * new_entry = &ext3u_de_save;
+	struct ext3u_del_entry * new_entry;
 	struct ext3u_record r_target, r_update;
 	struct buffer_head * bh, *blk_bh;
 	struct ext3_inode * raw_inode;
 	handle_t * handle;
-	int err = 0, name_length, block, offset, remaining, to_copy;
-	int end_offset = 0, end_block = 0;
-	char * buf, *src, *dest;
+	int err = 0, block, offset, remaining, to_copy;
+	int end_offset = 0, end_block = 0, first = 1;
+	char *src, *dest;
+	__u32 owner[EXT3u_OWNER_KINDS];
+	__u64 size;
 
-	if (EXT3_HAS_INCOMPAT_FEATURE(dentry->d_sb, EXT3u_FEATURE_COMPAT_UNDELETE)){
+	if (EXT3_HAS_INCOMPAT_FEATURE(sb, EXT3u_FEATURE_COMPAT_UNDELETE)){
 		return 0;
 	}
 	
-	buf = kmalloc(PATH_MAX+1, GFP_KERNEL);
-	if (!buf) {
+	/* The caller may already hold a handle. */
+	new_entry = ext3u_alloc_entry(GFP_NOFS);
+	if (!new_entry) {
 		return  -ENOMEM;
 	}
 
-	memset(buf, 0, PATH_MAX+1);
+	/* Initialize and fill the entry */ 
+	memset(new_entry, 0, sizeof(struct ext3u_del_entry));
 
-	/* Read the ext3u root inode */
-	u_inode = ext3_iget(dentry->d_sb, EXT3u_UNDEL_DIR_INO);
-	if (IS_ERR(u_inode)) {
+	/* The ext3u root inode and superblock are pinned at mount time. */
+	usbi = EXT3u_SB(sb);
+	u_inode = usbi->s_undel_inode;
+	bh = usbi->s_usbh;
+	usb = usbi->s_usb;
+	if (!u_inode) {
 		err = -ENOENT;
 		goto free_and_exit;
 	}
-	
-	ext3u_lock(u_inode);
-
-	/* Read the ext3u superblock. */
-	bh = ext3_bread(NULL, u_inode, 0, 0, &err);
-	if (!bh) {
-		goto err_exit;
-	}
-	
-	usb = (struct ext3u_super_block *) bh->b_data;	
 
-	/* Ignore this file if its size is bigger than allowed.  */
-	if (new_entry->d_inode.i_size > usb->s_del.d_max_size) {
-		goto err_exit;
+	/* The lock is taken before starting the transaction, so a */
+	/* restart can never wait for somebody waiting for us.     */
+	if (h == NULL) {
+		q = ext3u_lock_save(dentry, type);
+		if (!q) {
+			err = 0;
+			goto free_and_exit;
+		}
+		handle = ext3_journal_start(u_inode, EXT3u_SAVE_TRANS_BLOCKS(sb));
+		if (IS_ERR(handle)) {
+			err = PTR_ERR(handle);
+			ext3u_unlock_fifo(q);
+			goto free_and_exit;
+		}
+	} else {
+		handle = h;
 	}
+	fifo = q->q_fifo;
 
-	brelse(bh);
-	
 	/* Get the full path of the file */
-	if ((err = ext3u_get_full_path(dentry, buf, &name_length))) {
-		goto err_exit;
-	}
-		
-	/* Check if this entry should be skipped  */
-	if ((err = ext3u_skip_file(u_inode, buf))) {
+	err = ext3u_get_full_path(dentry, new_entry->d_path);
+	if (err < 0) {
 		goto err_exit;
 	}
-
-	/* Initialize and fill the entry */ 
-	memset(new_entry, 0, sizeof(struct ext3u_del_entry));
+	new_entry->d_path_length = err;
 
 	/* Save the inode state. */
 	err = ext3_get_inode_loc(dentry->d_inode, &iloc);
@@ -941,26 +4611,46 @@ int ext3u_save(handle_t * h, struct dentry * dentry, int type)
 
 	raw_inode = ext3_raw_inode(&iloc);
 	memcpy(&(new_entry->d_inode), raw_inode, sizeof(struct ext3_inode));
-
-	/* We must zero this, avoiding ext3_truncate() to be called. */
-	dentry->d_inode->i_blocks = 0;
-	dentry->d_inode->i_size = 0;
-	EXT3_I(dentry->d_inode)->i_disksize = 0;
-
-	/* Copy the path. */
-	new_entry->d_path_length = strlen(buf);
-	strncpy(new_entry->d_path, buf, PATH_MAX);
+	brelse(iloc.bh);
+
+	/* The inode is still alive: its dtime keeps the deletion time. */
+	new_entry->d_inode.i_dtime = cpu_to_le32(get_seconds());
+
+	/* A directory is empty by now and keeps its blocks: */
+	/* only its attributes are saved.                     */
+	if (type == EXT3u_ENTRY_DIR) {
+		memset(new_entry->d_inode.i_block, 0, sizeof(new_entry->d_inode.i_block));
+		new_entry->d_inode.i_blocks = 0;
+		new_entry->d_inode.i_size = 0;
+		new_entry->d_inode.i_size_high = 0;
+	}
 
 	/* Calculate the hash. */
-	new_entry->d_hash = ext3u_hash(buf, new_entry->d_path_length);
+	new_entry->d_hash = ext3u_hash(new_entry->d_path, new_entry->d_path_length);
 	new_entry->d_uid = dentry->d_inode->i_uid;
 	new_entry->d_mode = dentry->d_inode->i_mode;
 
+	/* The owners are known now: the compact encoding moves the path. */
+	ext3u_owner_key(new_entry->d_path, new_entry->d_uid, owner);
+
 	/* Set the type. */
 	new_entry->d_type = type;
 
-	/* Set the size in byte of this new entry. */
-	new_entry->d_size = EXT3u_DEL_ENTRY_SIZE + strlen(buf) + 1;
+	/* Set the size in byte of this new entry; a compact entry */
+	/* can only get smaller once its base is known.            */
+	if (EXT3u_HAS_FEATURE_COMPACT(usb->s_flags))
+		new_entry->d_size = EXT3u_COMPACT_ENTRY_SIZE(ext3u_compact_blocks(&(new_entry->d_inode)), 
+													 new_entry->d_path_length);
+	else
+		new_entry->d_size = EXT3u_DEL_ENTRY_SIZE + new_entry->d_path_length + 1;
+	size = ext3u_entry_size(new_entry);
+
+	/* Check if this entry should be skipped. */
+	if (ext3u_save_skipped(usbi, dentry->d_inode, new_entry->d_path, size)) {
+		atomic_long_inc(&usbi->s_stats.s_skipped);
+		err = 0;
+		goto err_exit;
+	}
 	
 	/* Now we have to write this entry in the FIFO queue. If	*/
 	/* the queueu is full, then we have to free some entries 	*/
@@ -976,51 +4666,51 @@ int ext3u_save(handle_t * h, struct dentry * dentry, int type)
 	/* 2) If we reached the max size of allowed data blocks, as specified by user at */
 	/* file system creation time; therefore we must free some of the oldest files.*/
 
-
-	if (ext3u_free_old_entries(u_inode, new_entry)) {
+	/* ext3u_make_room() has freed them before the handle was started, */
+	/* nothing is evicted here. The lock kept the room of 'q'; a save   */
+	/* in another queue may take some of the size freed meanwhile, and  */
+	/* the eviction thread, woken below, gives it back.                 */
+	if (fifo->f_free < new_entry->d_size) {
+		atomic_long_inc(&usbi->s_stats.s_skipped);
+		err = -ENOSPC;
 		goto err_exit;
 	}
 
-	/* Read the ext3u superblock. */
-	bh = ext3_bread(NULL, u_inode, 0, 0, &err);
-	if (!bh) {
+	err = ext3_journal_get_write_access(handle, bh);
+	if (err) {
 		goto err_exit;
 	}
-	
-	usb = (struct ext3u_super_block *) bh->b_data;	
+
+	/* The tail does not move any more, the base can be chosen. */
+	if (EXT3u_HAS_FEATURE_COMPACT(usb->s_flags))
+		ext3u_encode_entry(u_inode, fifo, new_entry);
+
+	/* Entries of different queues are ordered by this number. */
+	new_entry->d_queue = q->q_num;
+	write_seqlock(&usbi->s_del_lock);
+	new_entry->d_seq = usb->s_seq++;
+	write_sequnlock(&usbi->s_del_lock);
+	/* A read-only mount could not mark the FIFO. */
+	usb->s_flags |= EXT3u_FEATURE_SEQ;
 
 	/* We can finally write, there is enough free space in the FIFO*/
 	/* Update FIFO pointers. */
-	new_entry->d_previous.r_block = usb->s_fifo.f_last.r_block;
-	new_entry->d_previous.r_offset = usb->s_fifo.f_last.r_offset;
-	new_entry->d_previous.r_size = usb->s_fifo.f_last.r_size;
+	new_entry->d_previous.r_block = fifo->f_last.r_block;
+	new_entry->d_previous.r_real_block = fifo->f_last.r_real_block;
+	new_entry->d_previous.r_offset = fifo->f_last.r_offset;
+	new_entry->d_previous.r_size = fifo->f_last.r_size;
 	new_entry->d_next.r_block = 0;
 	new_entry->d_next.r_offset = 0;
 	new_entry->d_next.r_size = 0;
 	
-	block = usb->s_fifo.f_last_block;
-	offset = usb->s_fifo.f_last_offset;
+	block = fifo->f_last_block;
+	offset = fifo->f_last_offset;
 
 	blk_bh = ext3_bread(NULL, u_inode, block, 0, &err);
 	if (!blk_bh) {
 		goto err_exit;
 	}	
 
-	/* First entry in the FIFO ? */
-	if (EXT3u_FIFO_NULL((&usb->s_fifo.f_first))) {
-
-		usb->s_fifo.f_first.r_block = block;
-		usb->s_fifo.f_first.r_real_block = blk_bh->b_blocknr;
-		usb->s_fifo.f_first.r_size = new_entry->d_size; 
-		usb->s_fifo.f_first.r_offset = offset;
-	}
-
-	/* This is the first entry starting in this */
-	/* block so we must update the block header.*/
-	if (*((int*)blk_bh->b_data) == 0) {
-		*((int*)blk_bh->b_data) = offset;
-	}
-
 	r_update.r_block = block;
 	r_update.r_real_block = blk_bh->b_blocknr;
 	r_update.r_offset = offset;
@@ -1029,21 +4719,29 @@ int ext3u_save(handle_t * h, struct dentry * dentry, int type)
 	src = (char*) new_entry;
 	remaining = new_entry->d_size;
 
-	handle = ext3_journal_start(u_inode, EXT3_SINGLEDATA_TRANS_BLOCKS);
-	if (IS_ERR(handle)) {
-		goto err_exit;
-	}
-		
 	while (remaining > 0) {
 	
+		err = ext3_journal_get_write_access(handle, blk_bh);
+		if (err) {
+			brelse(blk_bh);
+			goto err_exit;
+		}
+
+		/* The block header is the first entry starting in the block, */
+		/* zero in the blocks an entry only goes on in: the headers   */
+		/* left by the previous round of the queue are overwritten.   */
+		if (!first)
+			*((__u32 *)blk_bh->b_data) = 0;
+		else if (EXT3u_FIFO_NULL(&(fifo->f_last)) || fifo->f_last.r_block != block)
+			*((__u32 *)blk_bh->b_data) = offset;
+		first = 0;
+
 		dest = (char*) (blk_bh->b_data + offset);
 		to_copy = MIN(usb->s_block_size - offset, remaining);	
 
 		memcpy(dest, src, to_copy);
 		
-		ext3_journal_get_write_access(handle, blk_bh);
 		ext3_journal_dirty_metadata(handle, blk_bh);
-		sync_dirty_buffer(blk_bh);
 		brelse(blk_bh);
 
 		src+=to_copy;
@@ -1052,7 +4750,7 @@ int ext3u_save(handle_t * h, struct dentry * dentry, int type)
 
 		/* We need at least another block. */
 		if (remaining) {		
-			block = (block % usb->s_fifo.f_blocks) + 1;
+			block = ext3u_next_block(fifo, block);
 			offset = EXT3u_BLOCK_HEADER_SIZE;
 			blk_bh = ext3_bread(NULL, u_inode, block, 0, &err);
 			if (!blk_bh) {
@@ -1062,50 +4760,90 @@ int ext3u_save(handle_t * h, struct dentry * dentry, int type)
 	}
 	end_block = block;
 
-	if ((usb->s_block_size - end_offset) < EXT3u_WRITE_MIN) {
-		usb->s_fifo.f_free -= (usb->s_block_size - end_offset);
-		end_block = (end_block % usb->s_fifo.f_blocks) + 1;
-		end_offset = EXT3u_BLOCK_HEADER_SIZE;
-	}
-
 	/* If this isn't the first entry, update the 'next' fifo pointer. */
-	if (!EXT3u_FIFO_NULL(&(usb->s_fifo.f_last))){
-		r_target.r_block = usb->s_fifo.f_last.r_block;
-		r_target.r_real_block = usb->s_fifo.f_last.r_real_block;
-		r_target.r_offset = usb->s_fifo.f_last.r_offset;
-		r_target.r_size = usb->s_fifo.f_last.r_size;
+	if (!EXT3u_FIFO_NULL(&(fifo->f_last))){
+		r_target.r_block = fifo->f_last.r_block;
+		r_target.r_real_block = fifo->f_last.r_real_block;
+		r_target.r_offset = fifo->f_last.r_offset;
+		r_target.r_size = fifo->f_last.r_size;
 
-		err = ext3u_update_entry(NULL, u_inode, &r_target, &r_update, EXT3u_UPDATE_NEXT);
+		err = ext3u_update_entry(handle, u_inode, &r_target, &r_update, EXT3u_UPDATE_NEXT);
 		if (err) {
 			goto err_exit;
 		}	
 	}	
 
+	/* First entry in the FIFO ? */
+	if (EXT3u_FIFO_NULL((&fifo->f_first))) {
+		fifo->f_first.r_block = r_update.r_block;
+		fifo->f_first.r_real_block = r_update.r_real_block;
+		fifo->f_first.r_size = r_update.r_size; 
+		fifo->f_first.r_offset = r_update.r_offset;
+	}
+
+	if ((usb->s_block_size - end_offset) < EXT3u_WRITE_MIN(usb)) {
+		fifo->f_free -= (usb->s_block_size - end_offset);
+		end_block = ext3u_next_block(fifo, end_block);
+		end_offset = EXT3u_BLOCK_HEADER_SIZE;
+	}
+
 	/* Update FIFO information. */
-	usb->s_fifo.f_last.r_block = r_update.r_block;
-	usb->s_fifo.f_last.r_real_block = r_update.r_real_block;
-	usb->s_fifo.f_last.r_offset = r_update.r_offset;
-	usb->s_fifo.f_last.r_size = r_update.r_size;
-	usb->s_fifo.f_last_block = end_block;
-	usb->s_fifo.f_last_offset = end_offset;
-	usb->s_fifo.f_free -= new_entry->d_size; 
-	usb->s_del.d_file_count++;
-	usb->s_del.d_current_size += new_entry->d_inode.i_size;
-
-	/* Write the ext3u superblock. */
-	ext3_journal_get_write_access(handle, bh);
+	fifo->f_last.r_block = r_update.r_block;
+	fifo->f_last.r_real_block = r_update.r_real_block;
+	fifo->f_last.r_offset = r_update.r_offset;
+	fifo->f_last.r_size = r_update.r_size;
+	fifo->f_last_block = end_block;
+	fifo->f_last_offset = end_offset;
+	fifo->f_free -= new_entry->d_size; 
+
+	write_seqlock(&usbi->s_del_lock);
+	if (type == EXT3u_ENTRY_DIR)
+		usb->s_del.d_dir_count++;
+	else
+		usb->s_del.d_file_count++;
+	usb->s_del.d_current_size += size;
+	write_sequnlock(&usbi->s_del_lock);
+
+	atomic_long_inc(type == EXT3u_ENTRY_DIR ? &usbi->s_stats.s_saved_dirs : &usbi->s_stats.s_saved_files);
+	if (type != EXT3u_ENTRY_DIR)
+		atomic_long_inc(&usbi->s_stats.s_sizes[ext3u_stats_class(size)]);
+	atomic_long_add(new_entry->d_size, &usbi->s_stats.s_used);
+
+	ext3u_index_insert(handle, u_inode, usb, new_entry->d_hash, &r_update);
+	ext3u_owner_add(usbi, owner, &r_update, size);
+
+	/* The ext3u superblock is written with the transaction. */
 	ext3_journal_dirty_metadata(handle, bh);
-	sync_dirty_buffer(bh);
-	brelse(bh);
 
-	ext3_journal_stop(handle);
+	/* The next evictions are left to the eviction thread. */
+	if (ext3u_need_evict(sb))
+		wake_up(&usbi->s_evict_wait);
+
+	/* The data blocks belong to the FIFO now: the inode     */
+	/* forgets them, so that a truncate finds nothing to free */
+	/* and a file truncated to zero can keep living. Only an  */
+	/* extended attribute block is left to the inode. The     */
+	/* caller marks the inode dirty in this same handle.      */
+	if (type == EXT3u_ENTRY_FILE) {
+		struct inode * inode = dentry->d_inode;
+
+		mutex_lock(&EXT3_I(inode)->truncate_mutex);
+		memset(EXT3_I(inode)->i_data, 0, sizeof(EXT3_I(inode)->i_data));
+		inode->i_blocks = EXT3_I(inode)->i_file_acl ? (inode->i_sb->s_blocksize >> 9) : 0;
+		i_size_write(inode, 0);
+		EXT3_I(inode)->i_disksize = 0;
+		mutex_unlock(&EXT3_I(inode)->truncate_mutex);
+		ext3_discard_reservation(inode);
+	}
 
 err_exit:
-	ext3u_unlock(u_inode);
-	iput(u_inode);
+	if (h == NULL) {
+		ext3_journal_stop(handle);
+		ext3u_unlock_fifo(q);
+	}
 
 free_and_exit:
-	kfree(buf);
+	ext3u_free_entry(new_entry);
 	return err;
 }
 
@@ -1122,6 +4860,7 @@ free_and_exit:
  * @param start The entry in the FIFO from which we start searching.
  * @param end The entry in the FIFO list where we stop the search.
  * @param path The path of the file's entry we are looking for.
+ * @param de The buffer where the entry is copied.
  * @entries It returns the number of the entries seen during the search.
  * 
  * @return On success it returns a pointer to the entry found, an error otherwise. 
@@ -1133,105 +4872,136 @@ static struct ext3u_del_entry * ext3u_search_entry(handle_t * handle,
 												 struct ext3u_record * start, 
 												 struct ext3u_record * end, 
 												 const char * path,
+												 struct ext3u_del_entry * de,
 												 int * entries)
 {	
-	struct buffer_head * bh;
+	struct ext3u_cursor cur;
 	struct ext3u_del_entry_header * dh;
-	struct ext3u_del_entry * de = &ext3u_de_remove;
-
-	int err, remaining, to_copy, copied;
-	unsigned int block, block_size, hash;
-	__u16 offset;
-	void *src, *dest;
-
-	memset(de, 0, sizeof(struct ext3u_del_entry));
+	struct ext3u_del_entry * e, * found = ERR_PTR(-ENOENT);
+	unsigned int hash;
+	int err;
 
 	hash = ext3u_hash(path, strlen(path));
 
-	block = start->r_block;
-	offset = start->r_offset;
-	block_size = usb->s_block_size;
-
-	bh = ext3_bread(NULL, u_inode, block, 0, &err);
-	if (!bh) {
-		return ERR_PTR(-EIO);
-	}
+	ext3u_cursor_init(&cur, u_inode, usb, start, 0);
 
 	do {	
-		/* The header cannot be splitted across blocks. */
-		dh = (struct ext3u_del_entry_header *) (bh->b_data + offset);
+		dh = ext3u_cursor_header(&cur);
+		if (IS_ERR(dh)) {
+			found = ERR_CAST(dh);
+			break;
+		}
 		(*entries)++;
 
 		/* First check the hash. */
 		if (dh->d_hash == hash) {
-				
-			dest = (void*) de;
-			src = (void*)(bh->b_data + offset);
 
-			memcpy(dest, src, EXT3u_DEL_HEADER_SIZE);
+			e = ext3u_cursor_entry(&cur, de);
+			if (IS_ERR(e)) {
+				found = e;
+				break;
+			}
+
+			/* Now we can check the paths. */		
+			if (!strncmp(path, e->d_path, PATH_MAX)) { 
+				ext3u_cursor_keep(e, de);
+
+				/* Check if user has the permission to restore this file */
+				if (ext3u_permission(de->d_uid, de->d_mode, MAY_WRITE) == -EPERM)
+					found = ERR_PTR(-EPERM);
+				else
+					found = de;
+				break;
+			}
+		}
+
+		/* This was the last entry of the list. */
+		err = ext3u_cursor_next(&cur);
+		if (err) {
+			if (err != -ENOENT)
+				found = ERR_PTR(err);
+			break;
+		}
+		
+	} while ( (cur.c_record.r_block != end->r_block || cur.c_record.r_offset != end->r_offset) );
+		
+	ext3u_cursor_release(&cur);
+	return found;
+}
+
+
+/**
+ * @brief Walk one FIFO queue backward, from its last entry, looking 
+ * for 'path'. Only the header of each entry is read, the rest only 
+ * when the hash of the path matches.
+ *
+ * @param u_inode The ext3u root inode.
+ * @param usb Pointer to the ext3u superblock.
+ * @param fifo The queue to walk.
+ * @param path The path of the file we are looking for.
+ * @param hash The hash of 'path'.
+ * @param de The buffer where the entry is copied.
+ * @param found It returns the position of the entry in the FIFO list.
+ * @param blocks It returns the number of blocks read.
+ *
+ * @return Returns zero if found, -ENOENT or another error otherwise.
+ */
+static int ext3u_find_in_queue(struct inode * u_inode,
+							   struct ext3u_super_block * usb,
+							   struct ext3u_fifo_info * fifo,
+							   const char * path,
+							   __u32 hash,
+							   struct ext3u_del_entry * de,
+							   struct ext3u_record * found,
+							   int * blocks)
+{
+	struct ext3u_cursor cur;
+	struct ext3u_del_entry_header * dh;
+	struct ext3u_del_entry * e;
+	__u32 entries, total_entries;
+	int err = -ENOENT;
+
+	total_entries = EXT3u_ENTRY_COUNT(usb);
+	ext3u_cursor_init(&cur, u_inode, usb, &(fifo->f_last), 1);
 
-			remaining =	de->d_size - EXT3u_DEL_HEADER_SIZE; 
-			copied = EXT3u_DEL_HEADER_SIZE;
-			offset += EXT3u_DEL_HEADER_SIZE;
-			dest += copied;
+	for (entries = 0; !EXT3u_FIFO_NULL(&(cur.c_record)) && entries < total_entries; entries++) {
 
-			/* The rest of the entry could be splited across    */
-			/* two or more blocks, so loop until read all the   */
-			/* bytes, eventualy reading more consecutive blocks */
-				
-			while (remaining > 0) {
-			
-				to_copy = MIN(block_size - offset, remaining);
+		dh = ext3u_cursor_header(&cur);
+		if (IS_ERR(dh)) {
+			err = PTR_ERR(dh);
+			goto out;
+		}
 
-				src = (void *) (bh->b_data + offset);
-				memcpy(dest, src, to_copy);
-				dest+= to_copy;
-	
-				offset = (offset + to_copy) % block_size;
-				copied += to_copy;
-				remaining -= to_copy;
+		/* First check the hash, then the path. */
+		if (dh->d_hash == hash) {
 			
-				/* If we reach the end of the block and */
-				/* start reading from the next block.  */
-				if ((offset == 0) && (remaining != 0)) {	
-					offset = EXT3u_BLOCK_HEADER_SIZE;
-					block = (block) % usb->s_fifo.f_blocks + 1;
-
-					bh = ext3_bread(NULL, u_inode, block, 0, &err);
-					if (!bh) {
-						return ERR_PTR(-EIO);
-					}
-				}
+			e = ext3u_cursor_entry(&cur, de);
+			if (IS_ERR(e)) {
+				err = PTR_ERR(e);
+				goto out;
 			}
-			/* Now we can check the paths. */		
-			if (!strncmp(path, de->d_path, PATH_MAX)) { 
-				/* Check if user has the permission to restore this file */
-				if (ext3u_permission(de->d_uid, de->d_mode, MAY_WRITE) == -EPERM)  {
-					return ERR_PTR(-EPERM);
-				} else
-					return de;
+
+			if (!strncmp(path, e->d_path, PATH_MAX)) { 
+				ext3u_cursor_keep(e, de);
+				memcpy(found, &(cur.c_record), EXT3u_RECORD_SIZE);
+				err = 0;
+				goto out;
 			}
 		}
-		/* Read the next entry. */
-		
-		/* Read a new block if it's different. */
-		if (dh->d_next.r_block != block) {
-			brelse(bh);
-			
-			block = dh->d_next.r_block;
 
-			bh = ext3_bread(NULL, u_inode, block, 0, &err);
-			if (!bh) {
-				return ERR_PTR(-EIO);
-			}
+		err = ext3u_cursor_next(&cur);
+		if (err && err != -ENOENT) {
+			goto out;
 		}
-		offset = dh->d_next.r_offset;
-		
-	} while ( (block != end->r_block && offset != end->r_offset) );
-		
-	return ERR_PTR(-ENOENT);
-}
+	}
+	
+	err = -ENOENT;
 
+out:
+	*blocks += cur.c_blocks;
+	ext3u_cursor_release(&cur);
+	return err;
+}
 
 /** 	
  * @brief This function is used when a file is restored. 
@@ -1239,141 +5009,254 @@ static struct ext3u_del_entry * ext3u_search_entry(handle_t * handle,
  * and going backward. We are assuming that the file the 
  * user wants to restore is one of the last deleted files.
  * This should be the most common case when un 'undelete' 
- * is needed.
+ * is needed. Each queue gives its most recent match, the
+ * most recently deleted of them is returned.
  *
  * @param handle The handle of this transaction.
  * @param u_inode The ext3u root inode.
  * @param path The path of the file we are looking for.
+ * @param de The buffer where the entry is copied.
+ * @param found It returns the position of the entry in the FIFO list.
+ * @param blocks It returns the number of blocks read.
  *
- * @return On success it returns the entry found, otherwise an error.
+ * @return On success it returns 'de', otherwise an error.
  */
 
-struct ext3u_del_entry * ext3u_find_entry(handle_t * handle, struct inode * u_inode, const char * path)
+struct ext3u_del_entry * ext3u_find_entry(handle_t * handle, 
+										  struct inode * u_inode, 
+										  const char * path,
+										  struct ext3u_del_entry * de,
+										  struct ext3u_record * found,
+										  int * blocks)
 {
-	struct buffer_head * bh;
 	struct ext3u_super_block * usb;
-	struct ext3u_record start_record, end_record;
-	struct ext3u_del_entry * de = NULL;
-	
-	int last_block, first_block, block, err, i = 0, entries = 0;
-	__u32 offset, total_entries;
-
-	/* Read the ext3u_superblock. */
-	bh = ext3_bread(NULL, u_inode, 0, 0, &err);
-	if (!bh) {
-		return ERR_PTR(-EIO);
-	}
-	
-	usb = (struct ext3u_super_block *) bh->b_data;	
-	ext3u_print_super_block(usb);
-	
-	first_block = usb->s_fifo.f_first.r_block; 
-	last_block = usb->s_fifo.f_last.r_block; 
-	total_entries = usb->s_del.d_file_count;
-	
-	block = last_block;
-	/* Circular shift on the list back of EXT3u_DISK_CACHE_SIZE positions. */
-	for (i = 0; i < EXT3u_DISK_CACHE_SIZE && block != first_block; i++) {
-		if ((--block) == 0)
-			block = usb->s_fifo.f_blocks;
-	}
-	
-	end_record.r_block =  0;
-	end_record.r_offset = 0;	
+	struct ext3u_record record;
+	__u32 hash, seq = 0;
+	unsigned int q;
+	int err, loaded = 0;
 
-	while (entries < total_entries) {
+	usb = EXT3u_SB(u_inode->i_sb)->s_usb;
 
-		do {
-			
-			/* Read the offset of the first entry in this block. */
-			bh = ext3_bread(NULL, u_inode, block, 0, &err);
-			if (!bh) {
-				ext3u_debug("Cannot read ext3u_superblock\n");
-				return ERR_PTR(-EIO);
-			}
-		
-			offset = *((unsigned int *)bh->b_data);
-			brelse(bh);
+	memset(found, 0, EXT3u_RECORD_SIZE);
+	hash = ext3u_hash(path, strlen(path));
 
-			/* No entry starting in this block. */
-			if (offset == 0) {
-				if (block == last_block)
-					return ERR_PTR(-ENOENT);
-					
-				block = (block % usb->s_fifo.f_blocks) + 1;
-			} else 
-				break;
+	for (q = 0; q < EXT3u_SB(u_inode->i_sb)->s_queue_count; q++) {
 
-		} while (block != last_block);
+		err = ext3u_find_in_queue(u_inode, usb, EXT3u_QUEUE_FIFO(usb, q), path, hash, de, &record, blocks);
+		if (err == -ENOENT) {
+			loaded = 0;
+			continue;
+		}
+		if (err) {
+			return ERR_PTR(err);
+		}
 
-		start_record.r_block = block;
-		start_record.r_offset = offset;
-		
-		de = ext3u_search_entry(handle, u_inode, usb, &start_record, &end_record, path, &entries);
-			
-		if (de) 
-			return de;
-		else {
-			end_record.r_block =  start_record.r_block;
-			end_record.r_offset =  start_record.r_offset;
+		loaded = EXT3u_FIFO_NULL(found) || ext3u_seq_before(seq, de->d_seq);
+		if (loaded) {
+			memcpy(found, &record, EXT3u_RECORD_SIZE);
+			seq = de->d_seq;
 		}
+	}
 
-		block = last_block;
+	if (EXT3u_FIFO_NULL(found)) {
+		return ERR_PTR(-ENOENT);
+	}
 
-		/* Circular shift on the list back of EXT3u_DISK_CACHE_SIZE positions. */
-		for (i = 0; i < EXT3u_DISK_CACHE_SIZE && block != first_block; i++) {
-			if ((--block) == 0)
-				block = usb->s_fifo.f_blocks;
-		}
-		last_block = block;
+	/* The last entry read was not the match. */
+	if (!loaded && (err = ext3u_read_entry(u_inode, usb, found, de, NULL))) {
+		return ERR_PTR(err);
+	}
 
+	/* Check if user has the permission to restore this file */
+	if (ext3u_permission(de->d_uid, de->d_mode, MAY_WRITE) == -EPERM)  {
+		return ERR_PTR(-EPERM);
 	}
-	
-	return ERR_PTR(-ENOENT);
+
+	return de;
 }
 
 
 /**
- * @brief Walk through all entries of the FIFO list, starting from the begining,
+ * @brief Walk through all entries of the FIFO queues, starting from the begining,
  * and search the entry corresponding to 'path'.
  *
  * @param handle The handle of this transaction.
  * @param u_inode Pointer to the ext3u root inode.
  * @param path The path of the file we are looking for.
+ * @param de The buffer where the entry is copied.
  *
  * @return If found it returns the entry, otherwise an error.
  */
 
-struct ext3u_del_entry * ext3u_get_entry(handle_t * handle, struct inode * u_inode, const char * path)
+struct ext3u_del_entry * ext3u_get_entry(handle_t * handle, struct inode * u_inode, const char * path, struct ext3u_del_entry * de)
 {
-	struct buffer_head * bh;
 	struct ext3u_super_block * usb;
+	struct ext3u_fifo_info * fifo;
 	struct ext3u_record start_entry, end_entry;
+	struct ext3u_del_entry * found = ERR_PTR(-ENOENT);
+	unsigned int q;
 	
-	int err;
 	__u32 entries = 0;
 	
-	/* Read the ext3u_superblock. */
-	bh = ext3_bread(NULL, u_inode, 0, 0, &err);
-	if (!bh) {
-		return  ERR_PTR(-EIO);
-	}
-	
-	usb = (struct ext3u_super_block *) bh->b_data;	
+	usb = EXT3u_SB(u_inode->i_sb)->s_usb;
 
 	/* FIFO list is empty*/
-	if (!usb->s_del.d_file_count) {
+	if (!EXT3u_ENTRY_COUNT(usb)) {
 		return ERR_PTR(-ENOENT);
 	}
 
-	start_entry.r_block = usb->s_fifo.f_first.r_block;
-	start_entry.r_offset = usb->s_fifo.f_first.r_offset;
-
 	end_entry.r_block = 0;
 	end_entry.r_offset = 0;
 
-	return (ext3u_search_entry(handle, u_inode, usb, &start_entry, &end_entry, path, &entries));
+	for (q = 0; q < EXT3u_SB(u_inode->i_sb)->s_queue_count; q++) {
+		fifo = EXT3u_QUEUE_FIFO(usb, q);
+		if (EXT3u_FIFO_EMPTY(fifo))
+			continue;
+
+		start_entry.r_block = fifo->f_first.r_block;
+		start_entry.r_offset = fifo->f_first.r_offset;
+
+		found = ext3u_search_entry(handle, u_inode, usb, &start_entry, &end_entry, path, de, &entries);
+		if (!IS_ERR(found) || PTR_ERR(found) != -ENOENT)
+			break;
+	}
+
+	return found;
+}
+
+/**
+ * @brief Take a restored entry out of the FIFO and of the index.
+ */
+static void ext3u_urm_remove(handle_t * handle, struct inode * u_inode, struct ext3u_super_block * usb, 
+							 struct ext3u_del_entry * de, struct ext3u_record * record)
+{
+	if (EXT3u_HAS_FEATURE_INDEX(usb->s_flags))
+		ext3u_index_remove(handle, u_inode, usb, de->d_hash, record);
+	ext3u_delete_entry(handle, u_inode, de);
+
+	/* Update the ext3u_superblock. */
+	ext3u_update_superblock(EXT3u_SB(u_inode->i_sb), EXT3u_QUEUE_FIFO(usb, ext3u_record_queue(usb, record)), 
+							de, EXT3u_UPDATE_DELETE);
+	ext3u_owner_remove(EXT3u_SB(u_inode->i_sb), record);
+	atomic_long_inc(&EXT3u_SB(u_inode->i_sb)->s_stats.s_restored);
+}
+
+/**
+ * @brief Restore a directory removed by rmdir together with everything
+ * saved under it, walking all the queues twice: the files first, then 
+ * the directories, which get their attributes back once their content 
+ * is in place. 'rm -r' removes the children before their parent, so in
+ * FIFO order a directory also comes after its subdirectories.
+ * Entries of other users and files already existing are left in the FIFO.
+ *
+ * @param handle The handle of the urm, extended or restarted between two entries.
+ * @param sb The superblock of the filesystem; all the queues are locked.
+ * @param root The path of the directory when it was removed.
+ * @param target The path where the directory is restored.
+ * @param de A buffer for the entries.
+ * @param blocks It counts the blocks read.
+ *
+ * @return Returns zero on success, a negative error code otherwise.
+ */
+static int ext3u_urm_tree(handle_t * handle, struct super_block * sb, const char * root, 
+						  const char * target, struct ext3u_del_entry * de, int * blocks)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct inode * u_inode = usbi->s_undel_inode;
+	struct ext3u_super_block * usb = usbi->s_usb;
+	struct ext3u_del_entry_header * dh;
+	struct ext3u_del_entry * e;
+	struct ext3u_cursor cur;
+	struct ext3u_record record, next;
+	struct dentry * dentry;
+	char * path, * name;
+	int root_length = strlen(root), type, err = 0;
+	unsigned int q;
+
+	path = kmalloc(PATH_MAX + 1, GFP_NOFS);
+	if (!path)
+		return -ENOMEM;
+
+	for (type = EXT3u_ENTRY_FILE; type <= EXT3u_ENTRY_DIR && !err; type++) {
+		for (q = 0; q < usbi->s_queue_count && !err; q++) {
+
+			ext3u_cursor_init(&cur, u_inode, usb, &(EXT3u_QUEUE_FIFO(usb, q)->f_first), 0);
+			for (; !EXT3u_FIFO_NULL(&(cur.c_record)); ext3u_cursor_seek(&cur, &next)) {
+
+				/* Most entries are told apart by their header. */
+				dh = ext3u_cursor_header(&cur);
+				if (IS_ERR(dh)) {
+					err = PTR_ERR(dh);
+					break;
+				}
+				memcpy(&record, &(cur.c_record), EXT3u_RECORD_SIZE);
+				memcpy(&next, &(dh->d_next), EXT3u_RECORD_SIZE);
+
+				if (dh->d_type != type || dh->d_path_length < root_length ||
+					ext3u_permission(dh->d_uid, dh->d_mode, MAY_WRITE)) {
+					continue;
+				}
+
+				e = ext3u_cursor_entry(&cur, de);
+				if (IS_ERR(e)) {
+					err = PTR_ERR(e);
+					break;
+				}
+
+				if (strncmp(e->d_path, root, root_length) ||
+					(e->d_path[root_length] != '/' && e->d_path[root_length] != '\0')) {
+					continue;
+				}
+
+				/* The entry is restored, and the FIFO changes under the cursor. */
+				ext3u_cursor_keep(e, de);
+
+				if (snprintf(path, PATH_MAX + 1, "%s%s", target, de->d_path + root_length) > PATH_MAX) {
+					err = -ENAMETOOLONG;
+					break;
+				}
+
+				/* Room for the file, the directories above it and the FIFO updates. */
+				err = ext3u_extend_or_restart(handle, 2 * EXT3u_URM_TRANS_BLOCKS(sb) + 
+													EXT3u_SAVE_TRANS_BLOCKS(sb), usbi->s_usbh);
+				if (err)
+					break;
+
+				if (type == EXT3u_ENTRY_DIR) {
+					dentry = ext3u_get_target_directory(sb, path);
+					if (IS_ERR(dentry)) {
+						err = PTR_ERR(dentry);
+						break;
+					}
+					err = ext3u_restore_dir(dentry, de);
+				} else {
+					name = strrchr(path, '/');
+					*name++ = '\0';
+					dentry = ext3u_get_target_directory(sb, *path ? path : "/");
+					if (IS_ERR(dentry)) {
+						err = PTR_ERR(dentry);
+						break;
+					}
+					err = ext3u_create(dentry, name, de);
+				}
+				dput(dentry);
+
+				if (err == -EEXIST) {
+					err = 0;
+					continue;
+				}
+				if (err)
+					break;
+
+				ext3u_urm_remove(handle, u_inode, usb, de, &record);
+			}
+			*blocks += cur.c_blocks;
+			ext3u_cursor_release(&cur);
+		}
+	}
 
+	kfree(path);
+	return err;
 }
 
 /**
@@ -1382,50 +5265,83 @@ struct ext3u_del_entry * ext3u_get_entry(handle_t * handle, struct inode * u_ino
  * @param sb Pointer to the ext3u superblock.
  * @param path Full path of the file to be restored.
  * @param where Optional path of the directory where the file will be restored.
+ * @param blocks It returns the number of blocks read to find the entry.
  *
  * @return On success returns zero, otherwise a negative integer specifying the error.
  */
 
-int ext3u_urm(struct super_block* sb, char * path, char * where)
+int ext3u_urm(struct super_block* sb, char * path, char * where, int * blocks)
 {
 	struct inode * u_inode;
 	struct buffer_head *bh;
 	struct ext3u_super_block * usb;
-	struct ext3u_del_entry * de;
+	struct ext3u_del_entry * de, * entry;
+	struct ext3u_record record;
 	handle_t * handle;
-	char * dir_path, * file_name;
+	char * dir_path, * file_name, * tree = NULL, * target;
 	struct dentry * parent;
 	int err, may_create = 1;
 
-	/* Read the ext3u root inode. */
-	u_inode = ext3_iget(sb, EXT3u_UNDEL_DIR_INO);
+	*blocks = 0;
+
+	/* The ext3u root inode and superblock are pinned at mount time. */
+	u_inode = EXT3u_SB(sb)->s_undel_inode;
+	bh = EXT3u_SB(sb)->s_usbh;
+	usb = EXT3u_SB(sb)->s_usb;
 	if (!u_inode) {
 		return  -EIO;
 	}
 	
-	/* */
-	ext3u_lock(u_inode);
+	/* The entry can be in any queue. */
+	ext3u_lock_all(sb);
 
-	handle = ext3_journal_start(u_inode, 	EXT3_DATA_TRANS_BLOCKS(sb) + 
-											EXT3_INDEX_EXTRA_TRANS_BLOCKS + 3 + 
-											2 * EXT3_QUOTA_INIT_BLOCKS(sb));
+	handle = ext3_journal_start(u_inode, EXT3u_URM_TRANS_BLOCKS(sb));
 
 	if (IS_ERR(handle)) {
-		ext3u_unlock(u_inode);
-		iput(u_inode);
+		ext3u_unlock_all(sb);
 		return -EIO;
 	}
 
+	entry = ext3u_alloc_entry(GFP_NOFS);
+	if (!entry) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	err = ext3_journal_get_write_access(handle, bh);
+	if (err) {
+		goto out;
+	}
+
+	/* The index is (re)built the first time it is needed. */
+	if (!EXT3u_HAS_FEATURE_INDEX(usb->s_flags)) {
+		if (ext3u_index_build(handle, u_inode, bh))
+			usb->s_flags &= ~EXT3u_FEATURE_INDEX;
+	}
+
 	/* Find the entry corresponding to 'path' */
-	de = ext3u_get_entry(handle, u_inode, path);
-	/*de = ext3u_find_entry(handle, u_inode, path);*/
+	if (EXT3u_HAS_FEATURE_INDEX(usb->s_flags)) {
+		de = ext3u_index_lookup(u_inode, usb, path, entry, &record, blocks);
+	} else {
+		de = ext3u_find_entry(handle, u_inode, path, entry, &record, blocks);
+	}
+	atomic_long_inc(&EXT3u_SB(sb)->s_stats.s_searches);
+	atomic_long_add(*blocks, &EXT3u_SB(sb)->s_stats.s_search_blocks);
 	if (IS_ERR(de)) {
-		ext3_journal_stop(handle);
-		ext3u_unlock(u_inode);
-		iput(u_inode);
-		return PTR_ERR(de);
+		err = PTR_ERR(de);
+		goto out_dirty;
 	}
 	
+	/* A directory brings back everything saved under it. */
+	if (de->d_type == EXT3u_ENTRY_DIR) {
+		tree = kmalloc(2 * (PATH_MAX + 1), GFP_NOFS);
+		if (!tree) {
+			err = -ENOMEM;
+			goto out_dirty;
+		}
+		strcpy(tree, de->d_path);
+	}
+
 	file_name = ext3u_get_file_name(de);
 	
 	/* If it was specified the directory where the file */
@@ -1435,10 +5351,8 @@ int ext3u_urm(struct super_block* sb, char * path, char * where)
 	if (where) {
 		err = ext3u_lookup(where, sb, &may_create);
 		if (err) {
-			ext3_journal_stop(handle);
-			ext3u_unlock(u_inode);
-			iput(u_inode);
-			return (err ==-EPERM ? err: -ENODATA);
+			err = (err ==-EPERM ? err: -ENODATA);
+			goto out_dirty;
 		}
 		dir_path = where;
 	} else if (*(de->d_path) == '\0') {
@@ -1450,54 +5364,461 @@ int ext3u_urm(struct super_block* sb, char * path, char * where)
 	err = ext3u_lookup(dir_path, sb, &may_create);
 
 	if ( (err == -EPERM) || ((err == -ENOENT)&&(!may_create)) ) {
-		ext3_journal_stop(handle);
-		ext3u_unlock(u_inode);
-		iput(u_inode);
-		return -EPERM;
+		err = -EPERM;
+		goto out_dirty;
+	}
+
+	if (tree) {
+		target = tree + PATH_MAX + 1;
+		if (where)
+			snprintf(target, PATH_MAX + 1, "%s/%s", where, file_name);
+		else
+			strcpy(target, tree);
+
+		err = ext3u_urm_tree(handle, sb, tree, target, de, blocks);
+		goto out_dirty;
 	}
 
 	/* Get the dentry of the directory where the file has to be restored.*/
 	parent = ext3u_get_target_directory(sb, dir_path);
 
 	if (IS_ERR(parent)) {
-		ext3_journal_stop(handle);
-		ext3u_unlock(u_inode);
-		iput(u_inode);
-		return -EIO;
+		err = -EIO;
+		goto out_dirty;
 	}
 	/* Rrestore the file. */
 	err = ext3u_create(parent, file_name, de);
 	dput(parent);
 	
 	if (err) { 
-		ext3_journal_stop(handle);
-		ext3u_unlock(u_inode);
-		iput(u_inode);
-		return err;
+		goto out_dirty;
 	}
+
 	/* Delete the entry */
-	ext3u_delete_entry(handle, u_inode, de);
+	ext3u_urm_remove(handle, u_inode, usb, de, &record);
 
-	/* Update the ext3u_superblock. */
-	bh = ext3_bread(NULL, u_inode, 0, 0, &err);
-	if (!bh) {
-		ext3_journal_stop(handle);
-		ext3u_unlock(u_inode);
-		iput(u_inode);
+out_dirty:
+	ext3_journal_dirty_metadata(handle, bh);
+
+out:
+	ext3_journal_stop(handle);
+	ext3u_unlock_all(sb);
+	if (entry)
+		ext3u_free_entry(entry);
+	kfree(tree);
+	return err;
+}
+
+/* A path given to a batch urm, or a pattern. */
+struct ext3u_urm_request {
+	char *					r_path;
+	__u32					r_hash;			/* a path is looked up by the hash in the headers */
+	int						r_length;		/* length of a path, the shortest one for a pattern */
+	int						r_glob;			/* the path has wildcards */
+	int						r_match;		/* a path: its newest entry in the matches, or -1 */
+	int						r_matches;		/* entries found */
+	int						r_dropped;		/* entries found when the matches were full */
+	int						r_status;		/* result returned to the user */
+};
+
+/* An entry found by a batch urm, restored when the FIFO walk is over. */
+struct ext3u_urm_match {
+	struct ext3u_record		m_record;
+	__u32					m_seq;
+	__u16					m_type;
+	int						m_request;
+};
+
+/* Hash of a path of a batch urm, the paths are sorted by it. */
+struct ext3u_urm_hash {
+	__u32					h_hash;
+	int						h_request;
+};
+
+/* State of a batch urm while walking the FIFO. */
+struct ext3u_urm_batch {
+	struct ext3u_urm_request *	b_req;
+	struct ext3u_urm_hash *		b_hashes;
+	int *						b_globs;		/* the patterns, matched against every entry */
+	struct ext3u_urm_match *	b_matches;
+	struct ext3u_del_entry *	b_de;
+	int							b_nhashes;
+	int							b_nglobs;
+	int							b_nmatches;
+};
+
+/**
+ * @brief Match 'path' against a pattern of a batch urm: '*' is any run
+ * of characters but '/', '?' any one of them, '\' quotes the next one.
+ */
+static int ext3u_glob_match(const char * pattern, const char * path)
+{
+	const char * star = NULL, * back = NULL;
+	char c;
+
+	while (*path) {
+		c = *pattern;
+		if (c == '*') {
+			star = ++pattern;
+			back = path;
+			continue;
+		}
+		if (c == '\\' && pattern[1])
+			c = *++pattern;
+		else if (c == '?' && *path != '/')
+			c = *path;
+
+		if (c && c == *path) {
+			pattern++;
+			path++;
+			continue;
+		}
+
+		/* The last '*' takes one more character, never a '/'. */
+		if (!star || *back == '/')
+			return 0;
+		pattern = star;
+		path = ++back;
+	}
+
+	while (*pattern == '*')
+		pattern++;
+	return !*pattern;
+}
+
+static int ext3u_urm_hash_cmp(const void * a, const void * b)
+{
+	__u32 ha = ((const struct ext3u_urm_hash *) a)->h_hash;
+	__u32 hb = ((const struct ext3u_urm_hash *) b)->h_hash;
+
+	return (ha > hb) - (ha < hb);
+}
+
+/* The files are restored first and the newest entries before the older ones. */
+static int ext3u_urm_match_cmp(const void * a, const void * b)
+{
+	const struct ext3u_urm_match * ma = a, * mb = b;
+
+	if (ma->m_type != mb->m_type)
+		return ma->m_type == EXT3u_ENTRY_FILE ? -1 : 1;
+	if (ma->m_seq == mb->m_seq)
+		return 0;
+	return ext3u_seq_before(ma->m_seq, mb->m_seq) ? 1 : -1;
+}
+
+/**
+ * @brief Split the paths of a batch urm and sort out the plain ones,
+ * looked up by hash, from the patterns.
+ *
+ * @return Returns zero, or -EINVAL if the paths do not fit the buffer.
+ */
+static int ext3u_batch_parse(struct ext3u_urm_batch * b, char * paths, int length, int count, int flag)
+{
+	struct ext3u_urm_request * r;
+	char * p = paths, * s;
+	int i, len;
+
+	for (i = 0; i < count; i++) {
+		len = strnlen(p, paths + length - p);
+		if (!len || len > PATH_MAX || p + len == paths + length)
+			return -EINVAL;
+
+		r = &(b->b_req[i]);
+		r->r_path = p;
+		r->r_match = -1;
+		r->r_status = -ENOENT;
+		r->r_glob = (flag & EXT3u_URM_GLOB) && strpbrk(p, "*?\\");
+
+		if (r->r_glob) {
+			for (s = p; *s; s++) {
+				if (*s == '*')
+					continue;
+				if (*s == '\\' && s[1])
+					s++;
+				r->r_length++;
+			}
+			b->b_globs[b->b_nglobs++] = i;
+		} else {
+			r->r_length = len;
+			r->r_hash = ext3u_hash(p, len);
+			b->b_hashes[b->b_nhashes].h_hash = r->r_hash;
+			b->b_hashes[b->b_nhashes++].h_request = i;
+		}
+		p += len + 1;
+	}
+
+	sort(b->b_hashes, b->b_nhashes, sizeof(struct ext3u_urm_hash), ext3u_urm_hash_cmp, NULL);
+	return 0;
+}
+
+/**
+ * @brief Record that the current entry matches the request 'r': a path
+ * keeps only its newest entry, the one a single urm restores, a pattern
+ * all of them. The entries of other users are left alone.
+ */
+static void ext3u_batch_add(struct ext3u_urm_batch * b, struct ext3u_urm_request * r, 
+							struct ext3u_cursor * cur, struct ext3u_del_entry_header * dh)
+{
+	struct ext3u_urm_match * m;
+
+	if (ext3u_permission(dh->d_uid, dh->d_mode, MAY_WRITE)) {
+		if (r->r_status == -ENOENT)
+			r->r_status = -EPERM;
+		return;
+	}
+
+	if (r->r_match >= 0) {
+		m = &(b->b_matches[r->r_match]);
+		if (!ext3u_seq_before(m->m_seq, dh->d_seq))
+			return;
+	} else if (b->b_nmatches == EXT3u_URM_BATCH_MAX) {
+		r->r_dropped++;
+		return;
+	} else {
+		m = &(b->b_matches[b->b_nmatches]);
+		if (!r->r_glob)
+			r->r_match = b->b_nmatches;
+		b->b_nmatches++;
+		r->r_matches++;
+	}
+
+	memcpy(&(m->m_record), &(cur->c_record), EXT3u_RECORD_SIZE);
+	m->m_seq = dh->d_seq;
+	m->m_type = dh->d_type;
+	m->m_request = r - b->b_req;
+}
+
+/**
+ * @brief Match the current entry against the requests of a batch urm.
+ * The entry itself is read only if its header leaves a request open.
+ *
+ * @return Returns zero, or the error reading the entry.
+ */
+static int ext3u_batch_entry(struct ext3u_urm_batch * b, struct ext3u_cursor * cur, 
+							 struct ext3u_del_entry_header * dh)
+{
+	struct ext3u_del_entry * e = NULL;
+	struct ext3u_urm_request * r;
+	int lo = 0, hi = b->b_nhashes, mid, i;
+
+	if (dh->d_type != EXT3u_ENTRY_FILE && dh->d_type != EXT3u_ENTRY_DIR)
+		return 0;
+
+	/* The first path with the hash of the entry. */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (b->b_hashes[mid].h_hash < dh->d_hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	for (i = lo; i < b->b_nhashes && b->b_hashes[i].h_hash == dh->d_hash; i++) {
+		r = &(b->b_req[b->b_hashes[i].h_request]);
+		if (r->r_length != dh->d_path_length)
+			continue;
+
+		if (!e) {
+			e = ext3u_cursor_entry(cur, b->b_de);
+			if (IS_ERR(e))
+				return PTR_ERR(e);
+		}
+		if (!strcmp(r->r_path, e->d_path))
+			ext3u_batch_add(b, r, cur, dh);
+	}
+
+	for (i = 0; i < b->b_nglobs; i++) {
+		r = &(b->b_req[b->b_globs[i]]);
+		if (dh->d_path_length < r->r_length)
+			continue;
+
+		if (!e) {
+			e = ext3u_cursor_entry(cur, b->b_de);
+			if (IS_ERR(e))
+				return PTR_ERR(e);
+		}
+		if (ext3u_glob_match(r->r_path, e->d_path))
+			ext3u_batch_add(b, r, cur, dh);
+	}
+	return 0;
+}
+
+/**
+ * @brief Restore many deleted files at once. All the paths are looked
+ * for in a single walk of the FIFO queues; then the entries found are 
+ * restored in one handle, extended or restarted as it fills up, the 
+ * files first and the newest entries first. Siblings, deleted one after
+ * the other, share the dentry of their directory. A directory brings 
+ * back everything saved under it, as with ext3u_urm().
+ *
+ * @param sb The superblock of the filesystem.
+ * @param paths The paths, each one ended by a '\0'.
+ * @param length The length of the buffer of the paths.
+ * @param count The number of paths.
+ * @param flag EXT3u_URM_GLOB if the paths are patterns.
+ * @param status It returns the result of each path: zero, -ENOENT if 
+ * nothing matched, -EPERM, -E2BIG if there were too many entries to 
+ * restore, or the error restoring an entry.
+ * @param restored It returns the number of entries restored.
+ * @param blocks It returns the number of blocks read.
+ *
+ * @return Returns zero if all the entries found have been restored or
+ * left with their error in 'status', a negative error code otherwise.
+ */
+int ext3u_urm_batch(struct super_block * sb, char * paths, int length, int count, int flag, 
+					int * status, int * restored, int * blocks)
+{
+	struct ext3u_sb_info * usbi = EXT3u_SB(sb);
+	struct inode * u_inode = usbi->s_undel_inode;
+	struct ext3u_super_block * usb = usbi->s_usb;
+	struct ext3u_urm_batch b;
+	struct ext3u_urm_request * r;
+	struct ext3u_urm_match * m;
+	struct ext3u_del_entry_header * dh;
+	struct ext3u_cursor cur;
+	struct dentry * parent = NULL;
+	handle_t * handle;
+	char * path = NULL, * name;
+	unsigned int q;
+	int i, ret, err = 0;
+
+	*restored = 0;
+	*blocks = 0;
+
+	if (!u_inode)
 		return -EIO;
+	if (count <= 0 || count > EXT3u_URM_BATCH_MAX)
+		return -EINVAL;
+
+	memset(&b, 0, sizeof(b));
+	b.b_req = vmalloc(count * (sizeof(struct ext3u_urm_request) + sizeof(struct ext3u_urm_hash) + sizeof(int)));
+	b.b_matches = vmalloc(EXT3u_URM_BATCH_MAX * sizeof(struct ext3u_urm_match));
+	b.b_de = ext3u_alloc_entry(GFP_NOFS);
+	path = kmalloc(2 * (PATH_MAX + 1), GFP_NOFS);
+	if (!b.b_req || !b.b_matches || !b.b_de || !path) {
+		err = -ENOMEM;
+		goto out_free;
+	}
+	memset(b.b_req, 0, count * sizeof(struct ext3u_urm_request));
+	b.b_hashes = (struct ext3u_urm_hash *) (b.b_req + count);
+	b.b_globs = (int *) (b.b_hashes + count);
+
+	err = ext3u_batch_parse(&b, paths, length, count, flag);
+	if (err)
+		goto out_free;
+
+	/* The entries can be in any queue. */
+	ext3u_lock_all(sb);
+
+	for (q = 0; q < usbi->s_queue_count && !err; q++) {
+		ext3u_cursor_init(&cur, u_inode, usb, &(EXT3u_QUEUE_FIFO(usb, q)->f_first), 0);
+		for (err = 0; !err; err = ext3u_cursor_next(&cur)) {
+			dh = ext3u_cursor_header(&cur);
+			if (IS_ERR(dh)) {
+				err = PTR_ERR(dh);
+				break;
+			}
+			err = ext3u_batch_entry(&b, &cur, dh);
+			if (err)
+				break;
+		}
+		if (err == -ENOENT)
+			err = 0;
+		*blocks += cur.c_blocks;
+		ext3u_cursor_release(&cur);
+	}
+	if (err)
+		goto out_unlock;
+
+	for (i = 0; i < count; i++) {
+		r = &(b.b_req[i]);
+		if (r->r_dropped)
+			r->r_status = -E2BIG;
+		else if (r->r_matches)
+			r->r_status = 0;
 	}
-	
-	usb = (struct ext3u_super_block *) bh->b_data;	
 
-	ext3u_update_superblock(usb, de, EXT3u_UPDATE_DELETE);	
-	ext3_journal_get_write_access(handle, bh);
-	ext3_journal_dirty_metadata(handle, bh);
-	ext3_journal_stop(handle);
-	sync_dirty_buffer(bh);
-	brelse(bh);	
+	handle = ext3_journal_start(u_inode, EXT3u_URM_TRANS_BLOCKS(sb));
+	if (IS_ERR(handle)) {
+		err = PTR_ERR(handle);
+		goto out_unlock;
+	}
+
+	err = ext3_journal_get_write_access(handle, usbi->s_usbh);
+	if (err)
+		goto out_stop;
 
-	ext3u_unlock(u_inode);
-	iput(u_inode);
+	sort(b.b_matches, b.b_nmatches, sizeof(struct ext3u_urm_match), ext3u_urm_match_cmp, NULL);
+
+	for (i = 0; i < b.b_nmatches; i++) {
+		m = &(b.b_matches[i]);
+		r = &(b.b_req[m->m_request]);
+
+		/* The pointers of the entry may have changed since the walk. */
+		err = ext3u_read_entry(u_inode, usb, &(m->m_record), b.b_de, blocks);
+		if (err)
+			break;
+
+		/* Matched twice, or restored with a directory above it. */
+		if (!ext3u_entry_live(u_inode, EXT3u_QUEUE_FIFO(usb, ext3u_record_queue(usb, &(m->m_record))), 
+							  &(m->m_record), (struct ext3u_del_entry_header *) b.b_de))
+			continue;
+
+		/* Room for the file, the directories above it and the FIFO updates. */
+		err = ext3u_extend_or_restart(handle, 2 * EXT3u_URM_TRANS_BLOCKS(sb) + 
+											EXT3u_SAVE_TRANS_BLOCKS(sb), usbi->s_usbh);
+		if (err)
+			break;
+
+		if (m->m_type == EXT3u_ENTRY_DIR) {
+			dput(parent);
+			parent = NULL;
+
+			strcpy(path, b.b_de->d_path);
+			ret = ext3u_urm_tree(handle, sb, path, path, b.b_de, blocks);
+		} else {
+			name = ext3u_get_file_name(b.b_de);
+
+			/* Siblings follow one another. */
+			if (!parent || strcmp(path, b.b_de->d_path)) {
+				dput(parent);
+				strcpy(path, b.b_de->d_path);
+				parent = ext3u_get_target_directory(sb, *path ? path : "/");
+				if (IS_ERR(parent)) {
+					ret = PTR_ERR(parent);
+					parent = NULL;
+					goto status;
+				}
+			}
+
+			ret = ext3u_create(parent, name, b.b_de);
+			if (!ret)
+				ext3u_urm_remove(handle, u_inode, usb, b.b_de, &(m->m_record));
+		}
+
+status:
+		/* A pattern also matches the older entries of a path restored. */
+		if (!ret)
+			(*restored)++;
+		else if (ret != -EEXIST || !r->r_glob)
+			r->r_status = ret;
+	}
+
+	dput(parent);
+	ext3_journal_dirty_metadata(handle, usbi->s_usbh);
+out_stop:
+	ext3_journal_stop(handle);
+out_unlock:
+	ext3u_unlock_all(sb);
+
+	for (i = 0; i < count; i++)
+		status[i] = b.b_req[i].r_status;
+out_free:
+	if (b.b_de)
+		ext3u_free_entry(b.b_de);
+	vfree(b.b_matches);
+	vfree(b.b_req);
+	kfree(path);
 	return err;
 }
 
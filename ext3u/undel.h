@@ -10,6 +10,11 @@
 #include <linux/inotify.h>
 #include <linux/dnotify.h>
 #include <linux/audit.h>
+#include <linux/wait.h>
+#include <linux/rbtree.h>
+#include <linux/seqlock.h>
+
+#include "undel_fifo.h"
 
 #define EXT3u_FEATURE_COMPAT_UNDELETE	0x4000
 
@@ -23,9 +28,20 @@
 
 #define EXT3u_FEATURE_INDEX			1
 
-#define EXT3u_BLOCK_HEADER_SIZE		4
+#define EXT3u_FEATURE_COMPACT		2
+
+/* The FIFO area is split into the sub-queues s_queue[]. */
+#define EXT3u_FEATURE_QUEUES		4
+
+/* The entry headers carry d_queue and d_seq, see ext3u_del_entry_header. */
+#define EXT3u_FEATURE_SEQ			8
 
-#define EXT3u_DISK_CACHE_SIZE		8
+/* Features of the undelete area known by this module: a filesystem */
+/* using any other one is not mounted.                              */
+#define EXT3u_FEATURE_SUPP			(EXT3u_FEATURE_INDEX | EXT3u_FEATURE_COMPACT | \
+									 EXT3u_FEATURE_QUEUES | EXT3u_FEATURE_SEQ)
+
+#define EXT3u_DISK_CACHE_SIZE		32
 
 #define EXT3u_UPDATE_PREVIOUS		1
 
@@ -43,6 +59,9 @@
 
 #define EXT3u_FIFO_END				0
 
+/* Max number of sub-queues the FIFO area can be split into. */
+#define EXT3u_MAX_QUEUES			8
+
 
 #ifndef MIN
 #define MIN(a,b) ( (a) <= (b) ? (a) : (b) )
@@ -55,18 +74,14 @@
 
 #define EXT3u_FIFO_NULL(r) (((r)->r_offset == 0) ? 1 : 0)
 
-#define EXT3u_FIFO_EMPTY(usb) (EXT3u_FIFO_NULL((&((usb)->s_fifo.f_first))))
+#define EXT3u_FIFO_EMPTY(fifo) (EXT3u_FIFO_NULL((&((fifo)->f_first))))
 
 #define ext3u_hash_to_entry(h, s) 	( (h)%(s) ) 
 
-//#define ext3u_lock(u_inode) 		spin_lock( &(u_inode->i_lock) )
-#define ext3u_lock(u_inode) 		mutex_lock( &(u_inode->i_mutex) )
-
-//#define ext3u_unlock(u_inode) 		spin_unlock( &(u_inode->i_lock) )
-#define ext3u_unlock(u_inode) 		mutex_unlock( &(u_inode->i_mutex) )
-
 #define EXT3u_HAS_FEATURE_INDEX(flag) ( (flag) & EXT3u_FEATURE_INDEX )
 
+#define EXT3u_HAS_FEATURE_COMPACT(flag) ( (flag) & EXT3u_FEATURE_COMPACT )
+
 
 
 /* Macro needed for ioctl() - 'f' is for file system (ext2,ext3) */
@@ -75,6 +90,8 @@
 #define EXT3_UNDEL_IOC_ULS _IOR('f', 12, struct ext3u_uls_info)
 #define EXT3_UNDEL_IOC_USTATS _IOR('f', 13, struct ext3u_ustats_info)
 #define EXT3_UNDEL_IOC_CONFIG _IOW('f', 14, struct ext3u_uconfig_info)
+#define EXT3_UNDEL_IOC_URM_BATCH _IOWR('f', 15, struct ext3u_urm_batch_info)
+#define EXT3_UNDEL_IOC_ULS_OPEN _IOW('f', 16, struct ext3u_uls_open_info)
 
 
 /* We redefine the ext3u_valid_inum() and add the EXT3_UNDEL_DIR_INO to the valid reserved inodes. */
@@ -89,50 +106,32 @@ static inline int ext3u_valid_inum(struct super_block *sb, unsigned long ino)
 }
 
 
-/* Pointer to an entry in the FIFO list. */
-struct ext3u_record {
-	__u32 r_block; 		/* logical block number */
-	__u64 r_real_block; /* fisical block number */
-	__u16 r_offset; 	/* offset in the block */
-	__u16 r_size;		/* size in bytes of the entry */
-};
-
-#define EXT3u_RECORD_SIZE (sizeof(struct ext3u_record))
-
-
-/* FIFO list  information */
-struct ext3u_fifo_info {
-	__u32 				f_blocks;				/* blocks reserved for the fifo queue */
-	__u32				f_start_block; 			/* first logical block of the fifo queue */
-	__u32				f_last_block; 			/* last logical block used  */
-	__u32				f_last_offset;			/* offset in the last writeable block */
-	__u32				f_last_block_remaining;	/* space left on the last used block */
-	__u32				f_free;					/* free space on the FIFO (in bytes) */
-	struct ext3u_record f_first;
-	struct ext3u_record f_last;
-};
-
-
 /* Information about the deleted files */
 struct ext3u_del_info {
 	__u64 d_max_size;		/* max allowed size for ext3u filesystem */
 	__u64 d_max_filesize;	/* max allowed size for a file to be saved */
 	__u64 d_current_size;	/* current size */
-	__u32 d_file_count; 	/* current number of all saved directories */
-	__u32 d_dir_count; 		/* current number of saved files */
+	__u32 d_file_count; 	/* current number of saved files */
+	__u32 d_dir_count; 		/* current number of saved directories */
 };
 
+/* Entries in the FIFO, files and directories. */
+#define EXT3u_ENTRY_COUNT(usb) ((usb)->s_del.d_file_count + (usb)->s_del.d_dir_count)
+
 
 /* Static entry used to insert or read an entry from the fifo queue */
 struct ext3u_del_entry {
 	__u16					d_size;				/* size in bytes of this entry */
+	__u16					d_queue;			/* sub-queue holding this entry */
+	__u32					d_seq;				/* deletion order, across all the sub-queues */
 	struct ext3u_record 	d_next;				/* pointer to next entry in the fifo list*/	
 	struct ext3u_record		d_previous;			/* pointer to the previous entry in the fifo list */
 	__u16					d_type;				/* flag specifying the type of this entry: file, directory, link*/
+	__u16					d_base;				/* offset of the base entry in the block, 0 for a full path */
 	__u32					d_hash;				/* hash of the file */
 	__u16					d_path_length;		/* path length */
 	__u16					d_mode;				/* */
-	__u16		 			d_uid;				/* */
+	__u32		 			d_uid;				/* owner */
 	struct ext3_inode 		d_inode;			/* inode of the deleted file */
 	char 					d_path[PATH_MAX+1];	/* buffer for the path */
 };
@@ -144,29 +143,105 @@ struct ext3u_del_entry {
  * this way, restoring the FIFO pointers after un unde- 
  * lete is much more efficient, since reading one block
  * is enough.
+ *
+ * The header has no implicit padding: d_next is at offset 8 and each
+ * field follows the previous one (see ext3u_check_layout()). The
+ * headers written before EXT3u_FEATURE_SEQ had no d_queue and d_seq,
+ * and d_next at the alignment of struct ext3u_record: where that is 
+ * 8 they have the same layout, with zeros in the three new fields.
  */
-
 struct ext3u_del_entry_header {
 	__u16					d_size;				/* size in bytes of this entry */
+	__u16					d_queue;			/* sub-queue holding this entry */
+	__u32					d_seq;				/* deletion order */
 	struct ext3u_record 	d_next;				/* pointer to next entry in the fifo list*/	
 	struct ext3u_record		d_previous;			/* pointer to the previous entry in the fifo list */
 	__u16					d_type;				/* type of this entry */
+	__u16					d_base;				/* compact entries: where the path prefix is */
 	__u32					d_hash;				/* hash of the path */
 	__u16					d_path_length;
 	__u16					d_mode;
-	unsigned int			d_uid;
+	__u32					d_uid;
 };
 
+/* The headers written without EXT3u_FEATURE_SEQ can be read as the current ones. */
+#define EXT3u_SEQ_COMPATIBLE		(__alignof__(struct ext3u_record) == 8)
 
 #define EXT3u_DEL_HEADER_SIZE (sizeof(struct ext3u_del_entry_header))
 
+/* The size of the file saved in an entry, i_size_high included. */
+static inline __u64 ext3u_entry_size(struct ext3u_del_entry * de)
+{
+	return le32_to_cpu(de->d_inode.i_size) | ((__u64) le32_to_cpu(de->d_inode.i_size_high) << 32);
+}
+
 #define EXT3u_DEL_ENTRY_SIZE (EXT3u_DEL_HEADER_SIZE + sizeof(struct ext3_inode))
 
-/* The header of an entry(48 bytes) cannot be splitted accross two blocks */
-#define EXT3u_WRITE_MIN	(EXT3u_DEL_HEADER_SIZE + sizeof(struct ext3_inode))
+/**
+ * Compact entries (EXT3u_FEATURE_COMPACT) keep the header, followed by
+ * this inode, the first 'c_nblocks' block pointers and the path; the 
+ * first 'c_prefix' bytes of the path are not stored, they are the same
+ * of the base entry, a full entry starting in the same block. The 
+ * space of a block is given back only when the head of the queue 
+ * leaves it, so the base is there as long as the entries using it.
+ */
+struct ext3u_compact_inode {
+	__le16	c_mode;
+	__le16	c_uid_low;
+	__le16	c_gid_low;
+	__le16	c_uid_high;
+	__le16	c_gid_high;
+	__u16	c_nblocks;		/* block pointers stored, the other ones are zero */
+	__u16	c_prefix;		/* bytes of the path taken from the base entry */
+	__u16	c_pad;
+	__le32	c_size;
+	__le32	c_size_high;
+	__le32	c_atime;
+	__le32	c_ctime;
+	__le32	c_mtime;
+	__le32	c_dtime;
+	__le32	c_blocks;
+	__le32	c_flags;
+	__le32	c_file_acl;
+	__le32	c_generation;
+};
+
+#define EXT3u_COMPACT_INODE_SIZE (sizeof(struct ext3u_compact_inode))
+
+#define EXT3u_COMPACT_ENTRY_SIZE(nblocks, path_length) \
+	(EXT3u_DEL_HEADER_SIZE + EXT3u_COMPACT_INODE_SIZE + (nblocks) * sizeof(__le32) + (path_length))
+
+#define EXT3u_ENTRY_MIN_SIZE(usb) (EXT3u_HAS_FEATURE_COMPACT((usb)->s_flags) ? \
+	EXT3u_COMPACT_ENTRY_SIZE(0, 0) : EXT3u_DEL_ENTRY_SIZE)
 
+/* The header of an entry cannot be splitted accross two blocks */
+#define EXT3u_WRITE_MIN(usb) (EXT3u_HAS_FEATURE_COMPACT((usb)->s_flags) ? \
+	EXT3u_DEL_HEADER_SIZE : EXT3u_DEL_ENTRY_SIZE)
 
-/* Information about files/directories to skip */
+/* Blocks dirtied by ext3u_save(): the superblock, the previous tail */
+/* entry, one index block and every block spanned by the longest     */
+/* possible entry.                                                   */
+#define EXT3u_SAVE_TRANS_BLOCKS(sb)	(3 + (EXT3u_DEL_ENTRY_SIZE + PATH_MAX + 1) / \
+					((sb)->s_blocksize - EXT3u_BLOCK_HEADER_SIZE) + 1)
+
+/* Blocks dirtied restoring a file: the new inode, its directory entry */
+/* and the ext3u superblock.                                          */
+#define EXT3u_URM_TRANS_BLOCKS(sb)	(EXT3_DATA_TRANS_BLOCKS(sb) + EXT3_INDEX_EXTRA_TRANS_BLOCKS + 4 + \
+					2 * EXT3_QUOTA_INIT_BLOCKS(sb))
+
+/* Budgets of the undelete area: the owners of an entry are its user */
+/* and the top level directory it was deleted from.                  */
+#define EXT3u_OWNER_UID			0
+
+#define EXT3u_OWNER_DIR			1
+
+#define EXT3u_OWNER_KINDS		2
+
+/* The saved entries are found by their position in 2^bits buckets. */
+#define EXT3u_OWNER_HASH_BITS	10
+
+/* Information about files/directories to skip. The rules are stored */
+/* one after the other in the blocks following the hash index.        */
 struct ext3u_skip_info {
 	__u32 s_dir_count; 			/* number af the directories  */
 	__u32 s_filext_size;		/* bytes reserved for the extensions */
@@ -177,21 +252,90 @@ struct ext3u_skip_info {
 };
 
 
-/* The in-memory structure used to specify a 'skip rule' */
-struct ext3u_skip_entry {
-	int sk_ext_len; /* number of extensions in sk_ext */
-	char * sk_dir;	/* the rule applies to all files in this directory or its subdirectories  */
-	char **sk_ext; 	/* file extensions to be skipped */
-};
-
-
-/* Skip entry header on disk. */
+/* Skip entry header on disk, followed by the directory path and by */
+/* the comma separated extensions, with no terminating zeros.      */
 struct ext3u_skip_header {
 	__u32 s_dir_length;		/* directory path length */
 	__u32 s_ext_length; 	/* extensions length */
-	__u32 s_file_max_size;	/* skip files bigger than this */
+	__u32 s_file_max_size;	/* skip files bigger than this, 0 for no limit */
 };
 
+#define EXT3u_SKIP_HEADER_SIZE	(sizeof(struct ext3u_skip_header))
+
+/* Rules are matched with a bit mask, and their size is bounded. */
+#define EXT3u_SKIP_MAX_RULES	64
+
+#define EXT3u_SKIP_MAX_SIZE		8192
+
+/* Longest extension, the lengths in use are kept in a bit mask. */
+#define EXT3u_SKIP_MAX_EXT		32
+
+/* Parts of a rule changed by EXT3_UNDEL_IOC_CONFIG, as in uconfig. */
+#define EXT3u_CONFIG_EXT		010
+
+#define EXT3u_CONFIG_SIZE		020
+
+/* Edge of the trie of the rule directories: (parent, character) -> child. */
+struct ext3u_skip_edge {
+	__u32 e_key;	/* (parent << 8 | character) + 1, zero for a free slot */
+	__u32 e_node;	/* child node */
+};
+
+/* Extension in the suffix hash. */
+struct ext3u_skip_suffix {
+	__u32 x_hash;			/* hash of the extension, read backwards */
+	__u32 x_length;			/* zero for a free slot */
+	const char * x_ext;		/* the extension, in sr_raw */
+	__u64 x_rules;			/* rules listing it */
+};
+
+/* Skip rules compiled at mount time and at each change, read under RCU. */
+struct ext3u_skip_rules {
+	char * sr_raw;						/* the rules as stored on disk */
+	__u32 sr_raw_size;
+	unsigned int sr_count;				/* number of rules */
+	unsigned int sr_ext_count;			/* number of extensions */
+	__u64 sr_all;						/* rules skipping every file */
+	__u64 sr_sized;						/* rules with a size limit */
+	__u32 sr_max_size[EXT3u_SKIP_MAX_RULES];
+	__u64 * sr_node_rules;				/* rules whose directory ends at each trie node */
+	struct ext3u_skip_edge * sr_edges;	/* trie edges, open addressing */
+	unsigned int sr_edge_mask;
+	struct ext3u_skip_suffix * sr_suffixes;
+	unsigned int sr_suffix_mask;
+	__u32 sr_suffix_lengths;			/* bit n set: some extension is n + 1 bytes long */
+};
+
+
+/* Hash index of the FIFO list: path hash -> record. */
+struct ext3u_index_info {
+	__u32 i_start_block;	/* first logical block of the index */
+	__u32 i_blocks;			/* blocks reserved for the index */
+	__u32 i_slots;			/* number of slots */
+	__u32 i_used;			/* used slots, including the deleted ones */
+};
+
+#define EXT3u_INDEX_SLOT_FREE		0
+
+#define EXT3u_INDEX_SLOT_USED		1
+
+#define EXT3u_INDEX_SLOT_DELETED	2
+
+/* One slot of the index every EXT3u_INDEX_BYTES_PER_SLOT bytes of FIFO. */
+#define EXT3u_INDEX_BYTES_PER_SLOT	128
+
+/* Slot of the hash index on disk. */
+struct ext3u_index_slot {
+	__u32				x_hash;		/* hash of the path */
+	__u32				x_state;	/* free, used or deleted */
+	struct ext3u_record x_record;	/* the entry in the FIFO list */
+};
+
+#define EXT3u_INDEX_SLOT_SIZE (sizeof(struct ext3u_index_slot))
+
+/* The index is dropped (and rebuilt) when 3/4 of the slots are used. */
+#define EXT3u_INDEX_FULL(ii) ((ii)->i_used * 4 >= (ii)->i_slots * 3)
+
 
 /* Information about ext3u filesystem. */
 struct ext3u_super_block {
@@ -200,14 +344,164 @@ struct ext3u_super_block {
 	__u32	s_inode_size;		/* inode size */
 	__u32	s_fifo_free;		/* free space in the fifo list, including holes */
 	__u64	s_block_count;		/* total number of used blocks */
-	__u64	s_low_watermark; 	
-	__u64	s_high_watermark;
+	__u64	s_low_watermark; 	/* saved data where the eviction thread stops, 0 for 3/4 of d_max_size */
+	__u64	s_high_watermark;	/* saved data where it starts, 0 for 7/8 of d_max_size */
 
 	struct ext3u_del_info	s_del;
 	struct ext3u_fifo_info 	s_fifo;
 	struct ext3u_skip_info	s_skip;
+	struct ext3u_index_info	s_index;
+	__u32	s_queue_count;		/* number of sub-queues, 0 or 1 means s_fifo only */
+	__u32	s_seq;				/* sequence number of the next saved entry */
+	struct ext3u_fifo_info	s_queue[EXT3u_MAX_QUEUES];
+	__u64	s_budget[EXT3u_OWNER_KINDS];	/* bytes of data each user, each top level directory, can keep; 0 for no limit */
 };
 
+/**
+ * The FIFO area can be split into sub-queues, each one with its own
+ * lock: s_fifo.f_blocks is still the size of the whole area, but the
+ * entries live in the sub-queues. EXT3u_FEATURE_QUEUES is set exactly
+ * when s_queue_count is above 1, so e2fsck knows where to look.
+ */
+static inline struct ext3u_fifo_info * EXT3u_QUEUE_FIFO(struct ext3u_super_block * usb, unsigned int q)
+{
+	return usb->s_queue_count > 1 ? &usb->s_queue[q] : &usb->s_fifo;
+}
+
+/* Bytes the entries can use in a FIFO queue. */
+#define EXT3u_FIFO_CAPACITY(fifo, bs)	((fifo)->f_blocks * ((bs) - EXT3u_BLOCK_HEADER_SIZE))
+
+/* The eviction thread starts when less than 1/8 of a queue is free, and stops at 1/4. */
+#define EXT3u_QUEUE_HIGH_ROOM(fifo, bs)	(EXT3u_FIFO_CAPACITY(fifo, bs) / 8)
+
+#define EXT3u_QUEUE_LOW_ROOM(fifo, bs)	(EXT3u_FIFO_CAPACITY(fifo, bs) / 4)
+
+/* Entries freed by the eviction thread each time it takes a queue lock, */
+/* by default and at most.                                               */
+#define EXT3u_EVICT_BATCH			64
+
+#define EXT3u_EVICT_BATCH_MAX		4096
+
+/* Entries unlinked from the head of a queue with a single update of the head. */
+#define EXT3u_EVICT_RUN				32
+
+/* True if the entry numbered 'a' was saved before the one numbered 'b'. */
+#define ext3u_seq_before(a, b)	((__s32) ((a) - (b)) < 0)
+
+/* Size classes of the saved files: below 4K, then four times bigger each. */
+#define EXT3u_STATS_SIZES	12
+
+/**
+ * Activity since mount, for ustats. The save, eviction and restore paths
+ * bump the counters without any lock, and ustats reads them the same 
+ * way: polling it never waits for an unlink.
+ */
+struct ext3u_stats {
+	atomic_long_t				s_saved_files;
+	atomic_long_t				s_saved_dirs;
+	atomic_long_t				s_evicted;
+	atomic_long_t				s_restored;
+	atomic_long_t				s_skipped;		/* by the rules, the size or a budget */
+	atomic_long_t				s_evict_runs;	/* runs of entries evicted together */
+	atomic_long_t				s_evict_usecs;	/* time spent by the runs */
+	atomic_long_t				s_evict_max_usecs;
+	atomic_long_t				s_sizes[EXT3u_STATS_SIZES];	/* files saved, by size class */
+	atomic_long_t				s_used;			/* bytes of the entries in the queues */
+	atomic_long_t				s_searches;		/* urm lookups by path */
+	atomic_long_t				s_search_blocks;	/* blocks they read */
+	unsigned long				s_mount_time;
+};
+
+/* Tunables in /proc/fs/ext3u/<dev>/, the first four kept in the ext3u superblock. */
+enum {
+	EXT3u_TUNE_MAX_SIZE,
+	EXT3u_TUNE_MAX_FILE_SIZE,
+	EXT3u_TUNE_LOW_WATERMARK,
+	EXT3u_TUNE_HIGH_WATERMARK,
+	EXT3u_TUNE_EVICT_BATCH,
+	EXT3u_TUNES
+};
+
+/* A tunable file of a mounted filesystem. */
+struct ext3u_tune {
+	struct super_block *		t_sb;
+	unsigned int				t_index;
+};
+
+/* In-memory sub-queue. */
+struct ext3u_queue {
+	struct mutex				q_mutex;		/* serializes the saves on this queue */
+	struct ext3u_fifo_info *	q_fifo;			/* head and tail, in the ext3u superblock */
+	unsigned int				q_num;			/* number of this queue */
+};
+
+/* Reader walking the entries of the FIFO queues, forward or backward. */
+/* The block of the current entry stays pinned, the blocks coming next */
+/* are read ahead EXT3u_DISK_CACHE_SIZE at a time.                      */
+struct ext3u_cursor {
+	struct inode *				c_inode;		/* the ext3u root inode */
+	struct ext3u_super_block *	c_usb;
+	struct ext3u_fifo_info *	c_fifo;			/* queue of the current entry */
+	struct ext3u_record			c_record;		/* the current entry */
+	struct buffer_head *		c_bh;			/* block of the current entry */
+	__u32						c_block;		/* logical block in c_bh */
+	__u32						c_ra_next;		/* first block not read ahead yet */
+	__u32						c_ra_left;		/* blocks read ahead from c_block on */
+	int							c_backward;		/* walking from the tail to the head */
+	int							c_blocks;		/* blocks read */
+};
+
+/* Owner of saved entries, in the tree of its kind. */
+struct ext3u_owner {
+	struct rb_node				o_node;			/* in s_owners[kind], by key */
+	__u32						o_key;			/* uid, or hash of the top level directory */
+	__u64						o_size;			/* bytes of data of its entries */
+	struct list_head			o_entries;		/* its entries, oldest first */
+};
+
+/* A saved entry, as seen by the budgets. */
+struct ext3u_owned {
+	struct hlist_node			w_hash;			/* in s_owned, by position */
+	struct list_head			w_list[EXT3u_OWNER_KINDS];	/* in the lists of its owners */
+	struct ext3u_owner *		w_owner[EXT3u_OWNER_KINDS];
+	struct ext3u_record			w_record;		/* where the entry is */
+	__u64						w_size;			/* bytes of data */
+};
+
+/* In-memory ext3u information, it wraps the ext3 superblock information. */
+struct ext3u_sb_info {
+	struct ext3_sb_info			s_ext3;			/* ext3 information, must be the first */
+	struct inode *				s_undel_inode;	/* the ext3u root inode */
+	struct buffer_head *		s_usbh;			/* buffer containing the ext3u superblock */
+	struct ext3u_super_block *	s_usb;			/* pointer to the ext3u superblock in the buffer */
+	unsigned int				s_queue_count;	/* number of sub-queues in use */
+	unsigned int				s_queue_opt;	/* sub-queues asked with the undel_queues= option */
+	unsigned int				s_compact_opt;	/* compact entries asked with the undel_compact option */
+	seqlock_t					s_del_lock;		/* protects s_del and s_seq, read without waiting */
+	atomic_t					s_generation;	/* bumped when entries leave the FIFO */
+	struct mutex				s_index_lock;	/* protects the hash index */
+	struct mutex				s_skip_lock;	/* serializes the changes of the skip rules */
+	struct ext3u_skip_rules *	s_skip;			/* compiled skip rules, RCU protected */
+	struct ext3u_queue			s_queue[EXT3u_MAX_QUEUES];
+	spinlock_t					s_owner_lock;	/* protects the owners and s_owned */
+	struct rb_root				s_owners[EXT3u_OWNER_KINDS];
+	struct hlist_head *			s_owned;		/* saved entries by position, NULL until needed */
+	int							s_owner_partial;	/* some entry is not tracked, the owners cannot be listed */
+	__u64						s_budget_opt[EXT3u_OWNER_KINDS];	/* undel_uid_budget= and undel_dir_budget= */
+	unsigned int				s_budget_set;	/* bit mask of the budget options given */
+	struct task_struct *		s_evict_task;	/* frees the old entries in background */
+	wait_queue_head_t			s_evict_wait;	/* the eviction thread waits here */
+	unsigned int				s_evict_batch;	/* entries it frees under a queue lock */
+	struct ext3u_stats			s_stats;
+	struct proc_dir_entry *		s_proc;			/* /proc/fs/ext3u/<dev>, NULL if not there */
+	struct ext3u_tune			s_tune[EXT3u_TUNES];
+};
+
+static inline struct ext3u_sb_info * EXT3u_SB(struct super_block * sb)
+{
+	return container_of(EXT3_SB(sb), struct ext3u_sb_info, s_ext3);
+}
+
 /* Ioctl information structures */ 
 
 /* urm command structure*/
@@ -218,8 +512,31 @@ struct ext3u_urm_info {
 	int u_path_length;		/* Path Length */
 	int u_dpath_length;		/* Operation Result Code */
 	int u_errcode;			/* Error code */			
+	int u_blocks;			/* Blocks read to find the entry */
 };
 
+/* urm of many files at once: 'u_buffer' holds 'u_count' paths, each */
+/* one ended by a '\0', and gets back the result of each one in     */
+/* 'u_status'. With EXT3u_URM_GLOB the paths are patterns.          */
+struct ext3u_urm_batch_info {
+	char * u_buffer;		/* The paths */
+	int u_buffer_length;	/* Buffer Length */
+	int u_count;			/* Number of paths */
+	int * u_status;			/* Result of each path, 'u_count' of them */
+	int u_flag;				/* EXT3u_URM_GLOB */
+	int u_restored;			/* Entries restored, a directory and its content count once */
+	int u_errcode;			/* Error code */
+	int u_blocks;			/* Blocks read to find the entries */
+};
+
+/* The paths of a batch urm are patterns: '*' matches any characters */
+/* but '/', '?' any one of them and '\' quotes the next one.         */
+#define EXT3u_URM_GLOB			1
+
+/* Most paths and entries a batch urm works on */
+#define EXT3u_URM_BATCH_MAX		65536
+#define EXT3u_URM_BATCH_SIZE	(EXT3u_URM_BATCH_MAX * 64)
+
 
 /* ustats command structure */
 struct ext3u_ustats_info {
@@ -232,6 +549,19 @@ struct ext3u_ustats_info {
 	__u32 u_fifo_free;				/* free space in the fifo list, including holes */
 	__u32 u_file_count;				/* current number of saved files */
 	__u32 u_dir_count;				/* current number of all saved directory */
+	__u32 u_fifo_tail;				/* free space at the tails of the queues, in one piece */
+	__u32 u_elapsed;				/* seconds since mount, for the counters below */
+	__u64 u_saved_files;			/* files saved */
+	__u64 u_saved_dirs;				/* directories saved */
+	__u64 u_evicted;				/* entries evicted */
+	__u64 u_restored;				/* entries restored */
+	__u64 u_skipped;				/* files not saved */
+	__u64 u_evict_runs;				/* runs of entries evicted together */
+	__u64 u_evict_usecs;			/* time spent evicting */
+	__u64 u_evict_max_usecs;		/* longest run */
+	__u64 u_sizes[EXT3u_STATS_SIZES];	/* files saved by size: below 4K, then 4 times bigger each */
+	__u64 u_searches;				/* urm lookups by path */
+	__u64 u_search_blocks;			/* blocks they read */
 };
 
 
@@ -254,6 +584,33 @@ struct ext3u_uls_entry {
 
 
 /* uls command */
+/* Filters of uls, checked on the header of each entry before its */
+/* path is copied: the bounds are the ones set in 'u_mask'.        */
+struct ext3u_uls_filter {
+	char * u_prefix;					/* Paths starting with it */
+	int u_prefix_length;				/* Prefix Length, zero for all the paths */
+	int u_mask;							/* EXT3u_ULS_UID, EXT3u_ULS_SIZE, EXT3u_ULS_MTIME */
+	unsigned int u_uid;					/* Owner */
+	__u32 u_min_mtime;					/* Modified Time range, a zero maximum for no bound */
+	__u32 u_max_mtime;
+	__u64 u_min_size;					/* Size range, a zero maximum for no bound */
+	__u64 u_max_size;
+};
+
+#define EXT3u_ULS_UID	1
+#define EXT3u_ULS_SIZE	2
+#define EXT3u_ULS_MTIME	4
+
+/* u_order: the FIFO order, or the 'u_max_files' biggest or most recent */
+/* entries, given all at once.                                          */
+#define EXT3u_ULS_ORDER_FIFO	0
+#define EXT3u_ULS_ORDER_SIZE	1
+#define EXT3u_ULS_ORDER_MTIME	2
+#define EXT3u_ULS_ORDER_DTIME	3
+
+/* Most entries of an ordered listing */
+#define EXT3u_ULS_TOP_MAX	4096
+
 struct ext3u_uls_info {
 	char * u_buffer;					/* Communication Buffer */ 
 	int u_buffer_length;				/* Buffer Length */
@@ -264,6 +621,9 @@ struct ext3u_uls_info {
 	int u_ll;							/* Long listing Option */
 	int u_order;						/* Visualization Order */
 	struct ext3u_record u_next_record;	/* First entry to search */
+	__u32 u_since;						/* Deleted from this time on, zero for no bound */
+	__u32 u_until;						/* Deleted up to this time, zero for no bound */
+	struct ext3u_uls_filter u_filter;
 };
 
 
@@ -272,42 +632,140 @@ struct ext3u_uls_info {
 #define EXT3u_ULL_ENTRY_SIZE (sizeof(struct ext3u_uls_entry) - sizeof(int))
 
 
+/* uls through a file: the ioctl returns a descriptor, each read() of */
+/* it gives the next entries as a run of ext3u_uls_record.             */
+struct ext3u_uls_open_info {
+	__u32 u_since;						/* Deleted from this time on, zero for no bound */
+	__u32 u_until;						/* Deleted up to this time, zero for no bound */
+	int u_flags;						/* O_CLOEXEC */
+	struct ext3u_uls_filter u_filter;
+};
+
+/* A fixed header followed by the path, ended by a '\0' and padded */
+/* to 8 bytes: the next record starts 'r_reclen' bytes after.     */
+struct ext3u_uls_record {
+	__u16 r_reclen;						/* Record Length */
+	__u16 r_path_length;				/* Path Length */
+	__u16 r_type;						/* EXT3u_ENTRY_FILE, EXT3u_ENTRY_DIR */
+	__u16 r_mode;						/* Permission */
+	__u32 r_uid;						/* User ID */
+	__u32 r_gid;						/* Group ID */
+	__u32 r_nlink;						/* Link Number */
+	__u32 r_mtime;						/* Modified Time */
+	__u32 r_dtime;						/* Deletion Time, zero if not known */
+	__u32 r_seq;						/* Deletion Order */
+	__u64 r_size;						/* Size */
+	char r_path[0];
+};
+
+/* Most bytes given by a read() of a uls descriptor */
+#define EXT3u_ULS_STREAM_SIZE	(64 * 1024)
+
+
+/* uconfig command: the buffer holds the directory followed by the */
+/* extensions, or receives the rules when listing.                 */
 struct ext3u_uconfig_info {
-	char * u_buffer;
-	int u_buffer_length;
-	int u_dir_length;
-	int u_ext_length;
-	int u_list;
-	int u_insert;
-	int u_errcode;
-	int u_mask;
-	 __u64 u_size;
+	char * u_buffer;				/* Communication Buffer */
+	int u_buffer_length;			/* Buffer Length, set to the rules size when listing */
+	int u_dir_length;				/* Directory Length */
+	int u_ext_length;				/* Extensions Length */
+	int u_list;						/* List the rules */
+	int u_insert;					/* Insert or change a rule, otherwise remove it */
+	int u_errcode;					/* Operation Result Code */
+	int u_mask;						/* EXT3u_CONFIG_EXT, EXT3u_CONFIG_SIZE */
+	 __u64 u_size;					/* Skip files bigger than this */
 };
 
-/* We use a static entry when adding a newly deleted file to the FIFO list,
- * instead allocating one entry for each deletion. This should reduce the
- * memory management overhead.
+/* The in-memory entries come from a dedicated slab cache, so each
+ * save, restore or listing works on its own entry.
  */
 
-extern struct ext3u_del_entry ext3u_de_save;
-extern struct ext3u_del_entry ext3u_de_remove;
-extern struct ext3u_del_entry ext3u_de_ioctl;
+int ext3u_init_cache(void);
+
+void ext3u_destroy_cache(void);
+
+void ext3u_init_proc(void);
+
+void ext3u_exit_proc(void);
+
+void ext3u_stats_read(struct super_block * sb, struct ext3u_ustats_info * ustats_info);
+
+struct ext3u_del_entry * ext3u_alloc_entry(gfp_t flags);
+
+void ext3u_free_entry(struct ext3u_del_entry * de);
+
+
+struct ext3u_queue * ext3u_lock_fifo(struct super_block * sb);
+
+void ext3u_unlock_fifo(struct ext3u_queue * q);
+
+void ext3u_lock_all(struct super_block * sb);
+
+void ext3u_unlock_all(struct super_block * sb);
+
+unsigned int ext3u_record_queue(struct ext3u_super_block * usb, struct ext3u_record * record);
+
+int ext3u_decode_entry(struct inode * u_inode, struct ext3u_super_block * usb, struct ext3u_record * record, struct ext3u_del_entry * de);
+
+void ext3u_cursor_init(struct ext3u_cursor * cur, struct inode * u_inode, struct ext3u_super_block * usb, 
+					   struct ext3u_record * record, int backward);
+
+int ext3u_cursor_seek(struct ext3u_cursor * cur, struct ext3u_record * record);
 
+struct ext3u_del_entry_header * ext3u_cursor_header(struct ext3u_cursor * cur);
 
-int ext3u_save(handle_t * handle, struct dentry * de, int type);
+struct ext3u_del_entry * ext3u_cursor_entry(struct ext3u_cursor * cur, struct ext3u_del_entry * de);
 
-int ext3u_urm(struct super_block * sb, char * path, char * dir);
+int ext3u_cursor_next(struct ext3u_cursor * cur);
+
+int ext3u_owner_first(struct super_block * sb, unsigned int uid, struct ext3u_record * record);
+
+int ext3u_owner_next(struct super_block * sb, unsigned int uid, struct ext3u_record * record);
+
+void ext3u_cursor_release(struct ext3u_cursor * cur);
+
+__u32 ext3u_cursor_time(struct ext3u_cursor * cur);
+
+__u32 ext3u_cursor_mtime(struct ext3u_cursor * cur);
+
+__u64 ext3u_cursor_size(struct ext3u_cursor * cur);
+
+int ext3u_uls_match(struct ext3u_cursor * cur, struct ext3u_del_entry_header * dh, 
+					struct ext3u_uls_filter * filter, struct ext3u_del_entry * de);
+
+int ext3u_uls_open(struct file * filp, struct ext3u_uls_open_info * open_info);
+
+int ext3u_time_seek(struct inode * u_inode, struct ext3u_super_block * usb, unsigned int q, 
+					__u32 since, struct ext3u_record * record);
+
+struct ext3u_queue * ext3u_lock_save(struct dentry * dentry, int type);
+
+int ext3u_save(handle_t * handle, struct ext3u_queue * q, struct dentry * de, int type);
+
+int ext3u_urm(struct super_block * sb, char * path, char * dir, int * blocks);
+
+int ext3u_urm_batch(struct super_block * sb, char * paths, int length, int count, int flag, 
+					int * status, int * restored, int * blocks);
 
 int ext3u_restore_inode(handle_t * handle, struct inode * inode, struct ext3u_del_entry * de);
 
+void ext3u_free_inode_blocks(handle_t * handle, struct inode * inode);
+
 struct buffer_head * ext3u_read_super(struct inode * u_inode);
 
-struct ext3u_del_entry * ext3u_get_entry(handle_t * handle, struct inode * u_inode, const char * path); 
+int ext3u_fill_super(struct super_block * sb);
+
+void ext3u_put_super(struct super_block * sb);
+
+struct ext3u_del_entry * ext3u_get_entry(handle_t * handle, struct inode * u_inode, const char * path, struct ext3u_del_entry * de); 
 
 void ext3u_print_entry(struct ext3u_del_entry * de);
 
 int ext3u_permission(unsigned int uid,  umode_t mode, int mask);
 
-int ext3u_skip(char * name);
+int ext3u_skip_list(struct super_block * sb, char * buf, int length);
+
+int ext3u_skip_config(struct super_block * sb, const char * dir, int dir_length, 
+					  const char * ext, int ext_length, __u64 size, int mask, int insert);
 
 #endif
@@ -0,0 +1,88 @@
+/**
+ * @file undel_fifo.h
+ * @autor Antonio Davoli, Vasile Claudiu Perta
+ *
+ * Layout of a FIFO queue and the arithmetic on its positions. Nothing
+ * here depends on the kernel: ext3u-utils/test builds it in user space.
+ */
+
+#ifndef __UNDEL_FIFO_H
+#define __UNDEL_FIFO_H
+
+#define EXT3u_BLOCK_HEADER_SIZE		4
+
+/* Pointer to an entry in the FIFO list. */
+struct ext3u_record {
+	__u32 r_block; 		/* logical block number */
+	__u64 r_real_block; /* fisical block number */
+	__u16 r_offset; 	/* offset in the block */
+	__u16 r_size;		/* size in bytes of the entry */
+};
+
+#define EXT3u_RECORD_SIZE (sizeof(struct ext3u_record))
+
+
+/* FIFO list  information */
+struct ext3u_fifo_info {
+	__u32 				f_blocks;				/* blocks reserved for the fifo queue */
+	__u32				f_start_block; 			/* first logical block of the fifo queue */
+	__u32				f_last_block; 			/* last logical block used  */
+	__u32				f_last_offset;			/* offset in the last writeable block */
+	__u32				f_last_block_remaining;	/* space left on the last used block */
+	__u32				f_free;					/* free space on the FIFO (in bytes) */
+	struct ext3u_record f_first;
+	struct ext3u_record f_last;
+};
+
+/* The logical block following 'block' in a FIFO queue. */
+static inline __u32 ext3u_next_block(struct ext3u_fifo_info * fifo, __u32 block)
+{
+	return (block + 1 - fifo->f_start_block) % fifo->f_blocks + fifo->f_start_block;
+}
+
+/* The logical block preceding 'block' in a FIFO queue. */
+static inline __u32 ext3u_prev_block(struct ext3u_fifo_info * fifo, __u32 block)
+{
+	return (block + fifo->f_blocks - 1 - fifo->f_start_block) % fifo->f_blocks + fifo->f_start_block;
+}
+
+/**
+ * @brief Bytes of a queue between two positions, the block headers
+ * excluded. When the two positions are the same, the queue is empty.
+ */
+static inline __u32 ext3u_fifo_distance(struct ext3u_fifo_info * fifo, __u32 block_size,
+										__u32 start_block, __u32 start_offset,
+										__u32 end_block, __u32 end_offset)
+{
+	__u32 blocks;
+
+	blocks = (end_block + fifo->f_blocks - start_block) % fifo->f_blocks;
+	if (!blocks) {
+		if (end_offset >= start_offset)
+			return end_offset - start_offset;
+		/* The end is behind the start: all the queue in between. */
+		blocks = fifo->f_blocks;
+	}
+
+	return (block_size - start_offset) +
+		   (blocks - 1) * (block_size - EXT3u_BLOCK_HEADER_SIZE) +
+		   (end_offset - EXT3u_BLOCK_HEADER_SIZE);
+}
+
+/**
+ * @brief Position right after the entry in 'record'. Every block of the
+ * queue holds 'block_size - EXT3u_BLOCK_HEADER_SIZE' bytes of entries,
+ * so the end is found counting from the header of the first block.
+ */
+static inline void ext3u_entry_end(struct ext3u_fifo_info * fifo, __u32 block_size,
+								   struct ext3u_record * record, __u32 * block, __u32 * offset)
+{
+	__u32 payload = block_size - EXT3u_BLOCK_HEADER_SIZE;
+	__u32 pos = record->r_offset - EXT3u_BLOCK_HEADER_SIZE + record->r_size;
+
+	*block = fifo->f_start_block +
+			 (record->r_block - fifo->f_start_block + pos / payload) % fifo->f_blocks;
+	*offset = pos % payload + EXT3u_BLOCK_HEADER_SIZE;
+}
+
+#endif